@@ -0,0 +1,178 @@
+#include "CovarianceMatrix.h"
+
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+static const int TILE = 4; // Variables per side of a tile of the matrix
+
+CovarianceMatrix::CovarianceMatrix(int nVariables, int blockSize) :
+  nVariables(nVariables), nPadded((nVariables + TILE - 1) / TILE * TILE), blockSize(blockSize),
+  nBuffered(0), block(nPadded * blockSize, 0), nEntries(0), nSkipped(0), means(nPadded, 0),
+  comoments(nPadded * nPadded, 0)
+{
+}
+
+void CovarianceMatrix::Fill(const double *values)
+{
+  for (int i = 0; i < nVariables; i++)
+  {
+    if (!std::isfinite(values[i]))
+    {
+      nSkipped++;
+      return;
+    }
+  }
+  for (int i = 0; i < nVariables; i++) block[i * blockSize + nBuffered] = values[i];
+  if (++nBuffered >= blockSize) Flush();
+}
+
+void CovarianceMatrix::Flush()
+{
+  if (nBuffered == 0) return;
+
+  // Centre each column on the block's own mean
+  vector<double> blockMeans(nPadded, 0);
+  for (int i = 0; i < nVariables; i++)
+  {
+    double *column = &block[i * blockSize];
+    double sum = 0;
+    for (int k = 0; k < nBuffered; k++) sum += column[k];
+    blockMeans[i] = sum / nBuffered;
+    for (int k = 0; k < nBuffered; k++) column[k] -= blockMeans[i];
+  }
+  AddBlock(nBuffered, blockMeans);
+  nBuffered = 0;
+}
+
+/**
+ *  Each tile of the upper triangle is summed over the block in sixteen separate
+ *  sums, so that the compiler can keep them in registers and vectorize the products.
+ *  Tiles on the diagonal also fill the few elements below it, which are not used
+ */
+void CovarianceMatrix::AddBlock(int nRows, const vector<double> &blockMeans)
+{
+  for (int iTile = 0; iTile < nPadded; iTile += TILE)
+  {
+    const double *a0 = &block[iTile * blockSize];
+    const double *a1 = a0 + blockSize;
+    const double *a2 = a1 + blockSize;
+    const double *a3 = a2 + blockSize;
+    for (int jTile = iTile; jTile < nPadded; jTile += TILE)
+    {
+      const double *b0 = &block[jTile * blockSize];
+      const double *b1 = b0 + blockSize;
+      const double *b2 = b1 + blockSize;
+      const double *b3 = b2 + blockSize;
+      double s[TILE][TILE] = {{0}};
+      for (int k = 0; k < nRows; k++)
+      {
+        double a[TILE] = {a0[k], a1[k], a2[k], a3[k]};
+        double b[TILE] = {b0[k], b1[k], b2[k], b3[k]};
+        for (int i = 0; i < TILE; i++)
+        {
+          for (int j = 0; j < TILE; j++) s[i][j] += a[i] * b[j];
+        }
+      }
+      for (int i = 0; i < TILE; i++)
+      {
+        for (int j = 0; j < TILE; j++) comoments[(iTile + i) * nPadded + jTile + j] += s[i][j];
+      }
+    }
+  }
+
+  // Then the block is merged as if it were a matrix of its own
+  double nTotal = nEntries + nRows;
+  double factor = nEntries * nRows / nTotal;
+  vector<double> delta(nPadded, 0);
+  for (int i = 0; i < nVariables; i++) delta[i] = blockMeans[i] - means[i];
+  for (int i = 0; i < nVariables; i++)
+  {
+    for (int j = i; j < nVariables; j++) comoments[i * nPadded + j] += delta[i] * delta[j] * factor;
+    means[i] += delta[i] * nRows / nTotal;
+  }
+  nEntries = nTotal;
+}
+
+// Add another matrix's entries to this one (e.g. from another worker). Both must have the same variables
+void CovarianceMatrix::Merge(CovarianceMatrix &other)
+{
+  if (other.nVariables != nVariables) return;
+  Flush();
+  other.Flush();
+  nSkipped += other.nSkipped;
+  if (other.nEntries <= 0) return;
+  double nTotal = nEntries + other.nEntries;
+  double factor = nEntries * other.nEntries / nTotal;
+  for (int i = 0; i < nVariables; i++)
+  {
+    double deltaI = other.means[i] - means[i];
+    for (int j = i; j < nVariables; j++)
+    {
+      double deltaJ = other.means[j] - means[j];
+      comoments[i * nPadded + j] += other.comoments[i * nPadded + j] + deltaI * deltaJ * factor;
+    }
+  }
+  for (int i = 0; i < nVariables; i++) means[i] += (other.means[i] - means[i]) * other.nEntries / nTotal;
+  nEntries = nTotal;
+}
+
+double CovarianceMatrix::GetEntries()
+{
+  Flush();
+  return nEntries;
+}
+
+double CovarianceMatrix::Mean(int i)
+{
+  Flush();
+  if (nEntries <= 0) return NAN;
+  return means[i];
+}
+
+double CovarianceMatrix::Covariance(int i, int j)
+{
+  Flush();
+  if (nEntries < 2) return NAN;
+  if (i > j) swap(i, j);
+  return comoments[i * nPadded + j] / (nEntries - 1);
+}
+
+double CovarianceMatrix::Correlation(int i, int j)
+{
+  double varianceI = Covariance(i, i);
+  double varianceJ = Covariance(j, j);
+  if (!(varianceI > 0) || !(varianceJ > 0)) return NAN;
+  return Covariance(i, j) / sqrt(varianceI * varianceJ);
+}
+
+vector<double> CovarianceMatrix::GetState() const
+{
+  vector<double> state;
+  state.push_back(nVariables);
+  state.push_back(blockSize);
+  state.push_back(nBuffered);
+  state.push_back(nEntries);
+  state.push_back(nSkipped);
+  state.insert(state.end(), means.begin(), means.end());
+  state.insert(state.end(), comoments.begin(), comoments.end());
+  state.insert(state.end(), block.begin(), block.end());
+  return state;
+}
+
+bool CovarianceMatrix::SetState(const vector<double> &state)
+{
+  if (state.size() != 5 + means.size() + comoments.size() + block.size()) return false;
+  if (state[0] != nVariables || state[1] != blockSize) return false;
+  nBuffered = (int)state[2];
+  nEntries = state[3];
+  nSkipped = (long long)state[4];
+  vector<double>::const_iterator it = state.begin() + 5;
+  copy(it, it + means.size(), means.begin());
+  it += means.size();
+  copy(it, it + comoments.size(), comoments.begin());
+  it += comoments.size();
+  copy(it, it + block.size(), block.begin());
+  return true;
+}
@@ -0,0 +1,52 @@
+// Streaming, mergeable covariance matrix of a fixed set of variables.
+// Entries are buffered in blocks, one column per variable. A full block's means
+// and centred cross-products are worked out in small tiles that stay in
+// registers, then folded into the running totals with the pairwise update of
+// Chan, Golub and LeVeque, which is also how two matrices are merged. This is
+// much cheaper than updating every element of the matrix for each entry, and
+// does not lose precision when the means are large.
+
+#ifndef COVARIANCEMATRIX_H
+#define COVARIANCEMATRIX_H
+
+#include <vector>
+
+class CovarianceMatrix
+{
+public:
+  CovarianceMatrix(int nVariables, int blockSize=256);
+
+  // One entry: a value for each variable. Entries with a NaN or infinite value are skipped
+  void Fill(const double *values);
+  void Merge(CovarianceMatrix &other);
+  void Flush(); // Fold the buffered entries into the totals
+
+  int GetNVariables() const { return nVariables; }
+  double GetEntries();
+  long long GetSkipped() const { return nSkipped; }
+
+  double Mean(int i);
+  double Covariance(int i, int j);
+  double Correlation(int i, int j); // NaN if either variable is constant
+
+  // Everything the matrix holds, including the entries not folded in yet, so that
+  // it can be saved and carried on with later exactly as if it had never stopped
+  std::vector<double> GetState() const;
+  bool SetState(const std::vector<double> &state); // False if the state is of a different matrix
+
+private:
+  // Add a block's centred cross-products to the totals
+  void AddBlock(int nRows, const std::vector<double> &blockMeans);
+
+  int nVariables;
+  int nPadded; // Rounded up to a whole number of tiles; the extra variables are always 0
+  int blockSize;
+  int nBuffered;
+  std::vector<double> block; // Column i holds variable i, blockSize rows each
+  double nEntries;
+  long long nSkipped;
+  std::vector<double> means;
+  std::vector<double> comoments; // Sums of products of deviations from the means, nPadded x nPadded
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "EventIndex.h"
+
+#include <cmath>
+
+using namespace std;
+
+static const size_t MIN_SLOTS = 1024;
+
+EventIndex::EventIndex(long long expectedEvents) : nFilled(0)
+{
+  size_t nSlots = (expectedEvents > 0 ? 2 * (size_t)expectedEvents : 0);
+  if (nSlots < MIN_SLOTS) nSlots = MIN_SLOTS;
+  Slot empty = {0, -1};
+  slots.assign(nSlots, empty);
+}
+
+bool EventIndex::Insert(uint64_t fingerprint, long long entry)
+{
+  if (4 * (nFilled + 1) > 3 * (long long)slots.size()) Grow(); // Probes get long when it is much fuller
+  size_t nSlots = slots.size();
+  for (size_t i = fingerprint % nSlots; ; i = (i + 1 == nSlots ? 0 : i + 1))
+  {
+    if (slots[i].fingerprint == fingerprint) return false;
+    if (slots[i].fingerprint != 0) continue;
+    slots[i].fingerprint = fingerprint;
+    slots[i].entry = entry;
+    nFilled++;
+    return true;
+  }
+}
+
+long long EventIndex::Find(uint64_t fingerprint) const
+{
+  size_t nSlots = slots.size();
+  for (size_t i = fingerprint % nSlots; slots[i].fingerprint != 0; i = (i + 1 == nSlots ? 0 : i + 1))
+  {
+    if (slots[i].fingerprint == fingerprint) return slots[i].entry;
+  }
+  return -1;
+}
+
+void EventIndex::Clear()
+{
+  Slot empty = {0, -1};
+  slots.assign(MIN_SLOTS, empty);
+  vector<Slot>(slots).swap(slots); // Give the memory back
+  nFilled = 0;
+}
+
+// Double the table. Only needed if there are many more events than were expected
+void EventIndex::Grow()
+{
+  vector<Slot> old;
+  old.swap(slots);
+  Slot empty = {0, -1};
+  slots.assign(2 * old.size(), empty);
+  nFilled = 0;
+  for (size_t i = 0; i < old.size(); i++)
+  {
+    if (old[i].fingerprint != 0) Insert(old[i].fingerprint, old[i].entry);
+  }
+}
+
+/**
+ *  Mix the two numbers into 64 bits with the finalizer of MurmurHash3, so that
+ *  events that are next to each other end up far apart in the table
+ */
+uint64_t EventIndex::Fingerprint(long long run, long long event)
+{
+  uint64_t h = (uint64_t)run * 0x9E3779B97F4A7C15ULL ^ (uint64_t)event;
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return (h == 0 ? 1 : h); // 0 marks an empty slot
+}
+
+int EventIndex::Partition(uint64_t fingerprint, int nPartitions)
+{
+  return (int)((fingerprint >> 40) % (uint64_t)nPartitions);
+}
+
+int EventIndex::PartitionsFor(long long nEvents, double maxBytes)
+{
+  if (maxBytes <= 0) return 1;
+  double bytesPerEvent = 2 * sizeof(Slot); // The table is made half full
+  int nPartitions = (int)ceil(nEvents * bytesPerEvent / maxBytes);
+  return (nPartitions < 1 ? 1 : nPartitions);
+}
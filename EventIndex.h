@@ -0,0 +1,46 @@
+// Hash index from an event's run and event numbers to its entry in a tree, for
+// matching the events of two trees. Each event takes one slot of an open-addressed
+// table: a 64-bit fingerprint of its numbers and its entry, 16 bytes, in a table
+// made with twice as many slots as the events expected. The numbers themselves are
+// not kept, so a match should be checked against the numbers read back from the
+// entry; two different events only share a fingerprint about once in 10^19 pairs.
+// An index can hold just one partition of the events (by Partition), so that a
+// tree too big to index in the memory allowed can be matched a part at a time.
+
+#ifndef EVENTINDEX_H
+#define EVENTINDEX_H
+
+#include <vector>
+#include <stdint.h>
+
+class EventIndex
+{
+public:
+  EventIndex(long long expectedEvents=0);
+
+  // False if the event is already there (the entry that is kept is the first)
+  bool Insert(uint64_t fingerprint, long long entry);
+  // The entry of the event, or -1 if it isn't in the index
+  long long Find(uint64_t fingerprint) const;
+  long long Size() const { return nFilled; }
+  void Clear();
+
+  static uint64_t Fingerprint(long long run, long long event);
+  // Which of nPartitions parts an event is in, from the top bits of its fingerprint
+  static int Partition(uint64_t fingerprint, int nPartitions);
+  // Partitions needed for an index of this many events to fit in this many bytes
+  static int PartitionsFor(long long nEvents, double maxBytes);
+
+private:
+  struct Slot
+  {
+    uint64_t fingerprint; // 0 if the slot is empty
+    long long entry;
+  };
+  void Grow();
+
+  std::vector<Slot> slots; // Twice as many as the events expected
+  long long nFilled;
+};
+
+#endif
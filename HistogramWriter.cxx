@@ -0,0 +1,173 @@
+#include "HistogramWriter.h"
+
+#include <iostream>
+#include <algorithm>
+#include "boost/filesystem.hpp"
+#include "TFile.h"
+#include "TH1.h"
+#include "TDirectory.h"
+#include "Compression.h"
+
+using namespace std;
+
+HistogramWriter::HistogramWriter() : file(0)
+{
+}
+
+HistogramWriter::~HistogramWriter()
+{
+  Close();
+}
+
+bool HistogramWriter::Open(string fileName, int compressionSettings)
+{
+  Close();
+  std::lock_guard<std::mutex> lock(fileMutex);
+  file = new TFile(fileName.c_str(), "RECREATE", "", compressionSettings);
+  if (file->IsZombie())
+  {
+    error = "could not open " + fileName;
+    delete file;
+    file = 0;
+    return false;
+  }
+  this->fileName = fileName;
+  return true;
+}
+
+// Write anything still waiting, then close the file
+void HistogramWriter::Close()
+{
+  Flush();
+  std::lock_guard<std::mutex> lock(fileMutex);
+  if (!file) return;
+  file->Close();
+  delete file;
+  file = 0;
+}
+
+void HistogramWriter::Add(const TObject *hist, string directory)
+{
+  if (!hist) return;
+  // The caller may carry on changing or delete the histogram, so take a copy
+  // that doesn't belong to any directory
+  TObject *copy = hist->Clone();
+  if (copy->InheritsFrom("TH1")) ((TH1*)copy)->SetDirectory(0);
+
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  for (int i=0; i<pending.size(); i++)
+  {
+    if (pending.at(i).directory == directory && string(pending.at(i).hist->GetName()) == copy->GetName())
+    {
+      delete pending.at(i).hist;
+      pending.at(i).hist = copy;
+      return;
+    }
+  }
+  PendingHistogram entry = {directory, copy};
+  pending.push_back(entry);
+}
+
+/**
+ *  Write the batch, a directory at a time. Histograms written again (as in
+ *  quick-look mode) replace the old ones rather than adding another cycle
+ */
+void HistogramWriter::Flush()
+{
+  vector<PendingHistogram> batch;
+  {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    batch.swap(pending);
+  }
+  if (batch.size() == 0) return;
+  stable_sort(batch.begin(), batch.end(),
+              [](const PendingHistogram &a, const PendingHistogram &b) { return a.directory < b.directory; });
+
+  std::lock_guard<std::mutex> lock(fileMutex);
+  TDirectory *directory = 0;
+  for (int i=0; i<batch.size(); i++)
+  {
+    PendingHistogram &entry = batch.at(i);
+    if (file && (i == 0 || entry.directory != batch.at(i-1).directory))
+    {
+      directory = file->GetDirectory(entry.directory.c_str());
+      if (!directory) directory = file->mkdir(entry.directory.c_str());
+    }
+    if (directory) directory->WriteTObject(entry.hist, entry.hist->GetName(), "Overwrite");
+    delete entry.hist;
+  }
+}
+
+/**
+ *  Write the file's keys, free space list and header as closing it would, so that
+ *  what is on disk is a complete file, without closing it: closing would delete the
+ *  histograms that are still being filled in its directories
+ */
+bool HistogramWriter::SaveCopy(string copyName)
+{
+  Flush();
+  std::lock_guard<std::mutex> lock(fileMutex);
+  if (!file) return false;
+  file->Save();
+  file->WriteStreamerInfo();
+  file->WriteFree();
+  file->WriteHeader();
+  file->Flush();
+  boost::system::error_code copyError;
+  boost::filesystem::copy_file(fileName, copyName + ".tmp", boost::filesystem::copy_option::overwrite_if_exists, copyError);
+  if (!copyError) boost::filesystem::rename(copyName + ".tmp", copyName, copyError);
+  if (copyError) error = "could not copy " + fileName + " to " + copyName;
+  return !copyError;
+}
+
+bool HistogramWriter::OpenCopy(string copyName, string fileName, int compressionSettings)
+{
+  Close();
+  boost::system::error_code copyError;
+  boost::filesystem::copy_file(copyName, fileName, boost::filesystem::copy_option::overwrite_if_exists, copyError);
+  if (copyError)
+  {
+    error = "could not copy " + copyName + " to " + fileName;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(fileMutex);
+  file = new TFile(fileName.c_str(), "UPDATE", "", compressionSettings);
+  if (file->IsZombie())
+  {
+    error = "could not open " + fileName;
+    delete file;
+    file = 0;
+    return false;
+  }
+  this->fileName = fileName;
+  return true;
+}
+
+int ParseCompressionSettings(string spec)
+{
+  string algorithm = spec;
+  int level = -1;
+  string::size_type pos = spec.find(':');
+  if (pos != string::npos)
+  {
+    algorithm = spec.substr(0, pos);
+    try
+    {
+      level = stoi(spec.substr(pos+1));
+    }
+    catch (exception &e)
+    {
+      return -1;
+    }
+    if (level < 0 || level > 9) return -1;
+  }
+  transform(algorithm.begin(), algorithm.end(), algorithm.begin(), ::tolower);
+
+  // Default levels are the ones ROOT recommends for each algorithm
+  if (algorithm == "zstd") return ROOT::CompressionSettings(ROOT::kZSTD, (level < 0 ? 5 : level));
+  if (algorithm == "lz4") return ROOT::CompressionSettings(ROOT::kLZ4, (level < 0 ? 4 : level));
+  if (algorithm == "zlib") return ROOT::CompressionSettings(ROOT::kZLIB, (level < 0 ? 1 : level));
+  if (algorithm == "lzma") return ROOT::CompressionSettings(ROOT::kLZMA, (level < 0 ? 7 : level));
+  if (algorithm == "none") return 0;
+  return -1;
+}
@@ -0,0 +1,60 @@
+// Collects finished histograms and writes them to the output ROOT file in one
+// batch per branch, sorted into a directory for each kind of plot (h/, tracker/,
+// calo/, pulls/). Histograms can be added from any thread. Other ROOT objects
+// (such as the sparse per-cell distributions) can be written the same way.
+
+#ifndef HISTOGRAMWRITER_H
+#define HISTOGRAMWRITER_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+class TFile;
+class TObject;
+
+class HistogramWriter
+{
+public:
+  HistogramWriter();
+  ~HistogramWriter();
+
+  // compressionSettings is algorithm*100 + level, as for TFile
+  bool Open(std::string fileName, int compressionSettings);
+  void Close();
+
+  // Keep a copy of the histogram as it is now, to be written to the directory at the next
+  // Flush. Adding a histogram with the same name to the same directory replaces it
+  void Add(const TObject *hist, std::string directory);
+
+  // Write everything added since the last Flush
+  void Flush();
+
+  // Write everything waiting, and copy the file as it is now to copyName. The copy is
+  // complete, and can be opened by itself. It is made under a temporary name and renamed
+  bool SaveCopy(std::string copyName);
+  // Carry on writing fileName from a copy made with SaveCopy, as if it had been written up to then
+  bool OpenCopy(std::string copyName, std::string fileName, int compressionSettings);
+
+  std::string GetError() { return error; }
+
+private:
+  struct PendingHistogram
+  {
+    std::string directory;
+    TObject *hist;
+  };
+
+  TFile *file;
+  std::string fileName;
+  std::vector<PendingHistogram> pending;
+  std::mutex pendingMutex; // For the list of histograms waiting to be written
+  std::mutex fileMutex; // Only one thread writes to the file at a time
+  std::string error;
+};
+
+// Compression settings for a string like "zstd:5", "lz4:4", "zlib:1" or "lzma:6"
+// (the level is optional). Returns -1 if the string can't be understood
+int ParseCompressionSettings(std::string spec);
+
+#endif
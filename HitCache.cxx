@@ -0,0 +1,158 @@
+#include "HitCache.h"
+
+#include <cstring>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// File header: magic, format version, bytes per value, key length, number of events,
+// then the key. Each block has a header of its number of events, number of values,
+// decompressed size and compressed size
+static const char HIT_CACHE_MAGIC[4] = {'V','P','H','C'};
+static const uint32_t HIT_CACHE_FORMAT = 1;
+static const size_t HEADER_SIZE = 4 + 3*sizeof(uint32_t) + sizeof(uint64_t);
+static const size_t BLOCK_HEADER_SIZE = 4*sizeof(uint32_t);
+static const size_t BLOCK_BYTES = 1<<20; // Start a new block after this many bytes of values
+static const uint32_t BLOCK_EVENTS = 1<<16; // or this many events
+static const int COMPRESSION_LEVEL = 1; // Decompression speed matters more than size
+
+HitCacheWriter::HitCacheWriter(string fileName, string key, int valueSize) :
+  fileName(fileName), file(0), valueSize(valueSize), nEvents(0), failed(false)
+{
+  tempName = fileName + ".tmp" + to_string(getpid()); // Runs can share a cache directory
+  file = fopen(tempName.c_str(), "wb");
+  if (!file) return;
+  uint32_t header[3] = {HIT_CACHE_FORMAT, (uint32_t)valueSize, (uint32_t)key.length()};
+  fwrite(HIT_CACHE_MAGIC, 1, 4, file);
+  fwrite(header, sizeof(uint32_t), 3, file);
+  fwrite(&nEvents, sizeof(uint64_t), 1, file); // Filled in when we close
+  fwrite(key.data(), 1, key.length(), file);
+  offsets.push_back(0);
+}
+
+HitCacheWriter::~HitCacheWriter()
+{
+  if (!file) return;
+  fclose(file);
+  remove(tempName.c_str());
+}
+
+void HitCacheWriter::Add(const void *eventValues, size_t nValues)
+{
+  if (!file) return;
+  values.insert(values.end(), (const char*)eventValues, (const char*)eventValues + nValues*valueSize);
+  offsets.push_back(values.size()/valueSize);
+  nEvents++;
+  if (values.size() >= BLOCK_BYTES || offsets.size() > BLOCK_EVENTS) WriteBlock();
+}
+
+void HitCacheWriter::WriteBlock()
+{
+  uint32_t blockEvents = offsets.size() - 1;
+  if (blockEvents == 0) return;
+
+  // Values first, so that they are aligned when the block is read back
+  vector<char> raw(values);
+  raw.insert(raw.end(), (const char*)&offsets[0], (const char*)(&offsets[0] + offsets.size()));
+  uLongf compressedSize = compressBound(raw.size());
+  compressed.resize(compressedSize);
+  if (compress2(&compressed[0], &compressedSize, (const Bytef*)&raw[0], raw.size(), COMPRESSION_LEVEL) != Z_OK) failed = true;
+
+  uint32_t header[4] = {blockEvents, (uint32_t)(values.size()/valueSize), (uint32_t)raw.size(), (uint32_t)compressedSize};
+  if (fwrite(header, sizeof(uint32_t), 4, file) != 4) failed = true;
+  if (fwrite(&compressed[0], 1, compressedSize, file) != compressedSize) failed = true;
+  values.clear();
+  offsets.assign(1, 0);
+}
+
+bool HitCacheWriter::Close()
+{
+  if (!file) return false;
+  WriteBlock();
+  fseek(file, 4 + 3*sizeof(uint32_t), SEEK_SET);
+  if (fwrite(&nEvents, sizeof(uint64_t), 1, file) != 1) failed = true;
+  if (fclose(file) != 0) failed = true;
+  file = 0;
+  if (failed || rename(tempName.c_str(), fileName.c_str()) != 0)
+  {
+    remove(tempName.c_str());
+    return false;
+  }
+  return true;
+}
+
+HitCacheReader::HitCacheReader(string fileName, string key, int valueSize) :
+  data(0), fileSize(0), position(0), valueSize(valueSize), nEvents(0), blockEvents(0), nextEvent(0), offsets(0)
+{
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < HEADER_SIZE)
+  {
+    close(fd);
+    return;
+  }
+  fileSize = info.st_size;
+  void *mapped = mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) return;
+  data = (const unsigned char*)mapped;
+  madvise(mapped, fileSize, MADV_SEQUENTIAL);
+
+  // Only use a column made from the same thing, in this format
+  uint32_t header[3];
+  memcpy(header, data + 4, sizeof(header));
+  memcpy(&nEvents, data + 4 + sizeof(header), sizeof(uint64_t));
+  if (memcmp(data, HIT_CACHE_MAGIC, 4) != 0 || header[0] != HIT_CACHE_FORMAT || header[1] != (uint32_t)valueSize
+      || header[2] != key.length() || HEADER_SIZE + key.length() > fileSize
+      || memcmp(data + HEADER_SIZE, key.data(), key.length()) != 0)
+  {
+    munmap((void*)data, fileSize);
+    data = 0;
+    return;
+  }
+  position = HEADER_SIZE + key.length();
+}
+
+HitCacheReader::~HitCacheReader()
+{
+  if (data) munmap((void*)data, fileSize);
+}
+
+bool HitCacheReader::LoadBlock()
+{
+  if (position + BLOCK_HEADER_SIZE > fileSize) return false;
+  uint32_t header[4];
+  memcpy(header, data + position, sizeof(header));
+  position += BLOCK_HEADER_SIZE;
+  uint32_t rawSize = header[2];
+  uint32_t compressedSize = header[3];
+  if (position + compressedSize > fileSize) return false;
+  if ((size_t)header[1]*valueSize + (header[0] + 1)*sizeof(uint32_t) != rawSize) return false;
+
+  block.resize(rawSize);
+  uLongf size = rawSize;
+  if (uncompress((Bytef*)&block[0], &size, data + position, compressedSize) != Z_OK || size != rawSize) return false;
+  position += compressedSize;
+  blockEvents = header[0];
+  nextEvent = 0;
+  offsets = (const uint32_t*)(&block[0] + (size_t)header[1]*valueSize);
+  return (offsets[0] == 0 && offsets[blockEvents] == header[1]);
+}
+
+bool HitCacheReader::NextRaw(const void *&eventValues, size_t &nValues)
+{
+  if (!data) return false;
+  while (nextEvent >= blockEvents)
+  {
+    if (!LoadBlock()) return false;
+  }
+  eventValues = &block[0] + (size_t)offsets[nextEvent]*valueSize;
+  nValues = offsets[nextEvent+1] - offsets[nextEvent];
+  nextEvent++;
+  return true;
+}
@@ -0,0 +1,81 @@
+// A local cache of the hits decoded from the map branches, so that a re-run with a
+// different config doesn't have to read and decode the ntuple again. Each column
+// (the cells of one map branch, or the values of one branch to average) is a file
+// of zlib-compressed blocks. A block holds a flat array of the values of a run of
+// events, followed by each event's offset into it. Files are memory-mapped when
+// read. They are written under a temporary name and renamed when complete, so an
+// interrupted run never leaves a partial column behind.
+
+#ifndef HITCACHE_H
+#define HITCACHE_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstddef>
+#include <stdint.h>
+
+class HitCacheWriter
+{
+public:
+  // key says what the column was made from: a column is only read back with the same key
+  HitCacheWriter(std::string fileName, std::string key, int valueSize);
+  ~HitCacheWriter(); // Abandons the column if it wasn't closed
+
+  bool IsOpen() { return (file != 0); }
+
+  // The values of the next event
+  void Add(const void *values, size_t nValues);
+
+  // Write the last block and put the file in place
+  bool Close();
+
+private:
+  void WriteBlock();
+
+  std::string fileName;
+  std::string tempName;
+  FILE *file;
+  int valueSize;
+  uint64_t nEvents;
+  std::vector<char> values; // The block being filled
+  std::vector<uint32_t> offsets;
+  std::vector<unsigned char> compressed;
+  bool failed;
+};
+
+class HitCacheReader
+{
+public:
+  HitCacheReader(std::string fileName, std::string key, int valueSize);
+  ~HitCacheReader();
+
+  bool IsOpen() { return (data != 0); }
+  uint64_t GetEntries() { return nEvents; }
+  size_t GetFileSize() { return fileSize; }
+
+  // The values of the next event. False at the end, or if the file is damaged
+  template <typename T> bool Next(const T *&eventValues, size_t &nValues)
+  {
+    const void *raw;
+    bool ok = NextRaw(raw, nValues);
+    eventValues = (const T*)raw;
+    return ok;
+  }
+  bool NextRaw(const void *&eventValues, size_t &nValues);
+
+private:
+  bool LoadBlock();
+
+  const unsigned char *data; // The mapped file
+  size_t fileSize;
+  size_t position; // Of the next block
+  int valueSize;
+  uint64_t nEvents;
+  std::vector<char> block; // The decompressed block: values, then offsets
+  uint32_t blockEvents;
+  uint32_t nextEvent; // In the block
+  const uint32_t *offsets;
+};
+
+#endif
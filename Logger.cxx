@@ -0,0 +1,103 @@
+#include "Logger.h"
+
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+static const char *LEVEL_NAMES[] = {"debug", "info", "warning", "error"};
+static const char *LEVEL_PREFIXES[] = {"DEBUG: ", "", "WARNING: ", "ERROR: "};
+
+Logger::Logger(ostream &out, int maxRepeats) :
+  out(out), maxRepeats(maxRepeats), minLevel(LOG_INFO), writing(false), stopping(false)
+{
+  writer = thread(&Logger::Run, this);
+}
+
+Logger::~Logger()
+{
+  {
+    lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  writer.join();
+}
+
+void Logger::Log(Level level, const string &key, const string &message)
+{
+  if (level < minLevel) return;
+  {
+    lock_guard<std::mutex> lock(mutex);
+    if (++counts[key] > maxRepeats) return;
+    queue.push_back(LEVEL_PREFIXES[level] + message);
+  }
+  wake.notify_one();
+}
+
+void Logger::Log(Level level, const string &message)
+{
+  if (level < minLevel) return;
+  {
+    lock_guard<std::mutex> lock(mutex);
+    queue.push_back(LEVEL_PREFIXES[level] + message);
+  }
+  wake.notify_one();
+}
+
+void Logger::Flush()
+{
+  unique_lock<std::mutex> lock(mutex);
+  while (!queue.empty() || writing) written.wait(lock);
+}
+
+void Logger::Summarise()
+{
+  map<string,long long> finished;
+  {
+    lock_guard<std::mutex> lock(mutex);
+    finished.swap(counts);
+    for (map<string,long long>::iterator it = finished.begin(); it != finished.end(); it++)
+    {
+      if (it->second <= maxRepeats) continue;
+      ostringstream summary;
+      summary << "(" << it->first << ": " << it->second - maxRepeats << " more like this were not shown, " << it->second << " in all)";
+      queue.push_back(summary.str());
+    }
+  }
+  wake.notify_one();
+}
+
+int Logger::ParseLevel(string name)
+{
+  transform(name.begin(), name.end(), name.begin(), ::tolower);
+  for (int level = LOG_DEBUG; level <= LOG_ERROR; level++)
+  {
+    if (name == LEVEL_NAMES[level]) return level;
+  }
+  return -1;
+}
+
+// The writer: take everything queued at once, and write it without holding the lock
+void Logger::Run()
+{
+  unique_lock<std::mutex> lock(mutex);
+  while (true)
+  {
+    while (queue.empty() && !stopping) wake.wait(lock);
+    if (queue.empty())
+    {
+      written.notify_all();
+      break;
+    }
+    deque<string> batch;
+    batch.swap(queue);
+    writing = true;
+    lock.unlock();
+    for (size_t i = 0; i < batch.size(); i++) out << batch[i] << '\n';
+    out.flush();
+    lock.lock();
+    writing = false;
+    if (queue.empty()) written.notify_all();
+  }
+}
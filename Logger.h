@@ -0,0 +1,55 @@
+// Log messages from any thread, including the ones reading the trees, without
+// waiting for the terminal. Messages are queued and written by a thread of their
+// own, in the order they were logged. Each kind of message (its key) is only
+// written the first few times; after that it is counted, and Summarise writes how
+// many of each were left out. Messages logged without a key, such as reports that
+// are different every time, are always written. Messages below the chosen level
+// are dropped.
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <ostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class Logger
+{
+public:
+  enum Level {LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR};
+
+  Logger(std::ostream &out, int maxRepeats=5);
+  ~Logger(); // Writes everything still queued
+
+  void SetLevel(Level level) { minLevel = level; }
+  void Log(Level level, const std::string &key, const std::string &message);
+  void Log(Level level, const std::string &message); // Never left out
+  // Wait until everything logged so far has been written
+  void Flush();
+  // Log how many messages of each kind were left out, and start counting again
+  void Summarise();
+
+  // A level for a name like "warning", or -1 if there isn't one
+  static int ParseLevel(std::string name);
+
+private:
+  void Run();
+
+  std::ostream &out;
+  int maxRepeats;
+  Level minLevel;
+  std::deque<std::string> queue;
+  std::map<std::string,long long> counts; // Messages logged of each kind
+  std::mutex mutex;
+  std::condition_variable wake; // Something to write, or time to stop
+  std::condition_variable written; // The queue is empty
+  bool writing;
+  bool stopping;
+  std::thread writer;
+};
+
+#endif
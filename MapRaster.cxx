@@ -0,0 +1,240 @@
+#include "MapRaster.h"
+
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include <csetjmp>
+#include <png.h>
+
+using namespace std;
+
+static const uint32_t WHITE = 0xFFFFFF;
+static const uint32_t BLACK = 0x000000;
+static const int PNG_COMPRESSION = 1; // Images are written often and read rarely
+
+RasterFont::RasterFont(int height) :
+  height(height), baseline(height), digitHeight(0)
+{
+}
+
+void RasterFont::AddGlyph(char c, int width, vector<unsigned char> coverage)
+{
+  RasterGlyph glyph;
+  glyph.width = width;
+  glyph.coverage = coverage;
+  glyphs[c] = glyph;
+  if (c != '0') return;
+
+  // Digits sit on the baseline, and labels are centred on their height
+  int top = -1, bottom = -1;
+  for (int row = 0; row < height; row++)
+  {
+    for (int column = 0; column < width; column++)
+    {
+      if (coverage[row*width + column] <= 127) continue;
+      if (top < 0) top = row;
+      bottom = row;
+      break;
+    }
+  }
+  if (top < 0) return;
+  baseline = bottom + 1;
+  digitHeight = baseline - top;
+}
+
+int RasterFont::TextWidth(string text)
+{
+  int textWidth = 0;
+  for (size_t i = 0; i < text.length(); i++)
+  {
+    if (glyphs.count(text[i])) textWidth += glyphs[text[i]].width;
+  }
+  return textWidth;
+}
+
+void RasterFont::Draw(vector<uint32_t> &pixels, int imageWidth, int imageHeight, string text, int x, int y, uint32_t colour)
+{
+  int top = y - baseline;
+  for (size_t i = 0; i < text.length(); i++)
+  {
+    if (!glyphs.count(text[i])) continue;
+    RasterGlyph &glyph = glyphs[text[i]];
+    for (int row = 0; row < height; row++)
+    {
+      int py = top + row;
+      if (py < 0 || py >= imageHeight) continue;
+      for (int column = 0; column < glyph.width; column++)
+      {
+        int px = x + column;
+        if (px < 0 || px >= imageWidth) continue;
+        unsigned int ink = glyph.coverage[row*glyph.width + column];
+        if (ink == 0) continue;
+        // Blend the ink into what is there, channel by channel
+        uint32_t &pixel = pixels[(size_t)py*imageWidth + px];
+        uint32_t blended = 0;
+        for (int shift = 0; shift <= 16; shift += 8)
+        {
+          unsigned int under = (pixel >> shift) & 0xFF;
+          unsigned int over = (colour >> shift) & 0xFF;
+          blended |= ((over*ink + under*(255 - ink)) / 255) << shift;
+        }
+        pixel = blended;
+      }
+    }
+    x += glyph.width;
+  }
+}
+
+MapRaster::MapRaster(int width, int height, vector<uint32_t> layout) :
+  width(width), height(height), layout(layout), hasPaletteBar(false), labelFont(0), titleFont(0),
+  titleX(0), titleY(0), titleCentred(false)
+{
+  // Only the colour matters
+  for (size_t i = 0; i < this->layout.size(); i++) this->layout[i] &= 0xFFFFFF;
+}
+
+void MapRaster::AddGrid(RasterGrid grid)
+{
+  grids.push_back(grid);
+}
+
+void MapRaster::SetPaletteBar(RasterGrid bar, RasterFont *font)
+{
+  paletteBar = bar;
+  labelFont = font;
+  hasPaletteBar = true;
+}
+
+void MapRaster::SetTitle(RasterFont *font, int x, int y, bool centred)
+{
+  titleFont = font;
+  titleX = x;
+  titleY = y;
+  titleCentred = centred;
+}
+
+uint32_t MapRaster::Rgb(float r, float g, float b)
+{
+  return ((uint32_t)lround(r*255) << 16) | ((uint32_t)lround(g*255) << 8) | (uint32_t)lround(b*255);
+}
+
+bool MapRaster::Write(string fileName, vector<vector<double> > &cells, double min, double max,
+                      vector<uint32_t> &bands, vector<RasterTick> &ticks, string title)
+{
+  if (cells.size() != grids.size() || bands.size() == 0) return false;
+  vector<uint32_t> pixels(layout);
+  double scale = (max > min ? bands.size()/(max - min) : 0);
+
+  // The colour of each cell, then each pixel of the frame that is still white in the
+  // layout takes the colour of its cell. Grid lines, the foil and labels stay on top
+  for (size_t i = 0; i < grids.size(); i++)
+  {
+    RasterGrid &grid = grids[i];
+    if (cells[i].size() != (size_t)grid.nX*grid.nY) return false;
+    vector<uint32_t> colours(cells[i].size(), WHITE);
+    for (size_t cell = 0; cell < cells[i].size(); cell++)
+    {
+      double value = cells[i][cell];
+      if (std::isnan(value) || value == 0 || value < min) continue;
+      int band = (int)(0.01 + (value - min)*scale); // As ROOT does
+      if (band >= (int)bands.size()) band = bands.size() - 1;
+      colours[cell] = bands[band];
+    }
+
+    int frameWidth = grid.right - grid.left;
+    int frameHeight = grid.bottom - grid.top;
+    for (int py = std::max(grid.top, 0); py < grid.bottom && py < height; py++)
+    {
+      int y = (grid.bottom - 1 - py)*grid.nY/frameHeight;
+      for (int px = std::max(grid.left, 0); px < grid.right && px < width; px++)
+      {
+        uint32_t &pixel = pixels[(size_t)py*width + px];
+        if (pixel != WHITE) continue;
+        int x = (px - grid.left)*grid.nX/frameWidth;
+        pixel = colours[x*grid.nY + y];
+      }
+    }
+  }
+
+  if (hasPaletteBar)
+  {
+    // The bands from the bottom up, with a frame, then the ticks and their labels on the right
+    int barHeight = paletteBar.bottom - paletteBar.top;
+    for (size_t band = 0; band < bands.size(); band++)
+    {
+      int bottom = paletteBar.bottom - (int)lround(band*(double)barHeight/bands.size());
+      int top = paletteBar.bottom - (int)lround((band + 1)*(double)barHeight/bands.size());
+      FillRectangle(pixels, paletteBar.left, top, paletteBar.right, bottom, bands[band]);
+    }
+    FillRectangle(pixels, paletteBar.left, paletteBar.top, paletteBar.right, paletteBar.top + 1, BLACK);
+    FillRectangle(pixels, paletteBar.left, paletteBar.bottom - 1, paletteBar.right, paletteBar.bottom, BLACK);
+    FillRectangle(pixels, paletteBar.left, paletteBar.top, paletteBar.left + 1, paletteBar.bottom, BLACK);
+    FillRectangle(pixels, paletteBar.right - 1, paletteBar.top, paletteBar.right, paletteBar.bottom, BLACK);
+    int tickLength = (paletteBar.right - paletteBar.left)/4;
+    for (size_t i = 0; i < ticks.size() && max > min; i++)
+    {
+      int y = paletteBar.bottom - (int)lround((ticks[i].value - min)/(max - min)*barHeight);
+      if (y < paletteBar.top || y > paletteBar.bottom) continue;
+      FillRectangle(pixels, paletteBar.right - tickLength, y, paletteBar.right, y + 1, BLACK);
+      if (labelFont) labelFont->Draw(pixels, width, height, ticks[i].label, paletteBar.right + tickLength, y + labelFont->GetDigitHeight()/2, BLACK);
+    }
+  }
+
+  if (titleFont && title.length() > 0)
+  {
+    int x = titleX;
+    if (titleCentred) x -= titleFont->TextWidth(title)/2;
+    titleFont->Draw(pixels, width, height, title, x, titleY, BLACK);
+  }
+  return WritePng(fileName, pixels);
+}
+
+void MapRaster::FillRectangle(vector<uint32_t> &pixels, int left, int top, int right, int bottom, uint32_t colour)
+{
+  for (int py = (top < 0 ? 0 : top); py < bottom && py < height; py++)
+  {
+    for (int px = (left < 0 ? 0 : left); px < right && px < width; px++) pixels[(size_t)py*width + px] = colour;
+  }
+}
+
+bool MapRaster::WritePng(string fileName, vector<uint32_t> &pixels)
+{
+  FILE *file = fopen(fileName.c_str(), "wb");
+  if (!file) return false;
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+  png_infop info = (png ? png_create_info_struct(png) : 0);
+  if (!info)
+  {
+    png_destroy_write_struct(&png, 0);
+    fclose(file);
+    return false;
+  }
+  vector<unsigned char> row(3*width);
+  if (setjmp(png_jmpbuf(png)))
+  {
+    // libpng jumps back here if anything goes wrong
+    png_destroy_write_struct(&png, &info);
+    fclose(file);
+    remove(fileName.c_str());
+    return false;
+  }
+  png_init_io(png, file);
+  png_set_compression_level(png, PNG_COMPRESSION);
+  png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+  for (int py = 0; py < height; py++)
+  {
+    for (int px = 0; px < width; px++)
+    {
+      uint32_t pixel = pixels[(size_t)py*width + px];
+      row[3*px] = (pixel >> 16) & 0xFF;
+      row[3*px + 1] = (pixel >> 8) & 0xFF;
+      row[3*px + 2] = pixel & 0xFF;
+    }
+    png_write_row(png, &row[0]);
+  }
+  png_write_end(png, info);
+  png_destroy_write_struct(&png, &info);
+  return (fclose(file) == 0);
+}
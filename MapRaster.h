@@ -0,0 +1,103 @@
+// A fast renderer for the tracker and calorimeter maps, whose geometry never changes.
+// The axes, labels, grids and foil lines are drawn by ROOT once, into a layout image.
+// Each map is then drawn straight into a copy of the layout's pixels: its cells are
+// filled with the colours of the palette, leaving the layout's lines and labels on top,
+// a palette bar is drawn with its tick labels, and the image is written as a PNG.
+// Text is drawn with glyphs that ROOT rendered once, so it looks the same
+
+#ifndef MAPRASTER_H
+#define MAPRASTER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+// Where the cells of one map (or one calorimeter wall) go in the image, in pixels.
+// right and bottom are just outside it. Cells are numbered (x-1)*nY+(y-1) as for
+// the bins of a 2D histogram, with y counting up from the bottom
+struct RasterGrid
+{
+  int left;
+  int top;
+  int right;
+  int bottom;
+  int nX;
+  int nY;
+};
+
+// A character drawn by ROOT: how much ink covers each pixel of its cell, from 0 to 255
+struct RasterGlyph
+{
+  int width;
+  std::vector<unsigned char> coverage;
+};
+
+class RasterFont
+{
+public:
+  // Every glyph's cell is this many pixels high, with the characters drawn at the
+  // same height in each. The baseline is found from the glyph of 0
+  RasterFont(int height);
+
+  void AddGlyph(char c, int width, std::vector<unsigned char> coverage);
+  int GetHeight() { return height; }
+  int GetBaseline() { return baseline; }
+  int GetDigitHeight() { return digitHeight; }
+  int TextWidth(std::string text);
+
+  // Draw text with its baseline starting at (x,y)
+  void Draw(std::vector<uint32_t> &pixels, int imageWidth, int imageHeight, std::string text, int x, int y, uint32_t colour);
+
+private:
+  int height;
+  int baseline;
+  int digitHeight;
+  std::map<char,RasterGlyph> glyphs;
+};
+
+// The tick labels of the palette axis
+struct RasterTick
+{
+  double value;
+  std::string label;
+};
+
+class MapRaster
+{
+public:
+  // layout is the image drawn by ROOT, as 0xAARRGGBB pixels
+  MapRaster(int width, int height, std::vector<uint32_t> layout);
+
+  void AddGrid(RasterGrid grid); // In the order of the maps given to Write
+  void SetPaletteBar(RasterGrid bar, RasterFont *labelFont); // Only nX and nY are ignored
+  void SetTitle(RasterFont *titleFont, int x, int y, bool centred); // Baseline position
+
+  /**
+   *  Draw a set of maps and write them to a PNG file. bands are the colours from
+   *  min to max in equal steps, as ROOT's COL option uses them: cells below min,
+   *  NaN cells and empty cells are left white, and cells above max get the last colour
+   */
+  bool Write(std::string fileName, std::vector<std::vector<double> > &cells, double min, double max,
+             std::vector<uint32_t> &bands, std::vector<RasterTick> &ticks, std::string title);
+
+  static uint32_t Rgb(float r, float g, float b);
+
+private:
+  void FillRectangle(std::vector<uint32_t> &pixels, int left, int top, int right, int bottom, uint32_t colour);
+  bool WritePng(std::string fileName, std::vector<uint32_t> &pixels);
+
+  int width;
+  int height;
+  std::vector<uint32_t> layout;
+  std::vector<RasterGrid> grids;
+  bool hasPaletteBar;
+  RasterGrid paletteBar;
+  RasterFont *labelFont;
+  RasterFont *titleFont;
+  int titleX;
+  int titleY;
+  bool titleCentred;
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "PlotServer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+static const size_t MAX_REQUEST_BYTES = 8192; // Only the request line and headers are read
+static const int REQUEST_TIMEOUT_S = 5;
+
+PlotServer::PlotServer(int port) : listener(-1)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+  {
+    error = string("could not make a socket: ") + strerror(errno);
+    return;
+  }
+  int yes = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)); // So that it can be restarted straight away
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 16) != 0)
+  {
+    error = "could not listen on port " + to_string(port) + ": " + strerror(errno);
+    close(fd);
+    return;
+  }
+  listener = fd;
+  signal(SIGPIPE, SIG_IGN); // A browser that goes away mid-answer shouldn't stop the server
+}
+
+PlotServer::~PlotServer()
+{
+  if (listener >= 0) close(listener);
+}
+
+void PlotServer::Serve(Handler handler)
+{
+  while (listener >= 0)
+  {
+    int connection = accept(listener, 0, 0);
+    if (connection < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      error = string("could not accept a connection: ") + strerror(errno);
+      return;
+    }
+    struct timeval timeout = {REQUEST_TIMEOUT_S, 0};
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    Answer(connection, handler);
+    close(connection);
+  }
+}
+
+// Read the request up to the end of its headers, and send the handler's answer
+void PlotServer::Answer(int connection, Handler &handler)
+{
+  string request;
+  char buffer[1024];
+  while (request.find("\r\n\r\n") == string::npos && request.find("\n\n") == string::npos)
+  {
+    ssize_t nRead = recv(connection, buffer, sizeof(buffer), 0);
+    if (nRead <= 0) return;
+    request.append(buffer, nRead);
+    if (request.size() > MAX_REQUEST_BYTES) return;
+  }
+
+  // The request line is "METHOD /path?query HTTP/1.x"
+  string line = request.substr(0, request.find_first_of("\r\n"));
+  size_t pathStart = line.find(' ');
+  size_t pathEnd = (pathStart == string::npos ? string::npos : line.find(' ', pathStart + 1));
+  string method = line.substr(0, pathStart);
+  string status = "200 OK";
+  string contentType = "text/plain";
+  string body;
+  if (pathEnd == string::npos) status = "400 Bad Request";
+  else if (method != "GET" && method != "HEAD") status = "405 Method Not Allowed";
+  else
+  {
+    string path = line.substr(pathStart + 1, pathEnd - pathStart - 1);
+    path = DecodeUrl(path.substr(0, path.find('?')));
+    if (!handler(path, contentType, body))
+    {
+      status = "404 Not Found";
+      contentType = "text/plain";
+      body = "Not found: " + path + "\n";
+    }
+  }
+  if (status.compare(0, 3, "200") != 0 && body.empty()) body = status + "\n";
+
+  string header = "HTTP/1.0 " + status + "\r\nContent-Type: " + contentType + "\r\nContent-Length: " + to_string(body.size())
+    + "\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+  if (method == "HEAD") body.clear();
+  string answer = header + body;
+  for (size_t sent = 0; sent < answer.size(); )
+  {
+    ssize_t nSent = send(connection, answer.data() + sent, answer.size() - sent, 0);
+    if (nSent <= 0) return;
+    sent += nSent;
+  }
+}
+
+string PlotServer::DecodeUrl(const string &text)
+{
+  string decoded;
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    if (text[i] == '%' && i + 2 < text.size() && isxdigit(text[i+1]) && isxdigit(text[i+2]))
+    {
+      decoded += (char)strtol(text.substr(i + 1, 2).c_str(), 0, 16);
+      i += 2;
+    }
+    else decoded += text[i];
+  }
+  return decoded;
+}
+
+string PlotServer::EscapeUrl(const string &text)
+{
+  string escaped;
+  char code[4];
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    unsigned char c = text[i];
+    if (isalnum(c) || c == '_' || c == '-' || c == '.' || c == '/') escaped += c;
+    else
+    {
+      snprintf(code, sizeof(code), "%%%02X", c);
+      escaped += code;
+    }
+  }
+  return escaped;
+}
+
+string PlotServer::EscapeHtml(const string &text)
+{
+  string escaped;
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    switch (text[i])
+    {
+      case '&': escaped += "&amp;"; break;
+      case '<': escaped += "&lt;"; break;
+      case '>': escaped += "&gt;"; break;
+      case '"': escaped += "&quot;"; break;
+      default: escaped += text[i];
+    }
+  }
+  return escaped;
+}
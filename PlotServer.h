@@ -0,0 +1,41 @@
+// A small HTTP server for looking through the plots of a run in a browser, without
+// anything else to install. It answers GET requests one at a time, in the thread that
+// calls Serve, so the handler can draw with ROOT, which can only draw from one thread.
+// Each connection gets one answer and is then closed (HTTP/1.0). It listens on the
+// loopback address only, as it is meant for the person on the machine (or at the far
+// end of an ssh tunnel), and requests that are too long or too slow are dropped.
+
+#ifndef PLOTSERVER_H
+#define PLOTSERVER_H
+
+#include <string>
+#include <functional>
+
+class PlotServer
+{
+public:
+  // Answer to the (decoded) path of a request. False for a 404
+  typedef std::function<bool(const std::string &path, std::string &contentType, std::string &body)> Handler;
+
+  PlotServer(int port);
+  ~PlotServer();
+
+  bool IsOpen() { return (listener >= 0); }
+  std::string GetError() { return error; }
+
+  // Answer requests until the process is stopped
+  void Serve(Handler handler);
+
+  // For building pages: text escaped for HTML, and a name escaped for a URL path
+  static std::string EscapeHtml(const std::string &text);
+  static std::string EscapeUrl(const std::string &text);
+
+private:
+  void Answer(int connection, Handler &handler);
+  static std::string DecodeUrl(const std::string &text);
+
+  int listener;
+  std::string error;
+};
+
+#endif
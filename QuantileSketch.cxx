@@ -0,0 +1,216 @@
+#include "QuantileSketch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+QuantileSketch::QuantileSketch(double compression) :
+  compression(compression), bufferSize(5 * compression)
+{
+  // Reserve everything up front; the sizes never grow past these
+  centroids.reserve(bufferSize + 2 * compression);
+  buffer.reserve(bufferSize + 2 * compression);
+  Reset();
+}
+
+void QuantileSketch::Reset()
+{
+  centroids.clear();
+  buffer.clear();
+  totalWeight = 0;
+  min = numeric_limits<double>::infinity();
+  max = -numeric_limits<double>::infinity();
+}
+
+void QuantileSketch::Fill(double x, double weight)
+{
+  if (std::isnan(x) || weight <= 0) return;
+  Centroid c = {x, weight};
+  buffer.push_back(c);
+  totalWeight += weight;
+  if (x < min) min = x;
+  if (x > max) max = x;
+  if (buffer.size() >= bufferSize) Compress();
+}
+
+// Add another sketch's entries to this one (e.g. to combine sketches from several workers)
+void QuantileSketch::Merge(const QuantileSketch &other)
+{
+  const vector<Centroid> *parts[2] = {&other.centroids, &other.buffer};
+  for (int p = 0; p < 2; p++)
+  {
+    for (unsigned int i = 0; i < parts[p]->size(); i++)
+    {
+      buffer.push_back(parts[p]->at(i));
+      if (buffer.size() >= bufferSize) Compress();
+    }
+  }
+  totalWeight += other.totalWeight;
+  if (other.min < min) min = other.min;
+  if (other.max > max) max = other.max;
+}
+
+// The "k1" scale function: a centroid may span at most one unit of k, which
+// keeps the centroids near q=0 and q=1 small
+double QuantileSketch::ScaleFunction(double q) const
+{
+  return compression / (2 * M_PI) * asin(2 * q - 1);
+}
+
+vector<double> QuantileSketch::GetState() const
+{
+  vector<double> state;
+  state.push_back(compression);
+  state.push_back(totalWeight);
+  state.push_back(min);
+  state.push_back(max);
+  state.push_back(centroids.size());
+  state.push_back(buffer.size());
+  const vector<Centroid> *parts[2] = {&centroids, &buffer};
+  for (int p = 0; p < 2; p++)
+  {
+    for (unsigned int i = 0; i < parts[p]->size(); i++)
+    {
+      state.push_back(parts[p]->at(i).mean);
+      state.push_back(parts[p]->at(i).weight);
+    }
+  }
+  return state;
+}
+
+bool QuantileSketch::SetState(const vector<double> &state)
+{
+  if (state.size() < 6 || state[0] != compression) return false;
+  size_t nCentroids = (size_t)state[4];
+  size_t nBuffered = (size_t)state[5];
+  if (state.size() != 6 + 2 * (nCentroids + nBuffered) || nBuffered >= bufferSize) return false;
+  Reset();
+  totalWeight = state[1];
+  min = state[2];
+  max = state[3];
+  for (size_t i = 0; i < nCentroids + nBuffered; i++)
+  {
+    Centroid c = {state[6 + 2 * i], state[7 + 2 * i]};
+    if (i < nCentroids) centroids.push_back(c);
+    else buffer.push_back(c);
+  }
+  return true;
+}
+
+bool QuantileSketch::CompareMeans(const Centroid &a, const Centroid &b)
+{
+  return a.mean < b.mean;
+}
+
+// Merge the buffered values and the existing centroids into a new set of centroids
+void QuantileSketch::Compress()
+{
+  if (buffer.empty()) return;
+  buffer.insert(buffer.end(), centroids.begin(), centroids.end());
+  sort(buffer.begin(), buffer.end(), CompareMeans);
+  centroids.clear();
+
+  double weightBefore = 0; // Weight to the left of the centroid being built
+  double kLeft = ScaleFunction(0);
+  Centroid current = buffer.at(0);
+  for (unsigned int i = 1; i < buffer.size(); i++)
+  {
+    const Centroid &next = buffer.at(i);
+    double qRight = (weightBefore + current.weight + next.weight) / totalWeight;
+    if (ScaleFunction(qRight) - kLeft <= 1)
+    {
+      current.mean += (next.mean - current.mean) * next.weight / (current.weight + next.weight);
+      current.weight += next.weight;
+    }
+    else
+    {
+      centroids.push_back(current);
+      weightBefore += current.weight;
+      kLeft = ScaleFunction(weightBefore / totalWeight);
+      current = next;
+    }
+  }
+  centroids.push_back(current);
+  buffer.clear();
+}
+
+// Each centroid is taken to sit at the middle of the weight it holds, and the
+// cumulative distribution is interpolated linearly between them and the extremes
+void QuantileSketch::CdfPoints(vector<double> &values, vector<double> &cumulative)
+{
+  Compress();
+  values.clear();
+  cumulative.clear();
+  if (totalWeight <= 0) return;
+  values.push_back(min);
+  cumulative.push_back(0);
+  double weightBefore = 0;
+  for (unsigned int i = 0; i < centroids.size(); i++)
+  {
+    values.push_back(centroids.at(i).mean);
+    cumulative.push_back(weightBefore + centroids.at(i).weight / 2.);
+    weightBefore += centroids.at(i).weight;
+  }
+  values.push_back(max);
+  cumulative.push_back(totalWeight);
+}
+
+double QuantileSketch::Quantile(double q)
+{
+  vector<double> values, cumulative;
+  CdfPoints(values, cumulative);
+  if (values.empty()) return NAN;
+  if (q <= 0) return min;
+  if (q >= 1) return max;
+  double target = q * totalWeight;
+  unsigned int i = upper_bound(cumulative.begin(), cumulative.end(), target) - cumulative.begin();
+  if (i >= cumulative.size()) return max;
+  double span = cumulative.at(i) - cumulative.at(i-1);
+  if (span <= 0) return values.at(i);
+  return values.at(i-1) + (values.at(i) - values.at(i-1)) * (target - cumulative.at(i-1)) / span;
+}
+
+double QuantileSketch::Cdf(double x)
+{
+  vector<double> values, cumulative;
+  CdfPoints(values, cumulative);
+  if (values.empty()) return NAN;
+  unsigned int i = upper_bound(values.begin(), values.end(), x) - values.begin();
+  return CdfAt(values, cumulative, i, x);
+}
+
+// The distribution at x from the points of CdfPoints, where i is the first point above x
+double QuantileSketch::CdfAt(const vector<double> &values, const vector<double> &cumulative, unsigned int i, double x)
+{
+  if (x < values.front()) return 0;
+  if (x >= values.back() || i >= values.size()) return 1;
+  double span = values.at(i) - values.at(i-1);
+  if (span <= 0) return cumulative.at(i) / cumulative.back();
+  return (cumulative.at(i-1) + (cumulative.at(i) - cumulative.at(i-1)) * (x - values.at(i-1)) / span) / cumulative.back();
+}
+
+/**
+ *  The largest difference of two piecewise-linear distributions is at one of
+ *  their corners, so only the centroids and extremes of each need checking
+ */
+double QuantileSketch::KolmogorovDistance(QuantileSketch &a, QuantileSketch &b)
+{
+  if (a.GetEntries() <= 0 || b.GetEntries() <= 0) return NAN;
+  vector<double> values, cumulative, otherValues, otherCumulative;
+  a.CdfPoints(values, cumulative);
+  b.CdfPoints(otherValues, otherCumulative);
+
+  // Go through the corners of both in order, keeping the first point of each above the corner
+  double distance = 0;
+  unsigned int i = 0, j = 0;
+  while (i < values.size() || j < otherValues.size())
+  {
+    double x = (j >= otherValues.size() || (i < values.size() && values.at(i) <= otherValues.at(j)) ? values.at(i) : otherValues.at(j));
+    while (i < values.size() && values.at(i) <= x) i++;
+    while (j < otherValues.size() && otherValues.at(j) <= x) j++;
+    distance = fmax(distance, fabs(CdfAt(values, cumulative, i, x) - CdfAt(otherValues, otherCumulative, j, x)));
+  }
+  return distance;
+}
@@ -0,0 +1,61 @@
+// Fixed-size, mergeable quantile sketch (a merging t-digest, after T. Dunning,
+// "Computing extremely accurate quantiles using t-digests").
+// Values are buffered and merged into a set of weighted centroids, which are
+// small near the tails and large in the middle of the distribution. The number
+// of centroids is bounded by the compression, so the memory used does not grow
+// with the number of entries.
+
+#ifndef QUANTILESKETCH_H
+#define QUANTILESKETCH_H
+
+#include <vector>
+
+class QuantileSketch
+{
+public:
+  QuantileSketch(double compression=200);
+
+  void Fill(double x, double weight=1);
+  void Merge(const QuantileSketch &other);
+  void Reset();
+
+  // Approximate value below which a fraction q of the entries lie
+  double Quantile(double q);
+  // Approximate fraction of the entries below x
+  double Cdf(double x);
+
+  double GetEntries() const { return totalWeight; }
+  double GetMin() const { return min; }
+  double GetMax() const { return max; }
+
+  // Everything in the sketch as one array, to keep it somewhere and put it back
+  std::vector<double> GetState() const;
+  bool SetState(const std::vector<double> &state); // False if the state is of a sketch with another compression
+
+  // Approximate Kolmogorov-Smirnov distance (largest difference between the
+  // cumulative distributions) of two sketches, without any binning
+  static double KolmogorovDistance(QuantileSketch &a, QuantileSketch &b);
+
+private:
+  struct Centroid
+  {
+    double mean;
+    double weight;
+  };
+  static bool CompareMeans(const Centroid &a, const Centroid &b);
+  void Compress();
+  double ScaleFunction(double q) const;
+  // Points of the piecewise-linear cumulative distribution: (value, weight below it)
+  void CdfPoints(std::vector<double> &values, std::vector<double> &cumulative);
+  static double CdfAt(const std::vector<double> &values, const std::vector<double> &cumulative, unsigned int i, double x);
+
+  double compression;
+  unsigned int bufferSize;
+  std::vector<Centroid> centroids;
+  std::vector<Centroid> buffer;
+  double totalWeight;
+  double min;
+  double max;
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include "ReferenceStore.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <functional>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// File header: magic, format version, key length, number of values, then the key,
+// padded so that the values that follow are aligned
+static const char REFERENCE_STORE_MAGIC[4] = {'V','P','R','S'};
+static const uint32_t REFERENCE_STORE_FORMAT = 1;
+static const size_t HEADER_SIZE = 4 + 2*sizeof(uint32_t) + sizeof(uint64_t);
+
+static size_t PaddedKeyLength(size_t keyLength)
+{
+  size_t end = HEADER_SIZE + keyLength;
+  return keyLength + (sizeof(double) - end % sizeof(double)) % sizeof(double);
+}
+
+static string HashName(const string &text)
+{
+  char name[17];
+  snprintf(name, sizeof(name), "%016zx", hash<string>()(text));
+  return name;
+}
+
+ReferenceStore::ReferenceStore(string directory, string referenceFile, string identity) :
+  directory(directory), identity(identity), open(false), nFound(0), nPublished(0)
+{
+  prefix = HashName(referenceFile) + "_";
+  open = (access(directory.c_str(), R_OK | W_OK | X_OK) == 0);
+  if (open) RemoveStaleEntries();
+}
+
+ReferenceStore::~ReferenceStore()
+{
+  for (size_t i = 0; i < mapped.size(); i++) munmap(mapped[i].first, mapped[i].second);
+  while (!locks.empty()) Unlock(locks.begin()->first);
+}
+
+string ReferenceStore::EntryFile(const string &key)
+{
+  return directory + "/" + prefix + HashName(identity) + "_" + HashName(key) + ".ref";
+}
+
+/**
+ *  Delete the entries of this reference that were made from another version of it,
+ *  and the temporary files left by jobs that died while writing. Only one job at a
+ *  time does this, under a lock of its own for the reference
+ */
+void ReferenceStore::RemoveStaleEntries()
+{
+  int lockFile = ::open((directory + "/" + prefix + "clean.lock").c_str(), O_RDWR | O_CREAT, 0666);
+  if (lockFile < 0) return;
+  while (flock(lockFile, LOCK_EX) != 0 && errno == EINTR);
+  string current = prefix + HashName(identity) + "_";
+  DIR *dir = opendir(directory.c_str());
+  while (dir)
+  {
+    struct dirent *file = readdir(dir);
+    if (!file) break;
+    string name = file->d_name;
+    if (name.compare(0, prefix.length(), prefix) != 0 || name == prefix + "clean.lock") continue;
+    bool stale = (name.compare(0, current.length(), current) != 0);
+    size_t temp = name.rfind(".tmp");
+    if (!stale && temp != string::npos)
+    {
+      // A file being written by a job that is no longer running
+      pid_t writer = (pid_t)atol(name.c_str() + temp + 4);
+      stale = (writer > 0 && kill(writer, 0) != 0 && errno == ESRCH);
+    }
+    if (stale) remove((directory + "/" + name).c_str());
+  }
+  if (dir) closedir(dir);
+  flock(lockFile, LOCK_UN);
+  close(lockFile);
+}
+
+const double *ReferenceStore::Find(const string &key, size_t &nValues)
+{
+  nValues = 0;
+  if (!open) return 0;
+  int fd = ::open(EntryFile(key).c_str(), O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < HEADER_SIZE)
+  {
+    close(fd);
+    return 0;
+  }
+  size_t fileSize = info.st_size;
+  void *data = mmap(0, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return 0;
+
+  // Only use an entry for this key, from this version of the reference, in this format
+  const char *bytes = (const char*)data;
+  string fullKey = identity + "|" + key;
+  uint32_t header[2];
+  uint64_t nStored;
+  memcpy(header, bytes + 4, sizeof(header));
+  memcpy(&nStored, bytes + 4 + sizeof(header), sizeof(uint64_t));
+  size_t valuesStart = HEADER_SIZE + PaddedKeyLength(fullKey.length());
+  if (memcmp(bytes, REFERENCE_STORE_MAGIC, 4) != 0 || header[0] != REFERENCE_STORE_FORMAT || header[1] != fullKey.length()
+      || valuesStart + nStored*sizeof(double) != fileSize || memcmp(bytes + HEADER_SIZE, fullKey.data(), fullKey.length()) != 0)
+  {
+    munmap(data, fileSize);
+    return 0;
+  }
+  mapped.push_back(make_pair(data, fileSize));
+  nValues = nStored;
+  nFound++;
+  return (const double*)(bytes + valuesStart);
+}
+
+bool ReferenceStore::Lock(const string &key)
+{
+  if (!open) return false;
+  if (locks.count(key)) return true;
+  int fd = ::open((EntryFile(key) + ".lock").c_str(), O_RDWR | O_CREAT, 0666);
+  if (fd < 0) return false;
+  int result;
+  while ((result = flock(fd, LOCK_EX)) != 0 && errno == EINTR);
+  if (result != 0)
+  {
+    close(fd);
+    return false;
+  }
+  locks[key] = fd;
+  return true;
+}
+
+void ReferenceStore::Unlock(const string &key)
+{
+  map<string,int>::iterator it = locks.find(key);
+  if (it == locks.end()) return;
+  flock(it->second, LOCK_UN);
+  close(it->second);
+  locks.erase(it);
+}
+
+bool ReferenceStore::Publish(const string &key, const vector<double> &values)
+{
+  if (!open) return false;
+  string fileName = EntryFile(key);
+  string tempName = fileName + ".tmp" + to_string(getpid());
+  FILE *file = fopen(tempName.c_str(), "wb");
+  bool failed = (file == 0);
+  if (file)
+  {
+    string fullKey = identity + "|" + key;
+    fullKey.resize(PaddedKeyLength(fullKey.length()), '\0');
+    uint32_t header[2] = {REFERENCE_STORE_FORMAT, (uint32_t)(identity.length() + 1 + key.length())};
+    uint64_t nValues = values.size();
+    if (fwrite(REFERENCE_STORE_MAGIC, 1, 4, file) != 4) failed = true;
+    if (fwrite(header, sizeof(uint32_t), 2, file) != 2) failed = true;
+    if (fwrite(&nValues, sizeof(uint64_t), 1, file) != 1) failed = true;
+    if (fwrite(fullKey.data(), 1, fullKey.length(), file) != fullKey.length()) failed = true;
+    if (nValues > 0 && fwrite(&values[0], sizeof(double), nValues, file) != nValues) failed = true;
+    if (fclose(file) != 0) failed = true;
+    if (failed || rename(tempName.c_str(), fileName.c_str()) != 0)
+    {
+      remove(tempName.c_str());
+      failed = true;
+    }
+  }
+  Unlock(key);
+  if (!failed) nPublished++;
+  return !failed;
+}
@@ -0,0 +1,60 @@
+// A store of filled reference histograms that is shared by the jobs on one node that
+// compare their samples with the same reference. Each entry is the filled contents of
+// one reference histogram, map or matrix as a flat array of doubles, in a file of its
+// own in the store's directory, which should be on a memory file system such as
+// /dev/shm. The first job to need an entry locks it, fills it from the reference and
+// publishes it; the jobs after that map the file read-only instead of reading the
+// reference, and jobs that ask while it is being filled wait for it. The locks are
+// flock()s on a lock file next to each entry, so the system gives them up if a job
+// dies. Entries are written under a temporary name and renamed when complete, so a
+// job never maps a partial one, and one that is mapped stays valid even if it is
+// deleted. The files of an entry are named after the reference's path, its identity
+// and the key. The identity is whatever the caller gives, and should be cheap to work
+// out, such as the path, size and modification time, so that a job can find the
+// entries without reading the reference; when the reference changes, the entries made
+// from the old version are deleted as soon as the store is opened for the new one.
+
+#ifndef REFERENCESTORE_H
+#define REFERENCESTORE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstddef>
+
+class ReferenceStore
+{
+public:
+  // identity should change whenever the reference file does
+  ReferenceStore(std::string directory, std::string referenceFile, std::string identity);
+  ~ReferenceStore(); // Unmaps the entries and gives up any locks still held
+
+  bool IsOpen() { return open; }
+
+  // The values of an entry, mapped read-only until the store is closed, or 0 if there is no such entry
+  const double *Find(const std::string &key, size_t &nValues);
+  // Wait until no other job holds the lock of an entry, and take it
+  bool Lock(const std::string &key);
+  void Unlock(const std::string &key);
+  // Write an entry and give up its lock
+  bool Publish(const std::string &key, const std::vector<double> &values);
+
+  // Number of entries found in the store and published to it
+  int GetFound() { return nFound; }
+  int GetPublished() { return nPublished; }
+
+private:
+  std::string EntryFile(const std::string &key);
+  void RemoveStaleEntries();
+
+  std::string directory;
+  std::string prefix; // Of the file names of this reference's entries
+  std::string identity;
+  bool open;
+  std::map<std::string,int> locks; // The lock file of each entry we hold the lock of
+  std::vector<std::pair<void*,size_t> > mapped;
+  int nFound;
+  int nPublished;
+};
+
+#endif
@@ -0,0 +1,305 @@
+#include "ResultsStore.h"
+
+#include <iostream>
+#include <ctime>
+#include <algorithm>
+#include <sqlite3.h>
+
+using namespace std;
+
+// Columns returned by every results query, in the order ReadResults expects
+static const char *RESULT_COLUMNS =
+  "r.run_id, r.run_time, r.sample, r.sample_hash, r.reference, r.reference_hash, "
+  "b.branch, b.chisq, b.ndf, b.p_value, b.ks, b.mean_pull, b.rms_pull, b.flagged_cells, "
+  "b.sample_entries, b.reference_entries";
+
+ResultsStore::ResultsStore() : db(0)
+{
+}
+
+ResultsStore::~ResultsStore()
+{
+  Close();
+}
+
+/**
+ *  Open the store, creating it (and its indices) if it doesn't exist yet, unless it
+ *  is only to be read
+ */
+bool ResultsStore::Open(string fileName, bool readOnly)
+{
+  Close();
+  int flags = (readOnly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  if (sqlite3_open_v2(fileName.c_str(), &db, flags, 0) != SQLITE_OK)
+  {
+    error = (db ? sqlite3_errmsg(db) : "out of memory");
+    Close();
+    return false;
+  }
+  // Several validation jobs may be appending at once, so wait for each other's locks
+  sqlite3_busy_timeout(db, 60000);
+  if (readOnly) return true;
+
+  if (!Execute("CREATE TABLE IF NOT EXISTS runs ("
+                 "run_id INTEGER PRIMARY KEY AUTOINCREMENT, run_time INTEGER, "
+                 "sample TEXT, sample_hash TEXT, reference TEXT, reference_hash TEXT, run_key TEXT);"
+                 "CREATE TABLE IF NOT EXISTS branch_results ("
+                 "run_id INTEGER REFERENCES runs(run_id), branch TEXT, "
+                 "chisq REAL, ndf INTEGER, p_value REAL, ks REAL, mean_pull REAL, rms_pull REAL, "
+                 "flagged_cells INTEGER, sample_entries INTEGER, reference_entries INTEGER);"
+                 "CREATE INDEX IF NOT EXISTS branch_results_by_branch ON branch_results(branch, run_id);"
+                 "CREATE INDEX IF NOT EXISTS branch_results_by_run ON branch_results(run_id);"
+                 "CREATE TABLE IF NOT EXISTS flagged_cells ("
+                 "run_id INTEGER REFERENCES runs(run_id), branch TEXT, cell TEXT, pull REAL);"
+                 "CREATE INDEX IF NOT EXISTS flagged_cells_by_branch ON flagged_cells(branch, run_id);")) return false;
+
+  // Stores made before runs had keys get the column, which is NULL for the runs already
+  // in them. Another job may add it at the same time, so check again if adding it fails
+  sqlite3_stmt *keyColumn = Prepare("SELECT run_key FROM runs LIMIT 0;");
+  if (!keyColumn && !Execute("ALTER TABLE runs ADD COLUMN run_key TEXT;"))
+  {
+    keyColumn = Prepare("SELECT run_key FROM runs LIMIT 0;");
+    if (!keyColumn) return false;
+  }
+  sqlite3_finalize(keyColumn);
+  error = "";
+  return Execute("CREATE UNIQUE INDEX IF NOT EXISTS runs_by_key ON runs(run_key);");
+}
+
+void ResultsStore::Close()
+{
+  if (db) sqlite3_close(db);
+  db = 0;
+}
+
+bool ResultsStore::Execute(const char *sql)
+{
+  char *message = 0;
+  if (sqlite3_exec(db, sql, 0, 0, &message) != SQLITE_OK)
+  {
+    error = (message ? message : sqlite3_errmsg(db));
+    sqlite3_free(message);
+    return false;
+  }
+  return true;
+}
+
+sqlite3_stmt *ResultsStore::Prepare(const char *sql)
+{
+  sqlite3_stmt *statement = 0;
+  if (sqlite3_prepare_v2(db, sql, -1, &statement, 0) != SQLITE_OK)
+  {
+    error = sqlite3_errmsg(db);
+    return 0;
+  }
+  return statement;
+}
+
+// Bind a double, storing NaN (e.g. no pulls for a 1-D histogram) as NULL
+static void BindValue(sqlite3_stmt *statement, int column, double value)
+{
+  if (std::isnan(value)) sqlite3_bind_null(statement, column);
+  else sqlite3_bind_double(statement, column, value);
+}
+
+static double ColumnValue(sqlite3_stmt *statement, int column)
+{
+  if (sqlite3_column_type(statement, column) == SQLITE_NULL) return NAN;
+  return sqlite3_column_double(statement, column);
+}
+
+static string ColumnText(sqlite3_stmt *statement, int column)
+{
+  const unsigned char *text = sqlite3_column_text(statement, column);
+  return (text ? (const char*)text : "");
+}
+
+/**
+ *  Add a run and the results of all its compared branches. Everything goes in one
+ *  transaction, so a run is either stored completely or not at all. A run that is
+ *  stopped after storing its results and then resumed stores them again, so runs
+ *  with a key are looked for first, in the same transaction
+ */
+long long ResultsStore::AppendRun(RunInfo run, const vector<BranchResult> &results)
+{
+  if (!db)
+  {
+    error = "store is not open";
+    return -1;
+  }
+  error = "";
+  if (run.runTime == 0) run.runTime = time(0);
+  if (!Execute("BEGIN IMMEDIATE;")) return -1;
+
+  if (run.runKey.length() > 0)
+  {
+    sqlite3_stmt *findRun = Prepare("SELECT run_id FROM runs WHERE run_key = ?;");
+    if (!findRun)
+    {
+      Execute("ROLLBACK;");
+      return -1;
+    }
+    sqlite3_bind_text(findRun, 1, run.runKey.c_str(), -1, SQLITE_TRANSIENT);
+    long long storedRunId = (sqlite3_step(findRun) == SQLITE_ROW ? sqlite3_column_int64(findRun, 0) : -1);
+    sqlite3_finalize(findRun);
+    if (storedRunId >= 0)
+    {
+      Execute("ROLLBACK;");
+      return storedRunId;
+    }
+  }
+
+  sqlite3_stmt *insertRun = Prepare("INSERT INTO runs (run_time, sample, sample_hash, reference, reference_hash, run_key) VALUES (?,?,?,?,?,?);");
+  sqlite3_stmt *insertBranch = Prepare("INSERT INTO branch_results VALUES (?,?,?,?,?,?,?,?,?,?,?);");
+  sqlite3_stmt *insertCell = Prepare("INSERT INTO flagged_cells VALUES (?,?,?,?);");
+  bool ok = (insertRun && insertBranch && insertCell);
+
+  if (ok)
+  {
+    sqlite3_bind_int64(insertRun, 1, run.runTime);
+    sqlite3_bind_text(insertRun, 2, run.sample.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(insertRun, 3, run.sampleHash.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(insertRun, 4, run.reference.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(insertRun, 5, run.referenceHash.c_str(), -1, SQLITE_TRANSIENT);
+    if (run.runKey.length() > 0) sqlite3_bind_text(insertRun, 6, run.runKey.c_str(), -1, SQLITE_TRANSIENT);
+    else sqlite3_bind_null(insertRun, 6); // Never the same as another run's
+    ok = (sqlite3_step(insertRun) == SQLITE_DONE);
+    run.runId = sqlite3_last_insert_rowid(db);
+  }
+
+  for (size_t i=0; ok && i<results.size(); i++)
+  {
+    const BranchResult &result = results.at(i);
+    sqlite3_reset(insertBranch);
+    sqlite3_bind_int64(insertBranch, 1, run.runId);
+    sqlite3_bind_text(insertBranch, 2, result.branchName.c_str(), -1, SQLITE_TRANSIENT);
+    BindValue(insertBranch, 3, result.chisq);
+    sqlite3_bind_int(insertBranch, 4, result.ndf);
+    BindValue(insertBranch, 5, (result.pValue < 0 ? NAN : result.pValue)); // No p-value without a comparison
+    BindValue(insertBranch, 6, (result.ks < 0 ? NAN : result.ks)); // No KS score for the calorimeter
+    BindValue(insertBranch, 7, result.meanPull);
+    BindValue(insertBranch, 8, result.rmsPull);
+    sqlite3_bind_int(insertBranch, 9, result.flaggedCells.size());
+    sqlite3_bind_int64(insertBranch, 10, result.sampleEntries);
+    sqlite3_bind_int64(insertBranch, 11, result.refEntries);
+    ok = (sqlite3_step(insertBranch) == SQLITE_DONE);
+
+    for (size_t j=0; ok && j<result.flaggedCells.size(); j++)
+    {
+      sqlite3_reset(insertCell);
+      sqlite3_bind_int64(insertCell, 1, run.runId);
+      sqlite3_bind_text(insertCell, 2, result.branchName.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_text(insertCell, 3, result.flaggedCells.at(j).cell.c_str(), -1, SQLITE_TRANSIENT);
+      BindValue(insertCell, 4, result.flaggedCells.at(j).pull);
+      ok = (sqlite3_step(insertCell) == SQLITE_DONE);
+    }
+  }
+  if (!ok && error.length() == 0) error = sqlite3_errmsg(db);
+
+  sqlite3_finalize(insertRun);
+  sqlite3_finalize(insertBranch);
+  sqlite3_finalize(insertCell);
+
+  if (!ok)
+  {
+    Execute("ROLLBACK;");
+    return -1;
+  }
+  if (!Execute("COMMIT;")) return -1;
+  return run.runId;
+}
+
+vector<StoredResult> ResultsStore::ReadResults(sqlite3_stmt *statement)
+{
+  vector<StoredResult> rows;
+  while (sqlite3_step(statement) == SQLITE_ROW)
+  {
+    StoredResult row;
+    row.run.runId = sqlite3_column_int64(statement, 0);
+    row.run.runTime = sqlite3_column_int64(statement, 1);
+    row.run.sample = ColumnText(statement, 2);
+    row.run.sampleHash = ColumnText(statement, 3);
+    row.run.reference = ColumnText(statement, 4);
+    row.run.referenceHash = ColumnText(statement, 5);
+    row.result.branchName = ColumnText(statement, 6);
+    row.result.hasComparison = true;
+    row.result.chisq = ColumnValue(statement, 7);
+    row.result.ndf = sqlite3_column_int(statement, 8);
+    row.result.pValue = ColumnValue(statement, 9);
+    row.result.ks = ColumnValue(statement, 10);
+    row.result.meanPull = ColumnValue(statement, 11);
+    row.result.rmsPull = ColumnValue(statement, 12);
+    row.nFlagged = sqlite3_column_int(statement, 13);
+    row.result.sampleEntries = sqlite3_column_int64(statement, 14);
+    row.result.refEntries = sqlite3_column_int64(statement, 15);
+    rows.push_back(row);
+  }
+  sqlite3_finalize(statement);
+  return rows;
+}
+
+vector<StoredResult> ResultsStore::TimeSeries(string branchName, int nRuns)
+{
+  vector<StoredResult> rows;
+  if (!db) return rows;
+  // Walk the (branch, run_id) index backwards from the latest run
+  string sql = string("SELECT ") + RESULT_COLUMNS + " FROM branch_results b JOIN runs r ON r.run_id = b.run_id "
+               "WHERE b.branch = ? ORDER BY b.run_id DESC LIMIT ?;";
+  sqlite3_stmt *statement = Prepare(sql.c_str());
+  if (!statement) return rows;
+  sqlite3_bind_text(statement, 1, branchName.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int(statement, 2, nRuns);
+  rows = ReadResults(statement);
+  reverse(rows.begin(), rows.end());
+  return rows;
+}
+
+vector<StoredResult> ResultsStore::WorstOffenders(string metric, int nRuns, int limit)
+{
+  vector<StoredResult> rows;
+  if (!db) return rows;
+  // Only known metrics are allowed, as this goes straight into the SQL
+  string order;
+  if (metric == "pvalue") order = "b.p_value IS NULL, b.p_value ASC";
+  else if (metric == "chisq") order = "b.chisq / MAX(b.ndf, 1) DESC";
+  else if (metric == "ks") order = "b.ks IS NULL, b.ks ASC";
+  else if (metric == "pull") order = "b.mean_pull IS NULL, ABS(b.mean_pull) DESC";
+  else if (metric == "flagged") order = "b.flagged_cells DESC";
+  else
+  {
+    error = "unknown metric " + metric + " (use pvalue, chisq, ks, pull or flagged)";
+    return rows;
+  }
+  string sql = string("SELECT ") + RESULT_COLUMNS + " FROM branch_results b JOIN runs r ON r.run_id = b.run_id "
+               "WHERE b.run_id >= (SELECT MIN(run_id) FROM (SELECT run_id FROM runs ORDER BY run_id DESC LIMIT ?)) "
+               "ORDER BY " + order + " LIMIT ?;";
+  sqlite3_stmt *statement = Prepare(sql.c_str());
+  if (!statement) return rows;
+  sqlite3_bind_int(statement, 1, nRuns);
+  sqlite3_bind_int(statement, 2, limit);
+  return ReadResults(statement);
+}
+
+vector<FlaggedCell> ResultsStore::FrequentlyFlaggedCells(string branchName, int nRuns, int limit, vector<int> &timesFlagged)
+{
+  vector<FlaggedCell> cells;
+  timesFlagged.clear();
+  if (!db) return cells;
+  sqlite3_stmt *statement = Prepare("SELECT cell, COUNT(*), AVG(pull) FROM flagged_cells "
+                                    "WHERE branch = ? AND run_id >= (SELECT MIN(run_id) FROM (SELECT run_id FROM runs ORDER BY run_id DESC LIMIT ?)) "
+                                    "GROUP BY cell ORDER BY COUNT(*) DESC, ABS(AVG(pull)) DESC LIMIT ?;");
+  if (!statement) return cells;
+  sqlite3_bind_text(statement, 1, branchName.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int(statement, 2, nRuns);
+  sqlite3_bind_int(statement, 3, limit);
+  while (sqlite3_step(statement) == SQLITE_ROW)
+  {
+    FlaggedCell cell;
+    cell.cell = ColumnText(statement, 0);
+    cell.pull = ColumnValue(statement, 2);
+    cells.push_back(cell);
+    timesFlagged.push_back(sqlite3_column_int(statement, 1));
+  }
+  sqlite3_finalize(statement);
+  return cells;
+}
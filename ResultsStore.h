@@ -0,0 +1,96 @@
+// Append-only store of per-branch validation statistics, so that trends can
+// be followed over many runs without parsing the ValidationResults.txt files.
+// It is a single SQLite file, indexed by branch name and run number.
+
+#ifndef RESULTSSTORE_H
+#define RESULTSSTORE_H
+
+#include <string>
+#include <vector>
+#include <cmath>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+// A cell (tracker or calorimeter) whose pull is over the reporting threshold
+struct FlaggedCell
+{
+  std::string cell;
+  double pull;
+};
+
+// Statistics from comparing one branch with the reference
+struct BranchResult
+{
+  std::string branchName;
+  bool hasComparison=false;
+  double chisq=0;
+  int ndf=0;
+  double pValue=-1;
+  double ks=-1;
+  double pValueLow=-1; // Range of p-values used for the quick-look stability test
+  double pValueHigh=-1;
+  double meanPull=NAN; // Only for map branches
+  double rmsPull=NAN;
+  std::vector<FlaggedCell> flaggedCells;
+  long long sampleEntries=0; // Number of entries the comparison was based on
+  long long refEntries=0;
+};
+
+// One run of the validation tool
+struct RunInfo
+{
+  long long runId=0;
+  long long runTime=0; // Unix time
+  std::string sample;
+  std::string sampleHash;
+  std::string reference;
+  std::string referenceHash;
+  std::string runKey; // If given, a run with the same key is only ever stored once
+};
+
+// One row of a query: a branch result and the run it came from
+struct StoredResult
+{
+  RunInfo run;
+  BranchResult result;
+  int nFlagged=0;
+};
+
+class ResultsStore
+{
+public:
+  ResultsStore();
+  ~ResultsStore();
+
+  // Read-only opens an existing store for queries, and never changes or creates it
+  bool Open(std::string fileName, bool readOnly=false);
+  void Close();
+
+  // Add a run and all its branch results in one transaction. Returns the new run number (or -1).
+  // If a run with the same key is already stored, nothing is added and its number is returned
+  long long AppendRun(RunInfo run, const std::vector<BranchResult> &results);
+
+  // The last nRuns results for a branch, oldest first
+  std::vector<StoredResult> TimeSeries(std::string branchName, int nRuns);
+
+  // The worst branch results in the last nRuns runs, ranked by one of
+  // "pvalue", "chisq" (per degree of freedom), "ks", "pull" (absolute mean pull) or "flagged"
+  std::vector<StoredResult> WorstOffenders(std::string metric, int nRuns, int limit);
+
+  // Cells of a branch most often over the pull threshold in the last nRuns runs,
+  // with the number of runs they were flagged in and their average pull
+  std::vector<FlaggedCell> FrequentlyFlaggedCells(std::string branchName, int nRuns, int limit, std::vector<int> &timesFlagged);
+
+  std::string GetError() { return error; }
+
+private:
+  bool Execute(const char *sql);
+  sqlite3_stmt *Prepare(const char *sql);
+  std::vector<StoredResult> ReadResults(sqlite3_stmt *statement);
+
+  sqlite3 *db;
+  std::string error;
+};
+
+#endif
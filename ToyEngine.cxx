@@ -0,0 +1,147 @@
+#include "ToyEngine.h"
+
+#include <cmath>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+using namespace std;
+
+ToyEngine::ToyEngine(int nToys, unsigned long seed, int nThreads) : nToys(nToys), seed(seed), nThreads(nThreads)
+{
+  if (this->nThreads <= 0) this->nThreads = max(1u, thread::hardware_concurrency());
+}
+
+void ToyEngine::Statistics(const vector<double> &sample, const vector<double> &sampleError,
+                           const vector<double> &ref, const vector<double> &refError,
+                           double &chisq, int &ndf, double &maxPull, int &maxPullCell)
+{
+  chisq = 0;
+  ndf = 0;
+  maxPull = 0;
+  maxPullCell = -1;
+  for (int i=0; i<(int)sample.size(); i++)
+  {
+    double val1 = sample[i];
+    double val2 = ref[i];
+    double err1 = sampleError[i];
+    double err2 = refError[i];
+    if (std::isnan(val1) || std::isnan(val2) || std::isnan(err1) || std::isnan(err2)) continue;
+    if (err1 == 0 || err2 == 0) continue;
+    double variance = err1*err1 + err2*err2;
+    chisq += (val1 - val2) * (val1 - val2) / variance;
+    ndf++;
+    if (val2 == 0) continue; // No pull where the reference is empty
+    double pull = fabs(val1 - val2) / sqrt(variance);
+    if (pull > maxPull)
+    {
+      maxPull = pull;
+      maxPullCell = i;
+    }
+  }
+}
+
+ToyResult ToyEngine::Run(const ToyComparison &comparison)
+{
+  ToyResult result;
+  Statistics(comparison.sample, comparison.sampleError, comparison.ref, comparison.refError,
+             result.chisq, result.ndf, result.maxPull, result.maxPullCell);
+  if (nToys <= 0 || result.ndf == 0) return result;
+
+  vector<double> toyChisq(nToys);
+  vector<double> toyMaxPull(nToys);
+  RunBlocks(comparison, toyChisq, toyMaxPull);
+
+  // Count the observation itself as one of the toys, so a p-value is never 0
+  int chisqOver = 0;
+  int pullOver = 0;
+  for (int i=0; i<nToys; i++)
+  {
+    if (toyChisq[i] >= result.chisq) chisqOver++;
+    if (toyMaxPull[i] >= result.maxPull) pullOver++;
+  }
+  result.nToys = nToys;
+  result.chisqPValue = (chisqOver + 1.) / (nToys + 1.);
+  result.globalPValue = (pullOver + 1.) / (nToys + 1.);
+  result.localPValue = erfc(result.maxPull / sqrt(2.));
+  return result;
+}
+
+/**
+ *  Generate the toys a block at a time. The threads take the next block until
+ *  they are all done, and write straight into their own slots of the results
+ */
+void ToyEngine::RunBlocks(const ToyComparison &comparison, vector<double> &toyChisq, vector<double> &toyMaxPull)
+{
+  int nCells = comparison.sample.size();
+  double k = comparison.scale;
+
+  // For averages, the expected value of both if they agree is their weighted mean
+  vector<double> pooledMean(nCells, 0);
+  for (int i=0; comparison.isAverage && i<nCells; i++)
+  {
+    double err1 = comparison.sampleError[i];
+    double err2 = comparison.refError[i];
+    if (err1 == 0 || err2 == 0 || std::isnan(err1) || std::isnan(err2)) continue;
+    pooledMean[i] = (comparison.sample[i]/(err1*err1) + comparison.ref[i]/(err2*err2)) / (1/(err1*err1) + 1/(err2*err2));
+  }
+
+  int nBlocks = (nToys + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  atomic<int> nextBlock(0);
+  auto worker = [&]()
+  {
+    vector<double> sample(nCells), sampleError(nCells), ref(nCells), refError(nCells);
+    // For counts, each cell's total is split between sample and reference in the ratio
+    // expected if they agree. Keeping the totals makes the toys match the observed
+    // spread of cell occupancies, which matters for the many cells with few hits.
+    // Setting up a distribution is slower than drawing from it, so do it once per cell
+    vector<int> total(nCells, 0);
+    vector<binomial_distribution<int> > split(nCells);
+    for (int i=0; !comparison.isAverage && i<nCells; i++)
+    {
+      if (std::isnan(comparison.sample[i]) || std::isnan(comparison.ref[i])) continue;
+      total[i] = (int)round(comparison.sample[i] + comparison.ref[i]/k); // The reference was scaled by k
+      split[i] = binomial_distribution<int>(total[i], k/(1+k));
+    }
+    for (int block = nextBlock++; block < nBlocks; block = nextBlock++)
+    {
+      seed_seq streamSeed = {(unsigned long)seed, (unsigned long)block};
+      mt19937_64 rng(streamSeed);
+      normal_distribution<double> gaussian(0, 1);
+      int lastToy = min(nToys, (block + 1) * BLOCK_SIZE);
+      for (int toy = block * BLOCK_SIZE; toy < lastToy; toy++)
+      {
+        for (int i=0; i<nCells; i++)
+        {
+          sample[i] = comparison.sample[i];
+          sampleError[i] = comparison.sampleError[i];
+          ref[i] = comparison.ref[i];
+          refError[i] = comparison.refError[i];
+          if (comparison.isAverage)
+          {
+            // Cells that can't be compared stay as they are
+            if (sampleError[i] == 0 || refError[i] == 0 || std::isnan(sampleError[i]) || std::isnan(refError[i])) continue;
+            sample[i] = pooledMean[i] + sampleError[i] * gaussian(rng);
+            ref[i] = pooledMean[i] + refError[i] * gaussian(rng);
+            continue;
+          }
+          if (std::isnan(sample[i]) || std::isnan(ref[i])) continue;
+          double n1 = split[i](rng);
+          double n2 = total[i] - n1;
+          sample[i] = n1;
+          sampleError[i] = (n1 > 0 ? sqrt(n1) : comparison.zeroCountError);
+          ref[i] = k * n2;
+          refError[i] = k * (n2 > 0 ? sqrt(n2) : comparison.zeroCountError);
+        }
+        int ndf, cell;
+        Statistics(sample, sampleError, ref, refError, toyChisq[toy], ndf, toyMaxPull[toy], cell);
+      }
+    }
+  };
+
+  vector<thread> threads;
+  for (int i=1; i<min(nThreads, nBlocks); i++) threads.push_back(thread(worker));
+  worker();
+  for (size_t i=0; i<threads.size(); i++) threads[i].join();
+}
@@ -0,0 +1,62 @@
+// Toy experiments for calibrating sample/reference comparisons. Replicas of
+// both sides are generated under the hypothesis that they agree (the counts in
+// each cell are split between sample and reference binomially, keeping the cell's
+// total; averages are drawn from Gaussians about their weighted mean),
+// and the chi-square and the largest cell pull of each replica give p-values
+// that don't rely on asymptotic distributions. The largest pull is compared
+// with the largest pull of each toy, so its p-value is corrected for the
+// number of cells tested. Toys run on all cores; each block of toys has its
+// own random number stream, so results don't depend on the number of threads.
+
+#ifndef TOYENGINE_H
+#define TOYENGINE_H
+
+#include <vector>
+
+// The cells of a comparison, with the values and uncertainties as compared
+struct ToyComparison
+{
+  bool isAverage=false;
+  double scale=1; // The reference counts were scaled by this to match the sample
+  double zeroCountError=0; // Uncertainty given to an empty bin of counts (0: the bin is left out)
+  std::vector<double> sample;
+  std::vector<double> sampleError;
+  std::vector<double> ref;
+  std::vector<double> refError;
+};
+
+struct ToyResult
+{
+  int nToys=0;
+  double chisq=0;
+  int ndf=0;
+  double chisqPValue=-1; // Fraction of toys with a chi-square at least as big
+  double maxPull=0; // Largest absolute pull, and the cell it is in
+  int maxPullCell=-1;
+  double localPValue=-1; // Two-sided Gaussian p-value of that cell on its own
+  double globalPValue=-1; // Fraction of toys with a largest pull at least as big
+};
+
+class ToyEngine
+{
+public:
+  ToyEngine(int nToys, unsigned long seed, int nThreads=0);
+
+  ToyResult Run(const ToyComparison &comparison);
+
+  // Chi-square and largest pull, with the same rules as the plots: cells with a
+  // zero or undefined uncertainty are left out
+  static void Statistics(const std::vector<double> &sample, const std::vector<double> &sampleError,
+                         const std::vector<double> &ref, const std::vector<double> &refError,
+                         double &chisq, int &ndf, double &maxPull, int &maxPullCell);
+
+private:
+  void RunBlocks(const ToyComparison &comparison, std::vector<double> &toyChisq, std::vector<double> &toyMaxPull);
+
+  int nToys;
+  unsigned long seed;
+  int nThreads;
+  static const int BLOCK_SIZE=64; // Toys per random number stream
+};
+
+#endif
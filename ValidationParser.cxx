@@ -8,6 +8,55 @@ TTree *reftree;
 map<string,string> configParams;
 string plotdir;
 ofstream textOut;
+int quickLookStride=1; // Quick-look mode is on if the first round skips entries
+int entryStride=1; // Only every entryStride-th entry is read in the current pass
+BranchResult branchResult; // Comparison statistics for the branch being plotted
+vector<BranchResult> allResults; // Final statistics for every compared branch, for the results store
+double sampleReadTime=0; // Time spent in tree passes, for the profile
+double refReadTime=0;
+std::mutex readTimeMutex;
+HistogramWriter histogramWriter; // Writes the finished histograms to ValidationHistograms.root
+Logger logger(cout, LOG_REPEATS); // For messages from the passes over the trees, which must not wait for the terminal
+int outputCompression=ROOT::CompressionSettings(ROOT::kZLIB, 1); // Set with -z
+int nToys=0; // Toy experiments to calibrate each comparison with, if any
+string selection=""; // Only entries that pass this are validated
+TEntryList *sampleSelection=0; // The entries that pass the selection, if there is one
+TEntryList *refSelection=0;
+string sliceKey=""; // Slice the sample by this (--slice), with these window edges, or windows of this width,
+vector<double> sliceEdges; // or else one slice per value
+double sliceWidth=0;
+string matchRunBranch=""; // With --match, each sample event is compared with the reference event that has the same numbers in these
+string matchEventBranch="";
+string hitCacheDir=""; // Keep the decoded map hits here, with --hit-cache, to fill from next time
+string sharedReferenceDir=""; // With --shared-reference, the filled reference histograms are shared with the other jobs on the node in a store here
+ReferenceStore *referenceStore=0; // The store for the reference being compared with
+bool makeImages=false; // Only with --images (or --serve) are there canvases and images, not just the histograms and results
+int pullSummary=PULLS_MEDIAN; // How the pulls of each map are summed up, set with --pull-summary
+bool fromOutputs=false; // With --from-outputs, the inputs are ValidationHistograms.root files of earlier runs
+bool planOnly=false; // With --plan, the execution plan is printed and nothing is read
+int servePort=0; // With --serve, the plots of an earlier run are drawn when a browser asks for them
+TFile *servedFile=0; // The output file of the run being served, its results, and what can be drawn from it
+string servedResults="";
+map<string,ServedBranch> servedBranches;
+map<string,string> servedImages; // The branch each image is of
+time_t servedFileTime=0;
+string checkpointDir=""; // A run that reads every entry is checkpointed here, to carry on from with --resume
+bool resumeRun=false;
+Checkpoint checkpoint; // Where the run has got to, as of the last checkpoint
+bool useMapRaster=true; // Map images are drawn by the fast renderer, unless it can't make its layouts
+MapRaster *trackerRaster=0; // Its layouts, made when the first map of each kind is drawn
+MapRaster *caloRaster=0;
+map<string,TH1D*> sliceTemplates; // Empty copies of the 1D histograms, for the binning of their slices
+map<string,MapAccumulator> sampleMaps; // Map histograms filled in the shared pass over each tree, by branch
+map<string,MapAccumulator> refMaps;
+bool keepSampleHistograms=false; // With several references, the sample histograms are kept to compare with each one
+map<pair<string,int>,MapAccumulator> filledSampleMaps; // The filled sample maps and 1D histograms, by branch and stride
+map<pair<string,int>,TH1D*> sampleHistograms;
+map<pair<string,int>,QuantileSketch> sampleSketches;
+vector<string> covarianceBranches; // The scalar h_ branches, whose covariance is filled in the shared pass
+CovarianceMatrix *sampleCovariance=0; // Filled once, with every entry, and kept for each reference
+vector<string> refCovarianceBranches; // Those of them that the reference has too
+CovarianceMatrix *refCovariance=0;
 
 /**
  *  main function
@@ -15,20 +64,23 @@ ofstream textOut;
  */
 int main(int argc, char **argv)
 {
-  gStyle->SetOptStat(0);
-  gStyle->SetPalette(PALETTE);
+  // The reference is read in its own thread, and baskets are prefetched in the background
+  ROOT::EnableThreadSafety();
+  gEnv->SetValue("TFile.AsyncPrefetching", 1);
   gErrorIgnoreLevel = kWarning;
+  TStopwatch runTimer;
   if (argc < 2)
   {
-    cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional)> -c <config file (optional)> -o <output directory (optional)> -t <temp directory (optional)>"<<endl;
+    cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional, repeatable)> -c <config file (optional)> -o <output directory (optional)> -t <temp directory (optional)> -q <quick-look initial stride (optional)> -s <results store (optional)> -j <decompression threads (optional)> -z <output compression, e.g. zstd:5 (optional)> -b <number of toys (optional)> --selection <expression (optional)> --slice <key branch[:width or edges] (optional)> --images --hit-cache <directory (optional)> --shared-reference <directory (optional)> --pull-summary <median, moments, trimmed or fit (optional)> --plan --from-outputs --pull-threshold <sigma (optional)> --pvalue-threshold <p-value (optional)> --log-level <debug, info, warning or error (optional)> --match <run branch>,<event branch> (optional)> --resume --serve <port (optional)>"<<endl;
     return -1;
   }
   // This bit is kept for compatibility with old version that would take just a root file name and a config file name
   string dataFileInput="";
-  string referenceFileInput="";
+  vector<string> referenceFileInputs;
   string configFileInput="";
   string tempDirInput="";
   string plotDirInput="";
+  string storeFileInput="";
   if (argc == 2 && argv[1][0]!= '-')
   {
     dataFileInput = argv[1];
@@ -41,20 +93,39 @@ int main(int argc, char **argv)
   else
   {
     int flag=0;
-    while ((flag = getopt (argc, argv, "h-i:r:c:t:o:")) != -1)
+    static struct option longOptions[] =
+    {
+      {"selection", required_argument, 0, 'e'},
+      {"slice", required_argument, 0, 'l'},
+      {"images", no_argument, 0, 'y'},
+      {"hit-cache", required_argument, 0, 'k'},
+      {"pull-summary", required_argument, 0, 'p'},
+      {"plan", no_argument, 0, 'd'},
+      {"from-outputs", no_argument, 0, 'f'},
+      {"pull-threshold", required_argument, 0, 'u'},
+      {"pvalue-threshold", required_argument, 0, 'v'},
+      {"log-level", required_argument, 0, 'g'},
+      {"match", required_argument, 0, 'm'},
+      {"resume", no_argument, 0, 'a'},
+      {"shared-reference", required_argument, 0, 'x'},
+      {"serve", required_argument, 0, 'w'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}
+    };
+    while ((flag = getopt_long (argc, argv, "h-i:r:c:t:o:q:s:j:z:b:e:l:yk:p:dfu:v:g:m:ax:w:", longOptions, 0)) != -1)
     {
       switch (flag)
       {
         case 'h':
         case '-':
-          cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional)> -c <config file (optional)> -o <output directory (optional)> -t <temp directory (optional)>"<<endl;
+          cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional, repeatable)> -c <config file (optional)> -o <output directory (optional)> -t <temp directory (optional)> -q <quick-look initial stride (optional)> -s <results store (optional)> -j <decompression threads (optional)> -z <output compression, e.g. zstd:5 (optional)> -b <number of toys (optional)> --selection <expression (optional)> --slice <key branch[:width or edges] (optional)> --images --hit-cache <directory (optional)> --shared-reference <directory (optional)> --pull-summary <median, moments, trimmed or fit (optional)> --plan --from-outputs --pull-threshold <sigma (optional)> --pvalue-threshold <p-value (optional)> --log-level <debug, info, warning or error (optional)> --match <run branch>,<event branch> (optional)> --resume --serve <port (optional)>"<<endl;
           return 1;
           break;
         case 'i':
           dataFileInput = optarg;
           break;
         case 'r':
-          referenceFileInput = optarg;
+          referenceFileInputs.push_back(optarg);
           break;
         case 'c':
           configFileInput = optarg;
@@ -65,8 +136,171 @@ int main(int argc, char **argv)
         case 't':
           tempDirInput = optarg;
           break;
+        case 's':
+          storeFileInput = optarg;
+          break;
+        case 'j':
+        {
+          // Decompress baskets with a pool of threads (0 for one per core)
+          int nThreads=-1;
+          try
+          {
+            size_t end=0;
+            nThreads = std::stoi(optarg, &end);
+            if (optarg[end]!='\0') nThreads=-1;
+          }
+          catch (exception &e)
+          {
+            nThreads = -1;
+          }
+          if (nThreads < 0 || nThreads > MAX_UNZIP_THREADS)
+          {
+            cout<<"ERROR: the number of decompression threads must be an integer from 0 (one per core) to "<<MAX_UNZIP_THREADS<<endl;
+            return -1;
+          }
+          ROOT::EnableImplicitMT(nThreads);
+          TTreeCacheUnzip::SetParallelUnzip(TTreeCacheUnzip::kEnable);
+          break;
+        }
+        case 'z':
+          outputCompression = ParseCompressionSettings(optarg);
+          if (outputCompression < 0)
+          {
+            cout<<"ERROR: unknown output compression "<<optarg<<" (use zstd, lz4, zlib, lzma or none, with an optional :level)"<<endl;
+            return -1;
+          }
+          break;
+        case 'e':
+          selection = optarg;
+          break;
+        case 'y':
+          makeImages = true;
+          break;
+        case 'k':
+          hitCacheDir = optarg;
+          break;
+        case 'x':
+          sharedReferenceDir = optarg;
+          break;
+        case 'd':
+          planOnly = true;
+          break;
+        case 'a':
+          resumeRun = true;
+          break;
+        case 'f':
+          fromOutputs = true;
+          break;
+        case 'g':
+        {
+          int level = Logger::ParseLevel(optarg);
+          if (level < 0)
+          {
+            cout<<"ERROR: unknown log level "<<optarg<<" (use debug, info, warning or error)"<<endl;
+            return -1;
+          }
+          logger.SetLevel((Logger::Level)level);
+          break;
+        }
+        case 'u':
+          try
+          {
+            REPORT_PULLS_OVER = std::stod(optarg);
+          }
+          catch (exception &e)
+          {
+            REPORT_PULLS_OVER = -1;
+          }
+          if (REPORT_PULLS_OVER <= 0)
+          {
+            cout<<"ERROR: pull threshold must be a positive number of sigma"<<endl;
+            return -1;
+          }
+          break;
+        case 'v':
+          try
+          {
+            PVALUE_THRESHOLD = std::stod(optarg);
+          }
+          catch (exception &e)
+          {
+            PVALUE_THRESHOLD = -1;
+          }
+          if (PVALUE_THRESHOLD <= 0 || PVALUE_THRESHOLD >= 1)
+          {
+            cout<<"ERROR: p-value threshold must be between 0 and 1"<<endl;
+            return -1;
+          }
+          break;
+        case 'p':
+          pullSummary = ParsePullSummary(optarg);
+          if (pullSummary < 0)
+          {
+            cout<<"ERROR: unknown pull summary "<<optarg<<" (use median, moments, trimmed or fit)"<<endl;
+            return -1;
+          }
+          break;
+        case 'l':
+          if (!ParseSliceSpec(optarg))
+          {
+            cout<<"ERROR: could not understand the slicing "<<optarg<<" (use a key branch, with :<window width> or :<edge>,<edge>,... for windows)"<<endl;
+            return -1;
+          }
+          break;
+        case 'm':
+          if (!ParseMatchSpec(optarg))
+          {
+            cout<<"ERROR: could not understand the matching "<<optarg<<" (use <run branch>,<event branch>)"<<endl;
+            return -1;
+          }
+          break;
+        case 'b':
+          try
+          {
+            nToys = std::stoi(optarg);
+          }
+          catch (exception &e)
+          {
+            nToys = -1;
+          }
+          if (nToys < 0)
+          {
+            cout<<"ERROR: number of toys must be a positive integer"<<endl;
+            return -1;
+          }
+          break;
+        case 'w':
+          try
+          {
+            servePort = std::stoi(optarg);
+          }
+          catch (exception &e)
+          {
+            servePort = 0;
+          }
+          if (servePort < 1 || servePort > 65535)
+          {
+            cout<<"ERROR: --serve needs a port number between 1 and 65535"<<endl;
+            return -1;
+          }
+          break;
+        case 'q':
+          try
+          {
+            quickLookStride = std::stoi(optarg);
+          }
+          catch (exception &e)
+          {
+            quickLookStride = 0;
+          }
+          if (quickLookStride < 1)
+          {
+            cout<<"ERROR: quick-look stride must be a positive integer"<<endl;
+            return -1;
+          }
+          break;
         case '?':
-          if (optopt == 'i' || optopt == 'r' || optopt == 'c' || optopt == 't' || optopt == 'o' )
+          if (optopt == 'i' || optopt == 'r' || optopt == 'c' || optopt == 't' || optopt == 'o' || optopt == 'q' || optopt == 's' || optopt == 'j' || optopt == 'z' || optopt == 'b' || optopt == 'e' || optopt == 'l' || optopt == 'k' || optopt == 'p' || optopt == 'u' || optopt == 'v' || optopt == 'g' || optopt == 'm' || optopt == 'x' || optopt == 'w' )
             fprintf (stderr, "Option -%c requires an argument.\n", optopt);
           else if (isprint (optopt))
             fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -74,7 +308,7 @@ int main(int argc, char **argv)
             fprintf (stderr,
                      "Unknown option character `\\x%x'.\n",
                      optopt);
-          cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional)> -c <config file (optional)> -o <output directory (optional)> -t <temp directory (optional)>"<<endl;
+          cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional, repeatable)> -c <config file (optional)> -o <output directory (optional)> -t <temp directory (optional)> -q <quick-look initial stride (optional)> -s <results store (optional)> -j <decompression threads (optional)> -z <output compression, e.g. zstd:5 (optional)> -b <number of toys (optional)> --selection <expression (optional)> --slice <key branch[:width or edges] (optional)> --images --hit-cache <directory (optional)> --shared-reference <directory (optional)> --pull-summary <median, moments, trimmed or fit (optional)> --plan --from-outputs --pull-threshold <sigma (optional)> --pvalue-threshold <p-value (optional)> --log-level <debug, info, warning or error (optional)> --match <run branch>,<event branch> (optional)> --resume --serve <port (optional)>"<<endl;
           return 1;
         default:
           abort ();
@@ -85,10 +319,45 @@ int main(int argc, char **argv)
   if (dataFileInput.length()<=0)
   {
     cout<<"ERROR: Data file name is needed."<<endl;
-    cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional)> -c <config file (optional)>"<<endl;
+    cout<<"Usage: "<<argv[0]<<" -i <data ROOT file> -r <reference ROOT file (optional, repeatable)> -c <config file (optional)> -q <quick-look initial stride (optional)> -s <results store (optional)> -j <decompression threads (optional)> -z <output compression, e.g. zstd:5 (optional)> -b <number of toys (optional)> --selection <expression (optional)> --slice <key branch[:width or edges] (optional)> --images --hit-cache <directory (optional)> --shared-reference <directory (optional)> --pull-summary <median, moments, trimmed or fit (optional)> --plan --from-outputs --pull-threshold <sigma (optional)> --pvalue-threshold <p-value (optional)> --log-level <debug, info, warning or error (optional)> --match <run branch>,<event branch> (optional)> --resume --serve <port (optional)>"<<endl;
     return -1;
   }
-  ParseRootFile(dataFileInput,configFileInput,referenceFileInput,tempDirInput,plotDirInput);
+
+  if (servePort>0) makeImages=true; // Drawing the plots is all it does
+
+  // The plot style is only needed for images. Without them we stay in batch mode,
+  // so no canvas is made and ROOT's X11 and image plugins are never loaded
+  if (makeImages)
+  {
+    gStyle->SetOptStat(0);
+    gStyle->SetPalette(PALETTE);
+  }
+  else gROOT->SetBatch(kTRUE);
+
+  if (servePort>0)
+  {
+    // Draw the plots of an earlier run when a browser asks for them, rather than all of them up front
+    if (!ServePlots(dataFileInput,configFileInput,servePort)) return -1;
+  }
+  else if (fromOutputs)
+  {
+    // Compare the histograms of two earlier runs again, without their ntuples
+    if (referenceFileInputs.size()!=1)
+    {
+      cout<<"ERROR: --from-outputs compares the output of one run (-i) with that of one other run (-r)"<<endl;
+      return -1;
+    }
+    if (!CompareOutputs(dataFileInput,referenceFileInputs.at(0),plotDirInput)) return -1;
+  }
+  else ParseRootFile(dataFileInput,configFileInput,referenceFileInputs,tempDirInput,plotDirInput,storeFileInput);
+
+  logger.Summarise();
+  logger.Flush();
+
+  // For comparing set-ups: the whole run, and the most memory it used at any time
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  cout<<Form("Run time %.2f s, peak memory %.1f MB",runTimer.RealTime(),usage.ru_maxrss/1024.)<<endl;
   return 0;
 }
 
@@ -97,8 +366,10 @@ int main(int argc, char **argv)
  *  Main work function - parses a ROOT file and plots the variables in the branches
  *  rootFileName: path to the ROOT file with SuperNEMO validation data
  *  configFileName: optional to specify how to plot certain variables
+ *  refFileNames: the reference files to compare with, if any. With more than one,
+ *  the sample histograms are made once and compared with each reference in turn
  */
-void ParseRootFile(string rootFileName, string configFileName, string refFileName, string tempDirName, string plotDirName)
+void ParseRootFile(string rootFileName, string configFileName, vector<string> refFileNames, string tempDirName, string plotDirName, string storeFileName)
 {
 
   // Check the input root file can be opened and contains a tree with the right name
@@ -137,36 +408,38 @@ void ParseRootFile(string rootFileName, string configFileName, string refFileNam
     configParams=LoadConfig(configFile);
   }
 
-  // Check for a reference file
+  // Get a list of all the branches in the main tree
+  TObjArray* branches = tree->GetListOfBranches();
+  TIter next(branches);
+  TBranch *branch;
+
+  // Loop the branches and decide how to treat them based on the first character of the name
+  vector<string> branchNames;
+  while( (branch=(TBranch *)next() )){
+    branchNames.push_back(branch->GetName());
+  }
+  covarianceBranches=ScalarBranches(tree, branchNames);
 
-  TFile *refFile;
-  if (refFileName.length() > 0)
+  // A dry run: plan the run from what the trees hold, and stop before reading anything
+  if (planOnly)
   {
-
-    refFile = new TFile(refFileName.c_str());
-    if (refFile->IsZombie())
+    vector<TTree*> refTrees;
+    for (int iRef=0;iRef<refFileNames.size();iRef++)
     {
-      cout<<"WARNING: No valid reference ROOT file given. To generate comparison plots, provide a valid reference ROOT file.";
-      if (refFileName.length()>0) cout<<" Bad ROOT file: "<<refFileName;
-      cout <<endl;
-      hasValidReference = false;
+      if (OpenReference(refFileNames.at(iRef))) refTrees.push_back(reftree);
     }
-  }
-  else
-  {
-    cout<<"WARNING: No reference ROOT file given. To generate comparison plots, provide a valid reference ROOT file."<<endl;
-    hasValidReference = false;
+    vector<PlanGroup> plan=MakePlan(branchNames, refTrees);
+    PrintPlan(plan, refTrees.size());
+    return;
   }
 
-  if (hasValidReference)
+  // Pick out the entries to validate, once for each tree. The selection can be given
+  // in the config file too, but the command line takes precedence
+  if (selection.length()==0 && configParams.count("selection")) selection=boost::trim_copy(configParams["selection"]);
+  if (selection.length()>0)
   {
-    reftree = (TTree*) refFile->Get(treeName.c_str()); // Name is in the .h file for now
-    // Check if it found the tree
-    if (reftree==0)
-    {
-      cout<<"WARNING: no reference data in a tree named "<<treeName<<" found in "<<refFileName<<". To generate comparison plots, provide a valid reference ROOT file."<<endl;
-      hasValidReference = false;
-    }
+    sampleSelection=SelectEntries(tree);
+    if (!sampleSelection) return;
   }
 
   // Make a directory to put the plots in
@@ -203,355 +476,3921 @@ void ParseRootFile(string rootFileName, string configFileName, string refFileNam
     }
   }
   else tempDirName=plotdir; // If no temp directory is specified, we will use the output directory for temp files
+  if (hitCacheDir.length() > 0) boost::filesystem::create_directories(hitCacheDir);
+  if (sharedReferenceDir.length() > 0) boost::filesystem::create_directories(sharedReferenceDir);
 
-  // In the plots directory, make an output ROOT file for the histograms
-  TFile *outputFile=new TFile((tempDirName+"/TempHistograms.root").c_str(),"RECREATE");
-  outputFile->cd();
-
-  if (hasValidReference)
+  // Checkpoints are kept in the output directory until the run is finished. Only runs
+  // that read every entry in one round can be resumed, as quick-look rounds depend on each other
+  Checkpoint resumeFrom;
+  if (quickLookStride==1)
   {
-    // Open the output text file
-    textOut.open((plotdir+"/ValidationResults.txt").c_str());
-    textOut<<"Sample: "<<rootFileName<<" ("<<tree->GetEntries() <<" entries)"<<endl;
-    textOut<<"SHA-256 hash: "<<FirstWordOf(exec(("shasum -a 256 "+rootFileName).c_str()))<<endl;
-    textOut<<"Compared with "<<refFileName<<" ("<<reftree->GetEntries() <<" entries)"<<endl;
-    textOut<<"SHA-256 hash: "<<FirstWordOf(exec(("shasum -a 256 "+refFileName).c_str()))<<endl;
-    textOut<<endl;
+    checkpointDir=plotdir+"/checkpoint";
+    checkpoint=Checkpoint();
+    checkpoint.settings=CheckpointSettings(rootFileName, configFileName, refFileNames);
+    if (resumeRun && LoadCheckpoint(resumeFrom))
+    {
+      if (resumeFrom.settings!=checkpoint.settings)
+      {
+        cout<<"ERROR: the checkpoint in "<<checkpointDir<<" is for a run with different inputs or settings, so it can't be resumed"<<endl;
+        return;
+      }
+      cout<<"Resuming from checkpoint "<<resumeFrom.number<<": reference "<<resumeFrom.reference+1<<", "<<resumeFrom.branchesDone<<" branches done"<<endl;
+      checkpoint=resumeFrom;
+    }
+    else
+    {
+      if (resumeRun) cout<<"WARNING: there is no checkpoint in "<<checkpointDir<<" to resume from, so the run will start from the beginning"<<endl;
+      boost::filesystem::remove_all(checkpointDir);
+      boost::filesystem::create_directories(checkpointDir);
+      char host[256]="";
+      gethostname(host,sizeof(host)-1);
+      checkpoint.runKey=Form("%s %lld %d",host,(long long)time(0),(int)getpid());
+      SaveCheckpoint();
+    }
+  }
+  else if (resumeRun) cout<<"WARNING: quick-look runs can't be resumed, so the run will start from the beginning"<<endl;
 
+  // Every reference's results go in the same store, beside the output directory unless one is given
+  if (storeFileName.length()==0)
+  {
+    boost::filesystem::path storePath=boost::filesystem::absolute(plotdir).parent_path() / "ValidationResultsStore.sqlite";
+    storeFileName=storePath.string();
   }
 
-  // Get a list of all the branches in the main tree
-  TObjArray* branches = tree->GetListOfBranches();
-  TIter next(branches);
-  TBranch *branch;
 
-  // Loop the branches and decide how to treat them based on the first character of the name
-  while( (branch=(TBranch *)next() )){
-    string branchName=branch->GetName();
-    PlotVariable(branchName);
-  }
+  // The first reference's results go in the output directory, as with a single
+  // reference. Each of the others gets its own directory inside it
+  if (refFileNames.size()==0) refFileNames.push_back("");
+  keepSampleHistograms=(refFileNames.size()>1);
+  string sampleHash="";
+  string sampleDir=plotdir;
+  vector<string> refLabels=checkpoint.refLabels;
+  vector<vector<BranchResult> > refResults=checkpoint.refResults;
+  for (int iRef=0;iRef<refFileNames.size();iRef++)
+  {
+    if (checkpointDir.length()>0 && iRef<checkpoint.reference) continue; // Finished before the checkpoint
+    bool resumeThis=(resumeFrom.branchesDone>0 && iRef==resumeFrom.reference);
+    string refFileName=refFileNames.at(iRef);
+    hasValidReference=OpenReference(refFileName);
+    if (iRef>0 && !hasValidReference) continue; // The sample has been plotted already
+    delete refCovariance;
+    refCovariance=0;
+    refCovarianceBranches.clear();
+    if (hasValidReference) refCovarianceBranches=ScalarBranches(reftree, covarianceBranches);
+    if (hasValidReference && selection.length()>0)
+    {
+      refSelection=SelectEntries(reftree);
+      if (!refSelection)
+      {
+        cout<<"WARNING: the selection can't be applied to the reference "<<refFileName<<", so it will not be compared with"<<endl;
+        hasValidReference=false;
+        refCovarianceBranches.clear();
+        if (iRef>0) continue; // The sample has been plotted already
+      }
+    }
+    if (iRef>0)
+    {
+      cout<<"Comparing with reference "<<iRef+1<<" of "<<refFileNames.size()<<": "<<refFileName<<endl;
+      plotdir=sampleDir+"/"+ReferenceLabel(refFileName, iRef);
+      boost::filesystem::create_directories(plotdir);
+    }
 
-  if (configFile.is_open()) configFile.close();
-  outputFile->Close();
-  if (textOut.is_open())  textOut.close();
-
-  // Fix ROOT problem by copying all histograms from the output file to another file
-  // If your input ntuple files are too big, ROOT will write them to the output file
-  // We don't want that, but we can't avoid it so instead, we will copy the good
-  // stuff to a new file and then delete the old stuff. Sigh.
-  MoveHistograms(tempDirName+"/TempHistograms.root" , plotdir+"/ValidationHistograms.root");
-  return;
-}
+    // Histograms are made in memory, and written to the output ROOT file in the
+    // plots directory by the histogram writer once each branch is done
+    gROOT->cd();
+    bool opened;
+    if (resumeThis) opened=histogramWriter.OpenCopy(checkpointDir+Form("/ValidationHistograms_%d.root",resumeFrom.number), plotdir+"/ValidationHistograms.root", outputCompression);
+    else opened=histogramWriter.Open(plotdir+"/ValidationHistograms.root", outputCompression);
+    if (!opened)
+    {
+      cout<<"ERROR: "<<histogramWriter.GetError()<<endl;
+      return;
+    }
 
-// Hack to move all the histograms from one ROOT file to another, while not moving
-// any TTrees. Then delete the old file. It fixes a "feature" of ROOT which means that it will
-// write the input tuples to the output file if they are too big to hold in memory.
-// Not ideal.
-void MoveHistograms(string fromFile, string toFile)
-{
-  TFile *fIn = new TFile(fromFile.c_str());
-  TFile *fOut = new TFile(toFile.c_str(),"RECREATE");
-  // Loop through the input file and if it's a histogram, write it to the output file
-  TList* list = fIn->GetListOfKeys() ;
-  TIter next(list) ;
-  TKey* key ;
-  TObject* obj ;
+    RunInfo run;
+    if (hasValidReference)
+    {
+      if (sampleHash.length()==0) sampleHash=FirstWordOf(exec(("shasum -a 256 "+rootFileName).c_str()));
+      run.sample=rootFileName;
+      run.sampleHash=sampleHash;
+      run.reference=refFileName;
+      if (checkpoint.runKey.length()>0) run.runKey=checkpoint.runKey+Form(" reference %d",iRef); // Stored once, even if resumed after storing
+      if (sharedReferenceDir.length()>0)
+      {
+        // Entries are kept by the reference's path, size and modification time, so a changed reference replaces them
+        boost::system::error_code error;
+        boost::filesystem::path refPath=boost::filesystem::canonical(refFileName, error);
+        referenceStore=new ReferenceStore(sharedReferenceDir, (error?refFileName:refPath.string()), FileIdentity(refFileName));
+        if (!referenceStore->IsOpen()) cout<<"WARNING: can't use the shared reference store in "<<sharedReferenceDir<<", so the reference will be read by this job"<<endl;
+      }
+      run.referenceHash=ReferenceHash(refFileName);
+
+      // Open the output text file. When resuming, it is cut back to where it was at the checkpoint
+      if (resumeThis)
+      {
+        boost::filesystem::resize_file(plotdir+"/ValidationResults.txt", resumeFrom.textBytes);
+        textOut.open((plotdir+"/ValidationResults.txt").c_str(), ios::app);
+      }
+      else textOut.open((plotdir+"/ValidationResults.txt").c_str());
+    }
+    if (hasValidReference && !resumeThis)
+    {
+      textOut<<"Sample: "<<rootFileName<<" ("<<tree->GetEntries() <<" entries)"<<endl;
+      textOut<<"SHA-256 hash: "<<run.sampleHash<<endl;
+      textOut<<"Compared with "<<refFileName<<" ("<<reftree->GetEntries() <<" entries)"<<endl;
+      textOut<<"SHA-256 hash: "<<run.referenceHash<<endl;
+      if (refFileNames.size()>1) textOut<<"Reference "<<iRef+1<<" of "<<refFileNames.size()<<" (comparison matrix in "<<sampleDir<<"/ComparisonMatrix.txt)"<<endl;
+      if (sampleSelection) textOut<<"Selection: "<<selection<<" ("<<sampleSelection->GetN()<<" sample and "<<refSelection->GetN()<<" reference entries pass)"<<endl;
+      textOut<<endl;
+
+    }
+
+    // The most expensive branches are plotted first, and those read together are plotted together
+    vector<PlanGroup> plan=MakePlan(branchNames, (hasValidReference?vector<TTree*>(1,reftree):vector<TTree*>()));
+    vector<string> plotOrder=PlannedOrder(plan);
+    cout<<Form("Plan: %d groups of branches, about %.1f s reading trees",(int)plan.size(),EstimatedRunTime(plan, hasValidReference?1:0))<<endl;
 
-  while (( key = (TKey*)next() )) {
-    obj = key->ReadObj() ;
-    if ( obj->InheritsFrom("TH2") || obj->InheritsFrom("TH1"))
+    allResults.clear();
+    int firstBranch=0;
+    if (resumeThis)
+    {
+      allResults=resumeFrom.results;
+      firstBranch=resumeFrom.branchesDone;
+      LoadSliceTemplates(checkpointDir+Form("/templates_%d.root",resumeFrom.number));
+    }
+    if (quickLookStride > 1)
+    {
+      QuickLook(plotOrder);
+    }
+    else
+    {
+      FillAllMaps(plotOrder); // All the tracker and calorimeter maps in one pass, or from its checkpoint
+      time_t lastCheckpoint=time(0);
+      for (int i=firstBranch;i<plotOrder.size();i++)
+      {
+        PlotVariable(plotOrder.at(i));
+        if (branchResult.hasComparison) allResults.push_back(branchResult);
+        if (checkpointDir.length()>0 && CheckpointDue(lastCheckpoint))
+        {
+          checkpoint.branchesDone=i+1;
+          checkpoint.results=allResults;
+          SaveCheckpoint();
+        }
+      }
+    }
+    // Quick-look mode can finish without a round that reads every entry, so the covariance gets a pass of its own
+    if (covarianceBranches.size()>0 && (!sampleCovariance || (refCovarianceBranches.size()>0 && !refCovariance))) FillAllMaps(vector<string>());
+    CompareCovariances();
+    if (iRef==0 && sliceKey.length()>0) FillSlices(branchNames); // Stability over runs or time, in one more pass
+    if (hasValidReference && matchRunBranch.length()>0) MatchEvents(branchNames); // Event by event, for a reprocessed reference
+    if (hasValidReference) AppendToResultsStore(storeFileName, run);
+
+    // So that the histograms can be compared again without the ntuple (--from-outputs)
+    TParameter<Long64_t> entriesUsed("entriesUsed",EntriesUsed(tree));
+    histogramWriter.Add(&entriesUsed,"run");
+    histogramWriter.Close();
+    if (textOut.is_open())  textOut.close();
+    if (referenceStore)
+    {
+      cout<<"Shared reference store: "<<referenceStore->GetFound()<<" histograms taken from other jobs, "<<referenceStore->GetPublished()<<" filled for them"<<endl;
+      delete referenceStore;
+      referenceStore=0;
+    }
+    if (hasValidReference)
+    {
+      refLabels.push_back(ReferenceLabel(refFileName, iRef));
+      refResults.push_back(allResults);
+    }
+    if (checkpointDir.length()>0)
     {
-      obj->Write("",TObject::kOverwrite);
+      // This reference is finished: the next checkpoint starts the next one
+      checkpoint.reference=iRef+1;
+      checkpoint.branchesDone=0;
+      checkpoint.textBytes=0;
+      checkpoint.results.clear();
+      checkpoint.refLabels=refLabels;
+      checkpoint.refResults=refResults;
+      SaveCheckpoint();
+      boost::filesystem::remove(PassCheckpointFile(tree));
+      if (hasValidReference) boost::filesystem::remove(PassCheckpointFile(reftree));
     }
   }
-  fOut->cd();
-  fOut->Close();
-  fIn->Close();
-  remove(fromFile.c_str());
+  plotdir=sampleDir;
+  if (refFileNames.size()>1) WriteComparisonMatrix(refLabels, refResults);
+
+  cout<<Form("Time spent reading trees: %.2f s sample, %.2f s reference",sampleReadTime,refReadTime)<<endl;
+  if (configFile.is_open()) configFile.close();
+  if (checkpointDir.length()>0) boost::filesystem::remove_all(checkpointDir); // The run is finished, so there is nothing to resume
+  return;
 }
 
 /**
- *  Decides what plot to make for a branch
- *  depending on the prefix
+ *  Plan the run from the branch metadata alone, before any entries are read. The map
+ *  branches are grouped by the map branch they are decoded from (after the dot of a
+ *  tm_, cm_, td_ or cd_ name), as each of those is read and decoded once in the shared
+ *  pass for all the plots made from it. Any other branch is a group of its own. The
+ *  groups are sorted by their estimated cost, so the most expensive come first
  */
-bool PlotVariable(string branchName)
+vector<PlanGroup> MakePlan(vector<string> branchNames, vector<TTree*> refTrees)
 {
-  string config="";
-  bool configFound=false;
-  // If we have a config file, check if this var is in it
-  if (hasConfig)
-  {
-    config = configParams[branchName];
-    if (config.length() > 0)
-    {
-      configFound=true;
-    }
-  }
-  cout<<"Plotting "<<branchName<<":"<<endl;
-  switch (branchName[0])
+  vector<PlanGroup> plan;
+  map<string,int> mapGroups;
+  for (int i=0;i<branchNames.size();i++)
   {
-    case 'h':
+    string fullBranchName=branchNames.at(i);
+    string branchName, mapBranch;
+    bool isCalo, isAverage;
+    if (MapBranchParts(fullBranchName, branchName, mapBranch, isCalo, isAverage) && tree->GetBranch(mapBranch.c_str()))
     {
-      Plot1DHistogram(branchName);
-      break;
+      if (!mapGroups.count(mapBranch))
+      {
+        mapGroups[mapBranch]=plan.size();
+        PlanGroup group;
+        group.name=mapBranch;
+        group.sharedPass=true;
+        group.reads.push_back(mapBranch);
+        if (mapBranch==BACKSCATTER_MAP_BRANCH)
+        {
+          group.reads.push_back("reco.electron_vertex_x");
+          group.reads.push_back("reco.track_calo_hits");
+        }
+        plan.push_back(group);
+      }
+      PlanGroup &group=plan.at(mapGroups[mapBranch]);
+      group.plots.push_back(fullBranchName);
+      if (isAverage) group.reads.push_back(fullBranchName);
+      continue;
     }
-    case 't':
+    PlanGroup group;
+    group.name=fullBranchName;
+    group.plots.push_back(fullBranchName);
+    if (fullBranchName[0]=='h')
     {
-      PlotTrackerMap(branchName);
-      break;
+      group.reads.push_back(fullBranchName);
+      group.passes=2; // The sample's sketch sets the binning, so its histogram takes a second pass
     }
-    case 'c':
+    plan.push_back(group);
+  }
+
+  // The scalar branches are read in the shared pass too, for their covariance
+  if (covarianceBranches.size()>0)
+  {
+    PlanGroup group;
+    group.name="covariance of the scalar branches";
+    group.sharedPass=true;
+    group.reads=covarianceBranches;
+    plan.push_back(group);
+  }
+  for (int i=0;i<plan.size();i++) EstimateReadCost(plan.at(i), tree, refTrees);
+  stable_sort(plan.begin(), plan.end(), CostsMore);
+  return plan;
+}
+
+bool CostsMore(const PlanGroup &a, const PlanGroup &b)
+{
+  return a.sampleSeconds+a.refSeconds > b.sampleSeconds+b.refSeconds;
+}
+
+// The time to read a group's branches from each tree, from their sizes in the files
+void EstimateReadCost(PlanGroup &group, TTree *sampleTree, vector<TTree*> &refTrees)
+{
+  vector<TTree*> trees(1,sampleTree);
+  trees.insert(trees.end(), refTrees.begin(), refTrees.end());
+  for (int iTree=0;iTree<trees.size();iTree++)
+  {
+    double zipped=0, unzipped=0, strings=0;
+    for (int i=0;i<group.reads.size();i++)
     {
-      PlotCaloMap(branchName);
-      break;
+      TBranch *branch=trees.at(iTree)->GetBranch(group.reads.at(i).c_str());
+      if (!branch) continue;
+      zipped+=branch->GetZipBytes("*")/1e6;
+      unzipped+=branch->GetTotBytes("*")/1e6;
+      if (string(branch->GetClassName())=="vector<string>") strings+=branch->GetTotBytes("*")/1e6;
     }
-    default:
+    int passes=(iTree==0?group.passes:1); // A reference's binning is known, so its sketch and histogram are filled together
+    double seconds=passes*(zipped/PLAN_READ_MB_PER_S + unzipped/PLAN_UNZIP_MB_PER_S + strings/PLAN_DECODE_MB_PER_S);
+    if (iTree==0)
     {
-      cout<< "Unknown variable type "<<branchName<<": ignoring this branch"<<endl;
-      break;
+      group.sampleMB=zipped;
+      group.sampleUnzippedMB=unzipped;
+      group.sampleSeconds=seconds;
+      continue;
     }
+    group.refMB+=zipped;
+    group.refUnzippedMB+=unzipped;
+    group.refSeconds+=seconds;
   }
-
-  return true;
 }
 
-
 /**
- *  Loads the config file (which should be short) into a memory
- *  map where the key is the branch name (first item in the CSV line)
- *  value is the rest of the line
+ *  The shared pass reads the sample and the first reference in parallel. The sample
+ *  is only read once, and later references are read on their own. The 1D branches
+ *  are read one after the other
  */
-map<string,string> LoadConfig(ifstream& configFile)
+double EstimatedRunTime(vector<PlanGroup> &plan, int nRefs)
 {
-  map<string,string> configLookup;
-  string thisLine;
+  double sharedSample=0, sharedRef=0, serial=0;
+  for (int i=0;i<plan.size();i++)
+  {
+    if (plan.at(i).sharedPass)
+    {
+      sharedSample+=plan.at(i).sampleSeconds;
+      sharedRef+=plan.at(i).refSeconds;
+    }
+    else serial+=plan.at(i).sampleSeconds+plan.at(i).refSeconds;
+  }
+  double firstRef=(nRefs>0?sharedRef/nRefs:0);
+  return TMath::Max(sharedSample,firstRef)+(sharedRef-firstRef)+serial;
+}
 
-  while (configFile)
+// The branches to plot, in the order of the plan
+vector<string> PlannedOrder(vector<PlanGroup> &plan)
+{
+  vector<string> order;
+  for (int i=0;i<plan.size();i++) order.insert(order.end(), plan.at(i).plots.begin(), plan.at(i).plots.end());
+  return order;
+}
+
+// The plan for --plan: each group with what it reads and its estimated cost
+void PrintPlan(vector<PlanGroup> &plan, int nRefs)
+{
+  cout<<"Execution plan, from the branch sizes (no entries have been read)"<<endl;
+  if (selection.length()>0 || configParams.count("selection")) cout<<"The estimates are for every entry: the selection would read fewer"<<endl;
+  cout<<Form("%-50s %6s %20s %20s %9s","Group","Passes","Sample MB (zip/raw)",Form("Reference%s MB",(nRefs>1?"s":"")),"Cost (s)")<<endl;
+  int nPlots=0;
+  for (int i=0;i<plan.size();i++)
   {
-    getline(configFile, thisLine);
-    string key=GetBitBeforeComma(thisLine);
-    configLookup[key]=thisLine; // the remainder of the line
+    PlanGroup &group=plan.at(i);
+    cout<<Form("%-50s %6d %9.1f/%-10.1f %9.1f/%-10.1f %9.2f%s",group.name.c_str(),group.passes,group.sampleMB,group.sampleUnzippedMB,group.refMB,group.refUnzippedMB,group.sampleSeconds+group.refSeconds,(group.sharedPass?"  (shared map pass)":""))<<endl;
+    if (group.plots.size()>1 || (group.plots.size()==1 && group.plots.at(0)!=group.name)) cout<<"    plots: "<<boost::algorithm::join(group.plots,", ")<<endl;
+    if (group.reads.size()>1) cout<<"    reads: "<<boost::algorithm::join(group.reads,", ")<<endl;
+    nPlots+=group.plots.size();
   }
-  return configLookup;
+  cout<<Form("%d branches to plot in %d groups. Estimated time reading trees: %.1f s",nPlots,(int)plan.size(),EstimatedRunTime(plan, nRefs))<<endl;
 }
 
 /**
- *  Make a basic histogram of a variable. The number of bins etc will come from
- *  the config file if there is one, if not we will guess
+ *  Compare the histograms that two earlier runs wrote to ValidationHistograms.root
+ *  (or their output directories), as if the first were the sample and the second the
+ *  reference, without reading any ntuples. This is for trying other thresholds or
+ *  pull summaries, or comparing one day's output with another's. Only the statistics
+ *  are made again: the results file and the pull histograms go in the output directory
  */
-void Plot1DHistogram(string branchName)
+bool CompareOutputs(string sampleFileName, string refFileName, string plotDirName)
 {
-  int notSetVal=-9999;
-  string config="";
-  config=configParams[branchName]; // get the config loaded from the file if there is one
-  int nbins=100;
-  double lowLimit=0;
-  double highLimit=notSetVal;
-  string title="";
-  bool hasReferenceBranch=hasValidReference;
+  sampleFileName=OutputFileOf(sampleFileName);
+  refFileName=OutputFileOf(refFileName);
+  TFile *sampleFile=TFile::Open(sampleFileName.c_str());
+  TFile *refFile=TFile::Open(refFileName.c_str());
+  if (!sampleFile || sampleFile->IsZombie() || !refFile || refFile->IsZombie())
+  {
+    cout<<"ERROR: could not open "<<((!sampleFile || sampleFile->IsZombie())?sampleFileName:refFileName)<<endl;
+    return false;
+  }
+  tree=0;
+  reftree=0;
+  hasValidReference=true;
+  makeImages=false; // The images are not stored, so there is nothing to redraw them from
+  Long64_t sampleEntries=StoredEntries(sampleFile);
+  Long64_t refEntries=StoredEntries(refFile);
+  double scale=1;
+  if (sampleEntries>0 && refEntries>0) scale=(double)sampleEntries/refEntries;
+  else cout<<"WARNING: the number of entries is not stored in both files (they were made by an older version), so counts are compared without normalising them"<<endl;
+
+  plotdir=(plotDirName.length()>0?plotDirName:"offline_comparison");
+  boost::filesystem::create_directories(plotdir);
+  if (!histogramWriter.Open(plotdir+"/ValidationHistograms.root", outputCompression))
+  {
+    cout<<"ERROR: "<<histogramWriter.GetError()<<endl;
+    return false;
+  }
+  textOut.open((plotdir+"/ValidationResults.txt").c_str());
+  textOut<<"Histograms: "<<sampleFileName<<" ("<<sampleEntries<<" entries)"<<endl;
+  textOut<<"Compared with the histograms in "<<refFileName<<" ("<<refEntries<<" entries)"<<endl;
+  textOut<<Form("Pull threshold %g sigma, p-value threshold %g",REPORT_PULLS_OVER,PVALUE_THRESHOLD)<<endl<<endl;
+
+  allResults.clear();
+  TDirectory *directory=sampleFile->GetDirectory("h");
+  TIter nextHistogram(directory?directory->GetListOfKeys():0);
+  TKey *key;
+  while (directory && (key=(TKey*)nextHistogram()))
+  {
+    string name=key->GetName();
+    TH1D *h=(TH1D*)sampleFile->Get(("h/"+name).c_str());
+    TH1D *href=(TH1D*)refFile->Get(("h/"+name).c_str());
+    if (!h || !href || name.substr(0,4)!="plt_") continue;
+    StartStoredComparison(name.substr(4), sampleEntries, refEntries);
+    CompareStoredHistogram(h, href, name.substr(4), scale);
+  }
 
-  // Check whether the reference file contains this branch
-  if (hasValidReference)
+  directory=sampleFile->GetDirectory("tracker");
+  TIter nextMap(directory?directory->GetListOfKeys():0);
+  while (directory && (key=(TKey*)nextMap()))
   {
-    hasReferenceBranch=reftree->GetBranchStatus(branchName.c_str());
-    if (!hasReferenceBranch) cout<<"WARNING: branch "<<branchName<<" not found in reference file. No comparison plots will be made for this branch"<<endl;
+    string name=key->GetName();
+    bool isAverage=(name.substr(0,4)=="ave_");
+    if (name.substr(0,4)!="plt_" && !isAverage) continue;
+    TH2D *h=(TH2D*)sampleFile->Get(("tracker/"+name).c_str());
+    TH2D *href=(TH2D*)refFile->Get(("tracker/"+name).c_str());
+    if (!h || !href) continue;
+    StartStoredComparison(name.substr(4), sampleEntries, refEntries);
+    CompareStoredTrackerMap(h, href, name.substr(4), isAverage, scale);
   }
 
-  // Read the config information
-  if (config.length()>0)
+  // The six walls of each calorimeter map, which end in the name of the wall. The
+  // reference maps of the earlier runs are there too, and are left out
+  directory=sampleFile->GetDirectory("calo");
+  TIter nextWall(directory?directory->GetListOfKeys():0);
+  while (directory && (key=(TKey*)nextWall()))
+  {
+    string name=key->GetName();
+    bool isAverage=(name.substr(0,4)=="ave_");
+    string suffix="_"+CALO_WALL[0];
+    if ((name.substr(0,4)!="plt_" && !isAverage) || name.length()<=4+suffix.length() || name.substr(name.length()-suffix.length())!=suffix) continue;
+    string stem=name.substr(0,name.length()-suffix.length());
+    vector<TH2D*> hists, refHists;
+    for (int wall=0;wall<6;wall++)
+    {
+      TH2D *h=(TH2D*)sampleFile->Get(("calo/"+stem+"_"+CALO_WALL[wall]).c_str());
+      TH2D *href=(TH2D*)refFile->Get(("calo/"+stem+"_"+CALO_WALL[wall]).c_str());
+      if (!h || !href) break;
+      hists.push_back(h);
+      refHists.push_back(href);
+    }
+    if (hists.size()<6) continue;
+    StartStoredComparison(stem.substr(4), sampleEntries, refEntries);
+    CompareStoredCaloMap(hists, refHists, stem.substr(4), isAverage, scale);
+  }
+
+  int nFailed=0;
+  for (int i=0;i<allResults.size();i++) if (allResults.at(i).pValue < PVALUE_THRESHOLD) nFailed++;
+  string summary=Form("%d of %d branches compared have a p-value under %g",nFailed,(int)allResults.size(),PVALUE_THRESHOLD);
+  cout<<summary<<endl;
+  textOut<<summary<<endl;
+  histogramWriter.Close();
+  textOut.close();
+  sampleFile->Close();
+  refFile->Close();
+  cout<<"Results written to "<<plotdir<<endl;
+  return true;
+}
+
+// The output file of a run, given it or the run's output directory
+string OutputFileOf(string path)
+{
+  if (boost::filesystem::is_directory(path)) return (boost::filesystem::path(path) / "ValidationHistograms.root").string();
+  return path;
+}
+
+// The number of sample entries a run's histograms were filled from, or 0 if it didn't store it
+Long64_t StoredEntries(TFile *file)
+{
+  TParameter<Long64_t> *entries=(TParameter<Long64_t>*)file->Get("run/entriesUsed");
+  return (entries?entries->GetVal():0);
+}
+
+void StartStoredComparison(string branchName, Long64_t sampleEntries, Long64_t refEntries)
+{
+  cout<<"Comparing "<<branchName<<":"<<endl;
+  branchResult=BranchResult();
+  branchResult.branchName=branchName;
+  branchResult.sampleEntries=sampleEntries;
+  branchResult.refEntries=refEntries;
+}
+
+// As in Plot1DHistogram, without the unbinned comparison (that needs the entries)
+void CompareStoredHistogram(TH1D *h, TH1D *href, string branchName, double scale)
+{
+  href->Scale(scale);
+  Double_t ks = h->KolmogorovTest(href);
+  Double_t chisq;
+  Int_t ndf;
+  Double_t p_value = ChiSquared(h, href, chisq, ndf, false);
+  cout<<"Kolmogorov: "<<ks<<endl;
+  cout<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+  RecordComparison(chisq, ndf, p_value, ks);
+  textOut<<branchName<<":"<<endl;
+  textOut<<"KS score: "<<ks<<endl;
+  textOut<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+  RunToys(vector<TH1*>(1,h), vector<TH1*>(1,href), false, scale, 0);
+  textOut<<endl;
+  allResults.push_back(branchResult);
+  histogramWriter.Flush();
+}
+
+// As in PlotTrackerMap. The stored maps are already finished: averages, or counts with errors
+void CompareStoredTrackerMap(TH2D *h, TH2D *href, string branchName, bool isAverage, double scale)
+{
+  if (!isAverage) href->Scale(scale);
+  Double_t ks = h->KolmogorovTest(href);
+  Double_t chisq;
+  Int_t ndf;
+  Double_t p_value=ChiSquared(h, href, chisq, ndf, isAverage);
+  cout<<"Kolmogorov: "<<ks<<endl;
+  cout<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+  RecordComparison(chisq, ndf, p_value, ks);
+  textOut<<branchName<<":"<<endl;
+  textOut<<"KS score: "<<ks<<endl;
+  textOut<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+  RunToys(vector<TH1*>(1,h), vector<TH1*>(1,href), isAverage, scale, 1);
+  TH2D *hPull = PullPlot2D(h,href);
+  CheckTrackerPull(hPull,h->GetTitle());
+  delete hPull;
+  textOut<<endl;
+  allResults.push_back(branchResult);
+  histogramWriter.Flush();
+}
+
+// As in PlotCaloMap, for the six walls of a stored calorimeter map
+void CompareStoredCaloMap(vector<TH2D*> hists, vector<TH2D*> refHists, string branchName, bool isAverage, double scale)
+{
+  Double_t chisq=0;
+  Int_t ndf=0;
+  for (int i=0;i<hists.size();i++)
+  {
+    if (!isAverage) refHists.at(i)->Scale(scale);
+    Double_t thisChisq=0;
+    Int_t thisNdf=0;
+    ChiSquared(hists.at(i), refHists.at(i), thisChisq, thisNdf, isAverage);
+    chisq += thisChisq;
+    ndf += thisNdf;
+  }
+  Double_t prob = TMath::Prob(chisq, ndf);
+  cout<<"P-value: "<<prob<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+  RecordComparison(chisq, ndf, prob, -1);
+  textOut<<branchName<<":"<<endl;
+  textOut<<"P-value: "<<prob<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+  RunToys(vector<TH1*>(hists.begin(),hists.end()), vector<TH1*>(refHists.begin(),refHists.end()), isAverage, scale, 1);
+  vector<TH2D*> pullHists = MakeCaloPullPlots(hists,refHists);
+  CheckCaloPulls(pullHists,BranchNameToEnglish(branchName));
+  for (int i=0;i<pullHists.size();i++) delete pullHists.at(i);
+  textOut<<endl;
+  allResults.push_back(branchResult);
+  histogramWriter.Flush();
+}
+
+/**
+ *  Serve the plots of an earlier run (its output directory, or its ValidationHistograms.root)
+ *  on a local port, drawing each one the first time it is asked for, in the same style
+ *  as the batch run draws them. A batch run without --images has everything needed, so
+ *  only the plots someone looks at are ever drawn. They are kept in served_plots in the
+ *  output directory, and drawn again if the histograms are newer. The config gives the
+ *  calorimeter titles, as it does in the batch run
+ */
+bool ServePlots(string outputPath, string configFileName, int port)
+{
+  string fileName=OutputFileOf(outputPath);
+  servedFile=TFile::Open(fileName.c_str());
+  if (!servedFile || servedFile->IsZombie())
+  {
+    cout<<"ERROR: could not open "<<fileName<<endl;
+    return false;
+  }
+  servedFileTime=boost::filesystem::last_write_time(fileName);
+  boost::filesystem::path outputDir=boost::filesystem::absolute(fileName).parent_path();
+  ifstream results((outputDir / "ValidationResults.txt").string().c_str());
+  if (results.is_open())
+  {
+    stringstream text;
+    text<<results.rdbuf();
+    servedResults=text.str();
+  }
+  if (configFileName.length()>0)
+  {
+    ifstream configFile(configFileName.c_str());
+    if (configFile.is_open()) configParams=LoadConfig(configFile);
+  }
+  FindServedBranches();
+
+  plotdir=(outputDir / "served_plots").string();
+  boost::filesystem::create_directories(plotdir);
+  gROOT->SetBatch(kTRUE); // Nothing is ever shown on the screen
+  PlotServer server(port);
+  if (!server.IsOpen())
+  {
+    cout<<"ERROR: "<<server.GetError()<<endl;
+    return false;
+  }
+  cout<<"Serving "<<servedBranches.size()<<" branches from "<<fileName<<" at http://localhost:"<<port<<"/ (stop with Ctrl-C)"<<endl;
+  server.Serve(HandlePlotRequest);
+  cout<<"ERROR: "<<server.GetError()<<endl;
+  return false;
+}
+
+// List the branches in the served file, and the images that can be drawn of each
+void FindServedBranches()
+{
+  servedBranches.clear();
+  servedImages.clear();
+  const string directories[3]={"h","tracker","calo"};
+  for (int i=0;i<3;i++)
+  {
+    TDirectory *directory=servedFile->GetDirectory(directories[i].c_str());
+    TIter nextKey(directory?directory->GetListOfKeys():0);
+    TKey *key;
+    while (directory && (key=(TKey*)nextKey()))
+    {
+      string stem=key->GetName();
+      if (stem.substr(0,4)!="plt_" && stem.substr(0,4)!="ave_") continue;
+      bool isAverage=(stem.substr(0,4)=="ave_");
+      string wallSuffix="_"+CALO_WALL[0];
+      if (directories[i]=="calo")
+      {
+        // Six walls to a map: the branch is named once, by its first
+        if (stem.length()<=4+wallSuffix.length() || stem.substr(stem.length()-wallSuffix.length())!=wallSuffix) continue;
+        stem=stem.substr(0,stem.length()-wallSuffix.length());
+      }
+      else wallSuffix="";
+      ServedBranch branch;
+      branch.name=stem.substr(4);
+      branch.directory=directories[i];
+      branch.stem=stem;
+      branch.images.push_back(branch.name);
+      if (directories[i]=="h" && directory->GetKey(("ref_"+branch.name).c_str())) branch.images.push_back("compare_"+branch.name);
+      string refName=(isAverage?"refave_":"ref_")+branch.name+wallSuffix;
+      if (directories[i]=="calo" && directory->GetKey(refName.c_str())) branch.images.push_back("ref_"+branch.name);
+      TDirectory *pulls=servedFile->GetDirectory("pulls");
+      if (directories[i]!="h" && pulls && pulls->GetKey(("pull_"+stem+wallSuffix).c_str())) branch.images.push_back("pull_"+branch.name);
+      servedBranches[branch.name]=branch;
+      for (int j=0;j<branch.images.size();j++) servedImages[branch.images.at(j)]=branch.name;
+    }
+  }
+}
+
+/**
+ *  Answer a request to the plot server: / for the list of branches, /results.txt,
+ *  /branch/<name> for a branch's statistics and plots, and /plots/<image>.png
+ */
+bool HandlePlotRequest(const string &path, string &contentType, string &body)
+{
+  contentType="text/html; charset=utf-8";
+  if (path=="/" || path=="/index.html")
+  {
+    body=PlotIndexPage();
+    return true;
+  }
+  if (path=="/results.txt")
+  {
+    contentType="text/plain; charset=utf-8";
+    body=servedResults;
+    return true;
+  }
+  if (path.substr(0,8)=="/branch/")
+  {
+    map<string,ServedBranch>::iterator branch=servedBranches.find(path.substr(8));
+    if (branch==servedBranches.end()) return false;
+    body=BranchPage(branch->second);
+    return true;
+  }
+  string suffix=".png";
+  if (path.substr(0,7)!="/plots/" || path.length()<=7+suffix.length() || path.substr(path.length()-suffix.length())!=suffix) return false;
+  string image=path.substr(7,path.length()-7-suffix.length());
+  if (!servedImages.count(image)) return false; // Only what we know how to draw, so no other file can be asked for
+
+  // Draw it unless it has been drawn already from these histograms
+  string fileName=plotdir+"/"+image+".png";
+  boost::system::error_code error;
+  time_t drawn=boost::filesystem::last_write_time(fileName, error);
+  if ((error || drawn<servedFileTime) && !RenderServedPlot(servedBranches[servedImages[image]], image)) return false;
+  ifstream png(fileName.c_str(), ios::binary);
+  if (!png.is_open()) return false;
+  stringstream contents;
+  contents<<png.rdbuf();
+  contentType="image/png";
+  body=contents.str();
+  return true;
+}
+
+// Every branch, by kind, with its p-value, and a link to its page
+string PlotIndexPage()
+{
+  string page="<!DOCTYPE html>\n<html><head><title>Validation plots</title></head><body>\n";
+  page+="<h1>Validation plots</h1>\n<p>"+PlotServer::EscapeHtml(servedFile->GetName())+" (<a href=\"/results.txt\">results</a>)</p>\n";
+  const string directories[3]={"h","tracker","calo"};
+  const string headings[3]={"Histograms","Tracker maps","Calorimeter maps"};
+  for (int i=0;i<3;i++)
+  {
+    string rows="";
+    for (map<string,ServedBranch>::iterator it=servedBranches.begin(); it!=servedBranches.end(); it++)
+    {
+      if (it->second.directory!=directories[i]) continue;
+      string pValue=ResultsValue(ResultsSection(it->first), "P-value: ");
+      bool failed=(pValue.length()>0 && atof(pValue.c_str())<PVALUE_THRESHOLD);
+      rows+="<tr><td><a href=\"/branch/"+PlotServer::EscapeUrl(it->first)+"\">"+PlotServer::EscapeHtml(it->first)+"</a></td><td"+(failed?" style=\"color:red\"":"")+">"+PlotServer::EscapeHtml(pValue)+(failed?" FAIL":"")+"</td></tr>\n";
+    }
+    if (rows.length()>0) page+="<h2>"+headings[i]+"</h2>\n<table>\n<tr><th>Branch</th><th>P-value</th></tr>\n"+rows+"</table>\n";
+  }
+  page+="</body></html>\n";
+  return page;
+}
+
+// A branch's statistics from the results file, and its plots, which are drawn as the browser asks for them
+string BranchPage(ServedBranch &branch)
+{
+  string page="<!DOCTYPE html>\n<html><head><title>"+PlotServer::EscapeHtml(branch.name)+"</title></head><body>\n";
+  page+="<p><a href=\"/\">All branches</a></p>\n<h1>"+PlotServer::EscapeHtml(branch.name)+"</h1>\n";
+  string section=ResultsSection(branch.name);
+  if (section.length()>0) page+="<pre>"+PlotServer::EscapeHtml(section)+"</pre>\n";
+  for (int i=0;i<branch.images.size();i++)
+  {
+    string url="/plots/"+PlotServer::EscapeUrl(branch.images.at(i))+".png";
+    page+="<p><a href=\""+url+"\"><img src=\""+url+"\" style=\"max-width:100%\" alt=\""+PlotServer::EscapeHtml(branch.images.at(i))+"\"></a></p>\n";
+  }
+  page+="</body></html>\n";
+  return page;
+}
+
+// What the results file says about a branch: from the line with its name up to the blank line after it
+string ResultsSection(string branchName)
+{
+  string heading=branchName+":\n";
+  size_t start=(servedResults.compare(0,heading.length(),heading)==0?0:servedResults.find("\n"+heading));
+  if (start==string::npos) return "";
+  if (start>0) start++;
+  size_t end=servedResults.find("\n\n",start);
+  return servedResults.substr(start,(end==string::npos?string::npos:end-start));
+}
+
+// The first word after a label in a section of the results, or "" if it isn't there
+string ResultsValue(string section, string label)
+{
+  size_t start=section.find(label);
+  if (start==string::npos) return "";
+  start+=label.length();
+  return section.substr(start,section.find_first_of(" \n",start)-start);
+}
+
+// Draw one image of a served branch, just as the batch run would have
+bool RenderServedPlot(ServedBranch &branch, string image)
+{
+  bool isPull=(image=="pull_"+branch.name);
+  bool isRef=(image=="ref_"+branch.name);
+  if (branch.directory=="h")
+  {
+    TH1D *h=(TH1D*)ServedHistogram("h/"+branch.stem);
+    if (!h) return false;
+    if (image==branch.name) PrintHistogramPlot(branch.name, h);
+    else
+    {
+      TH1D *href=(TH1D*)ServedHistogram("h/ref_"+branch.name);
+      if (!href)
+      {
+        delete h;
+        return false;
+      }
+      // The statistics are worked out again as in Plot1DHistogram, except the unbinned KS, which needs the ntuples
+      Double_t ks=h->KolmogorovTest(href);
+      Double_t chisq;
+      Int_t ndf;
+      Double_t p_value=ChiSquared(h, href, chisq, ndf, false);
+      string ksUnbinned=ResultsValue(ResultsSection(branch.name), "KS score (unbinned, approximate): ");
+      PrintComparisonPlot(branch.name, h, href, Form("K-S score (binned): %.2f",ks), Form("#chi^{2}/NDF: %.1f/%d = %.1f",chisq,ndf,chisq/(double)ndf), Form("(p-value %.2f)",p_value), (ksUnbinned.length()>0?Form("K-S score (unbinned): %.2f",atof(ksUnbinned.c_str())):""));
+      delete href;
+    }
+    delete h;
+    return true;
+  }
+
+  if (isPull) gStyle->SetPalette(PULL_PALETTE);
+  bool drawn=false;
+  if (branch.directory=="tracker")
+  {
+    TH2D *h=(TH2D*)ServedHistogram((isPull?"pulls/pull_":"tracker/")+branch.stem);
+    if (h) PrintTrackerMap(h, plotdir+"/"+image+".png", (isPull?-4:h->GetMinimum()), (isPull?4:h->GetMaximum()));
+    drawn=(h!=0);
+    delete h;
+  }
+  else
+  {
+    string stem="calo/"+branch.stem;
+    if (isPull) stem="pulls/pull_"+branch.stem;
+    else if (isRef) stem="calo/"+string(branch.stem.substr(0,4)=="ave_"?"refave_":"ref_")+branch.name;
+    vector<TH2D*> walls;
+    for (int wall=0;wall<6;wall++)
+    {
+      TH2D *h=(TH2D*)ServedHistogram(stem+"_"+CALO_WALL[wall]);
+      if (h) walls.push_back(h);
+    }
+    string title=MapTitle(branch.name,branch.name);
+    drawn=(walls.size()==6);
+    if (drawn) PrintCaloPlots(image, (isPull?"Pull: "+title:title), walls);
+    for (int wall=0;wall<walls.size();wall++) delete walls.at(wall);
+  }
+  gStyle->SetPalette(PALETTE);
+  return drawn;
+}
+
+// A histogram read from the served file, that belongs to us rather than to the file
+TH1 *ServedHistogram(string name)
+{
+  TH1 *h=(TH1*)servedFile->Get(name.c_str());
+  if (h) h->SetDirectory(0);
+  return h;
+}
+
+/**
+ *  Open a reference file and find its tree. False, with a warning, if there isn't a
+ *  usable one: the sample is still plotted, without comparisons. The files stay open
+ *  until the end, so that nothing kept for one reference can be mistaken for another's
+ */
+bool OpenReference(string refFileName)
+{
+  reftree=0;
+  refSelection=0;
+  if (refFileName.length()==0)
+  {
+    cout<<"WARNING: No reference ROOT file given. To generate comparison plots, provide a valid reference ROOT file."<<endl;
+    return false;
+  }
+  TFile *refFile = new TFile(refFileName.c_str());
+  if (refFile->IsZombie())
+  {
+    cout<<"WARNING: No valid reference ROOT file given. To generate comparison plots, provide a valid reference ROOT file.";
+    cout<<" Bad ROOT file: "<<refFileName;
+    cout <<endl;
+    return false;
+  }
+  reftree = (TTree*) refFile->Get(treeName.c_str()); // Name is in the .h file for now
+  // Check if it found the tree
+  if (reftree==0)
+  {
+    cout<<"WARNING: no reference data in a tree named "<<treeName<<" found in "<<refFileName<<". To generate comparison plots, provide a valid reference ROOT file."<<endl;
+    return false;
+  }
+  return true;
+}
+
+// Name of the output directory of a reference, and of its column of the comparison matrix
+string ReferenceLabel(string refFileName, int iRef)
+{
+  return Form("reference%d_%s",iRef+1,boost::filesystem::path(refFileName).stem().string().c_str());
+}
+
+/**
+ *  With several references, sum up every comparison in one table: a row for each
+ *  branch, with its p-value against each reference, and a FAIL where it is under
+ *  the threshold. It goes in ComparisonMatrix.txt in the output directory
+ */
+void WriteComparisonMatrix(vector<string> refLabels, vector<vector<BranchResult> > &refResults)
+{
+  if (refLabels.size()==0) return;
+  vector<string> rows;
+  map<string,vector<string> > cells;
+  vector<int> nFailed(refLabels.size(),0);
+  for (int iRef=0;iRef<refResults.size();iRef++)
+  {
+    for (int i=0;i<refResults.at(iRef).size();i++)
+    {
+      BranchResult &result=refResults.at(iRef).at(i);
+      if (!cells.count(result.branchName))
+      {
+        rows.push_back(result.branchName);
+        cells[result.branchName]=vector<string>(refLabels.size(),"-");
+      }
+      bool failed=(result.pValue < PVALUE_THRESHOLD);
+      if (failed) nFailed.at(iRef)++;
+      cells[result.branchName].at(iRef)=Form("%.3g%s",result.pValue,(failed?" FAIL":""));
+    }
+  }
+
+  ofstream matrixOut((plotdir+"/ComparisonMatrix.txt").c_str());
+  matrixOut<<"Chi-square p-values against each reference (threshold "<<PVALUE_THRESHOLD<<")"<<endl;
+  for (int iRef=0;iRef<refLabels.size();iRef++) matrixOut<<Form("%3d: %s",iRef+1,refLabels.at(iRef).c_str())<<endl;
+  matrixOut<<endl<<Form("%-50s","Branch");
+  for (int iRef=0;iRef<refLabels.size();iRef++) matrixOut<<Form(" %14d",iRef+1);
+  matrixOut<<endl;
+  for (int i=0;i<rows.size();i++)
+  {
+    matrixOut<<Form("%-50s",rows.at(i).c_str());
+    for (int iRef=0;iRef<refLabels.size();iRef++) matrixOut<<Form(" %14s",cells[rows.at(i)].at(iRef).c_str());
+    matrixOut<<endl;
+  }
+  matrixOut<<Form("%-50s","Failed");
+  for (int iRef=0;iRef<refLabels.size();iRef++) matrixOut<<Form(" %14s",Form("%d/%d",nFailed.at(iRef),(int)refResults.at(iRef).size()));
+  matrixOut<<endl;
+  matrixOut.close();
+
+  cout<<"Comparison matrix written to "<<plotdir<<"/ComparisonMatrix.txt"<<endl;
+  for (int iRef=0;iRef<refLabels.size();iRef++)
+  {
+    cout<<Form("%s: %d of %d branches fail",refLabels.at(iRef).c_str(),nFailed.at(iRef),(int)refResults.at(iRef).size())<<endl;
+  }
+}
+
+/**
+ *  Quick-look mode: plot every branch using only every Nth entry of the sample
+ *  and reference, then keep refining with more entries. A branch is dropped
+ *  from the later rounds as soon as its comparison verdict can no longer change.
+ *  Every round's results are written as they come, so the results file has a
+ *  preliminary answer for everything after the first round
+ */
+void QuickLook(vector<string> branchNames)
+{
+  vector<string> pending=branchNames;
+  vector<string> summary;
+  for (entryStride=quickLookStride; ; entryStride=TMath::Max(1,entryStride/QUICKLOOK_REFINE_FACTOR))
+  {
+    cout<<"Quick-look round: using every "<<entryStride<<" entries ("<<EntriesUsed(tree)<<" sample entries)"<<endl;
+    textOut<<"Quick-look round: using every "<<entryStride<<" entries"<<endl<<endl;
+    vector<string> stillPending;
+    FillAllMaps(pending);
+    for (int i=0;i<pending.size();i++)
+    {
+      PlotVariable(pending.at(i));
+      if (entryStride > 1 && !VerdictIsStable(branchResult))
+      {
+        stillPending.push_back(pending.at(i));
+        continue;
+      }
+      if (!branchResult.hasComparison) continue; // Nothing to summarise without a reference
+      allResults.push_back(branchResult);
+      // A verdict reached early is the one expected from the full sample
+      double pValue=(entryStride > 1 ? branchResult.pValueHigh : branchResult.pValue);
+      string verdict=(pValue < PVALUE_THRESHOLD)?"FAIL":"PASS";
+      summary.push_back(pending.at(i)+": "+verdict+Form(" (p-value %.3g) from %lld sample / %lld reference entries",branchResult.pValue,branchResult.sampleEntries,branchResult.refEntries));
+      if (entryStride > 1)
+      {
+        cout<<"Verdict for "<<pending.at(i)<<" is stable - stopping early"<<endl;
+        textOut<<pending.at(i)<<": verdict is stable, full-sample p-value expected between "<<branchResult.pValueLow<<" and "<<branchResult.pValueHigh<<" - stopping early"<<endl<<endl;
+      }
+    }
+    pending=stillPending;
+    if (pending.size()==0 || entryStride==1) break;
+  }
+  entryStride=1;
+
+  textOut<<"Quick-look summary (p-value threshold "<<PVALUE_THRESHOLD<<"):"<<endl;
+  for (int i=0;i<summary.size();i++)
+  {
+    textOut<<summary.at(i)<<endl;
+  }
+  textOut<<endl;
+}
+
+/**
+ *  A quick-look comparison is conclusive if the p-values at either end of the
+ *  expected spread of the chi-square (about sqrt(2 ndf)) fall on the same side
+ *  of the threshold once scaled to the full sample. A real difference between
+ *  sample and reference adds to the chi-square in proportion to the number of
+ *  entries, so the excess over ndf (and its spread) is multiplied by the stride:
+ *  a small excess that passes on a fraction of the entries can still fail on all
+ *  of them. Also fills in those p-values so they can be reported
+ */
+bool VerdictIsStable(BranchResult &result)
+{
+  if (!result.hasComparison || result.ndf<=0) return false;
+  double spread = QUICKLOOK_CONFIDENCE_Z * TMath::Sqrt(2. * result.ndf);
+  double excess = result.chisq - result.ndf;
+  result.pValueLow = TMath::Prob(result.ndf + (excess + spread) * entryStride, result.ndf);
+  result.pValueHigh = TMath::Prob(TMath::Max(result.ndf + (excess - spread) * entryStride, 0.), result.ndf);
+  return (result.pValueLow > PVALUE_THRESHOLD || result.pValueHigh < PVALUE_THRESHOLD);
+}
+
+// Number of entries of a tree that are read with the current stride (and selection).
+// The reference is normalised to the sample with these
+Long64_t EntriesUsed(TTree *thisTree)
+{
+  TEntryList *list=SelectionOf(thisTree);
+  if (!list) return (thisTree->GetEntries() + entryStride - 1) / entryStride;
+  if (entryStride <= 1) return list->GetN();
+
+  // Count the selected entries that the stride keeps, once per tree and stride
+  static map<pair<TTree*,int>,Long64_t> counted;
+  static std::mutex countedMutex;
+  std::lock_guard<std::mutex> lock(countedMutex);
+  pair<TTree*,int> key(thisTree,entryStride);
+  if (!counted.count(key))
+  {
+    Long64_t nUsed=0;
+    for (Long64_t i=0;i<list->GetN();i++)
+    {
+      if (list->GetEntry(i) % entryStride == 0) nUsed++;
+    }
+    counted[key]=nUsed;
+  }
+  return counted[key];
+}
+
+// The entries of a tree that pass the selection, or 0 if there is no selection
+TEntryList *SelectionOf(TTree *thisTree)
+{
+  return (thisTree==reftree?refSelection:sampleSelection);
+}
+
+// Number of entries a pass over the tree steps through, and the tree entry number of
+// each one: all of them, or just the selected ones. Passes skip the entry numbers
+// that aren't a multiple of the stride, as StrideSelection does for tree->Draw
+Long64_t SelectedEntries(TTree *thisTree)
+{
+  TEntryList *list=SelectionOf(thisTree);
+  return (list?list->GetN():thisTree->GetEntries());
+}
+
+Long64_t EntryNumber(TTree *thisTree, Long64_t i)
+{
+  TEntryList *list=SelectionOf(thisTree);
+  return (list?list->GetEntry(i):i);
+}
+
+/**
+ *  Compile the selection for a tree and evaluate it once for every entry. The entries
+ *  that pass are kept as an entry list, which tree->Draw uses from then on and the
+ *  other passes step through. An entry passes if any element of a vector passes
+ */
+TEntryList *SelectEntries(TTree *thisTree)
+{
+  string name=(thisTree==reftree?"reference":"sample");
+  TTreeFormula formula(("selection_"+name).c_str(), selection.c_str(), thisTree);
+  if (formula.GetNdim()==0)
+  {
+    cout<<"ERROR: could not understand the selection "<<selection<<" for the "<<name<<endl;
+    return 0;
+  }
+  vector<string> branches;
+  AddFormulaBranches(formula, branches);
+  ReadProfile profile=StartReadPass(thisTree, branches);
+  TEntryList *list=new TEntryList(("selected_"+name).c_str(),selection.c_str(),thisTree);
+  list->SetDirectory(0);
+  Long64_t nEntries=thisTree->GetEntries();
+  for (Long64_t iEntry=0; iEntry<nEntries; iEntry++)
+  {
+    thisTree->LoadTree(iEntry);
+    int nValues=formula.GetNdata();
+    for (int i=0;i<nValues;i++)
+    {
+      if (formula.EvalInstance(i) != 0)
+      {
+        list->Enter(iEntry);
+        break;
+      }
+    }
+  }
+  EndReadPass(thisTree, profile, "selection");
+  thisTree->SetEntryList(list);
+  cout<<"Selection: "<<list->GetN()<<" of "<<nEntries<<" "<<name<<" entries pass "<<selection<<endl;
+  return list;
+}
+
+// The branches a formula reads, to switch on for a pass
+void AddFormulaBranches(TTreeFormula &formula, vector<string> &branches)
+{
+  for (int i=0;i<formula.GetNcodes();i++)
+  {
+    if (formula.GetLeaf(i)) branches.push_back(formula.GetLeaf(i)->GetBranch()->GetName());
+  }
+}
+
+// Selection for tree->Draw that picks the same entries as the stride
+string StrideSelection()
+{
+  if (entryStride <= 1) return "";
+  return Form("Entry$%%%d==0",entryStride);
+}
+
+// Keep the statistics of a comparison, and how many entries it used
+void RecordComparison(double chisq, int ndf, double pValue, double ks)
+{
+  branchResult.hasComparison=true;
+  branchResult.chisq=chisq;
+  branchResult.ndf=ndf;
+  branchResult.pValue=pValue;
+  branchResult.ks=ks;
+  if (!tree) return; // Comparing stored histograms (CompareOutputs), which fills in the entries
+  branchResult.sampleEntries=EntriesUsed(tree);
+  branchResult.refEntries=EntriesUsed(reftree);
+}
+
+// Note in the results file how many entries a comparison was based on
+void WriteEntriesUsed()
+{
+  if (quickLookStride <= 1) return;
+  textOut<<"Based on "<<branchResult.sampleEntries<<" sample and "<<branchResult.refEntries<<" reference entries";
+  if (entryStride > 1) textOut<<" (preliminary)";
+  textOut<<endl;
+}
+
+/**
+ *  Calibrate a comparison with toy experiments, if they were asked for: the p-value
+ *  of the chi-square, and of the most deviant cell allowing for the number of cells
+ *  tested. zeroCountError is the uncertainty the plots give an empty bin of counts
+ */
+void RunToys(vector<TH1*> samples, vector<TH1*> refs, bool isAverage, double scale, double zeroCountError)
+{
+  if (nToys <= 0) return;
+  ToyComparison comparison;
+  comparison.isAverage=isAverage;
+  comparison.scale=scale;
+  comparison.zeroCountError=zeroCountError;
+  vector<string> cellNames;
+  for (int i=0;i<samples.size();i++)
+  {
+    for (int x=1; x<=samples.at(i)->GetNbinsX();x++)
+    {
+      for (int y=1; y<=samples.at(i)->GetNbinsY();y++)
+      {
+        comparison.sample.push_back(samples.at(i)->GetBinContent(x,y));
+        comparison.sampleError.push_back(samples.at(i)->GetBinError(x,y));
+        comparison.ref.push_back(refs.at(i)->GetBinContent(x,y));
+        comparison.refError.push_back(refs.at(i)->GetBinError(x,y));
+        if (samples.at(i)->GetNbinsY()==1) cellNames.push_back(Form("%s bin %d",samples.at(i)->GetName(),x));
+        else cellNames.push_back(Form("%s bin (%d,%d)",samples.at(i)->GetName(),x,y));
+      }
+    }
+  }
+
+  ToyEngine engine(nToys, TOY_SEED);
+  ToyResult result=engine.Run(comparison);
+  if (result.nToys==0) return;
+
+  cout<<"Chi-square p-value from "<<result.nToys<<" toys: "<<result.chisqPValue<<endl;
+  textOut<<"Chi-square p-value from "<<result.nToys<<" toys: "<<result.chisqPValue<<endl;
+  if (result.maxPullCell < 0) return;
+  double significance=TMath::NormQuantile(1 - result.globalPValue/2);
+  string report=Form("Most deviant cell: %s, pull %.2f (local p-value %.3g, trials-corrected p-value %.3g = %.2f sigma)",
+                     cellNames.at(result.maxPullCell).c_str(),result.maxPull,result.localPValue,result.globalPValue,significance);
+  cout<<report<<endl;
+  textOut<<report<<endl;
+}
+
+/**
+ *  Append the statistics of every compared branch to the results store, so that
+ *  trends over many runs can be queried with ValidationQuery. Unless a store is
+ *  given, it is shared by all runs whose output directories are in the same place
+ */
+void AppendToResultsStore(string storeFileName, RunInfo run)
+{
+  ResultsStore store;
+  if (!store.Open(storeFileName))
+  {
+    cout<<"WARNING: could not open results store "<<storeFileName<<": "<<store.GetError()<<endl;
+    return;
+  }
+  long long runId=store.AppendRun(run,allResults);
+  if (runId < 0)
+  {
+    cout<<"WARNING: could not write to results store "<<storeFileName<<": "<<store.GetError()<<endl;
+    return;
+  }
+  cout<<"Results for "<<allResults.size()<<" branches stored as run "<<runId<<" in "<<storeFileName<<endl;
+}
+
+/**
+ *  Decides what plot to make for a branch
+ *  depending on the prefix
+ */
+bool PlotVariable(string branchName)
+{
+  string config="";
+  bool configFound=false;
+  // If we have a config file, check if this var is in it
+  if (hasConfig)
+  {
+    config = configParams[branchName];
+    if (config.length() > 0)
+    {
+      configFound=true;
+    }
+  }
+  cout<<"Plotting "<<branchName<<":"<<endl;
+  branchResult=BranchResult();
+  branchResult.branchName=branchName;
+  switch (branchName[0])
+  {
+    case 'h':
+    {
+      Plot1DHistogram(branchName);
+      break;
+    }
+    case 't':
+    {
+      PlotTrackerMap(branchName);
+      break;
+    }
+    case 'c':
+    {
+      PlotCaloMap(branchName);
+      break;
+    }
+    default:
+    {
+      cout<< "Unknown variable type "<<branchName<<": ignoring this branch"<<endl;
+      break;
+    }
+  }
+  histogramWriter.Flush(); // Everything this branch made goes to the file in one go
+  logger.Flush(); // and what its passes logged is printed before the next branch starts
+
+  return true;
+}
+
+
+/**
+ *  Loads the config file (which should be short) into a memory
+ *  map where the key is the branch name (first item in the CSV line)
+ *  value is the rest of the line
+ */
+map<string,string> LoadConfig(ifstream& configFile)
+{
+  map<string,string> configLookup;
+  string thisLine;
+
+  while (configFile)
+  {
+    getline(configFile, thisLine);
+    string key=GetBitBeforeComma(thisLine);
+    configLookup[key]=thisLine; // the remainder of the line
+  }
+  return configLookup;
+}
+
+/**
+ *  Make a basic histogram of a variable. The number of bins etc will come from
+ *  the config file if there is one, if not we will guess
+ */
+void Plot1DHistogram(string branchName)
+{
+  int notSetVal=-9999;
+  string config="";
+  config=configParams[branchName]; // get the config loaded from the file if there is one
+  int nbins=100;
+  double lowLimit=notSetVal;
+  double highLimit=notSetVal;
+  string title="";
+  bool hasReferenceBranch=hasValidReference;
+
+  // Check whether the reference file contains this branch
+  if (hasValidReference)
+  {
+    hasReferenceBranch=reftree->GetBranchStatus(branchName.c_str());
+    if (!hasReferenceBranch) cout<<"WARNING: branch "<<branchName<<" not found in reference file. No comparison plots will be made for this branch"<<endl;
+  }
+
+  // Read the config information
+  if (config.length()>0)
+  {
+    // title, nbins, low limit, high limit separated by commas
+    title=GetBitBeforeComma(config); // config now has this bit chopped off ready for the next parsing stage
+
+    // Number of bins
+    try
+    {
+      string nbinString=GetBitBeforeComma(config);
+      std::string::size_type sz;   // alias of size_t
+      nbins = std::stoi (nbinString,&sz); // hopefully the next chunk is turnable into an integer
+    }
+    catch (exception &e)
+    {
+      nbins=0;
+    }
+
+    // Low bin limit
+    try
+    {
+      string lowString=GetBitBeforeComma(config);
+      lowLimit = std::stod (lowString); // hopefully the next chunk is turnable into an double
+    }
+    catch (exception &e)
+    {
+      lowLimit=notSetVal;
+    }
+
+    // High bin limit
+    try
+    {
+      string highString=GetBitBeforeComma(config);
+      highLimit = std::stod (highString); // hopefully the next chunk is turnable into an double
+    }
+    catch (exception &e)
+    {
+      highLimit=notSetVal;
+    }
+  }
+
+  if (title.length()==0)
+  {
+    title = BranchNameToEnglish(branchName);
+  }
+  TH1D *h;
+
+  // A quantile sketch of the values gives us unbinned comparisons, and ranges
+  // that are not set by a few outliers. It doesn't grow with the number of entries
+  QuantileSketch sketch(SKETCH_COMPRESSION);
+  pair<string,int> sampleKey(branchName,entryStride);
+  bool sampleMade=(sampleHistograms.count(sampleKey)>0);
+  if (sampleMade)
+  {
+    // Made for an earlier reference: the binning only depends on the sample
+    sketch=sampleSketches[sampleKey];
+    h=(TH1D*)sampleHistograms[sampleKey]->Clone();
+    h->SetDirectory(0);
+    nbins=h->GetNbinsX();
+    lowLimit=h->GetXaxis()->GetXmin();
+    highLimit=h->GetXaxis()->GetXmax();
+  }
+  else FillSketch(tree, branchName, sketch);
+
+  // Values are plotted from 0 unless told otherwise, or unless some are negative
+  if (!sampleMade && lowLimit == notSetVal)
+  {
+    lowLimit=0;
+    if (sketch.GetMin() < 0) lowLimit=sketch.Quantile(AUTORANGE_LOW_QUANTILE);
+  }
+  if (!sampleMade && highLimit == notSetVal)
+  {
+    // Use the default limits: leave out the highest 0.1% of values so that a single
+    // outlier can't squash the whole distribution into a few bins. It goes in the overflow
+    highLimit=sketch.Quantile(AUTORANGE_HIGH_QUANTILE);
+    EDataType datatype;
+    TClass *ctmp;
+    tree->FindBranch(branchName.c_str())->GetExpectedType(ctmp,datatype);
+    delete ctmp;
+    if (datatype==kBool_t)
+    {
+      nbins=2;
+      highLimit=2;
+      lowLimit=0;
+    }
+    else if (datatype== kInt_t || datatype== kUInt_t)
+    {
+      // Bin edges on the integers
+      lowLimit = TMath::Floor(lowLimit);
+      highLimit = TMath::Floor(highLimit) + 1;
+      if (highLimit - lowLimit <=100) nbins = (int) (highLimit - lowLimit);
+      else nbins = 100;
+    }
+    else
+    {
+      highLimit += (highLimit - lowLimit) /10.;
+      nbins = 100;
+    }
+    if (!(highLimit > lowLimit)) highLimit = lowLimit + 1; // Everything has the same value, or there is nothing
+  }
+  if (!sampleMade)
+  {
+    h = new TH1D(("plt_"+branchName).c_str(),title.c_str(),nbins,lowLimit,highLimit);
+    if( h->GetSumw2N() == 0 )h->Sumw2();
+    h->GetYaxis()->SetTitle("Events");
+    h->GetXaxis()->SetTitle(title.c_str());
+    h->SetFillColor(kPink-6);
+    h->SetFillStyle(1001);
+    tree->Draw((branchName + ">> plt_"+branchName).c_str(),StrideSelection().c_str(),"goff");
+    if (keepSampleHistograms)
+    {
+      // Keep it to compare with the next reference
+      sampleHistograms[sampleKey]=(TH1D*)h->Clone();
+      sampleHistograms[sampleKey]->SetDirectory(0);
+      sampleSketches[sampleKey]=sketch;
+    }
+  }
+  histogramWriter.Add(h,"h");
+  if (sliceKey.length()>0)
+  {
+    // The slices of this branch are filled later, with the same binning
+    delete sliceTemplates[branchName];
+    TH1D *sliceTemplate=(TH1D*)h->Clone(("slice_"+branchName).c_str());
+    sliceTemplate->SetDirectory(0);
+    sliceTemplate->Reset();
+    sliceTemplates[branchName]=sliceTemplate;
+  }
+  if (makeImages) PrintHistogramPlot(branchName, h);
+  if (hasReferenceBranch)
+  {
+    // Make the reference plot with the same binning
+    TH1D *href = new TH1D(("ref_"+branchName).c_str(),title.c_str(),nbins,lowLimit,highLimit);
+    if( href->GetSumw2N() == 0 )href->Sumw2();
+    QuantileSketch refSketch(SKETCH_COMPRESSION);
+
+    // Another job on this node may have filled them from the same reference already
+    string sharedKey=SharedReferenceKey(Form("h %s %d %.17g %.17g",branchName.c_str(),nbins,lowLimit,highLimit));
+    size_t nShared;
+    const double *shared=FindSharedReference(sharedKey, nShared);
+    const double *sharedEnd=shared+nShared;
+    if (!shared || !ReadHistogram(shared, sharedEnd, href) || !refSketch.SetState(vector<double>(shared, sharedEnd)))
+    {
+      if (shared) LockSharedReference(sharedKey); // It can't be used, so it is filled again, as for a new one
+      href->Reset();
+      refSketch.Reset();
+      FillSketch(reftree, branchName, refSketch, href);
+      vector<double> values;
+      AppendHistogram(values, href);
+      vector<double> sketchState=refSketch.GetState();
+      values.insert(values.end(), sketchState.begin(), sketchState.end());
+      PublishSharedReference(sharedKey, values);
+    }
+
+    // Normalise reference number of events to data
+    Double_t scale = (double)EntriesUsed(tree)/(double)EntriesUsed(reftree);
+    href->Scale(scale);
+    histogramWriter.Add(href,"h"); // So the comparison can be drawn again later (--serve)
+
+    // Calculate some stats
+    // Kolmogorov-Smirnov goodness of fit
+    Double_t ks = h->KolmogorovTest(href);
+
+    // And without the binning, from the quantile sketches
+    double ksDistance=QuantileSketch::KolmogorovDistance(sketch, refSketch);
+    double nEffective=sketch.GetEntries() * refSketch.GetEntries() / (sketch.GetEntries() + refSketch.GetEntries());
+    double ksUnbinned=TMath::KolmogorovProb(ksDistance * TMath::Sqrt(nEffective));
+    Double_t chisq;
+    Int_t ndf;
+    Double_t p_value = ChiSquared(h, href, chisq, ndf, false);
+    cout<<"Kolmogorov: "<<ks<<endl;
+    cout<<"Kolmogorov (unbinned, approximate): "<<ksUnbinned<<" (distance "<<ksDistance<<")"<<endl;
+    cout<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+    RecordComparison(chisq, ndf, p_value, ks);
+
+    // Write to output file
+    textOut<<branchName<<":"<<endl;
+    textOut<<"KS score: "<<ks<<endl;
+    textOut<<"KS score (unbinned, approximate): "<<ksUnbinned<<" (distance "<<ksDistance<<")"<<endl;
+    textOut<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+    WriteQuantileComparison(sketch, refSketch);
+    WriteEntriesUsed();
+    RunToys(vector<TH1*>(1,h), vector<TH1*>(1,href), false, scale, 0); // Empty bins are left out of the chi-square here
+    if (makeImages) PrintComparisonPlot(branchName, h, href, Form("K-S score (binned): %.2f",ks), Form("#chi^{2}/NDF: %.1f/%d = %.1f",chisq,ndf,chisq/(double)ndf), Form("(p-value %.2f)",p_value), Form("K-S score (unbinned): %.2f",ksUnbinned));
+
+    textOut<<endl;
+    delete href;
+  }
+  delete h;
+}
+
+// Save a plot of a 1D histogram on its own
+void PrintHistogramPlot(string branchName, TH1D *h)
+{
+  TCanvas *c = new TCanvas (("plot_"+branchName).c_str(),("plot_"+branchName).c_str(),900,600);
+  h->Draw("HIST");
+
+  h->Draw("E SAME");
+  c->SaveAs((plotdir+"/"+branchName+".png").c_str());
+  delete c;
+}
+
+/**
+ *  Save a plot of the sample and the (normalised) reference on the same axes, with
+ *  their ratio underneath, labelled with the statistics
+ */
+void PrintComparisonPlot(string branchName, TH1D *h, TH1D *href, string ksLabel, string chisqLabel, string pValueLabel, string ksUnbinnedLabel)
+{
+  TCanvas  *comp_canv= new TCanvas(("compare_"+branchName).c_str(),("compare_"+branchName).c_str(),900,900);
+  TPad *p_comp = new TPad("p_comp",
+                          "",0.0,0.4,1,1,0);
+
+  TPad *p_ratio = new TPad("p_ratio",
+                          "",0.0,0.0,1,0.4,0);
+  p_comp->Draw();
+  p_ratio->Draw();
+
+  p_comp->cd();
+  // Save a plot with both on the same axes
+  double maxy = h->GetMaximum()>href->GetMaximum()?h->GetMaximum()*1.1:href->GetMaximum()*1.1;
+  h->GetYaxis()->SetRangeUser(0,maxy);
+
+  // Draw the sample to get the right axis
+  h->SetLineColor(kBlack);
+  h->SetMarkerStyle(20);
+  h->SetMarkerSize(.5);
+  h->SetMarkerColor(kBlack);
+  h->SetLineWidth(1);
+  h->SetLineStyle(1);
+  h->Draw("E");
+
+  // Draw the error bars on the reference
+  href->SetFillColor(REF_FILL_COLOR);
+  href->SetFillStyle(REF_FILL_STYLE);
+  href->SetLineColor(REF_LINE_COLOR);
+  href->SetMarkerStyle(0);
+  href->DrawCopy("E2 SAME");
+  // Then the reference central value
+  href->SetFillColor(0);
+  href->DrawCopy("HIST SAME");
+  // Finally redraw the sample so it is on top
+  h->DrawCopy("E1 X0 SAME");
+
+
+  // Add a legend
+  TLegend* legend = new TLegend(0.75,0.8,0.9,0.9);
+  href->SetFillColor(REF_FILL_COLOR); // change it back so it is included in the legend
+  legend->AddEntry(h, "Sample", "lep");
+  legend->AddEntry(href,"Reference", "fl");
+  legend->Draw();
+
+  // Now make a ratio plot
+  p_ratio->cd();
+  TH1D *ratio_hist = (TH1D*)h->Clone(("ratio_"+branchName).c_str());
+  ratio_hist->SetTitle("");
+  ratio_hist->GetXaxis()->SetTitle("");
+  ratio_hist->Divide(href);
+  // Set a more sensible y axis
+  ratio_hist->GetYaxis()->SetRangeUser(ratio_hist->GetBinContent(ratio_hist->GetMinimumBin())*0.9,ratio_hist->GetBinContent(ratio_hist->GetMaximumBin())*1.1);
+  ratio_hist->SetLineColor(kBlack);
+  ratio_hist->GetYaxis()->SetTitle("Ratio to reference");
+  ratio_hist->GetYaxis()->SetLabelSize(ratio_hist->GetYaxis()->GetLabelSize() * 1.5);
+  ratio_hist->GetYaxis()->SetTitleSize(ratio_hist->GetYaxis()->GetTitleSize() * 1.5);
+  ratio_hist->Draw();
+
+  WriteLabel(0.6,0.8, ksLabel,0.04);
+  WriteLabel(0.6,0.72, chisqLabel,0.04);
+  WriteLabel(0.6,0.64, pValueLabel,0.04);
+  WriteLabel(0.6,0.56, ksUnbinnedLabel,0.04);
+
+  TLine *line=new TLine(h->GetXaxis()->GetXmin(),1.0,h->GetXaxis()->GetXmax(),1.0);
+  line->SetLineColor(kRed);
+  line->Draw();
+
+  comp_canv->SaveAs((plotdir+"/compare_"+branchName+".png").c_str());
+
+  delete ratio_hist;
+  delete comp_canv;
+}
+
+
+/**
+ *  Book the histograms for every tracker and calorimeter map branch in the list,
+ *  then fill them all in one pass over each tree. The two trees are in different
+ *  files, so the reference is read in a second thread while the sample is read here.
+ *  The first pass that reads every entry also fills the covariance of the scalar branches
+ */
+void FillAllMaps(vector<string> branchNames)
+{
+  sampleMaps.clear();
+  refMaps.clear();
+  vector<MapAccumulator*> sampleAccumulators;
+  for (int i=0;i<branchNames.size();i++)
+  {
+    string fullBranchName=branchNames.at(i);
+    string branchName, mapBranch;
+    bool isCalo, isAverage;
+    if (!MapBranchParts(fullBranchName, branchName, mapBranch, isCalo, isAverage)) continue;
+    if (!tree->GetBranch(mapBranch.c_str())) continue;
+
+    pair<string,int> filledKey(fullBranchName,entryStride);
+    if (filledSampleMaps.count(filledKey)) sampleMaps[fullBranchName]=CopyMapAccumulator(filledSampleMaps[filledKey]); // Filled for an earlier reference
+    else
+    {
+      // The tracker titles come from the config for the full name, the calorimeter ones don't need a title
+      if (isCalo) sampleMaps[fullBranchName]=BookCaloPlotSet(fullBranchName, branchName, false, isAverage, mapBranch);
+      else sampleMaps[fullBranchName]=BookTrackerMap(fullBranchName, branchName, MapTitle(fullBranchName,branchName), false, isAverage, mapBranch);
+      if (fullBranchName[1]=='d' && tree->GetBranch(fullBranchName.c_str()))
+      {
+        int nBins;
+        double low, high;
+        DistributionBinning(tree, fullBranchName, nBins, low, high);
+        sampleMaps[fullBranchName].distribution=BookDistribution(sampleMaps[fullBranchName], nBins, low, high);
+      }
+      sampleAccumulators.push_back(&sampleMaps[fullBranchName]);
+    }
+
+    if (!hasValidReference || !reftree->GetBranch(fullBranchName.c_str()) || !reftree->GetBranch(mapBranch.c_str())) continue;
+    if (isCalo) refMaps[fullBranchName]=BookCaloPlotSet(fullBranchName, branchName, true, isAverage, mapBranch);
+    else refMaps[fullBranchName]=BookTrackerMap(fullBranchName, branchName, MapTitle(fullBranchName,branchName), true, isAverage, mapBranch);
+    // Distributions are binned the same way for the sample and the reference
+    TAxis *values=(sampleMaps[fullBranchName].distribution?sampleMaps[fullBranchName].distribution->GetAxis(1):0);
+    if (values) refMaps[fullBranchName].distribution=BookDistribution(refMaps[fullBranchName], values->GetNbins(), values->GetXmin(), values->GetXmax());
+  }
+
+  CovarianceMatrix *sampleMatrix=0, *refMatrix=0;
+  if (entryStride==1)
+  {
+    if (!sampleCovariance && covarianceBranches.size()>0) sampleMatrix=sampleCovariance=new CovarianceMatrix(covarianceBranches.size());
+    if (!refCovariance && refCovarianceBranches.size()>0) refMatrix=refCovariance=new CovarianceMatrix(refCovarianceBranches.size());
+  }
+
+  // The reference maps (and matrix, which has no map) that another job on this node has
+  // filled already are taken from the shared store. Those it hasn't are locked until we
+  // have filled them, in the order of their keys so that no two jobs wait for each other
+  map<string,MapAccumulator*> refEntries;
+  for (map<string,MapAccumulator>::iterator it=refMaps.begin(); it!=refMaps.end(); it++) refEntries[MapReferenceKey(it->second)]=&it->second;
+  if (refMatrix) refEntries[SharedReferenceKey("covariance "+boost::algorithm::join(refCovarianceBranches," "))]=0;
+  vector<MapAccumulator*> refAccumulators;
+  vector<string> toPublish;
+  for (map<string,MapAccumulator*>::iterator it=refEntries.begin(); it!=refEntries.end(); it++)
+  {
+    size_t nShared;
+    const double *shared=FindSharedReference(it->first, nShared);
+    if (shared && it->second && SetMapState(*it->second, shared, nShared)) continue;
+    if (shared && !it->second && refMatrix->SetState(vector<double>(shared, shared+nShared)))
+    {
+      refMatrix=0;
+      continue;
+    }
+    if (shared) LockSharedReference(it->first); // It can't be used, so it is filled again, as for a new one
+    if (it->second) refAccumulators.push_back(it->second);
+    toPublish.push_back(it->first);
+  }
+
+  std::thread refThread;
+  if (refAccumulators.size()>0 || refMatrix) refThread=std::thread(FillMaps, reftree, std::ref(refAccumulators), std::ref(refCovarianceBranches), refMatrix);
+  if (sampleAccumulators.size()>0 || sampleMatrix) FillMaps(tree, sampleAccumulators, covarianceBranches, sampleMatrix);
+  if (refThread.joinable()) refThread.join();
+  logger.Flush();
+  for (int i=0;i<toPublish.size();i++)
+  {
+    MapAccumulator *accumulator=refEntries[toPublish.at(i)];
+    PublishSharedReference(toPublish.at(i), (accumulator?MapState(*accumulator):refCovariance->GetState()));
+  }
+
+  // Keep the sample maps as they are now, to compare with the next reference
+  if (!keepSampleHistograms) return;
+  for (int i=0;i<sampleAccumulators.size();i++)
+  {
+    filledSampleMaps[make_pair(sampleAccumulators.at(i)->fullBranchName,entryStride)]=CopyMapAccumulator(*sampleAccumulators.at(i));
+  }
+}
+
+// A copy of the histograms of a map, that belongs to no directory
+MapAccumulator CopyMapAccumulator(MapAccumulator &original)
+{
+  MapAccumulator copy=original;
+  for (int wall=0;wall<original.counts.size();wall++)
+  {
+    copy.counts.at(wall)=(TH2D*)original.counts.at(wall)->Clone();
+    copy.sums.at(wall)=(TH2D*)original.sums.at(wall)->Clone();
+    copy.sumsSquared.at(wall)=(TH2D*)original.sumsSquared.at(wall)->Clone();
+    copy.counts.at(wall)->SetDirectory(0);
+    copy.sums.at(wall)->SetDirectory(0);
+    copy.sumsSquared.at(wall)->SetDirectory(0);
+  }
+  if (original.distribution) copy.distribution=(THnSparseD*)original.distribution->Clone();
+  return copy;
+}
+
+/**
+ *  Split the name of a t_, c_, tm_, cm_, td_ or cd_ branch into the name we plot it
+ *  with and the map branch that gives its cells: for the averages, tm_name.t_map is the
+ *  value of name averaged over the cells of t_map. Distributions (td_, cd_) are
+ *  averages too, that also keep all the values. False if it isn't a map branch
+ */
+bool MapBranchParts(string fullBranchName, string &branchName, string &mapBranch, bool &isCalo, bool &isAverage)
+{
+  if (fullBranchName.length()<2 || (fullBranchName[0]!='t' && fullBranchName[0]!='c')) return false;
+  isCalo=(fullBranchName[0]=='c');
+  branchName=fullBranchName;
+  mapBranch=fullBranchName;
+  isAverage=false;
+  if (fullBranchName[1]=='m' || fullBranchName[1]=='d')
+  {
+    int pos=fullBranchName.find(".");
+    if (pos<=1) return false; // PlotTrackerMap and PlotCaloMap report this
+    mapBranch=fullBranchName.substr(pos+1);
+    branchName=fullBranchName.substr(0,pos);
+    isAverage=true;
+  }
+  return true;
+}
+
+/**
+ *  One pass over a tree that fills all the map histograms booked for it. Each
+ *  map branch is read and decoded once per event, however many branches are
+ *  averaged over its cells, and the decoded cells are shared between them.
+ *  If there is a covariance matrix, the scalar branches are read in the same pass to fill it
+ */
+void FillMaps(TTree *thisTree, vector<MapAccumulator*> &accumulators, vector<string> &scalarBranches, CovarianceMatrix *covariance)
+{
+  if (accumulators.size()==0 && !covariance) return;
+
+  // Find the distinct map branches, and which one each accumulator uses
+  vector<string> activeBranches;
+  vector<int> whichReader;
+  map<string,int> readerIndex;
+  vector<MapBranchReader> readers;
+  bool needBackscatter=false;
+  for (int i=0;i<accumulators.size();i++)
+  {
+    MapAccumulator *accumulator=accumulators.at(i);
+    if (!readerIndex.count(accumulator->mapBranch))
+    {
+      readerIndex[accumulator->mapBranch]=readers.size();
+      MapBranchReader reader={accumulator->mapBranch,accumulator->isCalo,0,0};
+      readers.push_back(reader);
+      activeBranches.push_back(accumulator->mapBranch);
+      if (accumulator->mapBranch==BACKSCATTER_MAP_BRANCH) needBackscatter=true;
+    }
+    whichReader.push_back(readerIndex[accumulator->mapBranch]);
+    if (accumulator->isAverage) activeBranches.push_back(accumulator->fullBranchName);
+  }
+  // Backscattering is found by matching calorimeter hits to the electron tracks
+  if (needBackscatter)
+  {
+    activeBranches.push_back("reco.electron_vertex_x");
+    activeBranches.push_back("reco.track_calo_hits");
+  }
+
+  // Carry on from the checkpoint of this pass, if it has one
+  Long64_t firstEntry=RestorePassCheckpoint(thisTree, accumulators, covariance);
+
+  // Fill from the hit cache if it has every column we need. If not, read the tree as
+  // usual and keep the columns the cache doesn't have yet for next time
+  vector<HitCacheWriter*> cellCache(readers.size(),(HitCacheWriter*)0);
+  vector<HitCacheWriter*> valueCache(accumulators.size(),(HitCacheWriter*)0);
+  if (hitCacheDir.length()>0 && accumulators.size()>0 && firstEntry==0)
+  {
+    string key=HitCacheKey(thisTree);
+    if (FillMapsFromCache(thisTree, key, accumulators, readers, whichReader))
+    {
+      // The cache only has the maps, so the scalar branches still need reading
+      vector<MapAccumulator*> noMaps;
+      if (covariance) FillMaps(thisTree, noMaps, scalarBranches, covariance);
+      return;
+    }
+    for (int i=0;i<readers.size();i++) cellCache.at(i)=OpenHitCacheWriter(key, readers.at(i).name, sizeof(CellHit));
+    for (int i=0;i<accumulators.size();i++)
+    {
+      if (accumulators.at(i)->isAverage) valueCache.at(i)=OpenHitCacheWriter(key, accumulators.at(i)->fullBranchName, sizeof(double));
+    }
+  }
+
+  if (covariance) activeBranches.insert(activeBranches.end(), scalarBranches.begin(), scalarBranches.end());
+
+  // Only read the branches we need
+  ReadProfile profile=StartReadPass(thisTree, activeBranches);
+
+  // Map the branches. The readers and value pointers don't move from here on
+  for (int i=0;i<readers.size();i++) AttachMapReader(thisTree, readers.at(i));
+  vector<std::vector<double>*> toAverage(accumulators.size(),(std::vector<double>*)0);
+  for (int i=0;i<accumulators.size();i++)
+  {
+    if (accumulators.at(i)->isAverage) thisTree->SetBranchAddress(accumulators.at(i)->fullBranchName.c_str(), &toAverage.at(i));
+  }
+  std::vector<double> *e_vert_x = 0;
+  std::vector<string> *trackCaloHits = 0;
+  if (needBackscatter)
+  {
+    thisTree->SetBranchAddress("reco.electron_vertex_x", &e_vert_x);
+    thisTree->SetBranchAddress("reco.track_calo_hits", &trackCaloHits);
+  }
+  // The scalar branches are read through their leaves, whatever their type
+  vector<TLeaf*> scalarLeaves;
+  for (int i=0;covariance && i<scalarBranches.size();i++) scalarLeaves.push_back(thisTree->GetLeaf(scalarBranches.at(i).c_str()));
+  vector<double> scalarValues(scalarLeaves.size());
+
+  // Loop through the tree
+  Long64_t nEntries = SelectedEntries(thisTree);
+  time_t lastCheckpoint=time(0);
+  for( Long64_t i = firstEntry; i < nEntries; i++ )
+  {
+    if (checkpointDir.length()>0 && i%1000==0 && CheckpointDue(lastCheckpoint)) SavePassCheckpoint(thisTree, accumulators, covariance, i);
+    Long64_t iEntry = EntryNumber(thisTree, i);
+    if (iEntry % entryStride != 0) continue;
+    thisTree->GetEntry(iEntry);
+    for (int j=0;j<readers.size();j++)
+    {
+      if (readers.at(j).name==BACKSCATTER_MAP_BRANCH) DecodeBackscatter(readers.at(j), e_vert_x, trackCaloHits);
+      else DecodeMapBranch(readers.at(j));
+      if (cellCache.at(j)) cellCache.at(j)->Add(readers.at(j).cells.data(), readers.at(j).cells.size());
+    }
+    for (int j=0;j<accumulators.size();j++)
+    {
+      FillMapAccumulator(*accumulators.at(j), readers.at(whichReader.at(j)).cells, toAverage.at(j));
+      if (valueCache.at(j)) valueCache.at(j)->Add((toAverage.at(j)?toAverage.at(j)->data():0), (toAverage.at(j)?toAverage.at(j)->size():0));
+    }
+    if (covariance)
+    {
+      for (int k=0;k<scalarLeaves.size();k++) scalarValues.at(k)=scalarLeaves.at(k)->GetValue();
+      covariance->Fill(scalarValues.data());
+    }
+  }
+  // The finished pass is kept too, until every branch of this reference is plotted
+  if (checkpointDir.length()>0) SavePassCheckpoint(thisTree, accumulators, covariance, nEntries);
+  if (covariance) covariance->Flush();
+  EndReadPass(thisTree, profile, Form("%d map branches for %d plots, %d scalar branches",(int)readers.size(),(int)accumulators.size(),(int)scalarLeaves.size()));
+
+  // Put the new columns in the cache
+  int nCached=0;
+  for (int i=0;i<cellCache.size();i++) if (cellCache.at(i) && cellCache.at(i)->Close()) nCached++;
+  for (int i=0;i<valueCache.size();i++) if (valueCache.at(i) && valueCache.at(i)->Close()) nCached++;
+  for (int i=0;i<cellCache.size();i++) delete cellCache.at(i);
+  for (int i=0;i<valueCache.size();i++) delete valueCache.at(i);
+  if (nCached>0) logger.Log(Logger::LOG_INFO, "Wrote to the hit cache", Form("Wrote %d columns to the hit cache in %s",nCached,hitCacheDir.c_str()));
+
+  // ROOT allocated these when it read the branches
+  for (int i=0;i<readers.size();i++)
+  {
+    delete readers.at(i).codes;
+    delete readers.at(i).caloHits;
+  }
+  for (int i=0;i<toAverage.size();i++) delete toAverage.at(i);
+  delete e_vert_x;
+  delete trackCaloHits;
+}
+
+/**
+ *  What the hits cached from a tree depend on: the file (its path, size and time it
+ *  was last changed), the entries that are read (the selection and stride), and the
+ *  version of the decoding. A cached column is only used if its key matches
+ */
+string HitCacheKey(TTree *thisTree)
+{
+  return FileIdentity(thisTree->GetCurrentFile()->GetName())+Form("|%s|%lld|%s|%d|%d",treeName.c_str(),thisTree->GetEntries(),selection.c_str(),entryStride,HIT_CACHE_VERSION);
+}
+
+// A file's full path, size and the time it was last changed, to tell if it is still the same file
+string FileIdentity(string fileName)
+{
+  boost::system::error_code error;
+  boost::filesystem::path path=boost::filesystem::canonical(fileName, error);
+  if (!error) fileName=path.string();
+  Long64_t fileSize=boost::filesystem::file_size(fileName, error);
+  long modified=(long)boost::filesystem::last_write_time(fileName, error);
+  return Form("%s|%lld|%ld",fileName.c_str(),fileSize,modified);
+}
+
+// The file a column of the cache is kept in. The key is long, so the name uses a hash of it
+string HitCacheFile(string key, string column)
+{
+  return hitCacheDir+"/"+Form("%016zx",std::hash<string>()(key))+"_"+column+".hits";
+}
+
+// A writer for a column the cache doesn't have yet, or 0 if it has it (or we can't write there)
+HitCacheWriter *OpenHitCacheWriter(string key, string column, int valueSize)
+{
+  HitCacheReader existing(HitCacheFile(key, column), key, valueSize);
+  if (existing.IsOpen()) return 0;
+  HitCacheWriter *writer=new HitCacheWriter(HitCacheFile(key, column), key, valueSize);
+  if (writer->IsOpen()) return writer;
+  logger.Log(Logger::LOG_WARNING, "Could not write to the hit cache", "could not write "+column+" to the hit cache in "+hitCacheDir);
+  delete writer;
+  return 0;
+}
+
+/**
+ *  Fill the maps of a tree from the hit cache rather than the tree, if the cache has
+ *  the cells of every map branch and the values of every branch to average, for the
+ *  same entries. The cells are used exactly as if they had just been decoded.
+ *  False (with the maps left empty) if the tree has to be read after all
+ */
+bool FillMapsFromCache(TTree *thisTree, string key, vector<MapAccumulator*> &accumulators, vector<MapBranchReader> &readers, vector<int> &whichReader)
+{
+  TStopwatch timer;
+  Long64_t nEntries=EntriesUsed(thisTree);
+  vector<HitCacheReader*> cellColumns;
+  vector<HitCacheReader*> valueColumns(accumulators.size(),(HitCacheReader*)0);
+  vector<string> damaged; // Columns for these entries that can't be used, to be written again
+  bool complete=true;
+  for (int i=0;i<readers.size();i++)
+  {
+    cellColumns.push_back(new HitCacheReader(HitCacheFile(key, readers.at(i).name), key, sizeof(CellHit)));
+    if (cellColumns.back()->IsOpen() && cellColumns.back()->GetEntries()!=nEntries) damaged.push_back(HitCacheFile(key, readers.at(i).name));
+    if (!cellColumns.back()->IsOpen() || cellColumns.back()->GetEntries()!=nEntries) complete=false;
+  }
+  for (int i=0;i<accumulators.size();i++)
+  {
+    if (!accumulators.at(i)->isAverage) continue;
+    valueColumns.at(i)=new HitCacheReader(HitCacheFile(key, accumulators.at(i)->fullBranchName), key, sizeof(double));
+    if (valueColumns.at(i)->IsOpen() && valueColumns.at(i)->GetEntries()!=nEntries) damaged.push_back(HitCacheFile(key, accumulators.at(i)->fullBranchName));
+    if (!valueColumns.at(i)->IsOpen() || valueColumns.at(i)->GetEntries()!=nEntries) complete=false;
+  }
+
+  vector<vector<double> > values(accumulators.size());
+  for (Long64_t iEntry=0; complete && iEntry<nEntries; iEntry++)
+  {
+    for (int i=0;i<readers.size();i++)
+    {
+      const CellHit *cells;
+      size_t nCells;
+      if (cellColumns.at(i)->Next(cells, nCells)) readers.at(i).cells.assign(cells, cells+nCells);
+      else
+      {
+        damaged.push_back(HitCacheFile(key, readers.at(i).name));
+        complete=false;
+      }
+    }
+    for (int i=0;i<accumulators.size();i++)
+    {
+      const double *eventValues;
+      size_t nValues;
+      if (!valueColumns.at(i)) continue;
+      if (valueColumns.at(i)->Next(eventValues, nValues)) values.at(i).assign(eventValues, eventValues+nValues);
+      else
+      {
+        damaged.push_back(HitCacheFile(key, accumulators.at(i)->fullBranchName));
+        complete=false;
+      }
+    }
+    if (!complete) break;
+    for (int i=0;i<accumulators.size();i++)
+    {
+      FillMapAccumulator(*accumulators.at(i), readers.at(whichReader.at(i)).cells, (valueColumns.at(i)?&values.at(i):0));
+    }
+  }
+
+  double megabytes=0;
+  for (int i=0;i<cellColumns.size();i++)
+  {
+    megabytes+=cellColumns.at(i)->GetFileSize()/1e6;
+    delete cellColumns.at(i);
+  }
+  for (int i=0;i<valueColumns.size();i++)
+  {
+    if (valueColumns.at(i)) megabytes+=valueColumns.at(i)->GetFileSize()/1e6;
+    delete valueColumns.at(i);
+  }
+  if (damaged.size()>0)
+  {
+    // Delete them, so that reading the tree writes them again
+    logger.Log(Logger::LOG_WARNING, "Damaged hit cache", string("the hit cache for ")+thisTree->GetCurrentFile()->GetName()+" is damaged, so the tree will be read instead and the damaged columns written again");
+    boost::system::error_code error;
+    for (int i=0;i<damaged.size();i++) boost::filesystem::remove(damaged.at(i), error);
+  }
+  if (!complete)
+  {
+    // Start again from the tree
+    for (int i=0;i<accumulators.size();i++)
+    {
+      MapAccumulator *accumulator=accumulators.at(i);
+      for (int wall=0;wall<accumulator->counts.size();wall++)
+      {
+        accumulator->counts.at(wall)->Reset();
+        accumulator->sums.at(wall)->Reset();
+        accumulator->sumsSquared.at(wall)->Reset();
+      }
+      if (accumulator->distribution) accumulator->distribution->Reset();
+    }
+    return false;
+  }
+
+  double seconds=timer.RealTime();
+  string report=Form("Read profile (%s, %d plots from the hit cache): %lld entries, %.1f MB in %.2f s (%.1f MB/s)",(thisTree==reftree?"reference":"sample"),(int)accumulators.size(),nEntries,megabytes,seconds,(seconds>0?megabytes/seconds:0.));
+  logger.Log(Logger::LOG_INFO, report);
+  std::lock_guard<std::mutex> lock(readTimeMutex);
+  if (thisTree==reftree) refReadTime+=seconds;
+  else sampleReadTime+=seconds;
+  return true;
+}
+
+// Tracker maps are a vector of encoded cell numbers. Calorimeter maps are either
+// a vector of geometry IDs with a format something like [1302:0.1.0.10.*], or
+// of packed locations: we can tell which from the type of the branch
+// What a shared reference entry was filled with, besides the reference itself
+string SharedReferenceKey(string what)
+{
+  return what+Form("|%s|%s|%d|%d",treeName.c_str(),selection.c_str(),entryStride,SHARED_REFERENCE_VERSION);
+}
+
+// Distributions are binned like the sample's, so their binning is part of the key
+string MapReferenceKey(MapAccumulator &accumulator)
+{
+  string what="map "+accumulator.fullBranchName;
+  TAxis *values=(accumulator.distribution?accumulator.distribution->GetAxis(1):0);
+  if (values) what+=Form(" %d %.17g %.17g",values->GetNbins(),values->GetXmin(),values->GetXmax());
+  return SharedReferenceKey(what);
+}
+
+/**
+ *  The values of an entry of the shared reference store, or 0 if there is no store or
+ *  no job has filled the entry. In that case we hold its lock until we publish it, and
+ *  other jobs that want it wait for us rather than read the reference too
+ */
+const double *FindSharedReference(string key, size_t &nValues)
+{
+  nValues=0;
+  if (!referenceStore || !referenceStore->IsOpen()) return 0;
+  const double *values=referenceStore->Find(key, nValues);
+  if (values) return values;
+  referenceStore->Lock(key);
+  values=referenceStore->Find(key, nValues); // Filled while we waited for the lock
+  if (values) referenceStore->Unlock(key);
+  return values;
+}
+
+// Take the lock of an entry that was found but can't be used, before filling it again
+void LockSharedReference(string key)
+{
+  if (referenceStore && referenceStore->IsOpen()) referenceStore->Lock(key);
+}
+
+void PublishSharedReference(string key, const vector<double> &values)
+{
+  if (!referenceStore || !referenceStore->IsOpen()) return;
+  if (!referenceStore->Publish(key, values)) logger.Log(Logger::LOG_WARNING, "Could not write to the shared reference store", "could not write to the shared reference store in "+sharedReferenceDir);
+}
+
+/**
+ *  The SHA-256 hash of the reference. Working it out reads the whole file, so it is
+ *  kept in the shared reference store (one value per character) and only the first
+ *  job to open this version of the reference does it
+ */
+string ReferenceHash(string refFileName)
+{
+  size_t nValues;
+  const double *values=FindSharedReference("sha256", nValues);
+  if (values)
+  {
+    string hash;
+    for (size_t i=0;i<nValues;i++) hash+=(char)values[i];
+    return hash;
+  }
+  string hash=FirstWordOf(exec(("shasum -a 256 "+refFileName).c_str()));
+  if (hash.length()>0) PublishSharedReference("sha256", vector<double>(hash.begin(), hash.end()));
+  else if (referenceStore) referenceStore->Unlock("sha256");
+  return hash;
+}
+
+// The bin contents, errors and number of entries of a histogram, including the under- and overflow
+void AppendHistogram(vector<double> &values, TH1 *h)
+{
+  int nCells=h->GetNcells();
+  values.push_back(nCells);
+  values.push_back(h->GetEntries());
+  for (int i=0;i<nCells;i++) values.push_back(h->GetBinContent(i));
+  for (int i=0;i<nCells;i++) values.push_back(h->GetBinError(i));
+}
+
+// Fill a histogram from AppendHistogram's values, and move past them. False if they are for another binning
+bool ReadHistogram(const double *&values, const double *end, TH1 *h)
+{
+  int nCells=h->GetNcells();
+  if (end-values<2+2*nCells || values[0]!=nCells) return false;
+  h->Reset();
+  for (int i=0;i<nCells;i++)
+  {
+    h->SetBinContent(i, values[2+i]);
+    if (h->GetSumw2N()>0) h->SetBinError(i, values[2+nCells+i]);
+  }
+  h->ResetStats();
+  h->SetEntries(values[1]);
+  values+=2+2*nCells;
+  return true;
+}
+
+// Everything in a filled map, for the shared reference store: the histograms of each
+// wall, then the filled bins of the distribution if there is one, as (cell, value bin, content)
+vector<double> MapState(MapAccumulator &accumulator)
+{
+  vector<double> values;
+  for (int wall=0;wall<accumulator.counts.size();wall++)
+  {
+    AppendHistogram(values, accumulator.counts.at(wall));
+    AppendHistogram(values, accumulator.sums.at(wall));
+    AppendHistogram(values, accumulator.sumsSquared.at(wall));
+  }
+  if (!accumulator.distribution) return values;
+  THnSparseD *distribution=accumulator.distribution;
+  values.push_back(distribution->GetNbins());
+  values.push_back(distribution->GetEntries());
+  int bin[2];
+  for (Long64_t i=0;i<distribution->GetNbins();i++)
+  {
+    double content=distribution->GetBinContent(i, bin);
+    values.push_back(bin[0]);
+    values.push_back(bin[1]);
+    values.push_back(content);
+  }
+  return values;
+}
+
+// Fill a map from MapState's values. False, with the map left empty, if they are for another map
+bool SetMapState(MapAccumulator &accumulator, const double *values, size_t nValues)
+{
+  const double *end=values+nValues;
+  bool ok=true;
+  for (int wall=0;ok && wall<accumulator.counts.size();wall++)
+  {
+    ok=(ReadHistogram(values, end, accumulator.counts.at(wall)) && ReadHistogram(values, end, accumulator.sums.at(wall))
+        && ReadHistogram(values, end, accumulator.sumsSquared.at(wall)));
+  }
+  THnSparseD *distribution=accumulator.distribution;
+  if (ok && distribution)
+  {
+    Long64_t nFilled=(end-values>=2?(Long64_t)values[0]:-1);
+    ok=(nFilled>=0 && end-values==2+3*nFilled);
+    for (Long64_t i=0;ok && i<nFilled;i++)
+    {
+      const double *cell=values+2+3*i;
+      int bin[2]={(int)cell[0],(int)cell[1]};
+      distribution->SetBinContent(distribution->GetBin(bin), cell[2]);
+    }
+    if (ok) distribution->SetEntries(values[1]);
+  }
+  else if (ok) ok=(values==end);
+  if (ok) return true;
+  for (int wall=0;wall<accumulator.counts.size();wall++)
+  {
+    accumulator.counts.at(wall)->Reset();
+    accumulator.sums.at(wall)->Reset();
+    accumulator.sumsSquared.at(wall)->Reset();
+  }
+  if (distribution) distribution->Reset();
+  return false;
+}
+
+void AttachMapReader(TTree *thisTree, MapBranchReader &reader)
+{
+  if (reader.isCalo && !IsPackedCaloBranch(thisTree, reader.name)) thisTree->SetBranchAddress(reader.name.c_str(), &reader.caloHits);
+  else thisTree->SetBranchAddress(reader.name.c_str(), &reader.codes);
+}
+
+// Calorimeter map branches of packed locations are vectors of integers, rather than strings
+bool IsPackedCaloBranch(TTree *thisTree, string branchName)
+{
+  TBranch *branch=thisTree->GetBranch(branchName.c_str());
+  return (branch && string(branch->GetClassName())=="vector<int>");
+}
+
+// Decode this event's hits of a map branch into the cells we plot them in, one per hit
+void DecodeMapBranch(MapBranchReader &reader)
+{
+  vector<CellHit> &cells=reader.cells;
+  if (!reader.isCalo)
+  {
+    // This decodes the encoded tracker map to extract the x and y positions
+    cells.resize(reader.codes->size());
+    for (int i=0;i<reader.codes->size();i++)
+    {
+      cells.at(i).wall=0;
+      cells.at(i).y=TMath::Abs(reader.codes->at(i)/100);
+      cells.at(i).x=reader.codes->at(i)%100;
+    }
+    return;
+  }
+  if (reader.codes)
+  {
+    // Packed calorimeter locations
+    cells.resize(reader.codes->size());
+    for (int i=0;i<reader.codes->size();i++)
+    {
+      CellHit &cell=cells.at(i);
+      if (!DecodeCaloCode(reader.codes->at(i),cell.wall,cell.x,cell.y)) cell.wall=-1;
+    }
+    return;
+  }
+  cells.resize(reader.caloHits->size());
+  for (int i=0;i<reader.caloHits->size();i++)
+  {
+    CellHit &cell=cells.at(i);
+    if (!DecodeCaloHit(reader.caloHits->at(i),cell.wall,cell.x,cell.y)) cell.wall=-1;
+  }
+}
+
+/**
+ *  Decode a calorimeter geometry ID like [1302:0.1.0.10.*] into the wall and the
+ *  cell we draw it in. Returns false if we don't know where to draw it. The ID is
+ *  read where it is, without copying it or any part of it, as this is done for
+ *  every calorimeter hit of every event
+ */
+bool DecodeCaloHit(const string &thisHit, int &whichWall, int &xValue, int &yValue)
+{
+  // This should always work, but there is next to no catching of badly formatted
+  // geom ID strings. Are they a possibility?
+  if (thisHit.length()<9) return false;
+
+  bool isFrance=(thisHit[8]=='1');
+  //Now to decode it
+  const char *wallType = thisHit.c_str()+1;
+  int column=0;
+  int row=0;
+
+  if (strncmp(wallType,"1302",4)==0) // Main walls
+  {
+    // x is the bit between the 2nd and 3rd "." characters, and y the bit after that
+    if (!GeomIdField(thisHit, 2, column) || !GeomIdField(thisHit, 3, row)) return false;
+    return PlaceCaloHit(CALO_MAIN_WALL, isFrance, false, column, row, whichWall, xValue, yValue);
+  }
+  else if (strncmp(wallType,"1232",4)==0) //x walls
+  {
+    bool isTunnel=(thisHit.length()>10 && thisHit[10]=='1');
+    // x is the bit between the 3rd and 4th "." characters, and y the bit after that
+    if (!GeomIdField(thisHit, 3, column) || !GeomIdField(thisHit, 4, row)) return false;
+    return PlaceCaloHit(CALO_X_WALL, isFrance, isTunnel, column, row, whichWall, xValue, yValue);
+  }
+  else if (strncmp(wallType,"1252",4)==0) // veto walls
+  {
+    bool isTop=(thisHit.length()>10 && thisHit[10]=='1');
+    if (!GeomIdField(thisHit, 4, column)) return false;
+    return PlaceCaloHit(CALO_VETO, isFrance, isTop, column, row, whichWall, xValue, yValue);
+  }
+  logger.Log(Logger::LOG_WARNING, "Calo hit found with unknown wall type", "Calo hit found with unknown wall type "+thisHit.substr(1,4));
+  return false; // We can't plot it if we don't know where to plot it
+}
+
+// The number after the given count of "." characters in a geometry ID. False if there isn't one
+bool GeomIdField(const string &geomId, int dots, int &value)
+{
+  size_t pos=0;
+  for (int i=0;i<dots;i++)
+  {
+    pos=geomId.find('.',pos);
+    if (pos==string::npos) return false;
+    pos++;
+  }
+  bool negative=(pos<geomId.length() && geomId[pos]=='-');
+  if (negative) pos++;
+  if (pos>=geomId.length() || !isdigit(geomId[pos])) return false;
+  value=0;
+  for (;pos<geomId.length() && isdigit(geomId[pos]);pos++) value=value*10+(geomId[pos]-'0');
+  if (negative) value=-value;
+  return true;
+}
+
+/**
+ *  Decode a packed calorimeter location (see CALO_TYPE) into the wall and the
+ *  cell we draw it in. Returns false if we don't know where to draw it
+ */
+bool DecodeCaloCode(int code, int &whichWall, int &xValue, int &yValue)
+{
+  if (code<0) return false;
+  int type=code/1000000;
+  bool isFrance=((code/100000)%10==1);
+  bool wallFlag=((code/10000)%10==1);
+  return PlaceCaloHit(type, isFrance, wallFlag, (code/100)%100, code%100, whichWall, xValue, yValue);
+}
+
+/**
+ *  Work out which wall histogram a calorimeter module goes in, and the cell we draw it
+ *  in. wallFlag is true for the tunnel X-wall or the top veto wall. Both encodings of
+ *  the location end up here, so they are always drawn the same way
+ */
+bool PlaceCaloHit(int type, bool isFrance, bool wallFlag, int column, int row, int &whichWall, int &xValue, int &yValue)
+{
+  switch (type)
+  {
+    case CALO_MAIN_WALL:
+      if (isFrance) whichWall = FRANCE; else whichWall = ITALY;
+      xValue=column;
+      yValue=row;
+      // The numbering is from mountain to tunnel
+      // But we draw the Italian side as we see it, with the mountain on the left
+      // So let's flip it around
+      if (!isFrance)xValue = -1 * (xValue + 1);
+      return true;
+    case CALO_X_WALL:
+      if (wallFlag) whichWall=TUNNEL; else whichWall = MOUNTAIN;
+      xValue=column;
+      yValue=row;
+      if (!isFrance)xValue = -1 * (xValue + 1); // Italy is on the left so reverse these to draw them
+      if (wallFlag) // Switch it so France is on the left for the tunnel side
+      {
+        xValue = -1 * (xValue + 1);
+      }
+      return true;
+    case CALO_VETO:
+      if (wallFlag) whichWall = TOP; else whichWall = BOTTOM;
+      yValue=((isFrance^wallFlag)?1:0); // We flip this so that French side is inwards on the print
+      xValue=column;
+      return true;
+    default:
+      logger.Log(Logger::LOG_WARNING, "Calo hit found with unknown wall type", Form("Calo hit found with unknown wall type %d",type));
+      return false; // We can't plot it if we don't know where to plot it
+  }
+}
+
+/**
+ *  The backscatter map is made of the main-wall calorimeter hits that are in the
+ *  same module as the calorimeter hit of an electron track whose vertex is on the
+ *  main wall. A hit is listed again for each electron that matches it
+ */
+void DecodeBackscatter(MapBranchReader &reader, vector<double> *e_vert_x, vector<string> *trackCaloHits)
+{
+  // Decode all the hits, then keep the ones that match. The two buffers are swapped
+  // rather than made again, so they keep their memory from one event to the next
+  DecodeMapBranch(reader);
+  vector<CellHit> &hits=reader.decoded;
+  hits.swap(reader.cells);
+  vector<CellHit> &cells=reader.cells;
+  cells.clear();
+  for (int i=0;i<e_vert_x->size();i++)
+  {
+    if (abs(e_vert_x->at(i)) != 434.994) continue; // Vertex is not on the main wall
+    CellHit vertex;
+    if (i>=trackCaloHits->size() || !DecodeCaloHit(trackCaloHits->at(i),vertex.wall,vertex.x,vertex.y)) continue;
+    if (vertex.wall!=ITALY && vertex.wall!=FRANCE) continue;
+
+    for (int j=0;j<hits.size();j++)
+    {
+      CellHit &cell=hits.at(j);
+      if (cell.wall!=ITALY && cell.wall!=FRANCE) continue;
+      if (cell.x == vertex.x && cell.y == vertex.y) cells.push_back(cell);
+    }
+  }
+}
+
+// Add one event's decoded cells to the histograms of a map branch
+void FillMapAccumulator(MapAccumulator &accumulator, vector<CellHit> &cells, vector<double> *toAverage)
+{
+  // The backscatter cells don't line up with the values of the branch, so that only has counts
+  bool isAverage=(accumulator.isAverage && accumulator.mapBranch != BACKSCATTER_MAP_BRANCH);
+  for (int i=0;i<cells.size();i++)
+  {
+    CellHit &cell=cells.at(i);
+    if (cell.wall<0) continue;
+    TH2D *h=accumulator.counts.at(cell.wall);
+    if (!isAverage)
+    {
+      h->Fill(cell.x,cell.y); // We will take the lot!
+      continue;
+    }
+    if (i>=toAverage->size()) break; // Fewer values than hits: nothing to average for the rest
+    double value=toAverage->at(i);
+    if (!accumulator.isCalo && std::isnan(value)) continue; // Only count tracker hits if there is something to average over
+    accumulator.sums.at(cell.wall)->Fill(cell.x,cell.y,value); // Sum it for now and we will divide out by number of hits
+    accumulator.sumsSquared.at(cell.wall)->Fill(cell.x,cell.y,pow(value,2)); // Sum the squares for variance calculation
+    h->Fill(cell.x,cell.y);
+    if (accumulator.distribution && !std::isnan(value))
+    {
+      int index=CellIndex(accumulator, cell);
+      if (index<0) continue;
+      double point[2]={index+0.5,value};
+      accumulator.distribution->Fill(point);
+    }
+  }
+}
+
+// Number of a cell across all the walls of a map: wall by wall, in the order of the bins
+// of each wall (as in the trends of the slices). -1 if it is outside the map
+int CellIndex(MapAccumulator &accumulator, CellHit &cell)
+{
+  int offset=0;
+  for (int wall=0;wall<cell.wall;wall++) offset+=accumulator.counts.at(wall)->GetNbinsX()*accumulator.counts.at(wall)->GetNbinsY();
+  TH2D *h=accumulator.counts.at(cell.wall);
+  int x=h->GetXaxis()->FindFixBin(cell.x);
+  int y=h->GetYaxis()->FindFixBin(cell.y);
+  if (x<1 || x>h->GetNbinsX() || y<1 || y>h->GetNbinsY()) return -1;
+  return offset+(x-1)*h->GetNbinsY()+(y-1);
+}
+
+// Where a numbered cell is, for reports
+string CellName(MapAccumulator &accumulator, int index)
+{
+  for (int wall=0;wall<accumulator.counts.size();wall++)
+  {
+    TH2D *h=accumulator.counts.at(wall);
+    int nCells=h->GetNbinsX()*h->GetNbinsY();
+    if (index>=nCells)
+    {
+      index-=nCells;
+      continue;
+    }
+    int x=(int)h->GetXaxis()->GetBinLowEdge(index/h->GetNbinsY()+1);
+    int y=(int)h->GetYaxis()->GetBinLowEdge(index%h->GetNbinsY()+1);
+    if (accumulator.isCalo) return Form("%s wall: module (%d,%d)",CALO_WALL[wall].c_str(),x,y);
+    return Form("Tracker layer %d, row %d",x,y);
+  }
+  return "unknown cell";
+}
+
+/**
+ *  Value bins for the distributions of a td_ or cd_ branch. The config line is as
+ *  for a 1D histogram (title, number of bins, low and high limits). Limits that
+ *  aren't given come from the values in the first entries of the sample, as the
+ *  automatic range of a 1D histogram does; values outside them go in the overflow
+ */
+void DistributionBinning(TTree *thisTree, string fullBranchName, int &nBins, double &low, double &high)
+{
+  string config=configParams[fullBranchName];
+  GetBitBeforeComma(config); // The title, which is for the maps
+  nBins=DISTRIBUTION_BINS;
+  bool hasLow=false, hasHigh=false;
+  try
+  {
+    nBins=std::stoi(GetBitBeforeComma(config));
+  }
+  catch (exception &e)
+  {
+    nBins=DISTRIBUTION_BINS;
+  }
+  try
+  {
+    low=std::stod(GetBitBeforeComma(config));
+    hasLow=true;
+  }
+  catch (exception &e)
+  {
+  }
+  try
+  {
+    high=std::stod(GetBitBeforeComma(config));
+    hasHigh=true;
+  }
+  catch (exception &e)
+  {
+  }
+  if (nBins<1) nBins=DISTRIBUTION_BINS;
+  if (hasLow && hasHigh && high>low) return;
+
+  QuantileSketch sketch(SKETCH_COMPRESSION);
+  ReadProfile profile=StartReadPass(thisTree, vector<string>(1,fullBranchName));
+  vector<double> *values=0;
+  thisTree->SetBranchAddress(fullBranchName.c_str(), &values);
+  Long64_t nEntries=SelectedEntries(thisTree);
+  Long64_t nRead=0;
+  for (Long64_t i=0; i<nEntries && nRead<DISTRIBUTION_RANGE_ENTRIES; i++)
+  {
+    Long64_t iEntry=EntryNumber(thisTree, i);
+    if (iEntry % entryStride != 0) continue;
+    thisTree->GetEntry(iEntry);
+    nRead++;
+    for (int j=0;j<values->size();j++)
+    {
+      if (!std::isnan(values->at(j))) sketch.Fill(values->at(j));
+    }
+  }
+  EndReadPass(thisTree, profile, fullBranchName+" range");
+  thisTree->ResetBranchAddresses();
+  delete values;
+
+  if (!hasLow) low=(sketch.GetMin()<0?sketch.Quantile(AUTORANGE_LOW_QUANTILE):0);
+  if (!hasHigh)
+  {
+    high=sketch.Quantile(AUTORANGE_HIGH_QUANTILE);
+    high+=(high-low)/10.;
+  }
+  if (!(high>low)) high=low+1; // Everything has the same value, or there is nothing
+}
+
+// A sparse histogram of cell number against value: only the bins that are filled take memory
+THnSparseD *BookDistribution(MapAccumulator &accumulator, int nBins, double low, double high)
+{
+  int nCells=0;
+  for (int wall=0;wall<accumulator.counts.size();wall++) nCells+=accumulator.counts.at(wall)->GetNbinsX()*accumulator.counts.at(wall)->GetNbinsY();
+  int bins[2]={nCells,nBins};
+  double mins[2]={0,low};
+  double maxes[2]={(double)nCells,high};
+  string name=string(accumulator.isRef?"ref_":"")+"dist_"+accumulator.branchName;
+  THnSparseD *distribution=new THnSparseD(name.c_str(),(BranchNameToEnglish(accumulator.branchName)+";Cell;Value").c_str(),2,bins,mins,maxes);
+  return distribution;
+}
+
+// The binned values of every cell that has any, including the under- and overflow
+void CellDistributions(MapAccumulator &accumulator, map<int,vector<double> > &cells)
+{
+  THnSparseD *distribution=accumulator.distribution;
+  int nBins=distribution->GetAxis(1)->GetNbins();
+  int bin[2];
+  for (Long64_t i=0;i<distribution->GetNbins();i++)
+  {
+    double content=distribution->GetBinContent(i,bin);
+    if (content==0) continue;
+    int cell=bin[0]-1;
+    if (!cells.count(cell)) cells[cell]=vector<double>(nBins+2,0);
+    cells[cell].at(bin[1])+=content;
+  }
+}
+
+// Quantile of a binned distribution, interpolating within the bin it falls in
+double BinnedQuantile(vector<double> &contents, TAxis *axis, double q)
+{
+  double total=0;
+  for (int i=0;i<contents.size();i++) total+=contents.at(i);
+  double target=q*total;
+  double below=0;
+  for (int i=0;i<contents.size();i++)
+  {
+    if (below+contents.at(i)>=target && contents.at(i)>0)
+    {
+      if (i==0) return axis->GetXmin(); // In the underflow
+      if (i==contents.size()-1) return axis->GetXmax(); // In the overflow
+      double fraction=(target-below)/contents.at(i);
+      return axis->GetBinLowEdge(i)+fraction*(axis->GetBinUpEdge(i)-axis->GetBinLowEdge(i));
+    }
+    below+=contents.at(i);
+  }
+  return axis->GetXmax();
+}
+
+// Maps of the median and interquartile range of each cell, for the output file
+void WriteCellQuantiles(MapAccumulator &accumulator, map<int,vector<double> > &cells)
+{
+  TAxis *axis=accumulator.distribution->GetAxis(1);
+  int offset=0;
+  for (int wall=0;wall<accumulator.counts.size();wall++)
+  {
+    TH2D *counts=accumulator.counts.at(wall);
+    TH2D *median=(TH2D*)counts->Clone(Form("median_%s",counts->GetName()));
+    TH2D *iqr=(TH2D*)counts->Clone(Form("iqr_%s",counts->GetName()));
+    median->Reset();
+    iqr->Reset();
+    for (int x=1;x<=counts->GetNbinsX();x++)
+    {
+      for (int y=1;y<=counts->GetNbinsY();y++)
+      {
+        int cell=offset+(x-1)*counts->GetNbinsY()+(y-1);
+        if (!cells.count(cell)) continue;
+        median->SetBinContent(x,y,BinnedQuantile(cells[cell],axis,0.5));
+        iqr->SetBinContent(x,y,BinnedQuantile(cells[cell],axis,0.75)-BinnedQuantile(cells[cell],axis,0.25));
+      }
+    }
+    histogramWriter.Add(median,"distributions");
+    histogramWriter.Add(iqr,"distributions");
+    delete median;
+    delete iqr;
+    offset+=counts->GetNbinsX()*counts->GetNbinsY();
+  }
+}
+
+/**
+ *  Write the per-cell distributions of a td_ or cd_ branch, with maps of their medians
+ *  and interquartile ranges, and test the shape of each cell's distribution against
+ *  the reference. A mean can hide a cell whose spectrum has changed shape (a second
+ *  peak, say), so this compares the binned distributions with a chi-square test of
+ *  whether they have the same shape, whatever the number of values in each. Cells
+ *  that fail, allowing for the number of cells tested, are reported
+ */
+void CompareDistributions(MapAccumulator &sample, MapAccumulator *ref, string title)
+{
+  if (!sample.distribution) return;
+  map<int,vector<double> > sampleCells;
+  CellDistributions(sample, sampleCells);
+  WriteCellQuantiles(sample, sampleCells);
+  histogramWriter.Add(sample.distribution,"distributions");
+  cout<<Form("Distributions of %s: %lld filled bins in %d cells (%.1f%% of the bins)",title.c_str(),sample.distribution->GetNbins(),(int)sampleCells.size(),100*sample.distribution->GetSparseFractionBins())<<endl;
+  if (!ref || !ref->distribution) return;
+  map<int,vector<double> > refCells;
+  CellDistributions(*ref, refCells);
+  WriteCellQuantiles(*ref, refCells);
+  histogramWriter.Add(ref->distribution,"distributions");
+
+  // Shape p-value of each cell, as a map
+  vector<TH2D*> shapes;
+  for (int wall=0;wall<sample.counts.size();wall++)
+  {
+    TH2D *shape=(TH2D*)sample.counts.at(wall)->Clone(Form("shape_%s",sample.counts.at(wall)->GetName()));
+    shape->Reset();
+    shape->SetTitle(("Shape p-value: "+title).c_str());
+    shapes.push_back(shape);
+  }
+
+  int nTested=0;
+  int nUnderThreshold=0;
+  vector<pair<double,int> > pValues;
+  TAxis *axis=sample.distribution->GetAxis(1);
+  for (map<int,vector<double> >::iterator it=sampleCells.begin(); it!=sampleCells.end(); it++)
+  {
+    if (!refCells.count(it->first)) continue;
+    vector<double> &n1=it->second;
+    vector<double> &n2=refCells[it->first];
+    double total1=0, total2=0;
+    for (int i=0;i<n1.size();i++)
+    {
+      total1+=n1.at(i);
+      total2+=n2.at(i);
+    }
+    // Two distributions with different numbers of entries (Numerical Recipes, chstwo)
+    double chisq=0;
+    int ndf=-1;
+    for (int i=0;i<n1.size();i++)
+    {
+      if (n1.at(i)+n2.at(i)==0) continue;
+      chisq+=pow(sqrt(total2/total1)*n1.at(i)-sqrt(total1/total2)*n2.at(i),2)/(n1.at(i)+n2.at(i));
+      ndf++;
+    }
+    if (ndf<1) continue;
+    double pValue=TMath::Prob(chisq,ndf);
+    nTested++;
+    if (pValue<PVALUE_THRESHOLD) nUnderThreshold++;
+    pValues.push_back(make_pair(pValue,it->first));
+
+    int cell=it->first;
+    for (int wall=0;wall<shapes.size();wall++)
+    {
+      int nCells=shapes.at(wall)->GetNbinsX()*shapes.at(wall)->GetNbinsY();
+      if (cell>=nCells)
+      {
+        cell-=nCells;
+        continue;
+      }
+      shapes.at(wall)->SetBinContent(cell/shapes.at(wall)->GetNbinsY()+1,cell%shapes.at(wall)->GetNbinsY()+1,pValue);
+      break;
+    }
+  }
+  for (int wall=0;wall<shapes.size();wall++)
+  {
+    histogramWriter.Add(shapes.at(wall),"distributions");
+    delete shapes.at(wall);
+  }
+
+  string summary=Form("Shapes of %d cells tested against the reference: %d with a p-value under %g (%.1f expected by chance)",nTested,nUnderThreshold,PVALUE_THRESHOLD,nTested*PVALUE_THRESHOLD);
+  cout<<summary<<endl;
+  textOut<<summary<<endl;
+  sort(pValues.begin(),pValues.end());
+  for (int i=0;i<pValues.size() && pValues.at(i).first<PVALUE_THRESHOLD/nTested;i++)
+  {
+    int cell=pValues.at(i).second;
+    string report=CellName(sample, cell)+Form(": shape p-value %.2g, median %.3g (reference %.3g)",pValues.at(i).first,BinnedQuantile(sampleCells[cell],axis,0.5),BinnedQuantile(refCells[cell],axis,0.5));
+    cout<<report<<endl;
+    textOut<<report<<endl;
+  }
+}
+
+// The h_ branches in the list that hold a single number per entry, for their covariance
+vector<string> ScalarBranches(TTree *thisTree, vector<string> branchNames)
+{
+  vector<string> scalars;
+  for (int i=0;i<branchNames.size();i++)
+  {
+    string branchName=branchNames.at(i);
+    if (branchName.length()<2 || branchName.substr(0,2)!="h_") continue;
+    TBranch *branch=thisTree->GetBranch(branchName.c_str());
+    // Vectors and objects are branches of a class, simple types are not
+    if (!branch || string(branch->GetClassName()).length()>0 || branch->GetNleaves()!=1) continue;
+    TLeaf *leaf=thisTree->GetLeaf(branchName.c_str());
+    if (!leaf || leaf->GetLen()!=1) continue;
+    scalars.push_back(branchName);
+  }
+  return scalars;
+}
+
+// The covariance and correlation matrices as 2D histograms, with a bin for each pair of branches
+void WriteCovarianceMatrices(CovarianceMatrix *matrix, vector<string> &branches, string label)
+{
+  int n=branches.size();
+  TH2D *covariances=new TH2D(("covariance_"+label).c_str(),("Covariance of the scalar branches: "+label).c_str(),n,0,n,n,0,n);
+  TH2D *correlations=new TH2D(("correlation_"+label).c_str(),("Correlation of the scalar branches: "+label).c_str(),n,0,n,n,0,n);
+  for (int i=0;i<n;i++)
+  {
+    covariances->GetXaxis()->SetBinLabel(i+1,branches.at(i).c_str());
+    covariances->GetYaxis()->SetBinLabel(i+1,branches.at(i).c_str());
+    correlations->GetXaxis()->SetBinLabel(i+1,branches.at(i).c_str());
+    correlations->GetYaxis()->SetBinLabel(i+1,branches.at(i).c_str());
+    for (int j=0;j<n;j++)
+    {
+      covariances->SetBinContent(i+1,j+1,matrix->Covariance(i,j));
+      correlations->SetBinContent(i+1,j+1,matrix->Correlation(i,j));
+    }
+  }
+  histogramWriter.Add(covariances,"correlations");
+  histogramWriter.Add(correlations,"correlations");
+  delete covariances;
+  delete correlations;
+}
+
+/**
+ *  Write the covariance and correlation matrices of the scalar h_ branches, and list
+ *  the correlations that changed most from the reference. A change in how two
+ *  quantities go together can leave each of their distributions as it was. The
+ *  significance of each change comes from Fisher's z transformation of the two
+ *  correlation coefficients, which is close to Gaussian whatever their values
+ */
+void CompareCovariances()
+{
+  if (!sampleCovariance || sampleCovariance->GetEntries()<2) return;
+  WriteCovarianceMatrices(sampleCovariance, covarianceBranches, "sample");
+  string summary=Form("Covariance of %d scalar branches from %.0f sample entries",(int)covarianceBranches.size(),sampleCovariance->GetEntries());
+  if (sampleCovariance->GetSkipped()>0) summary+=Form(" (%lld left out with a NaN or infinite value)",sampleCovariance->GetSkipped());
+  if (!hasValidReference || !refCovariance || refCovariance->GetEntries()<4 || sampleCovariance->GetEntries()<4)
+  {
+    cout<<summary<<endl;
+    histogramWriter.Flush();
+    return;
+  }
+  WriteCovarianceMatrices(refCovariance, refCovarianceBranches, "reference");
+  summary+=Form(" and %.0f reference entries",refCovariance->GetEntries());
+  if (refCovariance->GetSkipped()>0) summary+=Form(" (%lld left out)",refCovariance->GetSkipped());
+
+  // The change in each correlation, over the branches in both trees
+  map<string,int> refIndex;
+  for (int i=0;i<refCovarianceBranches.size();i++) refIndex[refCovarianceBranches.at(i)]=i;
+  int n=covarianceBranches.size();
+  TH2D *changes=new TH2D("correlation_change","Change in correlation from the reference",n,0,n,n,0,n);
+  double zScale=sqrt(1./(sampleCovariance->GetEntries()-3)+1./(refCovariance->GetEntries()-3));
+  vector<pair<double,string> > reports;
+  int nTested=0;
+  int nUnderThreshold=0;
+  for (int i=0;i<n;i++)
+  {
+    changes->GetXaxis()->SetBinLabel(i+1,covarianceBranches.at(i).c_str());
+    changes->GetYaxis()->SetBinLabel(i+1,covarianceBranches.at(i).c_str());
+    if (!refIndex.count(covarianceBranches.at(i))) continue;
+    for (int j=i+1;j<n;j++)
+    {
+      if (!refIndex.count(covarianceBranches.at(j))) continue;
+      double rho=sampleCovariance->Correlation(i,j);
+      double refRho=refCovariance->Correlation(refIndex[covarianceBranches.at(i)],refIndex[covarianceBranches.at(j)]);
+      if (std::isnan(rho) || std::isnan(refRho)) continue;
+      double change=rho-refRho;
+      changes->SetBinContent(i+1,j+1,change);
+      changes->SetBinContent(j+1,i+1,change);
+      // atanh is infinite for a perfect correlation; keep it finite
+      double z=(atanh(TMath::Max(-0.999999,TMath::Min(0.999999,rho)))-atanh(TMath::Max(-0.999999,TMath::Min(0.999999,refRho))))/zScale;
+      double pValue=TMath::Erfc(fabs(z)/sqrt(2.));
+      nTested++;
+      if (pValue<PVALUE_THRESHOLD) nUnderThreshold++;
+      reports.push_back(make_pair(-fabs(change),covarianceBranches.at(i)+" and "+covarianceBranches.at(j)+Form(": correlation %.3f (reference %.3f), change %+.3f, p-value %.2g",rho,refRho,change,pValue)));
+    }
+  }
+  histogramWriter.Add(changes,"correlations");
+  delete changes;
+  histogramWriter.Flush();
+
+  cout<<summary<<endl;
+  textOut<<summary<<endl;
+  string tested=Form("Correlations of %d pairs compared with the reference: %d with a p-value under %g (%.1f expected by chance)",nTested,nUnderThreshold,PVALUE_THRESHOLD,nTested*PVALUE_THRESHOLD);
+  cout<<tested<<endl;
+  textOut<<tested<<endl;
+  sort(reports.begin(),reports.end());
+  for (int i=0;i<reports.size() && i<CORRELATION_REPORT;i++)
+  {
+    cout<<reports.at(i).second<<endl;
+    textOut<<reports.at(i).second<<endl;
+  }
+  textOut<<endl;
+}
+
+// The title of a map from the config file, or made from the branch name if there isn't one
+string MapTitle(string configName, string branchName)
+{
+  string config=configParams[configName];
+  string title="";
+  if (config.length()>0)
+  {
+    // title is the only thing for this one
+    title=GetBitBeforeComma(config);
+  }
+  if (title.length()==0)
+  {
+    title = BranchNameToEnglish(branchName);
+  }
+  return title;
+}
+
+/**
+ *  Read the --slice option: a key branch (or expression) on its own for one slice
+ *  per value, as for run numbers; key:width for windows of that width (from 0);
+ *  or key:edge,edge,... for windows between the given edges
+ */
+bool ParseSliceSpec(string spec)
+{
+  string::size_type pos=spec.find(':');
+  sliceKey=boost::trim_copy(spec.substr(0,pos));
+  sliceEdges.clear();
+  sliceWidth=0;
+  if (sliceKey.length()==0) return false;
+  if (pos==string::npos) return true;
+
+  string edges=spec.substr(pos+1);
+  vector<double> values;
+  while (edges.length()>0)
+  {
+    try
+    {
+      values.push_back(std::stod(GetBitBeforeComma(edges)));
+    }
+    catch (exception &e)
+    {
+      return false;
+    }
+  }
+  if (values.size()==1)
+  {
+    sliceWidth=values.at(0);
+    return (sliceWidth>0);
+  }
+  for (int i=1;i<values.size();i++)
+  {
+    if (!(values.at(i)>values.at(i-1))) return false; // Edges must go up
+  }
+  sliceEdges=values;
+  return (sliceEdges.size()>1);
+}
+
+// Which slice a value of the key is in. False if it is outside all the windows
+bool SliceKeyOf(double value, Long64_t &key)
+{
+  if (std::isnan(value)) return false;
+  if (sliceWidth>0)
+  {
+    key=(Long64_t)floor(value/sliceWidth);
+    return true;
+  }
+  if (sliceEdges.size()>1)
+  {
+    if (value<sliceEdges.front() || value>=sliceEdges.back()) return false;
+    key=upper_bound(sliceEdges.begin(),sliceEdges.end(),value)-sliceEdges.begin()-1;
+    return true;
+  }
+  key=llround(value);
+  return true;
+}
+
+string SliceLabel(Long64_t key)
+{
+  if (sliceWidth>0) return Form("%g-%g",key*sliceWidth,(key+1)*sliceWidth);
+  if (sliceEdges.size()>1) return Form("%g-%g",sliceEdges.at(key),sliceEdges.at(key+1));
+  return Form("%lld",key);
+}
+
+/**
+ *  One more pass over the sample, split into slices by run or time window, to check
+ *  stability. Every map and 1D histogram gets its own copy for each slice, booked
+ *  when the first entry of that slice turns up, so empty slices take no memory.
+ *  Each map branch is decoded once per event for all the maps that use it, as in
+ *  the main pass. The 1D slices use the binning of the full-sample histogram
+ */
+void FillSlices(vector<string> branchNames)
+{
+  TTreeFormula keyFormula("slice_key", sliceKey.c_str(), tree);
+  if (keyFormula.GetNdim()==0)
+  {
+    cout<<"ERROR: could not understand the slice key "<<sliceKey<<". No slices will be made"<<endl;
+    return;
+  }
+  vector<string> activeBranches;
+  AddFormulaBranches(keyFormula, activeBranches);
+
+  // The maps to slice, with the readers for the branches that give their cells. The
+  // accumulators here have no histograms: they just say what to book for each slice
+  vector<MapAccumulator> mapSpecs;
+  vector<int> whichReader;
+  map<string,int> readerIndex;
+  vector<MapBranchReader> readers;
+  bool needBackscatter=false;
+  for (int i=0;i<branchNames.size();i++)
+  {
+    string fullBranchName=branchNames.at(i);
+    string branchName, mapBranch;
+    bool isCalo, isAverage;
+    if (!MapBranchParts(fullBranchName, branchName, mapBranch, isCalo, isAverage)) continue;
+    if (!tree->GetBranch(mapBranch.c_str())) continue;
+    MapAccumulator spec={fullBranchName,branchName,mapBranch,false,isAverage,isCalo};
+    mapSpecs.push_back(spec);
+    if (!readerIndex.count(mapBranch))
+    {
+      readerIndex[mapBranch]=readers.size();
+      MapBranchReader reader={mapBranch,isCalo,0,0};
+      readers.push_back(reader);
+      activeBranches.push_back(mapBranch);
+      if (mapBranch==BACKSCATTER_MAP_BRANCH) needBackscatter=true;
+    }
+    whichReader.push_back(readerIndex[mapBranch]);
+    if (isAverage) activeBranches.push_back(fullBranchName);
+  }
+  if (needBackscatter)
+  {
+    activeBranches.push_back("reco.electron_vertex_x");
+    activeBranches.push_back("reco.track_calo_hits");
+  }
+
+  // The 1D branches that were plotted, read as tree->Draw reads them
+  vector<string> histBranches;
+  vector<TTreeFormula*> formulas;
+  for (map<string,TH1D*>::iterator it=sliceTemplates.begin(); it!=sliceTemplates.end(); it++)
+  {
+    TTreeFormula *formula=new TTreeFormula(("slice_"+it->first).c_str(), it->first.c_str(), tree);
+    if (formula->GetNdim()==0)
+    {
+      delete formula;
+      continue;
+    }
+    histBranches.push_back(it->first);
+    formulas.push_back(formula);
+    AddFormulaBranches(*formula, activeBranches);
+  }
+
+  ReadProfile profile=StartReadPass(tree, activeBranches);
+  for (int i=0;i<readers.size();i++) AttachMapReader(tree, readers.at(i));
+  vector<std::vector<double>*> toAverage(mapSpecs.size(),(std::vector<double>*)0);
+  for (int i=0;i<mapSpecs.size();i++)
+  {
+    if (mapSpecs.at(i).isAverage) tree->SetBranchAddress(mapSpecs.at(i).fullBranchName.c_str(), &toAverage.at(i));
+  }
+  std::vector<double> *e_vert_x = 0;
+  std::vector<string> *trackCaloHits = 0;
+  if (needBackscatter)
+  {
+    tree->SetBranchAddress("reco.electron_vertex_x", &e_vert_x);
+    tree->SetBranchAddress("reco.track_calo_hits", &trackCaloHits);
+  }
+
+  map<Long64_t,SliceAccumulator> slices;
+  Long64_t nEntries = SelectedEntries(tree);
+  for (Long64_t i = 0; i < nEntries; i++)
+  {
+    Long64_t iEntry = EntryNumber(tree, i);
+    if (iEntry % entryStride != 0) continue;
+    tree->LoadTree(iEntry);
+    Long64_t key;
+    if (keyFormula.GetNdata()==0 || !SliceKeyOf(keyFormula.EvalInstance(0), key)) continue;
+    map<Long64_t,SliceAccumulator>::iterator slice=slices.find(key);
+    if (slice==slices.end()) slice=slices.insert(make_pair(key,BookSlice(key, mapSpecs, histBranches))).first;
+    SliceAccumulator &accumulator=slice->second;
+    accumulator.entries++;
+
+    tree->GetEntry(iEntry);
+    for (int j=0;j<readers.size();j++)
+    {
+      if (readers.at(j).name==BACKSCATTER_MAP_BRANCH) DecodeBackscatter(readers.at(j), e_vert_x, trackCaloHits);
+      else DecodeMapBranch(readers.at(j));
+    }
+    for (int j=0;j<mapSpecs.size();j++)
+    {
+      FillMapAccumulator(accumulator.maps.at(j), readers.at(whichReader.at(j)).cells, toAverage.at(j));
+    }
+    for (int j=0;j<formulas.size();j++)
+    {
+      int nValues=formulas.at(j)->GetNdata();
+      for (int k=0;k<nValues;k++)
+      {
+        double value=formulas.at(j)->EvalInstance(k);
+        accumulator.histograms.at(j)->Fill(value);
+        SliceMoments &moments=accumulator.moments.at(j);
+        moments.n++;
+        moments.sum+=value;
+        moments.sumSquared+=value*value;
+      }
+    }
+  }
+  EndReadPass(tree, profile, Form("%d slices of %d maps and %d histograms",(int)slices.size(),(int)mapSpecs.size(),(int)histBranches.size()));
+
+  // ROOT allocated these when it read the branches
+  for (int i=0;i<readers.size();i++)
+  {
+    delete readers.at(i).codes;
+    delete readers.at(i).caloHits;
+  }
+  for (int i=0;i<toAverage.size();i++) delete toAverage.at(i);
+  delete e_vert_x;
+  delete trackCaloHits;
+  tree->ResetBranchAddresses();
+  for (int i=0;i<formulas.size();i++) delete formulas.at(i);
+
+  WriteSlices(slices, mapSpecs, histBranches);
+}
+
+// The maps and histograms for a slice that has just turned up
+SliceAccumulator BookSlice(Long64_t key, vector<MapAccumulator> &mapSpecs, vector<string> &histBranches)
+{
+  SliceAccumulator slice;
+  slice.label=SliceLabel(key);
+  string tag=Form("_slice%lld",key);
+  for (int i=0;i<mapSpecs.size();i++)
+  {
+    MapAccumulator &spec=mapSpecs.at(i);
+    if (spec.isCalo) slice.maps.push_back(BookCaloPlotSet(spec.fullBranchName, spec.branchName+tag, false, spec.isAverage, spec.mapBranch));
+    else slice.maps.push_back(BookTrackerMap(spec.fullBranchName, spec.branchName+tag, MapTitle(spec.fullBranchName,spec.branchName)+" ("+sliceKey+" "+slice.label+")", false, spec.isAverage, spec.mapBranch));
+  }
+  for (int i=0;i<histBranches.size();i++)
+  {
+    TH1D *h=(TH1D*)sliceTemplates[histBranches.at(i)]->Clone(("plt_"+histBranches.at(i)+tag).c_str());
+    h->SetDirectory(0);
+    h->SetTitle((string(h->GetTitle())+" ("+sliceKey+" "+slice.label+")").c_str());
+    slice.histograms.push_back(h);
+  }
+  slice.moments.resize(histBranches.size());
+  return slice;
+}
+
+/**
+ *  Write each slice's maps and histograms to the slices/ directory, and a trend
+ *  of every branch to trends/: for a map, a 2D histogram of the value of each cell
+ *  (x, numbered wall by wall) in each slice (y); for a 1D branch, its mean in each
+ *  slice. Counts are per entry of the slice, so that slices of different sizes can
+ *  be compared. Each cell is tested for being constant over the slices, and the
+ *  least stable cell of each branch is reported
+ */
+void WriteSlices(map<Long64_t,SliceAccumulator> &slices, vector<MapAccumulator> &mapSpecs, vector<string> &histBranches)
+{
+  int nSlices=slices.size();
+  if (nSlices==0)
+  {
+    cout<<"WARNING: no entries have a value of "<<sliceKey<<" to slice by"<<endl;
+    return;
+  }
+  cout<<"Sliced the sample by "<<sliceKey<<" into "<<nSlices<<" slices"<<endl;
+  if (textOut.is_open()) textOut<<endl<<"Stability over "<<nSlices<<" slices of "<<sliceKey<<":"<<endl;
+
+  for (int i=0;i<mapSpecs.size();i++)
+  {
+    MapAccumulator &spec=mapSpecs.at(i);
+    // The backscatter cells only have counts, as when they are filled
+    bool isAverage=(spec.isAverage && spec.mapBranch != BACKSCATTER_MAP_BRANCH);
+    MapAccumulator &first=slices.begin()->second.maps.at(i);
+    int nCells=0;
+    for (int wall=0;wall<first.counts.size();wall++) nCells+=first.counts.at(wall)->GetNbinsX()*first.counts.at(wall)->GetNbinsY();
+
+    TH2D *trend=new TH2D(("trend_"+spec.fullBranchName).c_str(),MapTitle(spec.fullBranchName,spec.branchName).c_str(),nCells,0,nCells,nSlices,0,nSlices);
+    trend->SetDirectory(0);
+    trend->GetXaxis()->SetTitle("Cell");
+    trend->GetYaxis()->SetTitle(sliceKey.c_str());
+    vector<vector<double> > values(nCells), errors(nCells);
+    int iSlice=0;
+    for (map<Long64_t,SliceAccumulator>::iterator it=slices.begin(); it!=slices.end(); it++, iSlice++)
+    {
+      MapAccumulator &accumulator=it->second.maps.at(i);
+      double entries=it->second.entries;
+      trend->GetYaxis()->SetBinLabel(iSlice+1,it->second.label.c_str());
+      int cell=0;
+      for (int wall=0;wall<accumulator.counts.size();wall++)
+      {
+        TH2D *counts=accumulator.counts.at(wall);
+        TH2D *plotted=counts;
+        if (isAverage)
+        {
+          AverageWithError(counts, accumulator.sums.at(wall), accumulator.sumsSquared.at(wall));
+          plotted=accumulator.sums.at(wall);
+        }
+        for (int x=1;x<=counts->GetNbinsX();x++)
+        {
+          for (int y=1;y<=counts->GetNbinsY();y++, cell++)
+          {
+            double nHits=counts->GetBinContent(x,y);
+            double value, error;
+            if (isAverage)
+            {
+              if (nHits<=1) continue; // No error on the mean to compare with
+              value=plotted->GetBinContent(x,y);
+              error=plotted->GetBinError(x,y);
+            }
+            else
+            {
+              // An empty cell gets the error of one count, as in the comparisons
+              value=nHits/entries;
+              error=sqrt(max(nHits,1.))/entries;
+            }
+            trend->SetBinContent(cell+1,iSlice+1,value);
+            trend->SetBinError(cell+1,iSlice+1,error);
+            values.at(cell).push_back(value);
+            errors.at(cell).push_back(error);
+          }
+        }
+        histogramWriter.Add(plotted,"slices");
+      }
+      for (int wall=0;wall<accumulator.counts.size();wall++)
+      {
+        delete accumulator.counts.at(wall);
+        delete accumulator.sums.at(wall);
+        delete accumulator.sumsSquared.at(wall);
+      }
+    }
+    histogramWriter.Add(trend,"trends");
+    delete trend;
+
+    // The cell that changes the most from slice to slice
+    double worstPValue=2, worstChisq=0;
+    int worstCell=-1, worstNdf=0;
+    for (int cell=0;cell<nCells;cell++)
+    {
+      int ndf;
+      double chisq=ConstancyChiSquared(values.at(cell),errors.at(cell),ndf);
+      if (ndf<1) continue;
+      double pValue=TMath::Prob(chisq,ndf);
+      if (pValue<worstPValue)
+      {
+        worstPValue=pValue;
+        worstChisq=chisq;
+        worstCell=cell;
+        worstNdf=ndf;
+      }
+    }
+    string result=(worstCell<0?"nothing to compare":Form("least stable cell %d, chi-square %.2f for %d degrees of freedom (p-value %g)",worstCell,worstChisq,worstNdf,worstPValue));
+    cout<<"Stability of "<<spec.fullBranchName<<": "<<result<<endl;
+    if (textOut.is_open()) textOut<<spec.fullBranchName<<": "<<result<<endl;
+  }
+
+  for (int i=0;i<histBranches.size();i++)
+  {
+    TH1D *trend=new TH1D(("trend_"+histBranches.at(i)).c_str(),sliceTemplates[histBranches.at(i)]->GetTitle(),nSlices,0,nSlices);
+    trend->SetDirectory(0);
+    trend->GetXaxis()->SetTitle(sliceKey.c_str());
+    trend->GetYaxis()->SetTitle("Mean");
+    vector<double> values, errors;
+    int iSlice=0;
+    for (map<Long64_t,SliceAccumulator>::iterator it=slices.begin(); it!=slices.end(); it++, iSlice++)
+    {
+      SliceMoments &moments=it->second.moments.at(i);
+      trend->GetXaxis()->SetBinLabel(iSlice+1,it->second.label.c_str());
+      if (moments.n>1)
+      {
+        double mean=moments.sum/moments.n;
+        double variance=(moments.sumSquared/moments.n-mean*mean)*moments.n/(moments.n-1);
+        double error=sqrt(max(variance,0.)/moments.n);
+        trend->SetBinContent(iSlice+1,mean);
+        trend->SetBinError(iSlice+1,error);
+        values.push_back(mean);
+        errors.push_back(error);
+      }
+      histogramWriter.Add(it->second.histograms.at(i),"slices");
+      delete it->second.histograms.at(i);
+    }
+    histogramWriter.Add(trend,"trends");
+    delete trend;
+
+    int ndf;
+    double chisq=ConstancyChiSquared(values,errors,ndf);
+    string result=(ndf<1?"nothing to compare":Form("chi-square of the means %.2f for %d degrees of freedom (p-value %g)",chisq,ndf,TMath::Prob(chisq,ndf)));
+    cout<<"Stability of "<<histBranches.at(i)<<": "<<result<<endl;
+    if (textOut.is_open()) textOut<<histBranches.at(i)<<": "<<result<<endl;
+  }
+  histogramWriter.Flush();
+}
+
+// Chi-square of a set of measurements against their weighted mean. Those with no error are left out
+double ConstancyChiSquared(vector<double> &values, vector<double> &errors, int &ndf)
+{
+  double sumWeights=0, sumWeighted=0;
+  int n=0;
+  for (int i=0;i<values.size();i++)
+  {
+    if (!(errors.at(i)>0) || std::isnan(values.at(i))) continue;
+    double weight=1/(errors.at(i)*errors.at(i));
+    sumWeights+=weight;
+    sumWeighted+=weight*values.at(i);
+    n++;
+  }
+  ndf=n-1;
+  if (n<2) return 0;
+  double mean=sumWeighted/sumWeights;
+  double chisq=0;
+  for (int i=0;i<values.size();i++)
+  {
+    if (!(errors.at(i)>0) || std::isnan(values.at(i))) continue;
+    chisq+=pow((values.at(i)-mean)/errors.at(i),2);
+  }
+  return chisq;
+}
+
+// Read the --match option: the run number branch and the event number branch, separated by a comma
+bool ParseMatchSpec(string spec)
+{
+  matchRunBranch=boost::trim_copy(GetBitBeforeComma(spec));
+  matchEventBranch=boost::trim_copy(spec);
+  return (matchRunBranch.length()>0 && matchEventBranch.length()>0 && matchEventBranch.find(',')==string::npos);
+}
+
+/**
+ *  Event-by-event comparison with a reference made from the same events (--match),
+ *  such as the same raw data reconstructed with an older release. The reference
+ *  entries are indexed by their run and event numbers, then the sample is read in
+ *  order, and each of its events is compared with the reference entry that has the
+ *  same numbers: the value of every scalar h_ branch, and the decoded cells of every
+ *  map branch. If an index of the whole reference would take more than MATCH_INDEX_MB,
+ *  the events are split into parts by their hash, and matched a part at a time; each
+ *  part reads the run and event numbers of the reference again, and the sample again.
+ *  The reference is read in the order of the sample, so this is quickest when the two
+ *  trees have their events in much the same order
+ */
+void MatchEvents(vector<string> branchNames)
+{
+  TLeaf *runLeaf=tree->GetLeaf(matchRunBranch.c_str());
+  TLeaf *eventLeaf=tree->GetLeaf(matchEventBranch.c_str());
+  TLeaf *refRunLeaf=reftree->GetLeaf(matchRunBranch.c_str());
+  TLeaf *refEventLeaf=reftree->GetLeaf(matchEventBranch.c_str());
+  if (!runLeaf || !eventLeaf || !refRunLeaf || !refEventLeaf)
+  {
+    cout<<"ERROR: the sample and the reference both need "<<matchRunBranch<<" and "<<matchEventBranch<<" branches to match events. No events will be matched"<<endl;
+    return;
+  }
+  vector<string> keyBranches;
+  keyBranches.push_back(runLeaf->GetBranch()->GetName());
+  keyBranches.push_back(eventLeaf->GetBranch()->GetName());
+  vector<string> refKeyBranches;
+  refKeyBranches.push_back(refRunLeaf->GetBranch()->GetName());
+  refKeyBranches.push_back(refEventLeaf->GetBranch()->GetName());
+
+  // What to compare: the scalar h_ branches and the map branches that both trees have
+  vector<MatchedBranch> scalars;
+  vector<string> scalarNames=ScalarBranches(reftree, ScalarBranches(tree, branchNames));
+  for (int i=0;i<scalarNames.size();i++)
+  {
+    MatchedBranch scalar;
+    scalar.name=scalarNames.at(i);
+    scalars.push_back(scalar);
+  }
+  vector<MatchedMap> maps;
+  set<string> mapBranches;
+  for (int i=0;i<branchNames.size();i++)
+  {
+    string branchName, mapBranch;
+    bool isCalo, isAverage;
+    if (!MapBranchParts(branchNames.at(i), branchName, mapBranch, isCalo, isAverage)) continue;
+    // Backscattering is worked out from other branches, whose changes are shown themselves
+    if (mapBranch==BACKSCATTER_MAP_BRANCH || mapBranches.count(mapBranch)) continue;
+    if (!tree->GetBranch(mapBranch.c_str()) || !reftree->GetBranch(mapBranch.c_str())) continue;
+    mapBranches.insert(mapBranch);
+    MatchedMap matched;
+    MapBranchReader reader={mapBranch,isCalo,0,0};
+    matched.reader=reader;
+    matched.refReader=reader;
+    matched.cellsChanged=new TH1D(("cellsdiff_"+mapBranch).c_str(),(BranchNameToEnglish(mapBranch)+": cells that differ from the reference event").c_str(),MATCH_CELL_BINS,0,MATCH_CELL_BINS);
+    matched.cellsChanged->SetDirectory(0);
+    matched.cellsChanged->GetXaxis()->SetTitle("Cells in only one of the events");
+    maps.push_back(matched);
+  }
+  vector<string> activeBranches=scalarNames;
+  activeBranches.insert(activeBranches.end(), mapBranches.begin(), mapBranches.end());
+  vector<string> sampleBranches=activeBranches;
+  sampleBranches.insert(sampleBranches.end(), keyBranches.begin(), keyBranches.end());
+  vector<string> refBranches=activeBranches;
+  refBranches.insert(refBranches.end(), refKeyBranches.begin(), refKeyBranches.end());
+
+  Long64_t nRefEntries=SelectedEntries(reftree);
+  int nParts=EventIndex::PartitionsFor(nRefEntries, MATCH_INDEX_MB*1024*1024);
+  cout<<"Matching sample events with the reference by "<<matchRunBranch<<" and "<<matchEventBranch;
+  if (nParts>1) cout<<", in "<<nParts<<" parts to keep the index under "<<MATCH_INDEX_MB<<" MB";
+  cout<<endl;
+
+  Long64_t nSampleEntries=0, nMatched=0, nIndexed=0, nDuplicates=0, nCollisions=0, nMismatched=0, nChanged=0;
+  vector<ChangedEvent> mostChanged; // A heap, with the least changed of them on top
+  vector<double> values(scalars.size()), refValues(scalars.size());
+  vector<int> changedScalars, changedMaps, cellsDiffer(maps.size());
+  for (int part=0;part<nParts;part++)
+  {
+    // Index this part of the reference, reading only the run and event numbers
+    EventIndex index(nRefEntries/nParts);
+    ReadProfile refProfile=StartReadPass(reftree, refKeyBranches);
+    for (Long64_t i=0;i<nRefEntries;i++)
+    {
+      Long64_t iEntry=EntryNumber(reftree, i);
+      Long64_t run, event;
+      uint64_t fingerprint=EventFingerprint(refRunLeaf, refEventLeaf, iEntry, run, event);
+      if (EventIndex::Partition(fingerprint, nParts)!=part) continue;
+      if (index.Insert(fingerprint, iEntry)) continue;
+      // Either the same numbers again, or (very rarely) a different event with the same fingerprint
+      Long64_t firstRun, firstEvent;
+      EventFingerprint(refRunLeaf, refEventLeaf, index.Find(fingerprint), firstRun, firstEvent);
+      if (firstRun==run && firstEvent==event) nDuplicates++;
+      else nCollisions++;
+    }
+    EndReadPass(reftree, refProfile, Form("index of part %d of %d of the events",part+1,nParts));
+    nIndexed+=index.Size();
+
+    // Then walk the sample, and read each event of this part from both trees
+    ReadProfile profile=StartReadPass(tree, sampleBranches);
+    refProfile=StartReadPass(reftree, refBranches);
+    for (int j=0;j<maps.size();j++)
+    {
+      AttachMapReader(tree, maps.at(j).reader);
+      AttachMapReader(reftree, maps.at(j).refReader);
+    }
+    vector<TLeaf*> leaves, refLeaves;
+    for (int j=0;j<scalars.size();j++)
+    {
+      leaves.push_back(tree->GetLeaf(scalars.at(j).name.c_str()));
+      refLeaves.push_back(reftree->GetLeaf(scalars.at(j).name.c_str()));
+    }
+    Long64_t nEntries=SelectedEntries(tree);
+    for (Long64_t i=0;i<nEntries;i++)
+    {
+      Long64_t iEntry=EntryNumber(tree, i);
+      if (iEntry % entryStride != 0) continue;
+      Long64_t run, event;
+      uint64_t fingerprint=EventFingerprint(runLeaf, eventLeaf, iEntry, run, event);
+      if (EventIndex::Partition(fingerprint, nParts)!=part) continue;
+      nSampleEntries++;
+      Long64_t refEntry=index.Find(fingerprint);
+      if (refEntry<0) continue;
+      // Two events can share a fingerprint, though it is very unlikely
+      Long64_t refRun, refEvent;
+      EventFingerprint(refRunLeaf, refEventLeaf, refEntry, refRun, refEvent);
+      if (refRun!=run || refEvent!=event)
+      {
+        nMismatched++;
+        continue;
+      }
+      nMatched++;
+      tree->GetEntry(iEntry);
+      reftree->GetEntry(refEntry);
+
+      changedScalars.clear();
+      for (int j=0;j<scalars.size();j++)
+      {
+        values.at(j)=leaves.at(j)->GetValue();
+        refValues.at(j)=refLeaves.at(j)->GetValue();
+        if (!ValueChanged(values.at(j), refValues.at(j))) continue;
+        changedScalars.push_back(j);
+        scalars.at(j).changed++;
+        double difference=values.at(j)-refValues.at(j);
+        if (!std::isnan(difference) && !std::isinf(difference)) scalars.at(j).differences.Fill(difference);
+      }
+      changedMaps.clear();
+      int nCells=0;
+      for (int j=0;j<maps.size();j++)
+      {
+        MatchedMap &matched=maps.at(j);
+        DecodeMapBranch(matched.reader);
+        DecodeMapBranch(matched.refReader);
+        cellsDiffer.at(j)=CellsThatDiffer(matched.reader.cells, matched.refReader.cells);
+        matched.cellsChanged->Fill(cellsDiffer.at(j));
+        if (cellsDiffer.at(j)==0) continue;
+        changedMaps.push_back(j);
+        matched.changed++;
+        nCells+=cellsDiffer.at(j);
+      }
+      if (changedScalars.size()==0 && changedMaps.size()==0) continue;
+      nChanged++;
+
+      // Keep the most changed events, by the branches that changed and the cells that differ
+      double score=changedScalars.size()+nCells;
+      if (mostChanged.size()>=MATCH_REPORT && score<=mostChanged.front().score) continue;
+      ChangedEvent changed;
+      changed.score=score;
+      changed.run=run;
+      changed.event=event;
+      vector<string> changes;
+      for (int j=0;j<changedScalars.size();j++)
+      {
+        int k=changedScalars.at(j);
+        changes.push_back(scalars.at(k).name+Form(" %g (reference %g)",values.at(k),refValues.at(k)));
+      }
+      for (int j=0;j<changedMaps.size();j++)
+      {
+        int k=changedMaps.at(j);
+        changes.push_back(maps.at(k).reader.name+Form(" %d cells",cellsDiffer.at(k)));
+      }
+      if (changes.size()>LOG_REPEATS)
+      {
+        int nMore=changes.size()-LOG_REPEATS;
+        changes.resize(LOG_REPEATS);
+        changes.push_back(Form("and %d more",nMore));
+      }
+      changed.changes=boost::algorithm::join(changes,"; ");
+      if (mostChanged.size()>=MATCH_REPORT)
+      {
+        pop_heap(mostChanged.begin(), mostChanged.end(), MoreChanged);
+        mostChanged.pop_back();
+      }
+      mostChanged.push_back(changed);
+      push_heap(mostChanged.begin(), mostChanged.end(), MoreChanged);
+    }
+    EndReadPass(tree, profile, Form("events of part %d of %d matched with the reference",part+1,nParts));
+    EndReadPass(reftree, refProfile, Form("events of part %d of %d matched with the sample",part+1,nParts));
+  }
+
+  // ROOT allocated these when it read the branches
+  for (int i=0;i<maps.size();i++)
+  {
+    delete maps.at(i).reader.codes;
+    delete maps.at(i).reader.caloHits;
+    delete maps.at(i).refReader.codes;
+    delete maps.at(i).refReader.caloHits;
+  }
+
+  sort_heap(mostChanged.begin(), mostChanged.end(), MoreChanged);
+  WriteMatchedComparison(scalars, maps, mostChanged, nSampleEntries, nMatched, nIndexed, nDuplicates, nCollisions, nMismatched, nChanged);
+  for (int i=0;i<maps.size();i++) delete maps.at(i).cellsChanged;
+}
+
+// The run and event numbers of an entry and their fingerprint, reading only their branches
+uint64_t EventFingerprint(TLeaf *runLeaf, TLeaf *eventLeaf, Long64_t iEntry, Long64_t &run, Long64_t &event)
+{
+  runLeaf->GetBranch()->GetEntry(iEntry);
+  if (eventLeaf->GetBranch()!=runLeaf->GetBranch()) eventLeaf->GetBranch()->GetEntry(iEntry);
+  run=llround(runLeaf->GetValue());
+  event=llround(eventLeaf->GetValue());
+  return EventIndex::Fingerprint(run, event);
+}
+
+// Whether a value differs from the reference by more than rounding could explain. Two NaNs are the same
+bool ValueChanged(double value, double refValue)
+{
+  if (std::isnan(value) || std::isnan(refValue)) return (std::isnan(value)!=std::isnan(refValue));
+  if (value==refValue) return false;
+  return (fabs(value-refValue) > MATCH_TOLERANCE*TMath::Max(fabs(value),fabs(refValue)));
+}
+
+bool CellBefore(const CellHit &a, const CellHit &b)
+{
+  if (a.wall!=b.wall) return a.wall<b.wall;
+  if (a.x!=b.x) return a.x<b.x;
+  return a.y<b.y;
+}
+
+// How many cells are in one event's list but not the other's. A cell hit twice counts twice. Sorts both lists
+int CellsThatDiffer(vector<CellHit> &cells, vector<CellHit> &refCells)
+{
+  sort(cells.begin(), cells.end(), CellBefore);
+  sort(refCells.begin(), refCells.end(), CellBefore);
+  int nDiffer=0;
+  int i=0, j=0;
+  while (i<cells.size() && j<refCells.size())
+  {
+    if (CellBefore(cells.at(i), refCells.at(j))) i++;
+    else if (CellBefore(refCells.at(j), cells.at(i))) j++;
+    else
+    {
+      i++;
+      j++;
+      continue;
+    }
+    nDiffer++;
+  }
+  return nDiffer+(cells.size()-i)+(refCells.size()-j);
+}
+
+// For a heap with the least changed event on top
+bool MoreChanged(const ChangedEvent &a, const ChangedEvent &b)
+{
+  return a.score>b.score;
+}
+
+/**
+ *  Report the event-by-event comparison: how many events matched, the fraction of
+ *  them in which each branch changed, and the most changed events. The differences
+ *  of each scalar branch, in the events where it changed, are drawn from its sketch
+ *  into a histogram, and written to the matched/ directory with the number of cells
+ *  that differ in each map branch
+ */
+void WriteMatchedComparison(vector<MatchedBranch> &scalars, vector<MatchedMap> &maps, vector<ChangedEvent> &mostChanged, Long64_t nSampleEntries, Long64_t nMatched, Long64_t nIndexed, Long64_t nDuplicates, Long64_t nCollisions, Long64_t nMismatched, Long64_t nChanged)
+{
+  vector<string> report;
+  report.push_back("Event-by-event comparison, matching "+matchRunBranch+" and "+matchEventBranch+":");
+  report.push_back(Form("%lld sample events, %lld of them found in the reference; %lld only in the sample and %lld only in the reference",nSampleEntries,nMatched,nSampleEntries-nMatched-nMismatched,nIndexed-nMatched));
+  if (nDuplicates>0) report.push_back(Form("WARNING: %lld reference entries have the same numbers as an earlier one, and were left out",nDuplicates));
+  if (nCollisions>0) report.push_back(Form("WARNING: %lld reference entries have the fingerprint of a different, earlier event, and were left out",nCollisions));
+  if (nMismatched>0) report.push_back(Form("WARNING: %lld sample events had the fingerprint of a different reference event, and were left out",nMismatched));
+  if (nMatched==0)
+  {
+    for (int i=0;i<report.size();i++) cout<<report.at(i)<<endl;
+    for (int i=0;i<report.size();i++) textOut<<report.at(i)<<endl;
+    textOut<<endl;
+    return;
+  }
+  report.push_back(Form("%lld matched events (%.2f%%) changed in at least one branch",nChanged,100.*nChanged/nMatched));
+
+  int nBranches=scalars.size()+maps.size();
+  TH1D *changedFraction=new TH1D("changed_fraction","Fraction of the matched events that changed",TMath::Max(nBranches,1),0,TMath::Max(nBranches,1));
+  changedFraction->SetDirectory(0);
+  int nUnchanged=0;
+  for (int i=0;i<scalars.size();i++)
+  {
+    MatchedBranch &scalar=scalars.at(i);
+    changedFraction->GetXaxis()->SetBinLabel(i+1,scalar.name.c_str());
+    changedFraction->SetBinContent(i+1,(double)scalar.changed/nMatched);
+    if (scalar.changed==0)
+    {
+      nUnchanged++;
+      continue;
+    }
+    string line=scalar.name+Form(": changed in %lld events (%.2f%%)",scalar.changed,100.*scalar.changed/nMatched);
+    if (scalar.differences.GetEntries()>0)
+    {
+      line+=Form(", difference from the reference %.3g (median), %.3g to %.3g (5%% to 95%%)",scalar.differences.Quantile(0.5),scalar.differences.Quantile(0.05),scalar.differences.Quantile(0.95));
+      TH1D *differences=SketchHistogram(scalar.differences, "diff_"+scalar.name, BranchNameToEnglish(scalar.name)+": change from the reference event");
+      histogramWriter.Add(differences,"matched");
+      delete differences;
+    }
+    report.push_back(line);
+  }
+  for (int i=0;i<maps.size();i++)
+  {
+    MatchedMap &matched=maps.at(i);
+    int bin=scalars.size()+i+1;
+    changedFraction->GetXaxis()->SetBinLabel(bin,matched.reader.name.c_str());
+    changedFraction->SetBinContent(bin,(double)matched.changed/nMatched);
+    histogramWriter.Add(matched.cellsChanged,"matched");
+    if (matched.changed==0)
+    {
+      nUnchanged++;
+      continue;
+    }
+    report.push_back(matched.reader.name+Form(": cells differ in %lld events (%.2f%%), %.2f cells per event on average",matched.changed,100.*matched.changed/nMatched,matched.cellsChanged->GetMean()));
+  }
+  if (nUnchanged>0) report.push_back(Form("%d of %d branches are the same in every matched event",nUnchanged,nBranches));
+  histogramWriter.Add(changedFraction,"matched");
+  delete changedFraction;
+  histogramWriter.Flush();
+
+  if (mostChanged.size()>0) report.push_back("Most changed events:");
+  for (int i=0;i<mostChanged.size();i++)
+  {
+    ChangedEvent &changed=mostChanged.at(i);
+    report.push_back(Form("Run %lld, event %lld: ",changed.run,changed.event)+changed.changes);
+  }
+  for (int i=0;i<report.size();i++) cout<<report.at(i)<<endl;
+  for (int i=0;i<report.size();i++) textOut<<report.at(i)<<endl;
+  textOut<<endl;
+}
+
+/**
+ *  A histogram of what a quantile sketch has seen, over the range of the default
+ *  plot range quantiles. Each bin gets the sketch's estimate of the entries in it
+ */
+TH1D *SketchHistogram(QuantileSketch &sketch, string name, string title)
+{
+  double low=sketch.Quantile(AUTORANGE_LOW_QUANTILE);
+  double high=sketch.Quantile(AUTORANGE_HIGH_QUANTILE);
+  if (!(high>low))
+  {
+    low-=0.5;
+    high+=0.5;
+  }
+  TH1D *h=new TH1D(name.c_str(),title.c_str(),MATCH_DIFFERENCE_BINS,low,high);
+  h->SetDirectory(0);
+  double entries=sketch.GetEntries();
+  double below=sketch.Cdf(low);
+  h->SetBinContent(0,below*entries);
+  for (int i=1;i<=h->GetNbinsX();i++)
+  {
+    double above=sketch.Cdf(h->GetXaxis()->GetBinUpEdge(i));
+    h->SetBinContent(i,(above-below)*entries);
+    below=above;
+  }
+  h->SetBinContent(h->GetNbinsX()+1,(1-below)*entries);
+  h->SetEntries(entries);
+  return h;
+}
+
+/**
+ *  Everything the output of a run depends on, so that a checkpoint is only resumed
+ *  by a run that would make the same output: the input files (as they are now),
+ *  and the options that change what is read, compared or written
+ */
+string CheckpointSettings(string rootFileName, string configFileName, vector<string> refFileNames)
+{
+  string settings="sample="+FileIdentity(rootFileName);
+  for (int i=0;i<refFileNames.size();i++) settings+=" reference="+FileIdentity(refFileNames.at(i));
+  if (configFileName.length()>0) settings+=" config="+FileIdentity(configFileName);
+  settings+=" selection="+selection+" slice="+sliceKey+Form(":%g",sliceWidth);
+  for (int i=0;i<sliceEdges.size();i++) settings+=Form(",%g",sliceEdges.at(i));
+  settings+=" match="+matchRunBranch+","+matchEventBranch;
+  settings+=Form(" pulls=%g,%d pvalue=%g toys=%d images=%d compression=%d",REPORT_PULLS_OVER,pullSummary,PVALUE_THRESHOLD,nToys,(int)makeImages,outputCompression);
+  return settings;
+}
+
+// Whether it is time for another checkpoint. If it is, the time is reset
+bool CheckpointDue(time_t &lastCheckpoint)
+{
+  time_t now=time(0);
+  if (difftime(now,lastCheckpoint) < CHECKPOINT_MINUTES*60) return false;
+  lastCheckpoint=now;
+  return true;
+}
+
+/**
+ *  Write a checkpoint of the branches plotted so far: a copy of the histogram file
+ *  as it is now, the 1D histogram templates for the slices, and checkpoint.txt,
+ *  which has the results so far and how much of the results file they take up. Each
+ *  file is written under a temporary name and renamed, and checkpoint.txt is renamed
+ *  last, so a run that is killed at any time leaves the last checkpoint as it was
+ */
+void SaveCheckpoint()
+{
+  int number=checkpoint.number+1;
+  if (checkpoint.branchesDone>0)
+  {
+    if (!histogramWriter.SaveCopy(checkpointDir+Form("/ValidationHistograms_%d.root",number)))
+    {
+      logger.Log(Logger::LOG_WARNING, "Could not write a checkpoint", "could not write a checkpoint: "+histogramWriter.GetError());
+      return;
+    }
+    string templatesName=checkpointDir+Form("/templates_%d.root",number);
+    TFile templates((templatesName+".tmp").c_str(),"RECREATE");
+    for (map<string,TH1D*>::iterator it=sliceTemplates.begin(); it!=sliceTemplates.end(); it++) templates.WriteTObject(it->second, it->first.c_str());
+    templates.Close();
+    boost::system::error_code error;
+    boost::filesystem::rename(templatesName+".tmp", templatesName, error);
+    if (error)
+    {
+      logger.Log(Logger::LOG_WARNING, "Could not write a checkpoint", "could not write a checkpoint to "+checkpointDir+": "+error.message());
+      boost::filesystem::remove(checkpointDir+Form("/ValidationHistograms_%d.root",number), error);
+      return;
+    }
+  }
+  if (textOut.is_open())
+  {
+    textOut.flush();
+    checkpoint.textBytes=textOut.tellp();
+  }
+
+  string fileName=checkpointDir+"/checkpoint.txt";
+  ofstream file((fileName+".tmp").c_str());
+  file<<"settings\t"<<checkpoint.settings<<endl;
+  file<<"checkpoint\t"<<number<<endl;
+  file<<"run\t"<<checkpoint.runKey<<endl;
+  file<<"reference\t"<<checkpoint.reference<<endl;
+  file<<"branches\t"<<checkpoint.branchesDone<<endl;
+  file<<"text\t"<<checkpoint.textBytes<<endl;
+  for (int i=0;i<checkpoint.refLabels.size();i++)
+  {
+    file<<"label\t"<<checkpoint.refLabels.at(i)<<endl;
+    for (int j=0;j<checkpoint.refResults.at(i).size();j++) file<<"result\t"<<i<<"\t"<<BranchResultLine(checkpoint.refResults.at(i).at(j))<<endl;
+  }
+  for (int j=0;j<checkpoint.results.size();j++) file<<"result\t-1\t"<<BranchResultLine(checkpoint.results.at(j))<<endl;
+  file.close();
+  if (file.fail())
+  {
+    logger.Log(Logger::LOG_WARNING, "Could not write a checkpoint", "could not write a checkpoint to "+checkpointDir);
+    return;
+  }
+  boost::system::error_code error;
+  boost::filesystem::rename(fileName+".tmp", fileName, error);
+  if (error)
+  {
+    // checkpoint.txt still names the checkpoint before, so its files are kept and this one's go
+    logger.Log(Logger::LOG_WARNING, "Could not write a checkpoint", "could not write a checkpoint to "+checkpointDir+": "+error.message());
+    boost::filesystem::remove(checkpointDir+Form("/ValidationHistograms_%d.root",number), error);
+    boost::filesystem::remove(checkpointDir+Form("/templates_%d.root",number), error);
+    return;
+  }
+
+  // The files of the checkpoint before are not needed any more
+  boost::filesystem::remove(checkpointDir+Form("/ValidationHistograms_%d.root",checkpoint.number), error);
+  boost::filesystem::remove(checkpointDir+Form("/templates_%d.root",checkpoint.number), error);
+  checkpoint.number=number;
+}
+
+// Read checkpoint.txt. False if there isn't one, or it can't be understood
+bool LoadCheckpoint(Checkpoint &loaded)
+{
+  ifstream file((checkpointDir+"/checkpoint.txt").c_str());
+  if (!file) return false;
+  loaded=Checkpoint();
+  string line;
+  try
+  {
+    while (getline(file, line))
+    {
+      vector<string> fields;
+      boost::split(fields, line, boost::is_any_of("\t"));
+      if (fields.size()<2) continue;
+      if (fields.at(0)=="settings") loaded.settings=fields.at(1);
+      else if (fields.at(0)=="checkpoint") loaded.number=std::stoi(fields.at(1));
+      else if (fields.at(0)=="run") loaded.runKey=fields.at(1);
+      else if (fields.at(0)=="reference") loaded.reference=std::stoi(fields.at(1));
+      else if (fields.at(0)=="branches") loaded.branchesDone=std::stoi(fields.at(1));
+      else if (fields.at(0)=="text") loaded.textBytes=std::stoll(fields.at(1));
+      else if (fields.at(0)=="label")
+      {
+        loaded.refLabels.push_back(fields.at(1));
+        loaded.refResults.push_back(vector<BranchResult>());
+      }
+      else if (fields.at(0)=="result")
+      {
+        BranchResult result;
+        int iRef=std::stoi(fields.at(1));
+        if (!ParseBranchResultLine(vector<string>(fields.begin()+2,fields.end()), result)) return false;
+        if (iRef<0) loaded.results.push_back(result);
+        else if (iRef<loaded.refResults.size()) loaded.refResults.at(iRef).push_back(result);
+        else return false;
+      }
+    }
+  }
+  catch (exception &e)
+  {
+    return false;
+  }
+  return (loaded.settings.length()>0);
+}
+
+// A branch result as tab-separated fields, with every digit of the numbers so that it reads back the same
+string BranchResultLine(BranchResult &result)
+{
+  string line=result.branchName+Form("\t%d\t%.17g\t%d\t%.17g\t%.17g\t%.17g\t%.17g\t%.17g\t%.17g\t%lld\t%lld",
+                                     (int)result.hasComparison,result.chisq,result.ndf,result.pValue,result.ks,result.pValueLow,result.pValueHigh,
+                                     result.meanPull,result.rmsPull,result.sampleEntries,result.refEntries);
+  for (int i=0;i<result.flaggedCells.size();i++) line+="\t"+result.flaggedCells.at(i).cell+Form("\t%.17g",result.flaggedCells.at(i).pull);
+  return line;
+}
+
+bool ParseBranchResultLine(vector<string> fields, BranchResult &result)
+{
+  if (fields.size()<12 || fields.size()%2!=0) return false;
+  result.branchName=fields.at(0);
+  result.hasComparison=(std::stoi(fields.at(1))!=0);
+  result.chisq=std::stod(fields.at(2));
+  result.ndf=std::stoi(fields.at(3));
+  result.pValue=std::stod(fields.at(4));
+  result.ks=std::stod(fields.at(5));
+  result.pValueLow=std::stod(fields.at(6));
+  result.pValueHigh=std::stod(fields.at(7));
+  result.meanPull=std::stod(fields.at(8));
+  result.rmsPull=std::stod(fields.at(9));
+  result.sampleEntries=std::stoll(fields.at(10));
+  result.refEntries=std::stoll(fields.at(11));
+  for (int i=12;i<fields.size();i+=2)
+  {
+    FlaggedCell cell={fields.at(i),std::stod(fields.at(i+1))};
+    result.flaggedCells.push_back(cell);
+  }
+  return true;
+}
+
+// The 1D histograms the slices are binned like, for the branches plotted before the checkpoint
+void LoadSliceTemplates(string fileName)
+{
+  TFile file(fileName.c_str());
+  if (file.IsZombie()) return;
+  TIter next(file.GetListOfKeys());
+  TKey *key;
+  while ((key=(TKey*)next()))
+  {
+    TH1D *h=(TH1D*)key->ReadObj();
+    if (!h) continue;
+    h->SetDirectory(0);
+    sliceTemplates[key->GetName()]=h;
+  }
+}
+
+// The checkpoint of the shared pass over a tree
+string PassCheckpointFile(TTree *thisTree)
+{
+  return checkpointDir+"/pass_"+(thisTree==reftree?"reference":"sample")+".root";
+}
+
+// What a pass checkpoint was made for: the reference, and the maps and scalar branches it fills
+string PassCheckpointKey(vector<MapAccumulator*> &accumulators, CovarianceMatrix *covariance)
+{
+  string key=Form("reference %d, %d scalar branches, maps:",checkpoint.reference,(covariance?covariance->GetNVariables():0));
+  for (int i=0;i<accumulators.size();i++) key+=" "+accumulators.at(i)->fullBranchName;
+  return key;
+}
+
+/**
+ *  Save the maps and covariance filled so far in a pass over a tree, and the entry
+ *  to carry on from. The covariance is saved with the entries it hasn't folded in
+ *  yet, so it carries on exactly as if the pass had not stopped. The sample and the
+ *  reference are read in different threads, and each saves its own file
+ */
+void SavePassCheckpoint(TTree *thisTree, vector<MapAccumulator*> &accumulators, CovarianceMatrix *covariance, Long64_t nextEntry)
+{
+  string fileName=PassCheckpointFile(thisTree);
+  TFile file((fileName+".tmp").c_str(),"RECREATE");
+  if (file.IsZombie())
+  {
+    logger.Log(Logger::LOG_WARNING, "Could not write a checkpoint", "could not write a checkpoint to "+checkpointDir);
+    return;
+  }
+  TObjString key(PassCheckpointKey(accumulators, covariance).c_str());
+  file.WriteTObject(&key, "key");
+  TParameter<Long64_t> next("nextEntry",nextEntry);
+  file.WriteTObject(&next, "nextEntry");
+  for (int i=0;i<accumulators.size();i++)
   {
-    // title, nbins, low limit, high limit separated by commas
-    title=GetBitBeforeComma(config); // config now has this bit chopped off ready for the next parsing stage
-
-    // Number of bins
-    try
-    {
-      string nbinString=GetBitBeforeComma(config);
-      std::string::size_type sz;   // alias of size_t
-      nbins = std::stoi (nbinString,&sz); // hopefully the next chunk is turnable into an integer
-    }
-    catch (exception &e)
+    MapAccumulator *accumulator=accumulators.at(i);
+    TDirectory *directory=file.mkdir(Form("map%d",i));
+    for (int wall=0;wall<accumulator->counts.size();wall++)
     {
-      nbins=0;
+      directory->WriteTObject(accumulator->counts.at(wall), Form("counts%d",wall));
+      directory->WriteTObject(accumulator->sums.at(wall), Form("sums%d",wall));
+      directory->WriteTObject(accumulator->sumsSquared.at(wall), Form("sumsSquared%d",wall));
     }
+    if (accumulator->distribution) directory->WriteTObject(accumulator->distribution, "distribution");
+  }
+  if (covariance)
+  {
+    vector<double> state=covariance->GetState();
+    file.WriteObject(&state, "covariance");
+  }
+  file.Close();
+  // This runs in the thread reading the tree, so a failure must not throw: the checkpoint before is kept
+  boost::system::error_code error;
+  boost::filesystem::rename(fileName+".tmp", fileName, error);
+  if (error) logger.Log(Logger::LOG_WARNING, "Could not write a checkpoint", "could not write a checkpoint to "+checkpointDir+": "+error.message());
+}
 
-    // Low bin limit
-    try
+/**
+ *  Fill the maps and covariance of a pass from its checkpoint, if there is one for
+ *  the same maps and reference. The booked histograms are empty, so adding the saved
+ *  ones to them gives exactly what was saved. Everything in the file is checked
+ *  before anything is restored, so a damaged checkpoint leaves the pass to start
+ *  from the beginning with nothing filled. Returns the entry to carry on from
+ */
+Long64_t RestorePassCheckpoint(TTree *thisTree, vector<MapAccumulator*> &accumulators, CovarianceMatrix *covariance)
+{
+  if (checkpointDir.length()==0) return 0;
+  TFile file(PassCheckpointFile(thisTree).c_str());
+  if (file.IsZombie()) return 0;
+  TObjString *key=(TObjString*)file.Get("key");
+  TParameter<Long64_t> *next=(TParameter<Long64_t>*)file.Get("nextEntry");
+  vector<double> *state=0;
+  if (covariance) file.GetObject("covariance", state);
+  bool matches=(key && next && string(key->GetName())==PassCheckpointKey(accumulators, covariance));
+  if (covariance) matches=(matches && state);
+
+  // The saved histograms for each booked one, in the same order. The map histograms
+  // belong to the file, and go when it is closed
+  vector<TH1*> booked, saved;
+  vector<THnSparseD*> distributions(accumulators.size(), (THnSparseD*)0);
+  for (int i=0;matches && i<accumulators.size();i++)
+  {
+    MapAccumulator *accumulator=accumulators.at(i);
+    TDirectory *directory=file.GetDirectory(Form("map%d",i));
+    if (!directory)
     {
-      string lowString=GetBitBeforeComma(config);
-      lowLimit = std::stod (lowString); // hopefully the next chunk is turnable into an double
+      matches=false;
+      break;
     }
-    catch (exception &e)
+    for (int wall=0;wall<accumulator->counts.size();wall++)
     {
-      lowLimit=0;
+      booked.push_back(accumulator->counts.at(wall));
+      saved.push_back((TH1*)directory->Get(Form("counts%d",wall)));
+      booked.push_back(accumulator->sums.at(wall));
+      saved.push_back((TH1*)directory->Get(Form("sums%d",wall)));
+      booked.push_back(accumulator->sumsSquared.at(wall));
+      saved.push_back((TH1*)directory->Get(Form("sumsSquared%d",wall)));
     }
+    if (!accumulator->distribution) continue;
+    distributions.at(i)=(THnSparseD*)directory->Get("distribution");
+    if (!distributions.at(i)) matches=false;
+  }
+  for (int i=0;matches && i<saved.size();i++)
+  {
+    if (!saved.at(i) || saved.at(i)->GetNcells()!=booked.at(i)->GetNcells()) matches=false;
+  }
 
-    // High bin limit
-    try
-    {
-      string highString=GetBitBeforeComma(config);
-      highLimit = std::stod (highString); // hopefully the next chunk is turnable into an double
-    }
-    catch (exception &e)
-    {
-      highLimit=notSetVal;
-    }
+  // Only now change anything. The covariance is left as it was if its state doesn't fit
+  if (covariance) matches=(matches && covariance->SetState(*state));
+  for (int i=0;matches && i<saved.size();i++) booked.at(i)->Add(saved.at(i));
+  for (int i=0;i<accumulators.size();i++)
+  {
+    if (matches && distributions.at(i)) accumulators.at(i)->distribution->Add(distributions.at(i));
+    delete distributions.at(i);
   }
+  Long64_t nextEntry=(matches?next->GetVal():0);
+  delete key;
+  delete next;
+  delete state;
+  if (nextEntry>0) cout<<"Carrying on the pass over the "<<(thisTree==reftree?"reference":"sample")<<" from entry "<<nextEntry<<" of "<<SelectedEntries(thisTree)<<", from the checkpoint"<<endl;
+  return nextEntry;
+}
 
-  if (title.length()==0)
+/**
+ *  Set up a tree to read only the given branches, through a read cache sized to
+ *  hold a cluster of them plus the next cluster, which is prefetched in the
+ *  background while we decode the current one. Starts timing the pass.
+ */
+ReadProfile StartReadPass(TTree *thisTree, vector<string> branches)
+{
+  ReadProfile profile;
+  thisTree->SetBranchStatus("*",0);
+  Long64_t zipBytes=0;
+  for (int i=0;i<branches.size();i++)
   {
-    title = BranchNameToEnglish(branchName);
+    TBranch *branch=thisTree->GetBranch(branches.at(i).c_str());
+    if (!branch) continue;
+    thisTree->SetBranchStatus(branches.at(i).c_str(),1);
+    zipBytes+=branch->GetZipBytes("*");
   }
-  TCanvas *c = new TCanvas (("plot_"+branchName).c_str(),("plot_"+branchName).c_str(),900,600);
-  TH1D *h;
-  tree->Draw(branchName.c_str());
 
-  if (highLimit == notSetVal)
+  Long64_t nEntries=thisTree->GetEntries();
+  if (nEntries > 0)
   {
-    // Use the default limits
-    TH1D *tmp = (TH1D*) gPad->GetPrimitive("htemp");
-    highLimit=tmp->GetXaxis()->GetXmax();
-    delete tmp;
-    EDataType datatype;
-    TClass *ctmp;
-    tree->FindBranch(branchName.c_str())->GetExpectedType(ctmp,datatype);
-    delete ctmp;
-    if (datatype==kBool_t)
+    TTree::TClusterIterator clusters=thisTree->GetClusterIterator(0);
+    clusters();
+    Long64_t clusterEntries=TMath::Min(clusters.GetNextEntry(),nEntries);
+    Long64_t cacheSize=2 * zipBytes * clusterEntries / nEntries;
+    cacheSize=TMath::Max(cacheSize,(Long64_t)MIN_READ_CACHE_MB*1024*1024);
+    cacheSize=TMath::Min(cacheSize,(Long64_t)MAX_READ_CACHE_MB*1024*1024);
+    thisTree->SetCacheSize(cacheSize);
+    thisTree->DropBranchFromCache("*",true);
+    for (int i=0;i<branches.size();i++)
     {
-      nbins=2;
-      highLimit=2;
-      lowLimit=0;
+      if (thisTree->GetBranch(branches.at(i).c_str())) thisTree->AddBranchToCache(branches.at(i).c_str(),true);
     }
-    else if (datatype== kInt_t || datatype== kUInt_t)
-    {
+    thisTree->StopCacheLearningPhase();
+  }
 
-      highLimit +=1;
-      if (highLimit <=100) nbins = (int) highLimit;
-      else nbins = 100;
-    }
-    else
+  profile.bytesRead=thisTree->GetCurrentFile()->GetBytesRead();
+  profile.readCalls=thisTree->GetCurrentFile()->GetReadCalls();
+  profile.timer.Start();
+  return profile;
+}
+
+// Put the tree back as it was and report what the pass read, and how long it took
+void EndReadPass(TTree *thisTree, ReadProfile &profile, string what)
+{
+  profile.timer.Stop();
+  thisTree->ResetBranchAddresses();
+  thisTree->SetBranchStatus("*",1);
+
+  double seconds=profile.timer.RealTime();
+  double megabytes=(thisTree->GetCurrentFile()->GetBytesRead() - profile.bytesRead)/(1024.*1024.);
+  int readCalls=thisTree->GetCurrentFile()->GetReadCalls() - profile.readCalls;
+  string report=Form("Read profile (%s, %s): %lld entries, %.1f MB in %d reads, %.2f s (%.1f MB/s)",
+                     (thisTree==reftree?"reference":"sample"),what.c_str(),EntriesUsed(thisTree),megabytes,readCalls,seconds,(seconds>0?megabytes/seconds:0.));
+  logger.Log(Logger::LOG_INFO, report);
+  std::lock_guard<std::mutex> lock(readTimeMutex);
+  if (thisTree==reftree) refReadTime+=seconds;
+  else sampleReadTime+=seconds;
+}
+
+/**
+ *  Fill a quantile sketch with every value of a branch (all the elements, if it
+ *  is a vector), reading the same entries as the histograms. When the binning is
+ *  already known, the histogram is filled in the same pass
+ */
+void FillSketch(TTree *thisTree, string branchName, QuantileSketch &sketch, TH1 *h)
+{
+  ReadProfile profile=StartReadPass(thisTree, vector<string>(1,branchName));
+  TTreeFormula formula(("sketch_"+branchName).c_str(), branchName.c_str(), thisTree);
+  Long64_t nEntries = SelectedEntries(thisTree);
+  for (Long64_t i = 0; i < nEntries; i++)
+  {
+    Long64_t iEntry = EntryNumber(thisTree, i);
+    if (iEntry % entryStride != 0) continue;
+    thisTree->LoadTree(iEntry);
+    int nValues=formula.GetNdata();
+    for (int j=0;j<nValues;j++)
     {
-      highLimit += highLimit /10.;
-      nbins = 100;
+      double value=formula.EvalInstance(j);
+      sketch.Fill(value);
+      if (h) h->Fill(value);
     }
   }
-  h = new TH1D(("plt_"+branchName).c_str(),title.c_str(),nbins,lowLimit,highLimit);
-  if( h->GetSumw2N() == 0 )h->Sumw2();
-  h->GetYaxis()->SetTitle("Events");
-  h->GetXaxis()->SetTitle(title.c_str());
-  h->SetFillColor(kPink-6);
-  h->SetFillStyle(1001);
-  tree->Draw((branchName + ">> plt_"+branchName).c_str());
-  h->Write("",TObject::kOverwrite);
-  h->Draw("HIST");
+  EndReadPass(thisTree, profile, branchName);
+}
 
-  h->Draw("E SAME");
-  c->SaveAs((plotdir+"/"+branchName+".png").c_str());
-  if (hasReferenceBranch)
+// Write the quantiles of the sample and reference side by side
+void WriteQuantileComparison(QuantileSketch &sketch, QuantileSketch &refSketch)
+{
+  const int nQuantiles=5;
+  double quantiles[nQuantiles]={0.05,0.25,0.5,0.75,0.95};
+  textOut<<"Quantiles (sample / reference):";
+  for (int i=0;i<nQuantiles;i++)
   {
-    TCanvas  *comp_canv= new TCanvas(("compare_"+branchName).c_str(),("compare_"+branchName).c_str(),900,900);
-    TPad *p_comp = new TPad("p_comp",
-                            "",0.0,0.4,1,1,0);
-
-    TPad *p_ratio = new TPad("p_ratio",
-                            "",0.0,0.0,1,0.4,0);
-    p_comp->Draw();
-    p_ratio->Draw();
-
-    p_comp->cd();
-    // Make the reference plot with the same binning
-    TH1D *href = new TH1D(("ref_"+branchName).c_str(),title.c_str(),nbins,lowLimit,highLimit);
-    if( href->GetSumw2N() == 0 )href->Sumw2();
-    reftree->Draw((branchName + ">> ref_"+branchName).c_str());
-
-    // Normalise reference number of events to data
-    Double_t scale = (double)tree->GetEntries()/(double)reftree->GetEntries();
-    href->Scale(scale);
-
-    // Save a plot with both on the same axes
-    double maxy = h->GetMaximum()>href->GetMaximum()?h->GetMaximum()*1.1:href->GetMaximum()*1.1;
-    h->GetYaxis()->SetRangeUser(0,maxy);
-
-    // Draw the sample to get the right axis
-    h->SetLineColor(kBlack);
-    h->SetMarkerStyle(20);
-    h->SetMarkerSize(.5);
-    h->SetMarkerColor(kBlack);
-    h->SetLineWidth(1);
-    h->SetLineStyle(1);
-    h->Draw("E");
-
-    // Draw the error bars on the reference
-    href->SetFillColor(REF_FILL_COLOR);
-    href->SetFillStyle(REF_FILL_STYLE);
-    href->SetLineColor(REF_LINE_COLOR);
-    href->SetMarkerStyle(0);
-    href->DrawCopy("E2 SAME");
-    // Then the reference central value
-    href->SetFillColor(0);
-    href->DrawCopy("HIST SAME");
-    // Finally redraw the sample so it is on top
-    h->DrawCopy("E1 X0 SAME");
-
-
-    // Add a legend
-    TLegend* legend = new TLegend(0.75,0.8,0.9,0.9);
-    href->SetFillColor(REF_FILL_COLOR); // change it back so it is included in the legend
-    legend->AddEntry(h, "Sample", "lep");
-    legend->AddEntry(href,"Reference", "fl");
-    legend->Draw();
-
-    // Calculate some stats
-    // Kolmogorov-Smirnov goodness of fit
-    Double_t ks = h->KolmogorovTest(href);
-    Double_t chisq;
-    Int_t ndf;
-    Double_t p_value = ChiSquared(h, href, chisq, ndf, false);
-    cout<<"Kolmogorov: "<<ks<<endl;
-    cout<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
-
-    // Write to output file
-    textOut<<branchName<<":"<<endl;
-    textOut<<"KS score: "<<ks<<endl;
-    textOut<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
-
-
-    // Now make a ratio plot
-
-    p_ratio->cd();
-    TH1D *ratio_hist = (TH1D*)h->Clone(("ratio_"+branchName).c_str());
-    ratio_hist->SetTitle("");
-    ratio_hist->GetXaxis()->SetTitle("");
-    ratio_hist->Divide(href);
-    // Set a more sensible y axis
-    ratio_hist->GetYaxis()->SetRangeUser(ratio_hist->GetBinContent(ratio_hist->GetMinimumBin())*0.9,ratio_hist->GetBinContent(ratio_hist->GetMaximumBin())*1.1);
-    ratio_hist->SetLineColor(kBlack);
-    ratio_hist->GetYaxis()->SetTitle("Ratio to reference");
-    ratio_hist->GetYaxis()->SetLabelSize(ratio_hist->GetYaxis()->GetLabelSize() * 1.5);
-    ratio_hist->GetYaxis()->SetTitleSize(ratio_hist->GetYaxis()->GetTitleSize() * 1.5);
-    ratio_hist->Draw();
-
-    WriteLabel(0.6,0.8, Form("K-S score (binned): %.2f",ks),0.04);
-    WriteLabel(0.6,0.72, Form("#chi^{2}/NDF: %.1f/%d = %.1f",chisq,ndf,chisq/(double)ndf),0.04);
-    WriteLabel(0.6,0.64, Form("(p-value %.2f)",p_value),0.04);
-
-    TLine *line=new TLine(c->GetUxmin(),1.0,c->GetUxmax(),1.0);
-    line->SetLineColor(kRed);
-    line->Draw();
-
-    comp_canv->SaveAs((plotdir+"/compare_"+branchName+".png").c_str());
-
-    textOut<<endl;
-    delete href;
-    delete ratio_hist;
-   // delete c_ratio;
-    delete comp_canv;
+    textOut<<" "<<quantiles[i]*100<<"%: "<<sketch.Quantile(quantiles[i])<<" / "<<refSketch.Quantile(quantiles[i]);
   }
-  delete h;
-  delete c;
+  textOut<<endl;
 }
 
-
 /**
  *  Plot a map of the calorimeter walls
  *  We have 6 walls in total : 2 main walls (Italy, France)
@@ -564,15 +4403,13 @@ void Plot1DHistogram(string branchName)
 void PlotCaloMap(string branchName)
 {
 
-  string config="";
-
   string fullBranchName=branchName;//This is a combo of name and parent for average branches
 
   // is it an average?
   string mapBranch=branchName;
 
   bool isAverage=false;
-  if (branchName[1]=='m')
+  if (branchName[1]=='m' || branchName[1]=='d')
   {
     // In this case, the branch name should be split in two with a . character
     int pos=branchName.find(".");
@@ -586,39 +4423,39 @@ void PlotCaloMap(string branchName)
     isAverage=true;
   }
 
-  config=configParams[branchName]; // get the config loaded from the file if there is one
+  string title=MapTitle(branchName,branchName); // from the config file if there is one
 
-  string title="";
-  // Load the title from the config file
-  if (config.length()>0)
+  // Can we do a comparison to the reference for this plot?
+  bool hasReferenceBranch=hasValidReference;
+  if (hasValidReference && !reftree->GetBranchStatus(fullBranchName.c_str()))
   {
-    // title is the only thing for this one
-    title=GetBitBeforeComma(config); // config now has this bit chopped off ready for the next parsing stage
+    cout<<"WARNING: branch "<<fullBranchName<<" not found in reference file. No comparison plots will be made for this branch"<<endl;
+    hasReferenceBranch=false;
   }
-  // Set the title to a default if there isn't anything in the config file
-  if (title.length()==0)
+  else if (hasValidReference && isAverage && !reftree->GetBranchStatus(mapBranch.c_str()))
   {
-    title = BranchNameToEnglish(branchName);
+    cout<<"WARNING: map branch "<<mapBranch<<" not found in reference file. No comparison plots can be made for the branch "<<branchName<<endl;
+    hasReferenceBranch=false;
   }
 
-  vector<TH2D*> hists = MakeCaloPlotSet(fullBranchName, branchName, title, false, isAverage, mapBranch);
-  PrintCaloPlots(branchName,title,hists);
-
-  // Can we do a comparison to the reference for this plot?
-  if (!hasValidReference) return;
-  if (!reftree->GetBranchStatus(fullBranchName.c_str()))
+  // The sample and reference maps were filled in the shared pass over the trees (FillAllMaps)
+  if (!sampleMaps.count(fullBranchName))
   {
-    cout<<"WARNING: branch "<<fullBranchName<<" not found in reference file. No comparison plots will be made for this branch"<<endl;
+    cout<<"WARNING: map branch "<<mapBranch<<" not found in sample file. No plots can be made for the branch "<<branchName<<endl;
     return;
   }
-  if (isAverage && !reftree->GetBranchStatus(mapBranch.c_str()))
+  if (hasReferenceBranch && !refMaps.count(fullBranchName)) hasReferenceBranch=false;
+
+  vector<TH2D*> hists = FinishCaloPlotSet(sampleMaps[fullBranchName]);
+  PrintCaloPlots(branchName,title,hists);
+  if (!hasReferenceBranch)
   {
-    cout<<"WARNING: map branch "<<mapBranch<<" not found in reference file. No comparison plots can be made for the branch "<<branchName<<endl;
+    CompareDistributions(sampleMaps[fullBranchName], 0, title);
     return;
   }
 
   // Compare to reference now that we have checked that we have one.
-  vector<TH2D*> refHists = MakeCaloPlotSet(fullBranchName, branchName, title, true, isAverage, mapBranch);
+  vector<TH2D*> refHists = FinishCaloPlotSet(refMaps[fullBranchName]);
 
   PrintCaloPlots("ref_"+branchName,title,refHists);
 
@@ -640,18 +4477,22 @@ void PlotCaloMap(string branchName)
 
   Double_t prob = TMath::Prob(chisq, ndf); // Get it from the combined chi square
   cout<<"P-value: "<<prob<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+  RecordComparison(chisq, ndf, prob, -1); // No KS score for the calorimeter
 
   // Write to output file
   textOut<<branchName<<":"<<endl;
   textOut<<"P-value: "<<prob<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+  WriteEntriesUsed();
+  RunToys(vector<TH1*>(hists.begin(),hists.end()), vector<TH1*>(refHists.begin(),refHists.end()), isAverage, (double)EntriesUsed(tree)/EntriesUsed(reftree), 1);
 
   // Pull plots
   vector<TH2D*> pullHists = MakeCaloPullPlots(hists,refHists);
-  gStyle->SetPalette(PULL_PALETTE);
+  if (makeImages) gStyle->SetPalette(PULL_PALETTE);
 
   PrintCaloPlots("pull_"+branchName,"Pull: "+title,pullHists);
   CheckCaloPulls(pullHists,title);
-  gStyle->SetPalette(PALETTE);
+  if (makeImages) gStyle->SetPalette(PALETTE);
+  CompareDistributions(sampleMaps[fullBranchName], &refMaps[fullBranchName], title);
 
   textOut<<endl;
   cout<<endl;
@@ -675,6 +4516,8 @@ double CheckCaloPulls(vector<TH2D*> hPulls, string title)
   { // If the plots are the same there is no need to make a plot of all pulls
     cout<<"Pull is zero - plots are identical"<<endl;
     textOut<<"Pull is zero - plots are identical"<<endl;
+    branchResult.meanPull=0;
+    branchResult.rmsPull=0;
     return 0;
   }
   string firstName=hPulls.at(0)->GetName();
@@ -684,7 +4527,8 @@ double CheckCaloPulls(vector<TH2D*> hPulls, string title)
   TH1D *h1Pulls = new TH1D(hPullName.c_str(),(title+" pulls").c_str(),100,-10,10);
 
   double totalPull=0;
-  int pullCells=0;
+  vector<double> pulls;
+  vector<string> noData; // Modules without enough data for a pull
   for (int i=0;i<hPulls.size();i++)
   {
     TH2D *hPull = hPulls.at(i);
@@ -697,7 +4541,7 @@ double CheckCaloPulls(vector<TH2D*> hPulls, string title)
         if (!std::isnan(pull) && !std::isinf(pull))
         {
           totalPull+=pull;
-          pullCells++;
+          pulls.push_back(pull);
           h1Pulls->Fill(pull);
         }
 
@@ -738,9 +4582,14 @@ double CheckCaloPulls(vector<TH2D*> hPulls, string title)
               break;
               reportString=Form("ERROR: pull found for unknown calorimeter wall %d: this is a bug!",i);
           }
-          if (std::isnan(pull)) reportString += ": not enough data to calculate pull";
-          else if (std::isinf(pull)) reportString += ": not enough data to calculate pull";
-          else reportString += Form(": pull = %.2f",pull);
+          if (std::isnan(pull) || std::isinf(pull))
+          {
+            noData.push_back(reportString);
+            continue;
+          }
+          FlaggedCell cell={reportString,pull};
+          branchResult.flaggedCells.push_back(cell);
+          reportString += Form(": pull = %.2f",pull);
           cout<<reportString<<endl;
           textOut<<reportString<<endl;
         }
@@ -748,42 +4597,105 @@ double CheckCaloPulls(vector<TH2D*> hPulls, string title)
       }
     }
   }
-  PrintPlotOfPulls(h1Pulls,pullCells,title);
+  ReportCellsWithoutPulls(noData);
+  PrintPlotOfPulls(h1Pulls,pulls,title);
   return totalPull;
 }
 
-double  PrintPlotOfPulls(TH1D *h1Pulls, int pullCells, string title)
+// One line for all the cells of a map without enough data for a pull, naming the first few
+void ReportCellsWithoutPulls(vector<string> &cells)
+{
+  if (cells.size()==0) return;
+  vector<string> named(cells.begin(),cells.begin()+TMath::Min((int)cells.size(),LOG_REPEATS));
+  string report=Form("Not enough data to calculate the pull in %d cells: ",(int)cells.size())+boost::algorithm::join(named,"; ");
+  if (cells.size()>named.size()) report+=Form("; and %d more",(int)(cells.size()-named.size()));
+  cout<<report<<endl;
+  textOut<<report<<endl;
+}
+
+/**
+ *  Sum up the pulls of a map by their centre and width. By default these come straight
+ *  from the pulls (see SummarisePulls), with the estimator chosen with --pull-summary.
+ *  A Gaussian fit to the histogram of pulls is only done if it is asked for, as it
+ *  is much slower and can fail when few cells have data
+ */
+double  PrintPlotOfPulls(TH1D *h1Pulls, vector<double> &pulls, string title)
 {
   // Save the plot of pulls
   h1Pulls->GetXaxis()->SetTitle("Pull");
   h1Pulls->GetYaxis()->SetTitle("Frequency");
 
+  PullSummary summary=SummarisePulls(pulls);
+  double mean=summary.median;
+  double rms=summary.mad;
+  double meanerr=summary.medianError;
+  double rmserr=summary.madError;
+  string centreName="Median pull", widthName="Width of pulls (from MAD)";
+  if (pullSummary==PULLS_MOMENTS || pullSummary==PULLS_FIT)
+  {
+    mean=summary.mean;
+    rms=summary.rms;
+    meanerr=summary.meanError;
+    rmserr=summary.rmsError;
+    centreName="Mean pull";
+    widthName="RMS of pulls";
+  }
+  else if (pullSummary==PULLS_TRIMMED)
+  {
+    mean=summary.trimmedMean;
+    rms=summary.trimmedWidth;
+    meanerr=summary.trimmedMeanError;
+    rmserr=summary.trimmedWidthError;
+    centreName=Form("Trimmed mean pull (%.0f%%)",PULL_TRIM_FRACTION*100);
+    widthName="Trimmed width of pulls";
+  }
 
-  h1Pulls->Fit("gaus","LQ");
-  TF1 *fit = (TF1*)h1Pulls->GetFunction("gaus");
-  double mean=fit->GetParameter(1);
-  double rms=fit->GetParameter(2);
-  double meanerr=fit->GetParError(1);
-  double rmserr=fit->GetParError(2);
+  TF1 *fit=0;
+  if (pullSummary==PULLS_FIT)
+  {
+    h1Pulls->Fit("gaus","LQ0"); // Don't draw it yet: that would need a canvas
+    fit = (TF1*)h1Pulls->GetFunction("gaus");
+    if (fit)
+    {
+      mean=fit->GetParameter(1);
+      rms=fit->GetParameter(2);
+      meanerr=fit->GetParError(1);
+      rmserr=fit->GetParError(2);
+    }
+    else cout<<"WARNING: fit to the pulls of "<<title<<" failed - using their mean and RMS"<<endl;
+  }
 
-  // Report fitted mean pulls
-  textOut<<"Mean pull:"<<mean<<" +/- "<<meanerr<<" for "<<pullCells<<" modules with data. ";
-  cout<<"Mean pull:"<<mean<<" +/- "<<meanerr<<" for "<<pullCells<<" modules with data."<<endl;
+  // Report mean pulls
+  textOut<<centreName<<": "<<mean<<" +/- "<<meanerr<<" for "<<pulls.size()<<" modules with data. ";
+  cout<<centreName<<": "<<mean<<" +/- "<<meanerr<<" for "<<pulls.size()<<" modules with data."<<endl;
   if (mean < 0)  textOut<<"Note: negative pull indicates sample deficit."<<endl;
   else textOut<<"Note: positive pull indicates sample excess."<<endl;
-  cout<<"RMS of pulls "<<rms<<" +/- "<<rmserr<<endl;
-  textOut<<"RMS of pulls "<<rms<<" +/- "<<rmserr<<endl;
+  cout<<widthName<<" "<<rms<<" +/- "<<rmserr<<endl;
+  textOut<<widthName<<" "<<rms<<" +/- "<<rmserr<<endl;
+  textOut<<Form("Pulls: mean %.3f +/- %.3f, RMS %.3f +/- %.3f; median %.3f +/- %.3f, MAD width %.3f +/- %.3f; trimmed mean %.3f +/- %.3f, width %.3f +/- %.3f",
+                summary.mean,summary.meanError,summary.rms,summary.rmsError,summary.median,summary.medianError,summary.mad,summary.madError,
+                summary.trimmedMean,summary.trimmedMeanError,summary.trimmedWidth,summary.trimmedWidthError)<<endl;
+  branchResult.meanPull=mean;
+  branchResult.rmsPull=rms;
 
 
-  h1Pulls->Write("",TObject::kOverwrite);
+  histogramWriter.Add(h1Pulls,"pulls");
+  if (!makeImages) return mean;
   TCanvas *cPull = new TCanvas("cPull","cPull",900,600);
   h1Pulls->Draw("HIST");
+  if (!fit)
+  {
+    // The Gaussian these pulls are summed up by, for comparison with the histogram
+    fit=new TF1(Form("summary_%s",h1Pulls->GetName()),"gaus",h1Pulls->GetXaxis()->GetXmin(),h1Pulls->GetXaxis()->GetXmax());
+    fit->SetParameters(pulls.size()*h1Pulls->GetBinWidth(1)/(TMath::Sqrt(2*TMath::Pi())*rms),mean,rms);
+    h1Pulls->GetListOfFunctions()->Add(fit); // Deleted with the histogram
+  }
   fit->SetLineColor(kRed);
   fit->SetLineWidth(2);
-  fit->Draw("SAME");
+  if (rms>0) fit->Draw("SAME");
 
-  WriteLabel(.6,.75,Form ("Mean pull %.2f #pm %.2f",mean,meanerr),0.03);
-  WriteLabel(.6,.7,Form ("RMS  %.2f #pm %.2f",rms,rmserr),0.03);
+  WriteLabel(.6,.75,Form ("%s %.2f #pm %.2f",centreName.c_str(),mean,meanerr),0.03);
+  WriteLabel(.6,.7,Form ("%s  %.2f #pm %.2f",(pullSummary==PULLS_MEDIAN?"Width (MAD)":"RMS"),rms,rmserr),0.03);
   WriteLabel(.15,.84,title+" pulls",0.04);
   cPull->SaveAs((plotdir+Form("/%s.png",h1Pulls->GetName())).c_str());
   delete cPull;
@@ -791,365 +4703,144 @@ double  PrintPlotOfPulls(TH1D *h1Pulls, int pullCells, string title)
   return mean;
 }
 
-vector<TH2D*>MakeCaloPullPlots(vector<TH2D*> vSample, vector<TH2D*> vRef)
-{
-  vector <TH2D*> vPull;
-  if (vSample.size() != vRef.size())
-  { // This should never happen if it only gets called from here
-    cout<<"ERROR: number of sample and reference histograms does not match for "<<vSample.at(0)->GetName()<<endl;
-    return vPull;
-  }
-  for (int i=0;i<vSample.size();i++)
-  {
-    vPull.push_back(PullPlot2D(vSample.at(i), vRef.at(i)));
-  }
-  return vPull;
-}
-
-vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch)
+/**
+ *  The centre and width of a set of pulls, without a fit: the mean and standard
+ *  deviation; the median and the median absolute deviation (MAD); and the mean and
+ *  (winsorized) standard deviation of the pulls left when PULL_TRIM_FRACTION is cut
+ *  from each end. The robust widths are scaled to estimate sigma for Gaussian pulls,
+ *  and the uncertainties are the large-sample ones for Gaussian pulls
+ */
+PullSummary SummarisePulls(vector<double> pulls)
 {
+  PullSummary summary;
+  int n=pulls.size();
+  summary.n=n;
+  if (n==0) return summary;
 
-  vector<TH2D*> hists;
-  vector<TH2D*> ave_hists;
-  vector<TH2D*> var_hists;
-
-  string prefix = (isRef)?"ref_":"plt_";
-
-  for (int i=0; i<6; i++)
-  {
-    // Make a histogram to hold the count for each calo location
-    string prefix = (isRef)?"ref_":"plt_";
-    // The binnings etc are all in the header file
-    TH2D *h = new TH2D((prefix+branchName+"_"+CALO_WALL[i]).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
-    if( h->GetSumw2N() == 0 ) h->Sumw2();
-    hists.push_back(h);
-
-    // Another for the value to be averaged (if an average plot)
-    prefix = (isRef)?"refave_":"ave_";
-    TH2D *m = new TH2D((prefix+branchName+"_"+CALO_WALL[i]).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
-    if( m->GetSumw2N() == 0 ) m->Sumw2();
-    ave_hists.push_back(m);
-
-    // And another to histogram the quantity squared, to be used to calculate the error on the mean
-    prefix = (isRef)?"refvar_":"var_";
-    TH2D *v = new TH2D((prefix+branchName+"_"+CALO_WALL[i]).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
-    if( v->GetSumw2N() == 0 ) v->Sumw2();
-    var_hists.push_back(v);
-  }
-
-
-  // Loop the event tree and decode the position
-
-  // Set up a vector of strings to receive the list of calorimeter IDs
-  // There is one entry in the vector for each calorimeter hit in the event
-  // And it will have a format something like [1302:0.1.0.10.*]
-  std::vector<string> *caloHits = 0;
-
-  TTree *thisTree = (isRef)?reftree->CopyTree(""):tree->CopyTree("");
-
-  // Count the number of entries in the tree
-  int nEntries = thisTree -> GetEntries();
-  // Map the branches
-  thisTree->SetBranchAddress(mapBranch.c_str(), &caloHits);
-
-  std::vector<double>  *e_vert_x = 0;
-  std::vector<double>  *e_vert_y = 0;
-  std::vector<double>  *e_vert_z = 0;
-  thisTree->SetBranchAddress("reco.electron_vertex_x", &e_vert_x);
-  thisTree->SetBranchAddress("reco.electron_vertex_y", &e_vert_y);
-  thisTree->SetBranchAddress("reco.electron_vertex_z", &e_vert_z);
-
-  std::vector<string> *trackCaloHits = 0;
-
-  //thisTree->SetBranchAddress("c_calorimeter_hit_map_backscatter", &caloHits);
-  thisTree->SetBranchAddress("reco.track_calo_hits", &trackCaloHits);
-
-  std::vector<double> *toAverage = 0;
-  if (isAverage)
+  double sum=0, sumSquared=0;
+  for (int i=0;i<n;i++)
   {
-    thisTree->SetBranchAddress(fullBranchName.c_str(), &toAverage);
+    sum+=pulls.at(i);
+    sumSquared+=pulls.at(i)*pulls.at(i);
   }
-
-  // Loop through the tree
-  for( int iEntry = 0; iEntry < nEntries; iEntry++ )
+  summary.mean=sum/n;
+  if (n>1) summary.rms=TMath::Sqrt(TMath::Max(0.,(sumSquared-n*summary.mean*summary.mean)/(n-1)));
+  summary.meanError=summary.rms/TMath::Sqrt(n);
+  if (n>1) summary.rmsError=summary.rms/TMath::Sqrt(2.*(n-1));
+
+  sort(pulls.begin(),pulls.end());
+  summary.median=(n%2?pulls.at(n/2):(pulls.at(n/2-1)+pulls.at(n/2))/2);
+  vector<double> deviations(n);
+  for (int i=0;i<n;i++) deviations.at(i)=TMath::Abs(pulls.at(i)-summary.median);
+  std::nth_element(deviations.begin(),deviations.begin()+n/2,deviations.end());
+  summary.mad=1.4826*deviations.at(n/2); // Sigma, for a Gaussian
+  summary.medianError=1.2533*summary.mad/TMath::Sqrt(n); // The median is sqrt(pi/2) times less precise than the mean
+  summary.madError=1.1664*summary.mad/TMath::Sqrt(n); // The MAD is 37% efficient
+
+  // Winsorize: the trimmed pulls are replaced by the nearest ones kept, for the width
+  int nTrim=(int)(PULL_TRIM_FRACTION*n);
+  int nKept=n-2*nTrim;
+  double trimmedSum=0;
+  for (int i=nTrim;i<n-nTrim;i++) trimmedSum+=pulls.at(i);
+  summary.trimmedMean=trimmedSum/nKept;
+  double winsorizedMean=(trimmedSum+nTrim*(pulls.at(nTrim)+pulls.at(n-nTrim-1)))/n;
+  double winsorizedSum=0;
+  for (int i=0;i<n;i++)
   {
-    thisTree->GetEntry(iEntry);
-    // Populate these with which histogram we will fill and what cell
-    int xValue=0;
-    int yValue=0;
-
-    int xValue_vert=0;
-    int yValue_vert=0;
-
-   // TH2D *whichHistogram=0;
-   // TH2D *whichAverage=0; // this is a tad messy
-
-    int whichWall=-1;
-
-//std::cout<< "Entry num "<< iEntry << " with " <<e_vert_x->size() << " electrons - (check calo hits:" << caloHits->size() <<std::endl;
-//std::cout<< "vert X " << e_vert_x->at(0) <<std::endl;
-    for (int i=0;i<e_vert_x->size();i++)
-    {
-      if(abs(e_vert_x->at(i)) == 434.994)
-      {
-
-      //std::cout<< "Y location is " << e_vert_y->at(i) <<std::endl;
-      //xValue_vert = int((e_vert_y->at(i)+2505.494)/(2505.494*2)*20);
-      //yValue_vert = int((e_vert_z->at(i)+1300.)/(1300.*2)*13);
-
-
-      int xValue_vert = 0;
-      int yValue_vert = 0;
-
-      string thisHit=trackCaloHits->at(i);
-
-      if (thisHit.length()>=9)
-      {
-        bool isFrance=(thisHit.substr(8,1)=="1");
-        //Now to decode it
-        string wallType = thisHit.substr(1,4);
-
-        if (wallType=="1302") // Main walls
-        {
-
-          //if (isFrance) whichHistogram = hFrance; else whichHistogram = hItaly;
-          if (isFrance) whichWall = FRANCE; else whichWall = ITALY;
-          string useThisToParse = thisHit;
-
-          // Hacky way to get the bit between the 2nd and 3rd "." characters for x
-          int pos=useThisToParse.find('.');
-          useThisToParse=useThisToParse.substr(pos+1);
-          pos=useThisToParse.find('.');
-          useThisToParse=useThisToParse.substr(pos+1);
-          pos=useThisToParse.find('.');
-          std::string::size_type sz;   // alias of size_t
-          xValue_vert = std::stoi (useThisToParse.substr(0,pos),&sz);
-
-          // and the bit before the next . characters for y
-          useThisToParse=useThisToParse.substr(pos+1);
-          pos=useThisToParse.find_first_of('.');
-          yValue_vert = std::stoi (useThisToParse.substr(0,pos),&sz);
-
-          if (!isFrance)xValue_vert = -1 * (xValue_vert + 1);
-        }
-      }
-
-      if (caloHits->size()>0)
-      {
-        for (int i=0;i<caloHits->size();i++)
-        {
-          string thisHit=caloHits->at(i);
-
-          if (thisHit.length()>=9)
-          {
-            bool isFrance=(thisHit.substr(8,1)=="1");
-            //Now to decode it
-            string wallType = thisHit.substr(1,4);
-
-            if (wallType=="1302") // Main walls
-            {
-
-              //if (isFrance) whichHistogram = hFrance; else whichHistogram = hItaly;
-              if (isFrance) whichWall = FRANCE; else whichWall = ITALY;
-              string useThisToParse = thisHit;
-
-              // Hacky way to get the bit between the 2nd and 3rd "." characters for x
-              int pos=useThisToParse.find('.');
-              useThisToParse=useThisToParse.substr(pos+1);
-              pos=useThisToParse.find('.');
-              useThisToParse=useThisToParse.substr(pos+1);
-              pos=useThisToParse.find('.');
-              std::string::size_type sz;   // alias of size_t
-              xValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-
-              // and the bit before the next . characters for y
-              useThisToParse=useThisToParse.substr(pos+1);
-              pos=useThisToParse.find_first_of('.');
-              yValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-
-              // The numbering is from mountain to tunnel
-              // But we draw the Italian side as we see it, with the mountain on the left
-              // So let's flip it around
-              if (!isFrance)xValue = -1 * (xValue + 1);
-
-              //std::cout<< "VALUES " << xValue << " and " << yValue<<std::endl;
-              if(xValue_vert == xValue && yValue_vert == yValue){
-                //std::cout<< "BACKSCATTERING at xCal = " << xValue << " and yCal = " << yValue <<std::endl;
-                if (whichWall>=0 && mapBranch == "c_calorimeter_hit_map_backscatter")
-                {
-                  //std::cout<< "Part num "<< i << " in entry " << iEntry << " is on CaloWall!"<<std::endl;
-                  std::cout<< "Entry num "<< iEntry << " BACKSCATTERING at xCal = " << xValue << " and yCal = " << yValue <<std::endl;
-                  hists.at(whichWall)->Fill(xValue,yValue);
-                }
-              }
-
-
-            }//end wall
-          } //end if length hit
-        }//end for calo
-      }//end if calo
-    }//end if vert on wall
+    double pull=TMath::Min(TMath::Max(pulls.at(i),pulls.at(nTrim)),pulls.at(n-nTrim-1));
+    winsorizedSum+=pow(pull-winsorizedMean,2);
   }
+  double winsorizedSigma=(n>1?TMath::Sqrt(winsorizedSum/(n-1)):0);
+  summary.trimmedMeanError=winsorizedSigma/((1-2.*nTrim/n)*TMath::Sqrt(n));
+
+  // Winsorized variance of a unit Gaussian, to scale the width to sigma
+  double z=TMath::NormQuantile(1-PULL_TRIM_FRACTION);
+  double gaussianVariance=(1-2*PULL_TRIM_FRACTION)-2*z*TMath::Gaus(z,0,1,kTRUE)+2*PULL_TRIM_FRACTION*z*z;
+  summary.trimmedWidth=winsorizedSigma/TMath::Sqrt(gaussianVariance);
+  summary.trimmedWidthError=summary.trimmedWidth/TMath::Sqrt(2.*(1-2*PULL_TRIM_FRACTION)*n);
+  return summary;
+}
 
+// The pull summary asked for by name, or -1 if we don't know it
+int ParsePullSummary(string mode)
+{
+  if (mode=="median") return PULLS_MEDIAN;
+  if (mode=="moments" || mode=="mean") return PULLS_MOMENTS;
+  if (mode=="trimmed") return PULLS_TRIMMED;
+  if (mode=="fit") return PULLS_FIT;
+  return -1;
+}
 
+vector<TH2D*>MakeCaloPullPlots(vector<TH2D*> vSample, vector<TH2D*> vRef)
+{
+  vector <TH2D*> vPull;
+  if (vSample.size() != vRef.size())
+  { // This should never happen if it only gets called from here
+    cout<<"ERROR: number of sample and reference histograms does not match for "<<vSample.at(0)->GetName()<<endl;
+    return vPull;
+  }
+  for (int i=0;i<vSample.size();i++)
+  {
+    vPull.push_back(PullPlot2D(vSample.at(i), vRef.at(i)));
+  }
+  return vPull;
+}
 
-    // This should always work, but there is next to no catching of badly formatted
-    // geom ID strings. Are they a possibility?
-    if (caloHits->size()>0)
-    {
-      for (int i=0;i<caloHits->size();i++)
-      {
-        string thisHit=caloHits->at(i);
-
-        if (thisHit.length()>=9)
-        {
-          bool isFrance=(thisHit.substr(8,1)=="1");
-          //Now to decode it
-          string wallType = thisHit.substr(1,4);
-
-          if (wallType=="1302") // Main walls
-          {
-
-            //if (isFrance) whichHistogram = hFrance; else whichHistogram = hItaly;
-            if (isFrance) whichWall = FRANCE; else whichWall = ITALY;
-            string useThisToParse = thisHit;
-
-            // Hacky way to get the bit between the 2nd and 3rd "." characters for x
-            int pos=useThisToParse.find('.');
-            useThisToParse=useThisToParse.substr(pos+1);
-            pos=useThisToParse.find('.');
-            useThisToParse=useThisToParse.substr(pos+1);
-            pos=useThisToParse.find('.');
-            std::string::size_type sz;   // alias of size_t
-            xValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-
-            // and the bit before the next . characters for y
-            useThisToParse=useThisToParse.substr(pos+1);
-            pos=useThisToParse.find_first_of('.');
-            yValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-
-            // The numbering is from mountain to tunnel
-            // But we draw the Italian side as we see it, with the mountain on the left
-            // So let's flip it around
-            if (!isFrance)xValue = -1 * (xValue + 1);
-            //cout<<iEntry<<" : " <<thisHit<<" : " <<(isFrance?"Fr.":"It")<<" - "<<xValue<<":"<<yValue<<endl;
-          }
-          else if (wallType == "1232") //x walls
-          {
-            bool isTunnel=(thisHit.substr(10,1)=="1");
-//            if (isTunnel) whichHistogram = hTunnel; else whichHistogram = hMountain;
-            if (isTunnel) whichWall=TUNNEL; else whichWall = MOUNTAIN;
-            // Hacky way to get the bit between the 3rd and 4th "." characters for x
-            string useThisToParse = thisHit;
-            int pos=0;
-            for (int j=0;j<3;j++)
-            {
-              int pos=useThisToParse.find('.');
-              useThisToParse=useThisToParse.substr(pos+1);
-            }
-            pos=useThisToParse.find('.');
-            std::string::size_type sz;   // alias of size_t
-            xValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-
-            // and the bit before the next . characters for y
-            useThisToParse=useThisToParse.substr(pos+1);
-            pos=useThisToParse.find_first_of('.');
-            yValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-            if (!isFrance)xValue = -1 * (xValue + 1); // Italy is on the left so reverse these to draw them
-
-            if (isTunnel) // Switch it so France is on the left for the tunnel side
-            {
-              xValue = -1 * (xValue + 1);
-            }
+// Make the set of histograms (one per wall) that a calorimeter branch will be filled into
+MapAccumulator BookCaloPlotSet(string fullBranchName, string branchName, bool isRef, bool isAverage, string mapBranch)
+{
+  MapAccumulator accumulator={fullBranchName,branchName,mapBranch,isRef,isAverage,true};
+  vector<TH2D*> &hists=accumulator.counts;
+  vector<TH2D*> &ave_hists=accumulator.sums;
+  vector<TH2D*> &var_hists=accumulator.sumsSquared;
 
-            //cout<<iEntry<<" : " <<thisHit<<" : " <<(isFrance?"Fr.":"It")<<" - "<<(isTunnel?"tunnel":"mountain")<<" - "<<xValue<<":"<<yValue<<endl;
+  for (int i=0; i<6; i++)
+  {
+    // Make a histogram to hold the count for each calo location
+    string prefix = (isRef)?"ref_":"plt_";
+    // The binnings etc are all in the header file
+    TH2D *h = new TH2D((prefix+branchName+"_"+CALO_WALL[i]).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
+    if( h->GetSumw2N() == 0 ) h->Sumw2();
+    hists.push_back(h);
 
-          }
-          else if (wallType == "1252") // veto walls
-          {
-            bool isTop=(thisHit.substr(10,1)=="1");
-//            if (isTop) whichHistogram = hTop; else whichHistogram = hBottom;
-            if (isTop) whichWall = TOP; else whichWall = BOTTOM;
-            string useThisToParse = thisHit;
-            int pos=useThisToParse.find('.');
-            for (int j=0;j<4;j++)
-            {
-              useThisToParse=useThisToParse.substr(pos+1);
-              pos=useThisToParse.find('.');
-            }
+    // Another for the value to be averaged (if an average plot)
+    prefix = (isRef)?"refave_":"ave_";
+    TH2D *m = new TH2D((prefix+branchName+"_"+CALO_WALL[i]).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
+    if( m->GetSumw2N() == 0 ) m->Sumw2();
+    ave_hists.push_back(m);
 
-            std::string::size_type sz;   // alias of size_t
-            yValue=((isFrance^isTop)?1:0); // We flip this so that French side is inwards on the print
-            xValue = std::stoi (useThisToParse.substr(0,pos),&sz);
-            //cout<<iEntry<<" : " <<(isFrance?"Fr.":"It")<<" "<<(isTop?"top ":"bottom ")<<xValue<<endl;
-          }
-          else
-          {
-            cout<<"WARNING -- Calo hit found with unknown wall type "<<wallType<<endl;
-            continue; // We can't plot it if we don't know where to plot it
-          }
+    // And another to histogram the quantity squared, to be used to calculate the error on the mean
+    prefix = (isRef)?"refvar_":"var_";
+    TH2D *v = new TH2D((prefix+branchName+"_"+CALO_WALL[i]).c_str(),(CALO_WALL[i]).c_str(),CALO_XBINS[i],CALO_XLO[i],CALO_XHI[i],CALO_YBINS[i],0,CALO_YBINS[i]);
+    if( v->GetSumw2N() == 0 ) v->Sumw2();
+    var_hists.push_back(v);
+  }
+  return accumulator;
+}
 
-          // Now we know which histogram and the coordinates so write it
-          if (whichWall>=0)
-          {
-            if(mapBranch != "c_calorimeter_hit_map_backscatter"){
-            hists.at(whichWall)->Fill(xValue,yValue);
-            if (isAverage)
-            {
-              ave_hists.at(whichWall)->Fill(xValue,yValue,toAverage->at(i)); // Sum it for now and we will divide out by number of hits
-              var_hists.at(whichWall)->Fill(xValue,yValue, pow(toAverage->at(i),2)  ); // Sum the squares for variance calculation
-            }
-          }
-        }
+// Turn the filled calorimeter histograms into the maps we plot: averages with the
+// error on the mean, or counts scaled to the sample size
+vector<TH2D*> FinishCaloPlotSet(MapAccumulator &accumulator)
+{
+  vector<TH2D*> &hists=accumulator.counts;
+  vector<TH2D*> &ave_hists=accumulator.sums;
+  vector<TH2D*> &var_hists=accumulator.sumsSquared;
+  bool isRef=accumulator.isRef;
+  TTree *thisTree=(isRef?reftree:tree);
 
-          else
-          {
-            cout<<"WARNING -- Calo hit found with unknown wall type "<<endl;
-            continue; // We can't plot it if we don't know where to plot it
-          }
-        }// end parsable string
-      } // end for each hit
-    } // End if there are calo hits
-  }
-  if (isAverage)
+  if (accumulator.isAverage)
   {
     for (int i=0;i<hists.size();i++)
     {
-      ave_hists.at(i)->Divide(hists.at(i)); // Go from totals to averages
-
-      var_hists.at(i)->Divide(hists.at(i)); // This should correctly give us the mean of the squares
-
-
-      // Then variance of the sample is n/(n-1) times  mean of (x^2) - (mean of x)^2
-      // Variance on the MEAN is then variance of sample / number of hits
-      // Take the square root of that to get the error on the mean, which is what we need here
-      // Thank you Glen Cowan, "Statistical data analysis"
-      for (int x = 1; x<=hists.at(i)->GetNbinsX(); x++)
-      {
-        for (int y = 1; y<=hists.at(i)->GetNbinsY(); y++)
-        {
-          double nHits = hists.at(i)->GetBinContent(x,y);
-          if (nHits>1)
-          {
-            double meanSquared= pow(ave_hists.at(i)->GetBinContent(x,y),2);
-            double meanOfSquares = var_hists.at(i)->GetBinContent(x,y);
-            double variance =  (meanOfSquares - meanSquared)  * nHits / (nHits - 1);
-            ave_hists.at(i)->SetBinError(x,y, TMath::Sqrt(variance / nHits) );
-          }
-          else
-          { // What's the uncertainty on a single measurement?
-            ave_hists.at(i)->SetBinError(x,y,0);
-          }
-        }
-      }
-      ave_hists.at(i)->Write("",TObject::kOverwrite); // Write the average histograms
+      AverageWithError(hists.at(i), ave_hists.at(i), var_hists.at(i)); // Go from totals to averages
+      histogramWriter.Add(ave_hists.at(i),"calo"); // Write the average histograms
     }
     return ave_hists;
   }
   else
   {
     // Write the histograms to a file
-    double scale=(double)tree->GetEntries()/thisTree->GetEntries(); // Scale to the main tree, if it is a reference tree - otherwise scale is just 1
+    double scale=(double)EntriesUsed(tree)/EntriesUsed(thisTree); // Scale to the main tree, if it is a reference tree - otherwise scale is just 1
     for (int i=0;i<hists.size();i++)
     {
       // If count is 0, set uncertainty to 1
@@ -1162,12 +4853,10 @@ vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string t
         }
       }
       if (isRef) hists.at(i)->Scale(scale);
-      hists.at(i)->Write("",TObject::kOverwrite);
+      histogramWriter.Add(hists.at(i),"calo");
     }
     return hists;
   }
-
-  return hists;
 }
 
 
@@ -1178,8 +4867,7 @@ vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string t
 void PlotTrackerMap(string branchName)
 {
 
-  string config="";
-  config=configParams[branchName]; // get the config loaded from the file if there is one
+  string fullBranchName=branchName;//This is a combo of name and parent for average branches
 
   // Can we do a comparison to the reference for this plot?
   bool hasReferenceBranch=hasValidReference;
@@ -1191,19 +4879,10 @@ void PlotTrackerMap(string branchName)
     if (!hasReferenceBranch) cout<<"WARNING: branch "<<branchName<<" not found in reference file. No comparison plots will be made for this branch"<<endl;
   }
 
-  string title="";
-  // Load the title from the config file
-  if (config.length()>0)
-  {
-    // title is the only thing for this one
-    title=GetBitBeforeComma(config); // config now has this bit chopped off ready for the next parsing stage
-  }
-
-  string fullBranchName=branchName;//This is a combo of name and parent for average branches
   // is it an average?
   string mapBranch=branchName;
   bool isAverage=false;
-  if (branchName[1]=='m')
+  if (branchName[1]=='m' || branchName[1]=='d')
   {
     // In this case, the branch name should be split in two with a . character
     int pos=branchName.find(".");
@@ -1229,32 +4908,31 @@ void PlotTrackerMap(string branchName)
     isAverage=true;
   }
 
-  // Set the title to a default if there isn't anything in the config file
-  if (title.length()==0)
+  string title=MapTitle(fullBranchName,branchName); // from the config file if there is one
+
+  // Make the plot
+  // The sample and reference maps were filled in the shared pass over the trees (FillAllMaps)
+  if (!sampleMaps.count(fullBranchName))
   {
-    title = BranchNameToEnglish(branchName);
+    cout<<"ERROR: no map was filled for "<<fullBranchName<<endl;
+    return;
   }
+  if (hasReferenceBranch && !refMaps.count(fullBranchName)) hasReferenceBranch=false;
 
-  // Make the plot
-  TCanvas *c = new TCanvas (("plot_"+branchName).c_str(),("plot_"+branchName).c_str(),600,1200);
-  TH2D *h=TrackerMapHistogram(fullBranchName,branchName, title, false, isAverage, mapBranch);
+  TH2D *h=FinishTrackerMap(sampleMaps[fullBranchName]);
   if( h->GetSumw2N() == 0 )h->Sumw2();
-  h->Draw("COLZ0");
-  c->SetRightMargin(0.15);
-  OverlayWhiteForNaN(h);
-  AnnotateTrackerMap();
 
   // Save to a ROOT file and to a PNG
-  h->Write("",TObject::kOverwrite);
-  c->SaveAs((plotdir+"/"+branchName+".png").c_str());
+  histogramWriter.Add(h,"tracker");
+  if (makeImages) PrintTrackerMap(h,plotdir+"/"+branchName+".png",h->GetMinimum(),h->GetMaximum());
 
   // If there is a reference plot, make a pull plot
   if (hasReferenceBranch)
   {
-    TH2D *href=TrackerMapHistogram(fullBranchName,branchName, title, true, isAverage, mapBranch);
+    TH2D *href=FinishTrackerMap(refMaps[fullBranchName]);
     if( href->GetSumw2N() == 0 )href->Sumw2();
 
-    double scale=(double)tree->GetEntries()/(double)reftree->GetEntries();
+    double scale=(double)EntriesUsed(tree)/(double)EntriesUsed(reftree);
     if (!isAverage) href->Scale(scale); // Normalise it if it is a plot of counts. Don't normalise it if it is an average plot; the number of entries shouldn't matter
 
     Double_t ks = h->KolmogorovTest(href);
@@ -1264,32 +4942,47 @@ void PlotTrackerMap(string branchName)
 
     cout<<"Kolmogorov: "<<ks<<endl;
     cout<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+    RecordComparison(chisq, ndf, p_value, ks);
 
     // Write to output file
     textOut<<branchName<<":"<<endl;
     textOut<<"KS score: "<<ks<<endl;
     textOut<<"P-value: "<<p_value<<" Chi-square: "<<chisq<<" / "<<ndf<<" DoF = "<<chisq/(double)ndf<<endl;
+    WriteEntriesUsed();
+    RunToys(vector<TH1*>(1,h), vector<TH1*>(1,href), isAverage, scale, 1);
 
     TH2D *hPull = PullPlot2D(h,href);
     CheckTrackerPull(hPull,title);
-    gStyle->SetPalette(PULL_PALETTE);
     hPull->GetZaxis()->SetRangeUser(-4,4);
-    hPull->Draw("COLZ0");
-    OverlayWhiteForNaN(hPull);
-    AnnotateTrackerMap();
-    hPull->Write("",TObject::kOverwrite);
-    c->SaveAs((plotdir+"/pull_"+branchName+".png").c_str());
-
-    gStyle->SetPalette(PALETTE);
+    histogramWriter.Add(hPull,"pulls");
+    if (makeImages)
+    {
+      gStyle->SetPalette(PULL_PALETTE);
+      PrintTrackerMap(hPull,plotdir+"/pull_"+branchName+".png",-4,4);
+      gStyle->SetPalette(PALETTE);
+    }
     delete hPull;
-    textOut<<endl;
   }
+  CompareDistributions(sampleMaps[fullBranchName], (hasReferenceBranch?&refMaps[fullBranchName]:0), title);
+  if (hasReferenceBranch) textOut<<endl;
 
   delete h;
-  delete c;
 
 }
 
+// Save an image of a tracker map, with the fast renderer if it can, or else a canvas
+void PrintTrackerMap(TH2D *h, string fileName, double min, double max)
+{
+  if (WriteTrackerImage(h,fileName,min,max)) return;
+  TCanvas *c = new TCanvas (("plot_"+string(h->GetName())).c_str(),("plot_"+string(h->GetName())).c_str(),600,1200);
+  c->SetRightMargin(0.15);
+  h->Draw("COLZ0");
+  OverlayWhiteForNaN(h);
+  AnnotateTrackerMap();
+  c->SaveAs(fileName.c_str());
+  delete c;
+}
+
 // Draw the foil and label the French/Italian sides and Tunnel/Mountain ends
 void AnnotateTrackerMap()
 {
@@ -1337,7 +5030,7 @@ TH2D *PullPlot2D(TH2D *hSample, TH2D *hRef )
       }
   }
   hPull->GetZaxis()->SetRangeUser(-4.,4.);
-  hPull->Write("",TObject::kOverwrite);
+  histogramWriter.Add(hPull,"pulls");
   return hPull;
 }
 
@@ -1347,7 +5040,8 @@ double CheckTrackerPull(TH2D *hPull, string title)
 {
   bool problemPulls=false;
   double totalPull=0;
-  int pullCells=0;
+  vector<double> pulls;
+  vector<string> noData; // Cells without enough data for a pull
 
   string firstName=hPull->GetName();
   string hPullName="allpulls"+firstName.substr(4);
@@ -1363,24 +5057,29 @@ double CheckTrackerPull(TH2D *hPull, string title)
       if (!std::isnan(pull))
       {
         totalPull+=pull;
-        pullCells++;
+        pulls.push_back(pull);
         h1Pulls->Fill(pull);
       }
       else
       {
-        if (x > MAX_TRACKER_LAYERS)
-          textOut<<"Layer "<<x - MAX_TRACKER_LAYERS<<" (France), row "<<y<<": not enough data to calculate pull"<<endl;
-        else textOut<<"Layer "<< MAX_TRACKER_LAYERS + 1 - x<<" (Italy), row "<<y<<": not enough data to calculate pull"<<endl;      }
+        if (x > MAX_TRACKER_LAYERS) noData.push_back(Form("layer %d (France), row %d",x - MAX_TRACKER_LAYERS,y));
+        else noData.push_back(Form("layer %d (Italy), row %d",MAX_TRACKER_LAYERS + 1 - x,y));
+      }
       // Report any cells where sample and reference are too different
       if (TMath::Abs(pull) > REPORT_PULLS_OVER)
       {
+        string cellName;
         if (x > MAX_TRACKER_LAYERS)
-          textOut<<"Layer "<<x - MAX_TRACKER_LAYERS<<" (France), row "<<y<<": pull = "<<pull<<endl;
-        else textOut<<"Layer "<< MAX_TRACKER_LAYERS + 1 - x<<" (Italy), row "<<y<<": pull = "<<pull<<endl;
+          cellName=Form("Layer %d (France), row %d",x - MAX_TRACKER_LAYERS,y);
+        else cellName=Form("Layer %d (Italy), row %d",MAX_TRACKER_LAYERS + 1 - x,y);
+        textOut<<cellName<<": pull = "<<pull<<endl;
+        FlaggedCell cell={cellName,pull};
+        branchResult.flaggedCells.push_back(cell);
         problemPulls=true;
       }
     }
   }
+  ReportCellsWithoutPulls(noData);
   if (problemPulls)
   {
     textOut<<"Layers are numbered 1 to 9, with 1 nearest the foil. Rows count from mountain (1) to tunnel ("<<MAX_TRACKER_ROWS<<")."<<endl;
@@ -1392,21 +5091,23 @@ double CheckTrackerPull(TH2D *hPull, string title)
   {
     cout<<"Pull is zero - plots are identical"<<endl;
     textOut<<"Pull is zero - plots are identical"<<endl;
+    branchResult.meanPull=0;
+    branchResult.rmsPull=0;
   }
   else
   {
-    // If not, plot all the pulls and fit to a Gaussian
-    PrintPlotOfPulls(h1Pulls,pullCells,title);
+    // If not, plot all the pulls and sum them up
+    PrintPlotOfPulls(h1Pulls,pulls,title);
   }
   return totalPull;
 }
 
-// Make the tracker map histogram (either counts or averages, depending on whether there is a map branch)
+// Make the histograms for a tracker map (either counts or averages, depending on whether there is a map branch)
 // The formatting and decision-making about what goes into the histogram is done separately,
-// this just loops the tree and fills the histogram
-TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch)
+// this just books the histograms that FillMaps will fill
+MapAccumulator BookTrackerMap(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch)
 {
-  TTree *inputTree = (isRef?reftree:tree);
+  MapAccumulator accumulator={fullBranchName,branchName,mapBranch,isRef,isAverage,false};
 
   string tmpName="plt_"+branchName;
   if (isRef) tmpName = "ref_"+tmpName;
@@ -1424,77 +5125,23 @@ TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title
     TH2D *hQuantitySquared = new TH2D(tmpName.c_str(),title.c_str(),MAX_TRACKER_LAYERS*2,MAX_TRACKER_LAYERS*-1,MAX_TRACKER_LAYERS,MAX_TRACKER_ROWS,0,MAX_TRACKER_ROWS); // Use this to get the standard deviation of the measurements
     if( hQuantitySquared->GetSumw2N() == 0 )hQuantitySquared->Sumw2(); // Important to get errors right
 
-    // This decodes the encoded tracker map to extract the x and y positions
-
-    // Unfortunately it is not so easy to make the averages plot so we need to loop the tuple
-    std::vector<int> *trackerHits = 0;
-    std::vector<double> *toAverageTrk = 0;
-    TTree *thisTree=inputTree->CopyTree("");
-    thisTree->SetBranchAddress(mapBranch.c_str(), &trackerHits);
-
-    if (isAverage)
-    {
-      thisTree->SetBranchAddress(fullBranchName.c_str(), &toAverageTrk);
-    }
-
-    // Now we can fill the two plots
-    // Loop through the tree
+  accumulator.counts.push_back(h);
+  accumulator.sums.push_back(hAve);
+  accumulator.sumsSquared.push_back(hQuantitySquared);
+  return accumulator;
+}
 
-    int nEntries = thisTree -> GetEntries();
-    for( int iEntry = 0; iEntry < nEntries; iEntry++ )
-    {
-      thisTree->GetEntry(iEntry);
-      // Populate these with which histogram we will fill and what cell
-      int xValue=0;
-      int yValue=0;
-      if (trackerHits->size()>0)
-      {
-        for (int i=0;i<trackerHits->size();i++)
-        {
-          yValue=TMath::Abs(trackerHits->at(i)/100);
-          xValue=trackerHits->at(i)%100;
-          if (isAverage && !std::isnan(toAverageTrk->at(i)))
-          {
-            hAve->Fill(xValue,yValue,toAverageTrk->at(i)); // Ignore the uncertainties
-            hQuantitySquared->Fill(xValue,yValue,pow(toAverageTrk->at(i),2)); // We will use this to calculate uncertainty
-            h->Fill(xValue,yValue); // Only fill this if there is something to average over! We don't want to divide by a denominator that includes hits with no useful info. Obviously the best thing would be to not put that stuff in the tuple in the first place, but this works as a protection in case you do
-          }
-          if (!isAverage)
-          {
-            h->Fill(xValue,yValue); // We will take the lot!
-          }
-        }
-      }
-    } // Loop all entries
+// Turn the filled tracker histograms into the map we plot: the average and its
+// error on the mean for each cell, or the count
+TH2D *FinishTrackerMap(MapAccumulator &accumulator)
+{
+  TH2D *h=accumulator.counts.at(0);
+  TH2D *hAve=accumulator.sums.at(0);
+  TH2D *hQuantitySquared=accumulator.sumsSquared.at(0);
 
-    if (isAverage)
+    if (accumulator.isAverage)
     {
-      hAve->Divide(h); // This should correctly give us the mean
-      hQuantitySquared->Divide(h); // This should correctly give us the mean of the squares
-
-
-      // Then variance of the sample is n/(n-1) times  mean of (x^2) - (mean of x)^2
-      // Variance on the MEAN is then variance of sample / number of hits
-      // Take the square root of that to get the error on the mean, which is what we need here
-      // Thank you Glen Cowan, "Statistical data analysis"
-      for (int x = 1; x<=h->GetNbinsX(); x++)
-      {
-        for (int y = 1; y<=h->GetNbinsY(); y++)
-        {
-          double nHits = h->GetBinContent(x,y);
-          if (nHits>1)
-          {
-            double meanSquared= pow(hAve->GetBinContent(x,y),2);
-            double meanOfSquares = hQuantitySquared->GetBinContent(x,y);
-            double variance =  (meanOfSquares - meanSquared)  * nHits / (nHits - 1);
-            hAve->SetBinError(x,y, TMath::Sqrt(variance / nHits) );
-          }
-          else
-          { // Don't know the variance on a single measurement...
-            hAve->SetBinError(x,y,0);
-          }
-        }
-      }
+      AverageWithError(h, hAve, hQuantitySquared);
       h=hAve; // overwrite the temp plot with the one we actually want to save
     }
     else
@@ -1513,6 +5160,39 @@ TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title
   return h;
 }
 
+/**
+ *  Turn the sums of a map into averages, with the error on the mean of each cell.
+ *  The sums of squares become the means of the squares
+ */
+void AverageWithError(TH2D *counts, TH2D *sums, TH2D *sumsSquared)
+{
+  sums->Divide(counts); // This should correctly give us the mean
+  sumsSquared->Divide(counts); // This should correctly give us the mean of the squares
+
+  // Then variance of the sample is n/(n-1) times  mean of (x^2) - (mean of x)^2
+  // Variance on the MEAN is then variance of sample / number of hits
+  // Take the square root of that to get the error on the mean, which is what we need here
+  // Thank you Glen Cowan, "Statistical data analysis"
+  for (int x = 1; x<=counts->GetNbinsX(); x++)
+  {
+    for (int y = 1; y<=counts->GetNbinsY(); y++)
+    {
+      double nHits = counts->GetBinContent(x,y);
+      if (nHits>1)
+      {
+        double meanSquared= pow(sums->GetBinContent(x,y),2);
+        double meanOfSquares = sumsSquared->GetBinContent(x,y);
+        double variance =  (meanOfSquares - meanSquared)  * nHits / (nHits - 1);
+        sums->SetBinError(x,y, TMath::Sqrt(variance / nHits) );
+      }
+      else
+      { // Don't know the variance on a single measurement...
+        sums->SetBinError(x,y,0);
+      }
+    }
+  }
+}
+
 // Just a quick routine to write text at a (x,y) coordinate
 void WriteLabel(double x, double y, string text, double size)
 {
@@ -1603,7 +5283,7 @@ void OverlayWhiteForNaN(TH2D *hist)
   }
 }
 
-// Arrange all the bits of calorimeter on a canvas
+// Save an image of the calorimeter walls, all on the same scale
 void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
 {
   if (histos.size() !=6)
@@ -1611,7 +5291,33 @@ void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
     cout<<"Unable to print calorimeter map for "<<branchName<<" as we do not have 6 input histograms"<<endl;
     return;
   }
-  TCanvas *c = new TCanvas ("caloplots","caloplots",2000,1000);
+  if (!makeImages) return;
+
+  // Set them all to the same scale; first work out what it should be
+  double max=-9999;
+  double min=0;
+  for (int i=0;i<histos.size();i++)
+  {
+    max=TMath::Max(max,(double)histos.at(i)->GetMaximum());
+    min=TMath::Min(min,(double)histos.at(i)->GetMinimum());
+  }
+  if (min>0)min=0;
+  if (WriteCaloImage(histos,plotdir+"/"+branchName+".png",min,max,title)) return;
+
+  TCanvas *c=DrawCaloCanvas(histos,title,min,max,false);
+  c->SaveAs((plotdir+"/"+branchName+".png").c_str());
+
+  delete c;
+  return;
+}
+
+/**
+ *  Arrange all the bits of calorimeter on a canvas. For the layout of the fast
+ *  renderer, just the axes, grids and labels are drawn
+ */
+TCanvas *DrawCaloCanvas(vector <TH2D*> histos, string title, double min, double max, bool layoutOnly)
+{
+  TCanvas *c = new TCanvas ((layoutOnly?"layout_calo":"caloplots"),"caloplots",2000,1000);
   // Easier if we name them!
   TH2D *hItaly=histos.at(0);
   TH2D *hFrance=histos.at(1);
@@ -1658,17 +5364,10 @@ void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
 
   gStyle->SetOptTitle(0);
 
-  // Set them all to the same scale; first work out what it should be
-  double max=-9999;
-  double min=0;
-  for (int i=0;i<histos.size();i++)
+  for (int i=0;i<pads.size();i++)
   {
-    max=TMath::Max(max,(double)histos.at(i)->GetMaximum());
-    min=TMath::Min(min,(double)histos.at(i)->GetMinimum());
-    // While we are here, let's draw the pads
     pads.at(i)->Draw();pads.at(i)->SetGrid();
   }
-  if (min>0)min=0;
   gStyle->SetGridStyle(3);
   gStyle->SetGridColor(kGray);
   for (int i=0;i<histos.size();i++)
@@ -1689,15 +5388,16 @@ void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
   }
 
   hItaly->GetXaxis()->SetLabelSize(0.06);
-  hItaly->Draw("COLZ0"); // Only have the scale over on the right
+  string option=(layoutOnly?"AXIS":"COL0");
+  hItaly->Draw((layoutOnly?"AXIS":"COLZ0")); // Only have the scale over on the right
 
-  OverlayWhiteForNaN(hItaly);
+  if (!layoutOnly) OverlayWhiteForNaN(hItaly);
   WriteLabel(.45,.95,"Italy");
 
   // French main wall
   pFrance->cd();
-  hFrance->Draw("COL0");
-  OverlayWhiteForNaN(hFrance);
+  hFrance->Draw(option.c_str());
+  if (!layoutOnly) OverlayWhiteForNaN(hFrance);
   WriteLabel(.4,.95,"France");
 
   // Mountain x wall
@@ -1710,8 +5410,8 @@ void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
   hMountain->GetXaxis()->SetBinLabel(4,"Fr.");
   hMountain->GetXaxis()->SetLabelSize(0.2);
 
-  hMountain->Draw("COL0");
-  OverlayWhiteForNaN(hMountain);
+  hMountain->Draw(option.c_str());
+  if (!layoutOnly) OverlayWhiteForNaN(hMountain);
   WriteLabel(.2,.95,"Mountain",0.15);
   // Draw on the source foil
   TLine *foil=new TLine(0,0,0,16);
@@ -1728,15 +5428,15 @@ void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
   hTunnel->GetXaxis()->SetBinLabel(3,"");
   hTunnel->GetXaxis()->SetBinLabel(4,"It.");
   hTunnel->GetXaxis()->SetLabelSize(0.2);
-  hTunnel->Draw("COL0");
-  OverlayWhiteForNaN(hTunnel);
+  hTunnel->Draw(option.c_str());
+  if (!layoutOnly) OverlayWhiteForNaN(hTunnel);
   WriteLabel(.25,.95,"Tunnel",0.15);
   foil->Draw("SAME");
 
   // Top veto wall
   pTop->cd();
-  hTop->Draw("COL0");
-  OverlayWhiteForNaN(hTop);
+  hTop->Draw(option.c_str());
+  if (!layoutOnly) OverlayWhiteForNaN(hTop);
 
   hTop->GetXaxis()->SetLabelSize(0.1);
   hTop->GetYaxis()->SetLabelSize(0.15);
@@ -1751,18 +5451,278 @@ void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos)
   pBottom->cd();
   hBottom->GetXaxis()->SetLabelSize(0.1);
   hBottom->GetYaxis()->SetLabelSize(0.15);
-  hBottom->Draw("COL0");
-  OverlayWhiteForNaN(hBottom);
+  hBottom->Draw(option.c_str());
+  if (!layoutOnly) OverlayWhiteForNaN(hBottom);
   foilveto->Draw("SAME");
   WriteLabel(.42,.6,"Bottom",0.2);
 
-  pTitle->cd();
-  WriteLabel(.1,.5,title,0.2);
+  if (!layoutOnly)
+  {
+    pTitle->cd();
+    WriteLabel(.1,.5,title,0.2);
+  }
+  c->cd();
+  return c;
+}
 
-  c->SaveAs((plotdir+"/"+branchName+".png").c_str());
+/**
+ *  Write the image of a tracker map with the fast renderer (see MapRaster.h). False if
+ *  it can't be used, in which case the map should be drawn on a canvas as before
+ */
+bool WriteTrackerImage(TH2D *h, string fileName, double min, double max)
+{
+  if (!useMapRaster) return false;
+  if (!trackerRaster) trackerRaster=MakeTrackerRaster(h);
+  if (!trackerRaster)
+  {
+    cout<<"WARNING: could not make the layout for the fast map images - drawing them on canvases instead"<<endl;
+    useMapRaster=false;
+    return false;
+  }
+  vector<vector<double> > cells(1,CellValues(h));
+  vector<uint32_t> bands=PaletteBands(h);
+  vector<RasterTick> ticks=PaletteTicks(min,max);
+  return trackerRaster->Write(fileName,cells,min,max,bands,ticks,(gStyle->GetOptTitle()?h->GetTitle():""));
+}
+
+// The same for the six walls of a calorimeter map
+bool WriteCaloImage(vector<TH2D*> histos, string fileName, double min, double max, string title)
+{
+  if (!useMapRaster) return false;
+  if (!caloRaster) caloRaster=MakeCaloRaster(histos);
+  if (!caloRaster)
+  {
+    cout<<"WARNING: could not make the layout for the fast map images - drawing them on canvases instead"<<endl;
+    useMapRaster=false;
+    return false;
+  }
+  vector<vector<double> > cells;
+  for (int i=0;i<histos.size();i++) cells.push_back(CellValues(histos.at(i)));
+  vector<uint32_t> bands=PaletteBands(histos.at(0));
+  vector<RasterTick> ticks=PaletteTicks(min,max);
+  return caloRaster->Write(fileName,cells,min,max,bands,ticks,title);
+}
 
+// Draw the frame of a tracker map once, with its annotations, for the fast renderer
+MapRaster *MakeTrackerRaster(TH2D *h)
+{
+  TCanvas *c = new TCanvas ("layout_tracker","layout_tracker",600,1200);
+  c->SetRightMargin(0.15);
+  TH2D *frame=(TH2D*)h->Clone("layout_tracker_frame");
+  frame->Reset();
+  frame->SetTitle(""); // Each map draws its own
+  frame->Draw("AXIS");
+  AnnotateTrackerMap();
+  vector<uint32_t> pixels;
+  MapRaster *raster=0;
+  if (CanvasPixels(c,pixels))
+  {
+    raster=new MapRaster(c->GetWw(),c->GetWh(),pixels);
+    RasterGrid grid=FrameGrid(c,frame);
+    raster->AddGrid(grid);
+    raster->SetPaletteBar(PaletteBarGrid(c,grid),RasterFontOf(gStyle->GetLabelFont("Z"),PadTextPixels(c,h->GetZaxis()->GetLabelSize())));
+    // The title goes at the top in the middle, as the default style puts it
+    RasterFont *titleFont=RasterFontOf(gStyle->GetTitleFont(""),PadTextPixels(c,0.05));
+    raster->SetTitle(titleFont,c->GetWw()/2,(int)(0.01*c->GetWh())+titleFont->GetDigitHeight(),true);
+  }
   delete c;
-  return;
+  delete frame;
+  return raster;
+}
+
+// Draw the walls of a calorimeter map once, with their labels, for the fast renderer
+MapRaster *MakeCaloRaster(vector<TH2D*> histos)
+{
+  vector<TH2D*> frames;
+  for (int i=0;i<histos.size();i++)
+  {
+    frames.push_back((TH2D*)histos.at(i)->Clone(("layout_"+CALO_WALL[i]).c_str()));
+    frames.back()->Reset();
+  }
+  TCanvas *c=DrawCaloCanvas(frames,"",0,1,true);
+  vector<uint32_t> pixels;
+  MapRaster *raster=0;
+  if (CanvasPixels(c,pixels))
+  {
+    raster=new MapRaster(c->GetWw(),c->GetWh(),pixels);
+    // The pads of the walls, in the order of the histograms
+    string padNames[6]={"p_italy","p_france","p_tunnel","p_mountain","p_top","p_bottom"};
+    for (int i=0;i<frames.size();i++)
+    {
+      TVirtualPad *pad=(TVirtualPad*)c->GetPrimitive(padNames[i].c_str());
+      RasterGrid grid=FrameGrid(pad,frames.at(i));
+      raster->AddGrid(grid);
+      if (i==0) raster->SetPaletteBar(PaletteBarGrid(pad,grid),RasterFontOf(gStyle->GetLabelFont("Z"),PadTextPixels(pad,frames.at(i)->GetZaxis()->GetLabelSize())));
+    }
+    // Where DrawCaloCanvas writes the title
+    TVirtualPad *pTitle=(TVirtualPad*)c->GetPrimitive("p_title");
+    int left=pTitle->XtoAbsPixel(pTitle->GetX1());
+    int right=pTitle->XtoAbsPixel(pTitle->GetX2());
+    int top=pTitle->YtoAbsPixel(pTitle->GetY2());
+    int bottom=pTitle->YtoAbsPixel(pTitle->GetY1());
+    raster->SetTitle(RasterFontOf(gStyle->GetTextFont(),PadTextPixels(pTitle,0.2)),left+(int)(0.1*(right-left)),bottom-(int)(0.5*(bottom-top)),false);
+  }
+  delete c;
+  for (int i=0;i<frames.size();i++) delete frames.at(i);
+  return raster;
+}
+
+// The pixels of a drawn canvas, as 0xAARRGGBB. False if there is no image library to draw them
+bool CanvasPixels(TCanvas *c, vector<uint32_t> &pixels)
+{
+  c->Update();
+  TImage *image=TImage::Create();
+  if (!image) return false;
+  image->FromPad(c);
+  UInt_t *argb=image->GetArgbArray();
+  bool ok=(argb && image->GetWidth()==c->GetWw() && image->GetHeight()==c->GetWh());
+  if (ok) pixels.assign(argb,argb+(size_t)image->GetWidth()*image->GetHeight());
+  delete image;
+  return ok;
+}
+
+// Where the cells of a histogram drawn on a pad are, in pixels of the canvas
+RasterGrid FrameGrid(TVirtualPad *pad, TH2D *h)
+{
+  RasterGrid grid;
+  grid.left=pad->XtoAbsPixel(pad->GetUxmin());
+  grid.right=pad->XtoAbsPixel(pad->GetUxmax());
+  grid.top=pad->YtoAbsPixel(pad->GetUymax());
+  grid.bottom=pad->YtoAbsPixel(pad->GetUymin());
+  grid.nX=h->GetNbinsX();
+  grid.nY=h->GetNbinsY();
+  return grid;
+}
+
+// Where ROOT puts the palette of a COLZ plot: just to the right of the frame,
+// from half a percent to 5% of the width of the pad beyond it
+RasterGrid PaletteBarGrid(TVirtualPad *pad, RasterGrid frame)
+{
+  int padWidth=pad->XtoAbsPixel(pad->GetX2())-pad->XtoAbsPixel(pad->GetX1());
+  RasterGrid bar=frame;
+  bar.left=frame.right+(int)(0.005*padWidth);
+  bar.right=frame.right+(int)(0.05*padWidth);
+  bar.nX=1;
+  bar.nY=1;
+  return bar;
+}
+
+// Text sizes are a fraction of the width or height of the pad, whichever is smaller
+int PadTextPixels(TVirtualPad *pad, double size)
+{
+  int width=pad->XtoAbsPixel(pad->GetX2())-pad->XtoAbsPixel(pad->GetX1());
+  int height=pad->YtoAbsPixel(pad->GetY1())-pad->YtoAbsPixel(pad->GetY2());
+  return TMath::Max(1,(int)(size*TMath::Min(width,height)));
+}
+
+/**
+ *  The glyphs of a font at a size, for the fast renderer. ROOT draws every printable
+ *  character once, each in its own cell of a canvas, and they are cut out of its image.
+ *  Each font is only made once
+ */
+RasterFont *RasterFontOf(int font, int pixelSize)
+{
+  static map<pair<int,int>,RasterFont*> fonts;
+  pair<int,int> key(font,pixelSize);
+  if (fonts.count(key)) return fonts[key];
+
+  int cellWidth=2*pixelSize;
+  int cellHeight=2*pixelSize;
+  int nColumns=16;
+  int nRows=6; // Characters 32 to 127
+  TCanvas *c = new TCanvas ("raster_glyphs","raster_glyphs",nColumns*cellWidth+50,nRows*cellHeight+50);
+  c->cd();
+  int width=c->GetWw();
+  int height=c->GetWh();
+  TText text;
+  text.SetTextFont((font/10)*10+3); // Precision 3: the size is in pixels
+  text.SetTextSize(pixelSize);
+  text.SetTextAlign(11);
+  text.SetNDC();
+  vector<UInt_t> advances;
+  for (int i=0;i<nColumns*nRows;i++)
+  {
+    string character(1,(char)(32+i));
+    int x=(i%nColumns)*cellWidth;
+    int baseline=(i/nColumns)*cellHeight+(3*pixelSize)/2;
+    UInt_t advance=0;
+    text.GetTextAdvance(advance,character.c_str());
+    advances.push_back(advance);
+    if (character!=" ") text.DrawText((double)x/width,1-(double)baseline/height,character.c_str());
+  }
+
+  vector<uint32_t> pixels;
+  RasterFont *rasterFont=new RasterFont(cellHeight);
+  if (CanvasPixels(c,pixels))
+  {
+    // Ink is whatever isn't white: black text on a white canvas
+    for (int i=0;i<nColumns*nRows;i++)
+    {
+      int glyphWidth=TMath::Min((int)advances.at(i),cellWidth);
+      vector<unsigned char> coverage(glyphWidth*cellHeight,0);
+      for (int row=0;row<cellHeight;row++)
+      {
+        for (int column=0;column<glyphWidth;column++)
+        {
+          uint32_t pixel=pixels.at((size_t)((i/nColumns)*cellHeight+row)*width+(i%nColumns)*cellWidth+column);
+          int brightness=(((pixel>>16)&0xFF)+((pixel>>8)&0xFF)+(pixel&0xFF))/3;
+          coverage.at(row*glyphWidth+column)=255-brightness;
+        }
+      }
+      rasterFont->AddGlyph((char)(32+i),glyphWidth,coverage);
+    }
+  }
+  delete c;
+  fonts[key]=rasterFont;
+  return rasterFont;
+}
+
+// The contents of a map, cell by cell, as the fast renderer numbers them
+vector<double> CellValues(TH2D *h)
+{
+  vector<double> cells;
+  for (int x=1;x<=h->GetNbinsX();x++)
+  {
+    for (int y=1;y<=h->GetNbinsY();y++) cells.push_back(h->GetBinContent(x,y));
+  }
+  return cells;
+}
+
+// The colours ROOT's COL option would give the contour bands of a histogram, from the current palette
+vector<uint32_t> PaletteBands(TH2D *h)
+{
+  int nBands=TMath::Abs(h->GetContour());
+  if (nBands==0) nBands=gStyle->GetNumberContours();
+  int nColours=gStyle->GetNumberOfColors();
+  vector<uint32_t> bands;
+  for (int band=0;band<nBands;band++)
+  {
+    int colourIndex=TMath::Min((int)((band+0.99)*nColours/nBands),nColours-1);
+    TColor *colour=gROOT->GetColor(gStyle->GetColorPalette(colourIndex));
+    float r=1, g=1, b=1;
+    if (colour) colour->GetRGB(r,g,b);
+    bands.push_back(MapRaster::Rgb(r,g,b));
+  }
+  return bands;
+}
+
+// Tick marks for the palette axis, where ROOT would put them
+vector<RasterTick> PaletteTicks(double min, double max)
+{
+  vector<RasterTick> ticks;
+  if (!(max>min)) return ticks;
+  double binLow, binHigh, binWidth;
+  int nBins;
+  TGaxis::Optimize(min,max,10,binLow,binHigh,nBins,binWidth,"");
+  for (int i=0;i<=nBins;i++)
+  {
+    double value=binLow+i*binWidth;
+    if (TMath::Abs(value)<1e-9*binWidth) value=0;
+    if (value<min-1e-9*binWidth || value>max+1e-9*binWidth) continue;
+    RasterTick tick={value,Form("%g",value)};
+    ticks.push_back(tick);
+  }
+  return ticks;
 }
 
 double ChiSquared(TH1 *h1, TH1 *h2, double &chisq, int &ndf, bool isAverage)
@@ -1794,6 +5754,10 @@ double ChiSquared(TH1 *h1, TH1 *h2, double &chisq, int &ndf, bool isAverage)
         continue;
       }
 
+      // Empty map cells are given an error of 1 so that they can be compared with filled ones,
+      // but a cell that is empty on both sides says nothing and mustn't add a degree of freedom
+      if (!isAverage && val1 == 0 && val2 == 0) continue;
+
       ndf++;
       double numerator = pow((val1 - val2), 2);
       double denominator = pow(err1,2) + pow(err2,2);
@@ -2,24 +2,36 @@
 // Standard Library
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include "boost/algorithm/string.hpp"
 #include "boost/filesystem.hpp"
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <cstdio>
 #include <memory>
 #include <stdexcept>
 #include <string>
 #include <array>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <set>
+#include <sys/resource.h>
 
 // ROOT
 #include "TFile.h"
 #include "TTree.h"
 #include "TH1.h"
 #include "TH2.h"
+#include "THnSparse.h"
 #include "TCanvas.h"
+#include "TImage.h"
+#include "TColor.h"
+#include "TGaxis.h"
 #include "TLine.h"
 #include "TText.h"
 #include "TROOT.h"
@@ -31,6 +43,30 @@
 #include "TPaveText.h"
 #include "TLatex.h"
 #include "TF1.h"
+#include "TTreeFormula.h"
+#include "TEntryList.h"
+#include "TLeaf.h"
+#include "TMath.h"
+#include "TKey.h"
+#include "TParameter.h"
+#include "TObjString.h"
+#include "TEnv.h"
+#include "TStopwatch.h"
+#include "TTreeCacheUnzip.h"
+#include "Compression.h"
+
+// Per-branch statistics and the store they are appended to
+#include "ResultsStore.h"
+#include "QuantileSketch.h"
+#include "HistogramWriter.h"
+#include "ToyEngine.h"
+#include "HitCache.h"
+#include "MapRaster.h"
+#include "Logger.h"
+#include "CovarianceMatrix.h"
+#include "EventIndex.h"
+#include "ReferenceStore.h"
+#include "PlotServer.h"
 
 
 using namespace std;
@@ -56,6 +92,68 @@ int PULL_PALETTE=kThermometer;
 // is more than this many sigma
 double REPORT_PULLS_OVER=3.;
 
+// How the pulls of a map are summed up (--pull-summary): by their mean and standard
+// deviation, their median and MAD, a trimmed mean and width, or a Gaussian fit
+enum PULL_SUMMARY {PULLS_MOMENTS, PULLS_MEDIAN, PULLS_TRIMMED, PULLS_FIT};
+double PULL_TRIM_FRACTION=0.1; // Left out at each end for the trimmed estimators
+
+// Size limits for the read cache of each tree
+int MIN_READ_CACHE_MB=10;
+int MAX_READ_CACHE_MB=256;
+
+// The most threads -j may ask for to decompress baskets
+int MAX_UNZIP_THREADS=256;
+
+// Quantile sketches for 1-D histogram branches: centroids kept per sketch
+// (more is more accurate), and the percentiles used for the default plot range
+double SKETCH_COMPRESSION=200;
+double AUTORANGE_LOW_QUANTILE=0.001;
+double AUTORANGE_HIGH_QUANTILE=0.999;
+
+// Per-cell distributions (td_ and cd_ branches): value bins if the config doesn't
+// give them, and how many entries of the sample the default range is taken from
+int DISTRIBUTION_BINS=100;
+Long64_t DISTRIBUTION_RANGE_ENTRIES=10000;
+
+// Each kind of warning from the passes over the trees is printed this many times, then only counted.
+// The results file names this many of the cells of a map that have no pull
+int LOG_REPEATS=5;
+
+// A branch comparison fails if its chi-square p-value is below this
+double PVALUE_THRESHOLD=0.05;
+
+// Correlations between scalar h_ branches listed in the results, the most changed first
+int CORRELATION_REPORT=20;
+
+// Event-by-event comparison (--match): the most memory the index of the reference events may
+// take (a bigger reference is matched in parts that fit), how much an h_ value may differ from
+// the reference, relative to its size, and still be the same, and how many of the most
+// changed events are listed. The differences are histogrammed in this many bins, and the
+// number of cells that differ in a map branch counted up to this many
+double MATCH_INDEX_MB=1024;
+double MATCH_TOLERANCE=1e-6;
+int MATCH_REPORT=20;
+int MATCH_DIFFERENCE_BINS=100;
+int MATCH_CELL_BINS=50;
+
+// Quick-look mode: each round reads this many times more entries than the last,
+// and a verdict counts as stable once the p-value band spanned by this many
+// standard deviations of the chi-square lies entirely on one side of the threshold
+int QUICKLOOK_REFINE_FACTOR=4;
+double QUICKLOOK_CONFIDENCE_Z=2.;
+
+// Rough rates for the cost estimates of the execution plan, in MB per second: reading
+// compressed baskets, decompressing them, and decoding calorimeter geometry ID strings
+double PLAN_READ_MB_PER_S=200;
+double PLAN_UNZIP_MB_PER_S=400;
+double PLAN_DECODE_MB_PER_S=100;
+
+// A run that reads every entry saves a checkpoint this often, in minutes, to resume from with --resume
+double CHECKPOINT_MINUTES=5;
+
+// Toy experiments (-b) draw from random number streams seeded with this, so that a run can be repeated
+unsigned long TOY_SEED=20180822;
+
 // Calorimeter dimensions
 
 int MAINWALL_WIDTH = 20;
@@ -68,33 +166,323 @@ int VETO_WIDTH = 16;
 // 6 walls for the calorimeters, the order matters
 enum WALL  {ITALY, FRANCE, TUNNEL, MOUNTAIN, TOP, BOTTOM};
 string CALO_WALL[6] = {"Italy","France","Tunnel","Mountain","Top","Bottom"};
+// Calorimeter locations can be packed into an integer instead of a geometry ID string:
+// type*1000000 + side*100000 + wall*10000 + column*100 + row, where side is 1 for France,
+// wall is 1 for the tunnel X-wall or the top veto wall, and row is 0 for the vetoes
+enum CALO_TYPE {CALO_MAIN_WALL=1, CALO_X_WALL=2, CALO_VETO=3};
 int CALO_XBINS[6] = {MAINWALL_WIDTH,MAINWALL_WIDTH,XWALL_DEPTH,XWALL_DEPTH,VETO_WIDTH,VETO_WIDTH};
 int CALO_XLO[6] = {-1*MAINWALL_WIDTH,0,-1 * XWALL_DEPTH/2,-1 * XWALL_DEPTH/2,0,0};
 int CALO_XHI[6] = {0,MAINWALL_WIDTH,XWALL_DEPTH/2,XWALL_DEPTH/2,VETO_WIDTH,VETO_WIDTH};
 int CALO_YBINS[6] = {MAINWALL_HEIGHT,MAINWALL_HEIGHT,XWALL_HEIGHT,XWALL_HEIGHT,VETO_DEPTH,VETO_DEPTH}; // They are all zero to nbins in the y direction
 
+// The histograms that a map branch is filled into from one tree: counts of hits,
+// and sums and sums of squares of the value to average. There is one of each
+// for a tracker map, and one per wall for the calorimeter. Distribution branches
+// also keep the values in each cell, in a sparse histogram of cell number and value
+struct MapAccumulator
+{
+  string fullBranchName;
+  string branchName;
+  string mapBranch;
+  bool isRef;
+  bool isAverage;
+  bool isCalo;
+  vector<TH2D*> counts;
+  vector<TH2D*> sums;
+  vector<TH2D*> sumsSquared;
+  THnSparseD *distribution; // Only for td_ and cd_ branches
+};
+
+// A hit decoded from a map branch: the wall (0 for the tracker, -1 if it
+// couldn't be placed) and the cell we draw it in
+struct CellHit
+{
+  int wall;
+  int x;
+  int y;
+};
+
+// A map branch read in the shared pass over a tree. Its hits are decoded once
+// per event, and every branch that is mapped with it uses the same cells
+struct MapBranchReader
+{
+  string name;
+  bool isCalo;
+  vector<int> *codes; // Tracker cells, or packed calorimeter locations
+  vector<string> *caloHits; // Calorimeter geometry IDs
+  vector<CellHit> cells;
+  vector<CellHit> decoded; // Somewhere to keep the cells while picking some of them out
+};
+
+// The c_ branch we plot backscattering from, which is decoded from the calorimeter
+// hits that match an electron's track on a main wall
+string BACKSCATTER_MAP_BRANCH="c_calorimeter_hit_map_backscatter";
+
+// Change this when the decoding changes, so that hits cached by an older version aren't used
+int HIT_CACHE_VERSION=1;
+
+// Change this when what the shared reference store keeps for a histogram changes, so that older entries aren't used
+int SHARED_REFERENCE_VERSION=1;
+
+// Running sums for the mean of a 1D branch in a slice
+struct SliceMoments
+{
+  double n=0;
+  double sum=0;
+  double sumSquared=0;
+};
+
+// Everything filled from one slice of the sample (a run or a time window, with --slice).
+// The maps and histograms are in the same order as the branches being sliced
+struct SliceAccumulator
+{
+  string label; // What the slice covers, for the trend axis
+  Long64_t entries=0;
+  vector<MapAccumulator> maps;
+  vector<TH1D*> histograms;
+  vector<SliceMoments> moments;
+};
+
+// The centre and width of the pulls of a map, each estimated three ways, with
+// their uncertainties. The widths are scaled to estimate a Gaussian sigma
+struct PullSummary
+{
+  int n=0;
+  double mean=0, meanError=0, rms=0, rmsError=0;
+  double median=0, medianError=0, mad=0, madError=0;
+  double trimmedMean=0, trimmedMeanError=0, trimmedWidth=0, trimmedWidthError=0;
+};
+
+// Time and bytes read for one pass over a tree
+struct ReadProfile
+{
+  TStopwatch timer;
+  Long64_t bytesRead;
+  int readCalls;
+};
+
+// Branches that are plotted from the same reads, with what reading them is expected to cost.
+// The map branches are all read in one shared pass over each tree, with the sample and the
+// reference in parallel, and each group there is one map branch and the plots made from it.
+// A 1D branch is read twice from the sample (for its quantile sketch, which sets the binning,
+// and then its histogram) and once from each reference (for both)
+struct PlanGroup
+{
+  string name;
+  vector<string> plots;
+  vector<string> reads;
+  bool sharedPass=false;
+  int passes=1; // Over the sample
+  double sampleMB=0, sampleUnzippedMB=0; // Compressed and uncompressed size of everything read, per pass
+  double refMB=0, refUnzippedMB=0; // Summed over the references
+  double sampleSeconds=0, refSeconds=0;
+};
+
+// A scalar h_ branch compared event by event (--match): how many matched events it
+// changed in, and by how much
+struct MatchedBranch
+{
+  string name;
+  Long64_t changed=0;
+  QuantileSketch differences; // Sample value minus reference value, where they differ
+};
+
+// A map branch compared event by event, with the cells decoded from each tree
+struct MatchedMap
+{
+  MapBranchReader reader;
+  MapBranchReader refReader;
+  Long64_t changed=0;
+  TH1D *cellsChanged; // Cells that are in only one of the two events, for each matched event
+};
+
+// One of the most changed events: the branches that changed plus the cells that differ
+struct ChangedEvent
+{
+  double score;
+  Long64_t run;
+  Long64_t event;
+  string changes;
+};
+
+// How far a run had got at its last checkpoint: the reference being compared, how many
+// branches of the plan had been plotted, and their results; and the results of the
+// references before it. The output files of the branches plotted are in the checkpoint too
+struct Checkpoint
+{
+  string settings; // The inputs and options of the run, which a run that resumes it must have too
+  int number=0; // Goes up by one with each checkpoint, and is in the names of its files
+  string runKey; // Made when the run starts and kept when it is resumed, so that its results are stored once
+  int reference=0;
+  int branchesDone=0;
+  Long64_t textBytes=0; // How much of the results file had been written
+  vector<BranchResult> results;
+  vector<string> refLabels;
+  vector<vector<BranchResult> > refResults;
+};
+
+// A branch of an earlier run's output that --serve can draw, with the images it has,
+// named as the batch run names their files
+struct ServedBranch
+{
+  string name;
+  string directory; // Of its histograms in ValidationHistograms.root: h, tracker or calo
+  string stem; // Their name there: plt_<name>, or ave_<name> for an average
+  vector<string> images; // <name>, and compare_<name>, ref_<name> or pull_<name> if it was compared
+};
+
 int main(int argc, char **argv);
-void ParseRootFile(string rootFileName, string configFileName="", string refFileName="", string tempDirName="", string plotDirName="");
+void ParseRootFile(string rootFileName, string configFileName="", vector<string> refFileNames=vector<string>(), string tempDirName="", string plotDirName="", string storeFileName="");
+bool OpenReference(string refFileName);
+bool CompareOutputs(string sampleFileName, string refFileName, string plotDirName);
+string OutputFileOf(string path);
+Long64_t StoredEntries(TFile *file);
+bool ServePlots(string outputPath, string configFileName, int port);
+void FindServedBranches();
+bool HandlePlotRequest(const string &path, string &contentType, string &body);
+string PlotIndexPage();
+string BranchPage(ServedBranch &branch);
+string ResultsSection(string branchName);
+string ResultsValue(string section, string label);
+bool RenderServedPlot(ServedBranch &branch, string image);
+TH1 *ServedHistogram(string name);
+void StartStoredComparison(string branchName, Long64_t sampleEntries, Long64_t refEntries);
+void CompareStoredHistogram(TH1D *h, TH1D *href, string branchName, double scale);
+void CompareStoredTrackerMap(TH2D *h, TH2D *href, string branchName, bool isAverage, double scale);
+void CompareStoredCaloMap(vector<TH2D*> hists, vector<TH2D*> refHists, string branchName, bool isAverage, double scale);
+vector<PlanGroup> MakePlan(vector<string> branchNames, vector<TTree*> refTrees);
+bool CostsMore(const PlanGroup &a, const PlanGroup &b);
+void EstimateReadCost(PlanGroup &group, TTree *sampleTree, vector<TTree*> &refTrees);
+double EstimatedRunTime(vector<PlanGroup> &plan, int nRefs);
+vector<string> PlannedOrder(vector<PlanGroup> &plan);
+void PrintPlan(vector<PlanGroup> &plan, int nRefs);
+string ReferenceLabel(string refFileName, int iRef);
+void WriteComparisonMatrix(vector<string> refLabels, vector<vector<BranchResult> > &refResults);
 bool PlotVariable(string branchName);
+void QuickLook(vector<string> branchNames);
+bool VerdictIsStable(BranchResult &result);
+Long64_t EntriesUsed(TTree *thisTree);
+TEntryList *SelectionOf(TTree *thisTree);
+Long64_t SelectedEntries(TTree *thisTree);
+Long64_t EntryNumber(TTree *thisTree, Long64_t i);
+TEntryList *SelectEntries(TTree *thisTree);
+void AddFormulaBranches(TTreeFormula &formula, vector<string> &branches);
+string StrideSelection();
+void RecordComparison(double chisq, int ndf, double pValue, double ks);
+void WriteEntriesUsed();
+void RunToys(vector<TH1*> samples, vector<TH1*> refs, bool isAverage, double scale, double zeroCountError);
+void AppendToResultsStore(string storeFileName, RunInfo run);
 map<string,string> LoadConfig(ifstream& configFile);
 string GetBitBeforeComma(string& input);
 void Plot1DHistogram(string branchName);
+void PrintHistogramPlot(string branchName, TH1D *h);
+void PrintComparisonPlot(string branchName, TH1D *h, TH1D *href, string ksLabel, string chisqLabel, string pValueLabel, string ksUnbinnedLabel);
+void FillSketch(TTree *thisTree, string branchName, QuantileSketch &sketch, TH1 *h=0);
+void WriteQuantileComparison(QuantileSketch &sketch, QuantileSketch &refSketch);
 void PlotTrackerMap(string branchName);
 void PlotCaloMap(string branchName);
 string BranchNameToEnglish(string branchname);
 void WriteLabel(double x, double y, string text, double size=0.05);
 void PrintCaloPlots(string branchName, string title, vector <TH2D*> histos);
+TCanvas *DrawCaloCanvas(vector <TH2D*> histos, string title, double min, double max, bool layoutOnly);
+bool WriteTrackerImage(TH2D *h, string fileName, double min, double max);
+bool WriteCaloImage(vector<TH2D*> histos, string fileName, double min, double max, string title);
+MapRaster *MakeTrackerRaster(TH2D *h);
+MapRaster *MakeCaloRaster(vector<TH2D*> histos);
+bool CanvasPixels(TCanvas *c, vector<uint32_t> &pixels);
+RasterGrid FrameGrid(TVirtualPad *pad, TH2D *h);
+RasterGrid PaletteBarGrid(TVirtualPad *pad, RasterGrid frame);
+int PadTextPixels(TVirtualPad *pad, double size);
+RasterFont *RasterFontOf(int font, int pixelSize);
+vector<double> CellValues(TH2D *h);
+vector<uint32_t> PaletteBands(TH2D *h);
+vector<RasterTick> PaletteTicks(double min, double max);
 
 string exec(const char* cmd);
 string FirstWordOf(string input);
-TH2D *TrackerMapHistogram(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch = "");
+MapAccumulator BookTrackerMap(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch);
+TH2D *FinishTrackerMap(MapAccumulator &accumulator);
+void PrintTrackerMap(TH2D *h, string fileName, double min, double max);
 TH2D *PullPlot2D(TH2D *hSample, TH2D *hRef);
 void AnnotateTrackerMap();
 double CheckTrackerPull(TH2D *hPull, string title);
-vector<TH2D*> MakeCaloPlotSet(string fullBranchName, string branchName, string title, bool isRef, bool isAverage, string mapBranch = "");
+MapAccumulator BookCaloPlotSet(string fullBranchName, string branchName, bool isRef, bool isAverage, string mapBranch);
+vector<TH2D*> FinishCaloPlotSet(MapAccumulator &accumulator);
+void AverageWithError(TH2D *counts, TH2D *sums, TH2D *sumsSquared);
+bool ParseSliceSpec(string spec);
+bool SliceKeyOf(double value, Long64_t &key);
+string SliceLabel(Long64_t key);
+void FillSlices(vector<string> branchNames);
+bool ParseMatchSpec(string spec);
+void MatchEvents(vector<string> branchNames);
+uint64_t EventFingerprint(TLeaf *runLeaf, TLeaf *eventLeaf, Long64_t iEntry, Long64_t &run, Long64_t &event);
+bool ValueChanged(double value, double refValue);
+bool CellBefore(const CellHit &a, const CellHit &b);
+int CellsThatDiffer(vector<CellHit> &cells, vector<CellHit> &refCells);
+bool MoreChanged(const ChangedEvent &a, const ChangedEvent &b);
+void WriteMatchedComparison(vector<MatchedBranch> &scalars, vector<MatchedMap> &maps, vector<ChangedEvent> &mostChanged, Long64_t nSampleEntries, Long64_t nMatched, Long64_t nIndexed, Long64_t nDuplicates, Long64_t nCollisions, Long64_t nMismatched, Long64_t nChanged);
+TH1D *SketchHistogram(QuantileSketch &sketch, string name, string title);
+string CheckpointSettings(string rootFileName, string configFileName, vector<string> refFileNames);
+bool CheckpointDue(time_t &lastCheckpoint);
+void SaveCheckpoint();
+bool LoadCheckpoint(Checkpoint &loaded);
+string BranchResultLine(BranchResult &result);
+bool ParseBranchResultLine(vector<string> fields, BranchResult &result);
+void LoadSliceTemplates(string fileName);
+string PassCheckpointFile(TTree *thisTree);
+string PassCheckpointKey(vector<MapAccumulator*> &accumulators, CovarianceMatrix *covariance);
+void SavePassCheckpoint(TTree *thisTree, vector<MapAccumulator*> &accumulators, CovarianceMatrix *covariance, Long64_t nextEntry);
+Long64_t RestorePassCheckpoint(TTree *thisTree, vector<MapAccumulator*> &accumulators, CovarianceMatrix *covariance);
+SliceAccumulator BookSlice(Long64_t key, vector<MapAccumulator> &mapSpecs, vector<string> &histBranches);
+void WriteSlices(map<Long64_t,SliceAccumulator> &slices, vector<MapAccumulator> &mapSpecs, vector<string> &histBranches);
+double ConstancyChiSquared(vector<double> &values, vector<double> &errors, int &ndf);
+string MapTitle(string configName, string branchName);
+bool MapBranchParts(string fullBranchName, string &branchName, string &mapBranch, bool &isCalo, bool &isAverage);
+void FillAllMaps(vector<string> branchNames);
+MapAccumulator CopyMapAccumulator(MapAccumulator &original);
+void FillMaps(TTree *thisTree, vector<MapAccumulator*> &accumulators, vector<string> &scalarBranches, CovarianceMatrix *covariance);
+void DecodeMapBranch(MapBranchReader &reader);
+bool DecodeCaloHit(const string &thisHit, int &whichWall, int &xValue, int &yValue);
+bool GeomIdField(const string &geomId, int dots, int &value);
+bool DecodeCaloCode(int code, int &whichWall, int &xValue, int &yValue);
+bool PlaceCaloHit(int type, bool isFrance, bool wallFlag, int column, int row, int &whichWall, int &xValue, int &yValue);
+void AttachMapReader(TTree *thisTree, MapBranchReader &reader);
+string HitCacheKey(TTree *thisTree);
+string FileIdentity(string fileName);
+string HitCacheFile(string key, string column);
+HitCacheWriter *OpenHitCacheWriter(string key, string column, int valueSize);
+bool FillMapsFromCache(TTree *thisTree, string key, vector<MapAccumulator*> &accumulators, vector<MapBranchReader> &readers, vector<int> &whichReader);
+bool IsPackedCaloBranch(TTree *thisTree, string branchName);
+string SharedReferenceKey(string what);
+string MapReferenceKey(MapAccumulator &accumulator);
+const double *FindSharedReference(string key, size_t &nValues);
+void LockSharedReference(string key);
+void PublishSharedReference(string key, const vector<double> &values);
+string ReferenceHash(string refFileName);
+void AppendHistogram(vector<double> &values, TH1 *h);
+bool ReadHistogram(const double *&values, const double *end, TH1 *h);
+vector<double> MapState(MapAccumulator &accumulator);
+bool SetMapState(MapAccumulator &accumulator, const double *values, size_t nValues);
+void DecodeBackscatter(MapBranchReader &reader, vector<double> *e_vert_x, vector<string> *trackCaloHits);
+void FillMapAccumulator(MapAccumulator &accumulator, vector<CellHit> &cells, vector<double> *toAverage);
+int CellIndex(MapAccumulator &accumulator, CellHit &cell);
+string CellName(MapAccumulator &accumulator, int index);
+void DistributionBinning(TTree *thisTree, string fullBranchName, int &nBins, double &low, double &high);
+THnSparseD *BookDistribution(MapAccumulator &accumulator, int nBins, double low, double high);
+void CellDistributions(MapAccumulator &accumulator, map<int,vector<double> > &cells);
+double BinnedQuantile(vector<double> &contents, TAxis *axis, double q);
+void WriteCellQuantiles(MapAccumulator &accumulator, map<int,vector<double> > &cells);
+void CompareDistributions(MapAccumulator &sample, MapAccumulator *ref, string title);
+vector<string> ScalarBranches(TTree *thisTree, vector<string> branchNames);
+void CompareCovariances();
+void WriteCovarianceMatrices(CovarianceMatrix *matrix, vector<string> &branches, string label);
+ReadProfile StartReadPass(TTree *thisTree, vector<string> branches);
+void EndReadPass(TTree *thisTree, ReadProfile &profile, string what);
 vector<TH2D*>MakeCaloPullPlots(vector<TH2D*> vSample, vector<TH2D*> vRef);
 double CheckCaloPulls(vector<TH2D*> hPulls, string title="");
+void ReportCellsWithoutPulls(vector<string> &cells);
 void OverlayWhiteForNaN(TH2D *hist);
 double ChiSquared(TH1 *h1, TH1 *h2, double &chisq, int &ndf, bool isAverage);
-double  PrintPlotOfPulls(TH1D *h1Pulls, int pullCells, string title);
-void MoveHistograms(string fromFile, string toFile);
+double  PrintPlotOfPulls(TH1D *h1Pulls, vector<double> &pulls, string title);
+PullSummary SummarisePulls(vector<double> pulls);
+int ParsePullSummary(string mode);
@@ -0,0 +1,137 @@
+// Query the results store written by ValidationParser: trends of one branch
+// over many runs, and the worst-performing branches of recent runs
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "ResultsStore.h"
+
+using namespace std;
+
+void PrintUsage(char *program)
+{
+  cout<<"Usage: "<<program<<" -s <results store> [-b <branch> (time series)] [-w <pvalue|chisq|ks|pull|flagged> (worst offenders)] [-f <branch> (most flagged cells)] [-n <number of runs (default 500)>] [-l <max rows (default 20)>]"<<endl;
+}
+
+// Format a Unix time as a date and time
+string TimeString(long long unixTime)
+{
+  time_t t = unixTime;
+  char buffer[32];
+  strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", localtime(&t));
+  return buffer;
+}
+
+void PrintResult(StoredResult row, bool showBranch)
+{
+  printf("%6lld  %s  ", row.run.runId, TimeString(row.run.runTime).c_str());
+  if (showBranch) printf("%-45s ", row.result.branchName.c_str());
+  printf("%10.2f %5d %10.3g %8.3g %8.3g %8.3g %5d  %s\n",
+         row.result.chisq, row.result.ndf, row.result.pValue, row.result.ks,
+         row.result.meanPull, row.result.rmsPull, row.nFlagged, row.run.sample.c_str());
+}
+
+void PrintHeader(bool showBranch)
+{
+  printf("%6s  %-16s  ", "Run", "Time");
+  if (showBranch) printf("%-45s ", "Branch");
+  printf("%10s %5s %10s %8s %8s %8s %5s  %s\n", "Chi-sq", "NDF", "P-value", "KS", "MeanPull", "RMSPull", "Flags", "Sample");
+}
+
+int main(int argc, char **argv)
+{
+  string storeName="";
+  string branchName="";
+  string worstMetric="";
+  string flaggedBranch="";
+  int nRuns=500;
+  int limit=20;
+
+  int flag=0;
+  while ((flag = getopt (argc, argv, "hs:b:w:f:n:l:")) != -1)
+  {
+    switch (flag)
+    {
+      case 's':
+        storeName = optarg;
+        break;
+      case 'b':
+        branchName = optarg;
+        break;
+      case 'w':
+        worstMetric = optarg;
+        break;
+      case 'f':
+        flaggedBranch = optarg;
+        break;
+      case 'n':
+        nRuns = atoi(optarg);
+        break;
+      case 'l':
+        limit = atoi(optarg);
+        break;
+      case 'h':
+      default:
+        PrintUsage(argv[0]);
+        return 1;
+    }
+  }
+  if (storeName.length()==0 || (branchName.length()==0 && worstMetric.length()==0 && flaggedBranch.length()==0))
+  {
+    PrintUsage(argv[0]);
+    return -1;
+  }
+  if (access(storeName.c_str(), R_OK) != 0)
+  {
+    cout<<"ERROR: results store "<<storeName<<" not found"<<endl;
+    return -1;
+  }
+
+  ResultsStore store;
+  if (!store.Open(storeName, true))
+  {
+    cout<<"ERROR: could not open results store "<<storeName<<": "<<store.GetError()<<endl;
+    return -1;
+  }
+
+  if (branchName.length() > 0)
+  {
+    vector<StoredResult> rows = store.TimeSeries(branchName, nRuns);
+    cout<<branchName<<": last "<<rows.size()<<" runs"<<endl;
+    PrintHeader(false);
+    for (size_t i=0;i<rows.size();i++) PrintResult(rows.at(i), false);
+    cout<<endl;
+  }
+
+  if (worstMetric.length() > 0)
+  {
+    vector<StoredResult> rows = store.WorstOffenders(worstMetric, nRuns, limit);
+    if (store.GetError().length() > 0)
+    {
+      cout<<"ERROR: "<<store.GetError()<<endl;
+      return -1;
+    }
+    cout<<"Worst "<<rows.size()<<" branch results by "<<worstMetric<<" in the last "<<nRuns<<" runs"<<endl;
+    PrintHeader(true);
+    for (size_t i=0;i<rows.size();i++) PrintResult(rows.at(i), true);
+    cout<<endl;
+  }
+
+  if (flaggedBranch.length() > 0)
+  {
+    vector<int> timesFlagged;
+    vector<FlaggedCell> cells = store.FrequentlyFlaggedCells(flaggedBranch, nRuns, limit, timesFlagged);
+    cout<<flaggedBranch<<": most frequently flagged cells in the last "<<nRuns<<" runs"<<endl;
+    for (size_t i=0;i<cells.size();i++)
+    {
+      printf("%5d runs  mean pull %6.2f  %s\n", timesFlagged.at(i), cells.at(i).pull, cells.at(i).cell.c_str());
+    }
+    cout<<endl;
+  }
+  return 0;
+}
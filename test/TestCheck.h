@@ -0,0 +1,39 @@
+// A minimal check for the tests of the parts that don't need ROOT. Each test is a
+// program of its own, which prints every check that fails and returns the number of
+// them, so that ctest counts it as failed if there are any.
+
+#ifndef TESTCHECK_H
+#define TESTCHECK_H
+
+#include <iostream>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+
+static int nFailed = 0;
+
+#define CHECK(condition) \
+  do \
+  { \
+    if (!(condition)) \
+    { \
+      std::cout << __FILE__ << ":" << __LINE__ << ": failed: " << #condition << std::endl; \
+      nFailed++; \
+    } \
+  } while (0)
+
+#define CHECK_CLOSE(value, expected, tolerance) CHECK(std::fabs((value) - (expected)) <= (tolerance))
+
+// A new, empty directory for a test's files
+inline std::string ScratchDirectory()
+{
+  char name[] = "/tmp/ValidationParserTestXXXXXX";
+  if (!mkdtemp(name))
+  {
+    std::cout << "could not make a scratch directory" << std::endl;
+    exit(1);
+  }
+  return name;
+}
+
+#endif
@@ -0,0 +1,82 @@
+#include "../CovarianceMatrix.h"
+#include "TestCheck.h"
+
+#include <vector>
+#include <random>
+
+using namespace std;
+
+int main()
+{
+  // Three variables, y following x and z independent of both, with large means, over
+  // more than one block. Compared with the covariance worked out directly
+  const int nEntries = 1000;
+  mt19937 random(12345);
+  normal_distribution<double> gauss(0, 1);
+  vector<vector<double> > entries;
+  for (int i = 0; i < nEntries; i++)
+  {
+    double x = 1e6 + gauss(random);
+    entries.push_back({x, 2 * x + 0.5 * gauss(random), -3e5 + 4 * gauss(random)});
+  }
+  double mean[3] = {0, 0, 0}, covariance[3][3] = {{0}};
+  for (int i = 0; i < nEntries; i++) for (int a = 0; a < 3; a++) mean[a] += entries[i][a] / nEntries;
+  for (int i = 0; i < nEntries; i++)
+  {
+    for (int a = 0; a < 3; a++) for (int b = 0; b < 3; b++) covariance[a][b] += (entries[i][a] - mean[a]) * (entries[i][b] - mean[b]) / (nEntries - 1);
+  }
+
+  CovarianceMatrix whole(3, 64);
+  for (int i = 0; i < nEntries; i++) whole.Fill(entries[i].data());
+  CHECK(whole.GetEntries() == nEntries);
+  for (int a = 0; a < 3; a++)
+  {
+    CHECK_CLOSE(whole.Mean(a), mean[a], 1e-6 * fabs(mean[a]));
+    for (int b = 0; b < 3; b++) CHECK_CLOSE(whole.Covariance(a, b), covariance[a][b], 1e-6 * (1 + fabs(covariance[a][b])));
+  }
+  CHECK_CLOSE(whole.Correlation(0, 1), covariance[0][1] / sqrt(covariance[0][0] * covariance[1][1]), 1e-9);
+  CHECK(whole.Correlation(1, 0) == whole.Correlation(0, 1));
+
+  // Entries with a NaN or infinite value are skipped
+  double bad[3] = {NAN, 0, 0}, infinite[3] = {0, INFINITY, 0};
+  whole.Fill(bad);
+  whole.Fill(infinite);
+  CHECK(whole.GetEntries() == nEntries);
+  CHECK(whole.GetSkipped() == 2);
+
+  // Merging two parts, filled in blocks of another size, gives the same matrix
+  CovarianceMatrix first(3, 64), second(3, 64);
+  for (int i = 0; i < nEntries; i++) (i < 300 ? first : second).Fill(entries[i].data());
+  first.Merge(second);
+  CHECK(first.GetEntries() == nEntries);
+  for (int a = 0; a < 3; a++) for (int b = 0; b < 3; b++) CHECK_CLOSE(first.Covariance(a, b), covariance[a][b], 1e-6 * (1 + fabs(covariance[a][b])));
+
+  // A matrix stopped part way through a block and put back from its state carries on exactly
+  CovarianceMatrix stopped(3, 64), carriedOn(3, 64), straight(3, 64);
+  for (int i = 0; i < 500; i++) stopped.Fill(entries[i].data());
+  CHECK(carriedOn.SetState(stopped.GetState()));
+  for (int i = 0; i < nEntries; i++)
+  {
+    if (i >= 500) carriedOn.Fill(entries[i].data());
+    straight.Fill(entries[i].data());
+  }
+  carriedOn.Flush();
+  straight.Flush();
+  CHECK(carriedOn.GetState() == straight.GetState());
+
+  // The state of a matrix of other variables or another block size is refused
+  CovarianceMatrix otherSize(4, 64), otherBlock(3, 32);
+  CHECK(!otherSize.SetState(stopped.GetState()));
+  CHECK(!otherBlock.SetState(stopped.GetState()));
+
+  // A constant variable has no correlation
+  CovarianceMatrix constant(2);
+  for (int i = 0; i < 10; i++)
+  {
+    double values[2] = {1, (double)i};
+    constant.Fill(values);
+  }
+  CHECK(std::isnan(constant.Correlation(0, 1)));
+
+  return nFailed;
+}
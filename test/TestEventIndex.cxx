@@ -0,0 +1,54 @@
+#include "../EventIndex.h"
+#include "TestCheck.h"
+
+#include <vector>
+
+using namespace std;
+
+int main()
+{
+  // Many more events than expected, so the table has to grow, over several runs
+  EventIndex index(100);
+  long long entry = 0;
+  for (long long run = 1000; run < 1005; run++)
+  {
+    for (long long event = 0; event < 2000; event++) CHECK(index.Insert(EventIndex::Fingerprint(run, event), entry++));
+  }
+  CHECK(index.Size() == 10000);
+  CHECK(index.Find(EventIndex::Fingerprint(1000, 0)) == 0);
+  CHECK(index.Find(EventIndex::Fingerprint(1003, 1234)) == 3 * 2000 + 1234);
+  CHECK(index.Find(EventIndex::Fingerprint(1004, 1999)) == 9999);
+  CHECK(index.Find(EventIndex::Fingerprint(1005, 0)) == -1);
+  CHECK(index.Find(EventIndex::Fingerprint(999, 1999)) == -1);
+
+  // The run and event numbers are not interchangeable
+  CHECK(EventIndex::Fingerprint(1, 2) != EventIndex::Fingerprint(2, 1));
+  CHECK(EventIndex::Fingerprint(0, 0) != 0);
+
+  // The same event again is refused, and the first entry is kept
+  CHECK(!index.Insert(EventIndex::Fingerprint(1002, 5), 123456));
+  CHECK(index.Find(EventIndex::Fingerprint(1002, 5)) == 2 * 2000 + 5);
+  CHECK(index.Size() == 10000);
+
+  // Every event is in exactly one partition, and they are shared out roughly evenly
+  const int nPartitions = 4;
+  vector<int> inPartition(nPartitions, 0);
+  for (long long event = 0; event < 10000; event++)
+  {
+    int partition = EventIndex::Partition(EventIndex::Fingerprint(7, event), nPartitions);
+    CHECK(partition >= 0 && partition < nPartitions);
+    inPartition[partition]++;
+  }
+  for (int i = 0; i < nPartitions; i++) CHECK(inPartition[i] > 2000 && inPartition[i] < 3000);
+
+  // 32 bytes per event, as the table is made half full
+  CHECK(EventIndex::PartitionsFor(1000, 1e6) == 1);
+  CHECK(EventIndex::PartitionsFor(1000000, 1e7) == 4);
+  CHECK(EventIndex::PartitionsFor(1000000, 0) == 1);
+
+  index.Clear();
+  CHECK(index.Size() == 0);
+  CHECK(index.Find(EventIndex::Fingerprint(1000, 0)) == -1);
+
+  return nFailed;
+}
@@ -0,0 +1,87 @@
+#include "../HitCache.h"
+#include "TestCheck.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h>
+
+using namespace std;
+
+// The values of an event: its number, then as many of its cells as it is long
+static vector<int> EventValues(int event)
+{
+  vector<int> values;
+  for (int i = 0; i < event % 7; i++) values.push_back(event * 10 + i);
+  return values;
+}
+
+int main()
+{
+  string directory = ScratchDirectory();
+  string fileName = directory + "/column.hits";
+  string key = "sample.root|1234|5678|selection|1";
+
+  // More events than fit in one block, some of them with no values
+  const int nEvents = 200000;
+  {
+    HitCacheWriter writer(fileName, key, sizeof(int));
+    CHECK(writer.IsOpen());
+    for (int event = 0; event < nEvents; event++)
+    {
+      vector<int> values = EventValues(event);
+      writer.Add(values.data(), values.size());
+    }
+    CHECK(access(fileName.c_str(), F_OK) != 0); // Only put in place when it is complete
+    CHECK(writer.Close());
+  }
+
+  {
+    HitCacheReader reader(fileName, key, sizeof(int));
+    CHECK(reader.IsOpen());
+    CHECK(reader.GetEntries() == (uint64_t)nEvents);
+    const int *values;
+    size_t nValues;
+    int event = 0;
+    bool same = true;
+    while (reader.Next(values, nValues))
+    {
+      vector<int> expected = EventValues(event++);
+      same = same && (nValues == expected.size()) && equal(expected.begin(), expected.end(), values);
+    }
+    CHECK(same);
+    CHECK(event == nEvents);
+  }
+
+  // A column made from something else, or holding values of another size, isn't read
+  CHECK(!HitCacheReader(fileName, key + "x", sizeof(int)).IsOpen());
+  CHECK(!HitCacheReader(fileName, "sample.root|1234|5678|selection|2", sizeof(int)).IsOpen());
+  CHECK(!HitCacheReader(fileName, key, sizeof(double)).IsOpen());
+  CHECK(!HitCacheReader(directory + "/missing.hits", key, sizeof(int)).IsOpen());
+
+  // A column that is cut short is read up to the damage, and then stops
+  size_t fileSize = HitCacheReader(fileName, key, sizeof(int)).GetFileSize();
+  CHECK(truncate(fileName.c_str(), fileSize - 100) == 0);
+  {
+    HitCacheReader reader(fileName, key, sizeof(int));
+    CHECK(reader.IsOpen());
+    const int *values;
+    size_t nValues;
+    int event = 0;
+    while (reader.Next(values, nValues)) event++;
+    CHECK(event < nEvents);
+  }
+
+  // A writer that isn't closed leaves nothing behind
+  string abandoned = directory + "/abandoned.hits";
+  {
+    HitCacheWriter writer(abandoned, key, sizeof(int));
+    int value = 1;
+    writer.Add(&value, 1);
+  }
+  CHECK(access(abandoned.c_str(), F_OK) != 0);
+
+  remove(fileName.c_str());
+  rmdir(directory.c_str());
+  return nFailed;
+}
@@ -0,0 +1,69 @@
+#include "../Logger.h"
+#include "TestCheck.h"
+
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static int Count(const string &text, const string &what)
+{
+  int n = 0;
+  for (size_t at = text.find(what); at != string::npos; at = text.find(what, at + 1)) n++;
+  return n;
+}
+
+int main()
+{
+  ostringstream out;
+  {
+    Logger logger(out, 3);
+
+    // Each kind of message is only written the first 3 times, from however many threads
+    vector<thread> threads;
+    for (int i = 0; i < 4; i++)
+    {
+      threads.push_back(thread([&logger]()
+      {
+        for (int j = 0; j < 100; j++) logger.Log(Logger::LOG_WARNING, "unknown wall", "hit on an unknown wall");
+      }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    logger.Flush();
+    CHECK(Count(out.str(), "WARNING: hit on an unknown wall\n") == 3);
+
+    // Messages without a key are always written
+    for (int i = 0; i < 10; i++) logger.Log(Logger::LOG_INFO, "Read profile " + to_string(i));
+    logger.Flush();
+    CHECK(Count(out.str(), "Read profile ") == 10);
+
+    // The summary says how many were left out, and the counting starts again
+    logger.Summarise();
+    logger.Flush();
+    CHECK(Count(out.str(), "(unknown wall: 397 more like this were not shown, 400 in all)") == 1);
+    logger.Log(Logger::LOG_WARNING, "unknown wall", "hit on an unknown wall");
+    logger.Flush();
+    CHECK(Count(out.str(), "WARNING: hit on an unknown wall\n") == 4);
+
+    // Messages below the level are dropped, with or without a key
+    logger.SetLevel(Logger::LOG_WARNING);
+    logger.Log(Logger::LOG_INFO, "info", "an info message");
+    logger.Log(Logger::LOG_DEBUG, "a debug message");
+    logger.Log(Logger::LOG_ERROR, "error", "an error");
+    logger.Flush();
+    CHECK(out.str().find("info message") == string::npos);
+    CHECK(out.str().find("debug message") == string::npos);
+    CHECK(out.str().find("ERROR: an error\n") != string::npos);
+
+    // Whatever is still queued is written when the logger goes
+    logger.Log(Logger::LOG_ERROR, "the last message");
+  }
+  CHECK(out.str().find("ERROR: the last message\n") != string::npos);
+
+  CHECK(Logger::ParseLevel("Warning") == Logger::LOG_WARNING);
+  CHECK(Logger::ParseLevel("debug") == Logger::LOG_DEBUG);
+  CHECK(Logger::ParseLevel("loud") == -1);
+
+  return nFailed;
+}
@@ -0,0 +1,78 @@
+#include "../MapRaster.h"
+#include "TestCheck.h"
+
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <png.h>
+
+using namespace std;
+
+static const int WIDTH = 50;
+static const int HEIGHT = 30;
+
+// The colour of each pixel of a PNG as 0xRRGGBB, or nothing if it can't be read
+static vector<uint32_t> ReadPng(string fileName)
+{
+  png_image image;
+  memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&image, fileName.c_str())) return vector<uint32_t>();
+  image.format = PNG_FORMAT_RGB;
+  vector<unsigned char> bytes(PNG_IMAGE_SIZE(image));
+  if (image.width != WIDTH || image.height != HEIGHT || !png_image_finish_read(&image, 0, &bytes[0], 0, 0)) return vector<uint32_t>();
+  vector<uint32_t> pixels(WIDTH*HEIGHT);
+  for (size_t i = 0; i < pixels.size(); i++) pixels[i] = (bytes[3*i] << 16) | (bytes[3*i + 1] << 8) | bytes[3*i + 2];
+  return pixels;
+}
+
+int main()
+{
+  string directory = ScratchDirectory();
+  string fileName = directory + "/map.png";
+
+  // A white layout with a grid line and a label pixel inside the map, which is 3x2
+  // cells of 10x10 pixels, and a palette bar on the right
+  vector<uint32_t> layout(WIDTH*HEIGHT, 0xFFFFFFFF);
+  for (int py = 0; py < HEIGHT; py++) layout[py*WIDTH + 22] = 0xFF000000;
+  layout[20*WIDTH + 14] = 0xFFFF0000;
+  MapRaster raster(WIDTH, HEIGHT, layout);
+  RasterGrid grid = {10, 5, 40, 25, 3, 2};
+  raster.AddGrid(grid);
+  RasterGrid bar = {42, 5, 48, 25, 0, 0};
+  raster.SetPaletteBar(bar, 0);
+
+  // Cells are numbered up each column, from the bottom left
+  vector<uint32_t> bands = {0x0000FF, 0x00FF00, 0xFFFF00, 0xFF8000};
+  vector<vector<double> > cells(1, vector<double>{2.5, NAN, 0, 100, -1, 0.5});
+  vector<RasterTick> ticks;
+  CHECK(raster.Write(fileName, cells, 0, 4, bands, ticks, ""));
+  vector<uint32_t> pixels = ReadPng(fileName);
+  CHECK(pixels.size() == (size_t)WIDTH*HEIGHT);
+  if (pixels.size() == (size_t)WIDTH*HEIGHT)
+  {
+    CHECK(pixels[20*WIDTH + 16] == 0xFFFF00); // 2.5 is in the third band of 0 to 4
+    CHECK(pixels[10*WIDTH + 16] == 0xFFFFFF); // NaN
+    CHECK(pixels[20*WIDTH + 26] == 0xFFFFFF); // Empty
+    CHECK(pixels[10*WIDTH + 26] == 0xFF8000); // Over the maximum takes the last band
+    CHECK(pixels[20*WIDTH + 36] == 0xFFFFFF); // Under the minimum
+    CHECK(pixels[10*WIDTH + 36] == 0x0000FF);
+    CHECK(pixels[20*WIDTH + 14] == 0xFF0000); // The layout stays on top of the cells
+    CHECK(pixels[10*WIDTH + 22] == 0x000000);
+    CHECK(pixels[20*WIDTH + 22] == 0x000000);
+    CHECK(pixels[2*WIDTH + 16] == 0xFFFFFF); // Outside the map
+    CHECK(pixels[22*WIDTH + 45] == 0x0000FF); // The palette bar, from the bottom up, with a frame
+    CHECK(pixels[7*WIDTH + 45] == 0xFF8000);
+    CHECK(pixels[15*WIDTH + 42] == 0x000000);
+  }
+
+  // The cells must fit the grids
+  cells[0].pop_back();
+  CHECK(!raster.Write(fileName, cells, 0, 4, bands, ticks, ""));
+  CHECK(MapRaster::Rgb(1, 0.5, 0) == 0xFF8000);
+
+  remove(fileName.c_str());
+  rmdir(directory.c_str());
+  return nFailed;
+}
@@ -0,0 +1,86 @@
+#include "../PlotServer.h"
+#include "TestCheck.h"
+
+#include <thread>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+// Send a request to the server and return the whole answer
+static string Ask(int port, const string &request)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  string answer;
+  if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0 && send(fd, request.data(), request.size(), 0) == (ssize_t)request.size())
+  {
+    char buffer[1024];
+    ssize_t nRead;
+    while ((nRead = recv(fd, buffer, sizeof(buffer), 0)) > 0) answer.append(buffer, nRead);
+  }
+  close(fd);
+  return answer;
+}
+
+int main()
+{
+  CHECK(PlotServer::EscapeHtml("<a href=\"x\">&</a>") == "&lt;a href=&quot;x&quot;&gt;&amp;&lt;/a&gt;");
+  CHECK(PlotServer::EscapeUrl("h_energy/ref x?&.png") == "h_energy/ref%20x%3F%26.png");
+
+  // Find a free port
+  PlotServer *server = 0;
+  int port;
+  for (port = 28080; port < 28180; port++)
+  {
+    server = new PlotServer(port);
+    if (server->IsOpen()) break;
+    delete server;
+    server = 0;
+  }
+  CHECK(server != 0);
+  if (!server) return nFailed;
+  CHECK(!PlotServer(port).IsOpen()); // Only one server can have the port
+  CHECK(PlotServer(port).GetError().find("could not listen") == 0);
+
+  // A handler that knows one page, and sees the path decoded and without its query
+  thread serving([server]()
+  {
+    server->Serve([](const string &path, string &contentType, string &body)
+    {
+      if (path != "/branch/h energy") return false;
+      contentType = "text/html";
+      body = "<p>h energy</p>";
+      return true;
+    });
+  });
+  serving.detach(); // It serves until the process ends
+
+  string answer = Ask(port, "GET /branch/h%20energy?sort=p HTTP/1.1\r\nHost: localhost\r\n\r\n");
+  CHECK(answer.find("HTTP/1.0 200 OK\r\n") == 0);
+  CHECK(answer.find("Content-Type: text/html\r\n") != string::npos);
+  CHECK(answer.find("Content-Length: 15\r\n") != string::npos);
+  CHECK(answer.find("\r\n\r\n<p>h energy</p>") != string::npos);
+
+  answer = Ask(port, "HEAD /branch/h%20energy HTTP/1.0\r\n\r\n");
+  CHECK(answer.find("HTTP/1.0 200 OK\r\n") == 0);
+  CHECK(answer.find("Content-Length: 15\r\n") != string::npos);
+  CHECK(answer.find("<p>") == string::npos);
+
+  CHECK(Ask(port, "GET /nothing HTTP/1.0\r\n\r\n").find("HTTP/1.0 404 Not Found\r\n") == 0);
+  CHECK(Ask(port, "POST /branch/h%20energy HTTP/1.0\r\n\r\n").find("HTTP/1.0 405 Method Not Allowed\r\n") == 0);
+  CHECK(Ask(port, "nonsense\r\n\r\n").find("HTTP/1.0 400 Bad Request\r\n") == 0);
+
+  // A request that is too long gets no answer, and the server carries on
+  CHECK(Ask(port, "GET /" + string(10000, 'x') + " HTTP/1.0\r\n\r\n").empty());
+  CHECK(Ask(port, "GET /branch/h%20energy HTTP/1.0\r\n\r\n").find("HTTP/1.0 200 OK\r\n") == 0);
+
+  return nFailed;
+}
@@ -0,0 +1,70 @@
+#include "../QuantileSketch.h"
+#include "TestCheck.h"
+
+#include <vector>
+
+using namespace std;
+
+int main()
+{
+  // Quantiles and the distribution of 0..9999, in order and well inside the tails
+  QuantileSketch sketch(200);
+  for (int i = 0; i < 10000; i++) sketch.Fill(i);
+  CHECK(sketch.GetEntries() == 10000);
+  CHECK(sketch.GetMin() == 0);
+  CHECK(sketch.GetMax() == 9999);
+  CHECK_CLOSE(sketch.Quantile(0.5), 5000, 50);
+  CHECK_CLOSE(sketch.Quantile(0.01), 100, 10);
+  CHECK_CLOSE(sketch.Cdf(2500), 0.25, 0.005);
+
+  // Two halves merged are the same as the whole
+  QuantileSketch low(200), high(200);
+  for (int i = 0; i < 5000; i++) low.Fill(i);
+  for (int i = 5000; i < 10000; i++) high.Fill(i);
+  low.Merge(high);
+  CHECK(low.GetEntries() == 10000);
+  CHECK_CLOSE(low.Quantile(0.5), sketch.Quantile(0.5), 50);
+  CHECK_CLOSE(QuantileSketch::KolmogorovDistance(low, sketch), 0, 0.01);
+
+  // A shifted sample is seen as different
+  QuantileSketch shifted(200);
+  for (int i = 0; i < 10000; i++) shifted.Fill(i + 1000);
+  CHECK_CLOSE(QuantileSketch::KolmogorovDistance(sketch, shifted), 0.1, 0.01);
+
+  // The distance is the largest difference anywhere: no point of a fine grid has a larger one
+  QuantileSketch narrow(200), wide(200);
+  for (int i = 0; i < 20000; i++)
+  {
+    narrow.Fill(sin(i * 0.37) * 10);
+    wide.Fill(sin(i * 0.53) * 11 + 0.5);
+  }
+  double distance = QuantileSketch::KolmogorovDistance(narrow, wide);
+  double largest = 0;
+  for (double x = -12; x <= 12; x += 0.001) largest = fmax(largest, fabs(narrow.Cdf(x) - wide.Cdf(x)));
+  CHECK(largest <= distance + 1e-12);
+  CHECK(largest > distance - 1e-3);
+
+  // The state of a sketch with values still buffered puts it back exactly
+  QuantileSketch partial(200);
+  for (int i = 0; i < 1234; i++) partial.Fill(i * 0.5, 1 + i % 3);
+  vector<double> state = partial.GetState();
+  QuantileSketch restored(200);
+  CHECK(restored.SetState(state));
+  CHECK(restored.GetEntries() == partial.GetEntries());
+  CHECK(restored.GetMin() == partial.GetMin());
+  CHECK(restored.GetMax() == partial.GetMax());
+  for (double q = 0.05; q < 1; q += 0.1) CHECK(restored.Quantile(q) == partial.Quantile(q));
+  CHECK(restored.GetState() == partial.GetState());
+
+  // A state is refused by a sketch with another compression, or when it is cut short
+  QuantileSketch other(100);
+  CHECK(!other.SetState(state));
+  state.pop_back();
+  CHECK(!restored.SetState(state));
+
+  // Reset empties it
+  sketch.Reset();
+  CHECK(sketch.GetEntries() == 0);
+
+  return nFailed;
+}
@@ -0,0 +1,96 @@
+#include "../ReferenceStore.h"
+#include "TestCheck.h"
+
+#include <vector>
+#include <cstdio>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static int FilesIn(string directory)
+{
+  int nFiles = 0;
+  DIR *dir = opendir(directory.c_str());
+  while (struct dirent *file = (dir ? readdir(dir) : 0)) if (file->d_name[0] != '.') nFiles++;
+  if (dir) closedir(dir);
+  return nFiles;
+}
+
+static void Empty(string directory)
+{
+  DIR *dir = opendir(directory.c_str());
+  while (struct dirent *file = (dir ? readdir(dir) : 0)) if (file->d_name[0] != '.') remove((directory + "/" + file->d_name).c_str());
+  if (dir) closedir(dir);
+  rmdir(directory.c_str());
+}
+
+int main()
+{
+  string directory = ScratchDirectory();
+  vector<double> histogram = {3, 100, 1.5, 2.5, 96};
+  size_t nValues;
+
+  {
+    ReferenceStore store(directory, "/data/reference.root", "/data/reference.root|1000|1");
+    CHECK(store.IsOpen());
+    CHECK(store.Find("h x", nValues) == 0);
+    CHECK(nValues == 0);
+    CHECK(store.Lock("h x"));
+    CHECK(store.Publish("h x", histogram));
+    const double *values = store.Find("h x", nValues);
+    CHECK(values != 0 && nValues == histogram.size() && vector<double>(values, values + nValues) == histogram);
+    CHECK(store.Publish("empty", vector<double>()));
+    CHECK(store.Find("empty", nValues) != 0 && nValues == 0);
+    CHECK(store.GetFound() == 2);
+    CHECK(store.GetPublished() == 2);
+  }
+
+  // Another job with the same reference finds the entries; another reference doesn't
+  {
+    ReferenceStore store(directory, "/data/reference.root", "/data/reference.root|1000|1");
+    const double *values = store.Find("h x", nValues);
+    CHECK(values != 0 && values[4] == 96);
+    CHECK(store.Find("h y", nValues) == 0);
+    ReferenceStore other(directory, "/data/other.root", "/data/other.root|1000|1");
+    CHECK(other.Find("h x", nValues) == 0);
+  }
+
+  // A job waits for the one filling an entry, and then finds it
+  pid_t filler = fork();
+  if (filler == 0)
+  {
+    ReferenceStore store(directory, "/data/reference.root", "/data/reference.root|1000|1");
+    store.Lock("map t");
+    usleep(300000);
+    store.Publish("map t", vector<double>(1000, 7.));
+    _exit(0);
+  }
+  usleep(100000);
+  {
+    ReferenceStore store(directory, "/data/reference.root", "/data/reference.root|1000|1");
+    CHECK(store.Find("map t", nValues) == 0);
+    CHECK(store.Lock("map t"));
+    const double *values = store.Find("map t", nValues);
+    CHECK(values != 0 && nValues == 1000 && values[999] == 7);
+    store.Unlock("map t");
+  }
+  int status;
+  waitpid(filler, &status, 0);
+
+  // When the reference changes, the entries made from the old version go
+  {
+    ReferenceStore store(directory, "/data/reference.root", "/data/reference.root|1000|2");
+    CHECK(store.Find("h x", nValues) == 0);
+    CHECK(FilesIn(directory) == 2); // Only the clean locks of the two references are left
+  }
+
+  // Without a directory to write to there is no store
+  ReferenceStore missing(directory + "/missing", "/data/reference.root", "/data/reference.root|1000|1");
+  CHECK(!missing.IsOpen());
+  CHECK(!missing.Publish("h x", histogram));
+
+  Empty(directory);
+  return nFailed;
+}
@@ -0,0 +1,139 @@
+#include "../ResultsStore.h"
+#include "TestCheck.h"
+
+#include <vector>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+
+using namespace std;
+
+static BranchResult Result(string branchName, double pValue, double chisq, int ndf)
+{
+  BranchResult result;
+  result.branchName = branchName;
+  result.hasComparison = true;
+  result.pValue = pValue;
+  result.chisq = chisq;
+  result.ndf = ndf;
+  result.ks = 0.1;
+  result.sampleEntries = 1000;
+  result.refEntries = 2000;
+  return result;
+}
+
+int main()
+{
+  string directory = ScratchDirectory();
+  string fileName = directory + "/store.sqlite";
+
+  // Two runs, one with a map branch with flagged cells, and a branch without a p-value
+  {
+    ResultsStore store;
+    CHECK(store.Open(fileName));
+    RunInfo first;
+    first.runTime = 1000;
+    first.sample = "first.root";
+    first.reference = "reference.root";
+    vector<BranchResult> results;
+    results.push_back(Result("h_energy", 0.5, 10, 10));
+    results.push_back(Result("t_hits", 0.2, 30, 25));
+    results.back().meanPull = 0.5;
+    results.back().flaggedCells.push_back({"tracker 0 1 2", 4.5});
+    CHECK(store.AppendRun(first, results) == 1);
+
+    RunInfo second = first;
+    second.runTime = 2000;
+    second.sample = "second.root";
+    results.clear();
+    results.push_back(Result("h_energy", 0.001, 40, 10));
+    results.push_back(Result("h_empty", -1, 0, 0)); // Not compared
+    results.push_back(Result("t_hits", 0.3, 28, 25));
+    results.back().flaggedCells.push_back({"tracker 0 1 2", 5.5});
+    results.back().flaggedCells.push_back({"tracker 1 0 0", -4});
+    CHECK(store.AppendRun(second, results) == 2);
+  }
+
+  chmod(fileName.c_str(), 0444);
+  ResultsStore store;
+  CHECK(store.Open(fileName, true));
+
+  // A branch's results, oldest first, or only the last ones
+  vector<StoredResult> series = store.TimeSeries("h_energy", 10);
+  CHECK(series.size() == 2);
+  if (series.size() == 2)
+  {
+    CHECK(series[0].run.sample == "first.root" && series[0].run.runTime == 1000);
+    CHECK(series[1].run.sample == "second.root" && series[1].result.pValue == 0.001);
+    CHECK(series[1].result.chisq == 40 && series[1].result.ndf == 10);
+    CHECK(series[1].result.sampleEntries == 1000 && series[1].result.refEntries == 2000);
+  }
+  series = store.TimeSeries("h_energy", 1);
+  CHECK(series.size() == 1 && series[0].run.runId == 2);
+  CHECK(store.TimeSeries("h_unknown", 10).empty());
+
+  // Worst p-values first, with the branch that has none last
+  vector<StoredResult> worst = store.WorstOffenders("pvalue", 10, 10);
+  CHECK(worst.size() == 5);
+  if (worst.size() == 5)
+  {
+    CHECK(worst[0].result.branchName == "h_energy" && worst[0].result.pValue == 0.001);
+    CHECK(worst[1].result.pValue == 0.2);
+    CHECK(worst[4].result.branchName == "h_empty" && std::isnan(worst[4].result.pValue));
+  }
+  worst = store.WorstOffenders("chisq", 1, 1);
+  CHECK(worst.size() == 1 && worst[0].result.branchName == "h_energy" && worst[0].run.runId == 2);
+  worst = store.WorstOffenders("flagged", 10, 1);
+  CHECK(worst.size() == 1 && worst[0].result.branchName == "t_hits" && worst[0].nFlagged == 2);
+  CHECK(store.WorstOffenders("nonsense", 10, 10).empty() && store.GetError().find("unknown metric") == 0);
+
+  // The cell flagged in both runs comes first
+  vector<int> timesFlagged;
+  vector<FlaggedCell> cells = store.FrequentlyFlaggedCells("t_hits", 10, 10, timesFlagged);
+  CHECK(cells.size() == 2);
+  if (cells.size() == 2)
+  {
+    CHECK(cells[0].cell == "tracker 0 1 2" && timesFlagged[0] == 2);
+    CHECK_CLOSE(cells[0].pull, 5, 1e-12);
+  }
+
+  // A store opened read-only can't be written to, and one that isn't there isn't made
+  RunInfo third;
+  CHECK(store.AppendRun(third, vector<BranchResult>(1, Result("h_energy", 0.5, 10, 10))) == -1);
+  CHECK(store.TimeSeries("h_energy", 10).size() == 2);
+  store.Close();
+  ResultsStore missing;
+  CHECK(!missing.Open(directory + "/missing.sqlite", true));
+  CHECK(access((directory + "/missing.sqlite").c_str(), F_OK) != 0);
+
+  // A run with a key is stored once however often it is appended, as when a job is
+  // resumed after storing its results. A store made before runs had keys gets them
+  string oldFileName = directory + "/old.sqlite";
+  sqlite3 *db = 0;
+  CHECK(sqlite3_open(oldFileName.c_str(), &db) == SQLITE_OK);
+  CHECK(sqlite3_exec(db, "CREATE TABLE runs (run_id INTEGER PRIMARY KEY AUTOINCREMENT, run_time INTEGER, "
+                         "sample TEXT, sample_hash TEXT, reference TEXT, reference_hash TEXT);"
+                         "INSERT INTO runs (run_time) VALUES (500);", 0, 0, 0) == SQLITE_OK);
+  sqlite3_close(db);
+  {
+    ResultsStore keyed;
+    CHECK(keyed.Open(oldFileName));
+    RunInfo resumed;
+    resumed.runKey = "job 1 reference 0";
+    vector<BranchResult> results(1, Result("h_energy", 0.5, 10, 10));
+    CHECK(keyed.AppendRun(resumed, results) == 2);
+    CHECK(keyed.AppendRun(resumed, results) == 2);
+    RunInfo unkeyed;
+    CHECK(keyed.AppendRun(unkeyed, results) == 3);
+    CHECK(keyed.AppendRun(unkeyed, results) == 4);
+    resumed.runKey = "job 1 reference 1";
+    CHECK(keyed.AppendRun(resumed, results) == 5);
+    CHECK(keyed.TimeSeries("h_energy", 10).size() == 4);
+  }
+
+  remove(oldFileName.c_str());
+  remove(fileName.c_str());
+  rmdir(directory.c_str());
+  return nFailed;
+}
@@ -0,0 +1,63 @@
+#include "../ToyEngine.h"
+#include "TestCheck.h"
+
+#include <vector>
+
+using namespace std;
+
+// Counts in 20 cells, with the reference the same as the sample but for one cell
+static ToyComparison Counts(double changedCell)
+{
+  ToyComparison comparison;
+  for (int i = 0; i < 20; i++)
+  {
+    double count = 100 + 10 * i;
+    comparison.sample.push_back(i == 7 ? changedCell : count);
+    comparison.ref.push_back(count);
+  }
+  for (int i = 0; i < 20; i++)
+  {
+    comparison.sampleError.push_back(sqrt(comparison.sample[i]));
+    comparison.refError.push_back(sqrt(comparison.ref[i]));
+  }
+  return comparison;
+}
+
+int main()
+{
+  // The statistics skip cells without an uncertainty, and give no pull where the reference is empty
+  vector<double> sample = {10, 5, 3, 8}, sampleError = {1, 0, 1, 1};
+  vector<double> ref = {8, 5, 0, 8}, refError = {1, 1, 1, 1};
+  double chisq, maxPull;
+  int ndf, maxPullCell;
+  ToyEngine::Statistics(sample, sampleError, ref, refError, chisq, ndf, maxPull, maxPullCell);
+  CHECK(ndf == 3);
+  CHECK_CLOSE(chisq, 4. / 2 + 9. / 2, 1e-12);
+  CHECK(maxPullCell == 0);
+  CHECK_CLOSE(maxPull, 2 / sqrt(2.), 1e-12);
+
+  // The same seed gives the same p-values, whatever the number of threads
+  ToyComparison agreeing = Counts(170);
+  ToyResult oneThread = ToyEngine(1000, 42, 1).Run(agreeing);
+  ToyResult fourThreads = ToyEngine(1000, 42, 4).Run(agreeing);
+  CHECK(oneThread.nToys == 1000);
+  CHECK(oneThread.chisqPValue == fourThreads.chisqPValue);
+  CHECK(oneThread.globalPValue == fourThreads.globalPValue);
+
+  // Samples that agree are not flagged; a cell 10 sigma out is, by both tests
+  CHECK(oneThread.chisq == 0);
+  CHECK(oneThread.chisqPValue == 1);
+  ToyResult disagreeing = ToyEngine(1000, 42, 2).Run(Counts(170 + 10 * sqrt(2 * 170.)));
+  CHECK(disagreeing.maxPullCell == 7);
+  CHECK(disagreeing.chisqPValue < 0.01);
+  CHECK(disagreeing.globalPValue < 0.01);
+  CHECK(disagreeing.globalPValue >= 1. / 1001); // The observation counts as a toy, so it is never 0
+  CHECK(disagreeing.localPValue < 1e-10);
+
+  // Without toys, only the statistics are worked out
+  ToyResult noToys = ToyEngine(0, 42).Run(agreeing);
+  CHECK(noToys.nToys == 0);
+  CHECK(noToys.chisqPValue == -1);
+
+  return nFailed;
+}